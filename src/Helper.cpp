@@ -21,6 +21,38 @@ std::vector<std::string> splitEntry(const std::string& entry)
 }
 
 
+/**
+ * @brief       Parses a size given in bytes, optionally with a K, M or G suffix (e.g. "64M").
+ * @param       size        The size to parse
+ * @return      The size in bytes
+ */
+uint64_t parseSize(const std::string& size)
+{
+    size_t end = 0;
+    uint64_t value = std::stoull(size, &end);
+    std::string suffix = size.substr(end);
+
+    if (suffix == "K" || suffix == "k")
+    {
+        value <<= 10;
+    }
+    else if (suffix == "M" || suffix == "m")
+    {
+        value <<= 20;
+    }
+    else if (suffix == "G" || suffix == "g")
+    {
+        value <<= 30;
+    }
+    else if (!suffix.empty())
+    {
+        throw std::invalid_argument("Unknown size suffix: " + suffix);
+    }
+
+    return value;
+}
+
+
 /**
  * @brief       Prints a help message (menu).
  * @return      void
@@ -28,11 +60,31 @@ std::vector<std::string> splitEntry(const std::string& entry)
 void printHelpMessage()
 {
     std::cout
-            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + LIST_CMD + "    <dir>"           << YELLOW "Lists directory content.\n"      RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + LIST_CMD + "    <dir|glob>"      << YELLOW "Lists directory content, or the files matching a pattern (ls /dir/*.log).\n" RESET
             << std::setw(COLUMN_SPACING) << std::left << MAGENTA + CONTENT_CMD + "   <path>"        << YELLOW "Shows file content.\n"           RESET
             << std::setw(COLUMN_SPACING) << std::left << MAGENTA + CREATE_FILE_CMD + " <path>"      << YELLOW "Creates an empty file.\n"        RESET
-            // << std::setw(COLUMN_SPACING) << std::left << RED + CREATE_DIR_CMD + " <path>"           << YELLOW "Creates an empty directory.\n"   RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + CREATE_DIR_CMD + " <path>"       << YELLOW "Creates an empty directory.\n"   RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + REMOVE_CMD + "    <path>"        << YELLOW "Removes a file or an empty directory.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + MOVE_CMD + "    <old> <new>"     << YELLOW "Moves or renames a file.\n"     RESET
             << std::setw(COLUMN_SPACING) << std::left << MAGENTA + EDIT_CMD + "  <path>"            << YELLOW "Re-sets file content.\n"         RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + APPEND_CMD + " <path>"          << YELLOW "Appends to file content.\n"      RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + IMPORT_CMD + " <host> <path>"   << YELLOW "Copies a host file in.\n"        RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + COMPRESS_CMD + " <path>"        << YELLOW "Compresses a file's content.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + COMPRESSION_CMD + " <on|off>"   << YELLOW "Compresses new file content by default.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + DEDUP_CMD + " <on|off>"         << YELLOW "Shares identical blocks of new file content.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + LOG_CMD + " <on|off>"           << YELLOW "Writes log-structured, with a background segment cleaner.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + SNAPSHOT_CMD + " <name>"        << YELLOW "Takes a snapshot of the file system.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + LIST_SNAPSHOTS_CMD               << YELLOW "Lists the snapshots.\n"           RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + DELETE_SNAPSHOT_CMD + " <name>" << YELLOW "Deletes a snapshot.\n"           RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + DISK_FREE_CMD                    << YELLOW "Shows space usage and fragmentation.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + STATS_CMD + " [reset]"          << YELLOW "Shows operation counts and latencies.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + TRACE_CMD + " start|<file>"       << YELLOW "Starts a Chrome trace of the operations, or stops it into a file.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + GROW_CMD + "  <size>"            << YELLOW "Grows the device (e.g. 64M).\n"  RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + SYNC_CMD                         << YELLOW "Commits the journal to the device.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + COMPACT_CMD                      << YELLOW "Moves the data to the start of the device and frees the rest.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + CLEAN_CMD                        << YELLOW "Empties the least used segments of the log.\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + SCRUB_CMD + " [threads]"         << YELLOW "Checks every block against its checksum (also fsck).\n" RESET
+            << std::setw(COLUMN_SPACING) << std::left << MAGENTA + CHECKSUMS_CMD + " <on|off>"     << YELLOW "Keeps a CRC32C of every block, checked on every read.\n" RESET
             << std::setw(COLUMN_SPACING) << std::left << MAGENTA + HELP_CMD                         << YELLOW "Shows this help message.\n"      RESET
             << std::setw(COLUMN_SPACING) << std::left << MAGENTA + EXIT_CMD                         << YELLOW "Gracefully exit.\n"              RESET;
 }
@@ -5,15 +5,26 @@
 #include <vector>
 #include <sstream>
 #include <iomanip>
+#include <stdint.h>
 
 const std::string FS_NAME = "myfs";
 
 #define MAX_FILE_NAME       20
-#define MAX_FILE_SIZE       1024
 
 // Table Entries
+#define ENTRY_NOT_FOUND     -1
+
+#define ENTRY_FLAG_USED         0x01
+#define ENTRY_FLAG_DIRECTORY    0x02
+#define ENTRY_FLAG_EXTENT_MAP   0x04        // The entry address points to a chain of extent map blocks instead of the data itself
+#define ENTRY_FLAG_INLINE       0x08        // The data is kept in the inode's inline record, the entry has no blocks
+#define ENTRY_FLAG_COMPRESSED   0x10        // The data is a compressed stream, always behind an extent map
+#define ENTRY_FLAG_DEDUP        0x20        // The data blocks may be shared with other files, a write copies the shared ones it touches
+#define ENTRY_FLAG_SNAPSHOT     0x40        // The blocks may be a snapshot's too, a write copies the ones it touches to new blocks
+#define ENTRY_FLAG_FROZEN       0x80        // In a snapshot's table, the snapshot holds references on the entry's blocks
+
+// Legacy (version 0x03) text table entries - "name|address|size"
 #define ENTRY_DELIMITER     '|'
-#define ENTRY_NOT_FOUND     "-1"
 
 #define FILE_NAME_INDEX     0
 #define FILE_ADDRESS_INDEX  1
@@ -30,25 +41,56 @@ const std::string FS_NAME = "myfs";
 #define WHITE               "\033[37m"
 #define BOLDYELLOW          "\033[1m\033[33m"
 
-#define COLUMN_SPACING      20
+#define COLUMN_SPACING      27
 
 // Commands
 const std::string LIST_CMD 			= "ls";
 const std::string CONTENT_CMD 		= "cat";
 const std::string CREATE_FILE_CMD 	= "touch";
-// const std::string CREATE_DIR_CMD 	= "mkdir";
+const std::string CREATE_DIR_CMD 	= "mkdir";
+const std::string REMOVE_CMD 		= "rm";
+const std::string MOVE_CMD 			= "mv";
 const std::string EDIT_CMD 			= "edit";
+const std::string APPEND_CMD 		= "append";
+const std::string DISK_FREE_CMD 	= "df";
+const std::string GROW_CMD 			= "grow";
+const std::string SYNC_CMD 			= "sync";
+const std::string COMPACT_CMD 		= "compact";
+const std::string CLEAN_CMD 		= "clean";
+const std::string LOG_CMD 			= "log";
+const std::string SCRUB_CMD 		= "scrub";
+const std::string FSCK_CMD 			= "fsck";			// The same as scrub
+const std::string CHECKSUMS_CMD 	= "checksums";
+const std::string IMPORT_CMD 		= "import";
+const std::string COMPRESS_CMD 		= "compress";
+const std::string COMPRESSION_CMD 	= "compression";
+const std::string DEDUP_CMD 		= "dedup";
+const std::string SNAPSHOT_CMD 		= "snapshot";
+const std::string LIST_SNAPSHOTS_CMD = "snapshots";
+const std::string DELETE_SNAPSHOT_CMD = "rmsnapshot";
+const std::string STATS_CMD 		= "stats";
+const std::string TRACE_CMD 		= "trace";
 const std::string TREE_CMD 			= "tree";
 const std::string HELP_CMD 			= "help";
 const std::string EXIT_CMD 			= "exit";
 
+// Legacy (version 0x03) file count, stored as text right after the header
 const int FILE_COUNT_ADDRESS    = 5;
 const int FILE_COUNT_SIZE       = 11;
-const int FILE_SIZE             = 1024;
+const int LEGACY_SLOT_SIZE      = 1024;     // Versions 0x03 and 0x04 gave every file a fixed data slot
+const int LEGACY_TABLE_START_ADDRESS = 16;  // Versions up to 0x06 had a 16 bytes header
+
 
-const int TABLE_START_ADDRESS   = 16;
+const int TABLE_START_ADDRESS   = 64;
 const int TABLE_END_ADDRESS     = 1024;
 const int TABLE_ENTRY_SIZE      = 32;
+const int DIR_ENTRY_SIZE        = 24;
+
+const int INLINE_DATA_SIZE      = 96;       // Files up to this size keep their data in an inline record instead of blocks
+const int INLINE_START_ADDRESS  = TABLE_END_ADDRESS;    // Formatting puts the inline records right after the table
+
+const int BLOCK_SIZE            = 256;
+const int BITMAP_START_ADDRESS  = TABLE_END_ADDRESS;    // Versions up to 0x08 put the bitmap right after the table
 
 
 const std::string MENU_ASCII_ART = 
@@ -67,5 +109,6 @@ const std::string MENU_ASCII_ART =
 
 
 std::vector<std::string> splitEntry(const std::string& entry);
+uint64_t parseSize(const std::string& size);
 
 void printHelpMessage();
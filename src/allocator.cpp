@@ -0,0 +1,688 @@
+#include "allocator.h"
+#include "Helper.h"
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+
+
+/**
+ @brief		Constructor - Initializes the allocator. The bitmap is set up by format() or load().
+ @param		blkdevsim_		The block device
+ */
+BlockAllocator::BlockAllocator(BlockDevice *blkdevsim_) :
+	blkdevsim(blkdevsim_), _bitmapAddress(0), _blockCount(0), _freeBlocks(0), _freeSegments(0), _logHead(0), _logEnd(0)
+{
+}
+
+
+/**
+ @brief		Returns the size in bytes of a bitmap covering the given amount of blocks.
+ @param		blockCount		The number of blocks
+ @return	The bitmap size in bytes
+ */
+int BlockAllocator::bitmapSize(uint32_t blockCount)
+{
+	return (blockCount + 7) / 8;
+}
+
+
+/**
+ @brief		Resizes the in-memory bitmap to cover blockCount blocks. Added blocks are free, and the padding bits past
+			the last block are marked as used so they are never handed out.
+ @param		blockCount		The number of blocks
+ @return	void
+ */
+void BlockAllocator::resizeBitmap(uint32_t blockCount)
+{
+	// Clearing the old padding bits, they are real blocks now
+	for (uint32_t block = this->_blockCount; block < this->_bitmap.size() * 8; block++)
+	{
+		this->_bitmap[block / 8] &= ~(1 << (block % 8));
+	}
+
+	this->_bitmap.resize(bitmapSize(blockCount), 0);
+	this->_freeBlocks += blockCount - this->_blockCount;
+	this->_blockCount = blockCount;
+
+	for (uint32_t block = this->_blockCount; block < this->_bitmap.size() * 8; block++)
+	{
+		this->_bitmap[block / 8] |= (1 << (block % 8));
+	}
+
+	this->countSegments();
+}
+
+
+/**
+ @brief		Counts the used blocks of every segment from the bitmap. The blocks a partial last segment lacks count as
+			used (the padding bits are set, the missing bytes are added), so it's never free.
+ @return	void
+ */
+void BlockAllocator::countSegments()
+{
+	uint32_t segments = (this->_blockCount + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS;
+
+	this->_segmentUsed.assign(segments, 0);
+	this->_freeSegments = 0;
+
+	for (uint32_t segment = 0; segment < segments; segment++)
+	{
+		uint32_t firstByte = segment * (SEGMENT_BLOCKS / 8);
+		uint32_t used = 0;
+
+		for (uint32_t byte = firstByte; byte < firstByte + SEGMENT_BLOCKS / 8; byte++)
+		{
+			used += byte < this->_bitmap.size() ? __builtin_popcount(this->_bitmap[byte]) : 8;
+		}
+
+		this->_segmentUsed[segment] = used;
+		this->_freeSegments += (used == 0);
+	}
+}
+
+
+/**
+ @brief		Clears the bitmap, marks the first reservedBlocks blocks (header, table and bitmap) as used
+			and writes it to the device.
+ @param		bitmapAddress		The address of the on-disk bitmap
+ @param		blockCount			The number of blocks the bitmap covers
+ @param		reservedBlocks		The number of blocks at the start of the device that are never allocated
+ @return	void
+ */
+void BlockAllocator::format(uint64_t bitmapAddress, uint32_t blockCount, uint32_t reservedBlocks)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	this->_bitmapAddress = bitmapAddress;
+	this->_bitmap.clear();
+	this->_blockCount = 0;
+	this->_freeBlocks = 0;
+	this->_logHead = 0;
+	this->_logEnd = 0;
+	this->resizeBitmap(blockCount);
+
+	this->markRange(0, reservedBlocks, true, false);
+	this->blkdevsim->write(this->_bitmapAddress, this->_bitmap.size(), (const char *)this->_bitmap.data());
+}
+
+
+/**
+ @brief		Reads the on-disk bitmap into memory and counts the free blocks.
+ @param		bitmapAddress		The address of the on-disk bitmap
+ @param		blockCount			The number of blocks the bitmap covers
+ @return	void
+ */
+void BlockAllocator::load(uint64_t bitmapAddress, uint32_t blockCount)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	this->_bitmapAddress = bitmapAddress;
+	this->_blockCount = blockCount;
+	this->_bitmap.resize(bitmapSize(blockCount));
+	this->blkdevsim->read(this->_bitmapAddress, this->_bitmap.size(), (char *)this->_bitmap.data());
+
+	// Padding bits are always set, so every zero bit is a free block
+	uint32_t usedBits = 0;
+	for (uint8_t byte : this->_bitmap)
+	{
+		usedBits += __builtin_popcount(byte);
+	}
+	this->_freeBlocks = this->_bitmap.size() * 8 - usedBits;
+
+	this->_logHead = 0;
+	this->_logEnd = 0;
+	this->countSegments();
+}
+
+
+/**
+ @brief		Extends the bitmap over blocks added at the end of the device. When the bitmap outgrows its blocks it is
+			moved to a free run (usually inside the added space) and its old blocks are released.
+ @param		blockCount		The new number of blocks
+ @param		reservedTail	The blocks at the new end of the device to mark used before the bitmap looks for room
+ @return	void
+ */
+void BlockAllocator::grow(uint32_t blockCount, uint32_t reservedTail)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	if (blockCount <= this->_blockCount)
+	{
+		return;
+	}
+
+	uint32_t oldBitmapStart = this->_bitmapAddress / BLOCK_SIZE;
+	uint32_t oldBitmapBlocks = (this->_bitmapAddress + this->_bitmap.size() + BLOCK_SIZE - 1) / BLOCK_SIZE - oldBitmapStart;
+
+	this->resizeBitmap(blockCount);
+	this->markRange(blockCount - reservedTail, reservedTail, true, false);
+
+	uint32_t newBitmapBlocks = (this->_bitmapAddress + this->_bitmap.size() + BLOCK_SIZE - 1) / BLOCK_SIZE - oldBitmapStart;
+	if (newBitmapBlocks > oldBitmapBlocks)
+	{
+		// Moving the bitmap, nothing is written through until it has its new place
+		newBitmapBlocks = (this->_bitmap.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		extent run = this->findRun(newBitmapBlocks);
+		if (run.length < newBitmapBlocks)
+		{
+			throw std::runtime_error(RED "Not enough contiguous space for the block bitmap" RESET);
+		}
+
+		this->markRange(run.start, newBitmapBlocks, true, false);
+		this->markRange(oldBitmapStart, oldBitmapBlocks, false, false);
+		this->_bitmapAddress = (uint64_t)run.start * BLOCK_SIZE;
+	}
+
+	this->blkdevsim->write(this->_bitmapAddress, this->_bitmap.size(), (const char *)this->_bitmap.data());
+}
+
+
+/**
+ @brief		Checks whether the given block is free.
+ @param		block		The block number
+ @return	True if the block is free, false otherwise.
+ */
+bool BlockAllocator::isFree(uint32_t block) const
+{
+	return !(this->_bitmap[block / 8] & (1 << (block % 8)));
+}
+
+
+/**
+ @brief		Marks a range of blocks as used or free and writes the touched bitmap bytes through to the device.
+ @param		start			The first block of the range
+ @param		length			The number of blocks in the range
+ @param		used			Whether to mark the blocks as used or as free
+ @param		writeThrough	Whether to write the touched bitmap bytes to the device
+ @return	void
+ */
+void BlockAllocator::markRange(uint32_t start, uint32_t length, bool used, bool writeThrough)
+{
+	if (length == 0)
+	{
+		return;
+	}
+
+	for (uint32_t block = start; block < start + length; block++)
+	{
+		uint8_t bit = 1 << (block % 8);
+		bool wasUsed = this->_bitmap[block / 8] & bit;
+
+		if (used)
+		{
+			this->_bitmap[block / 8] |= bit;
+		}
+		else
+		{
+			this->_bitmap[block / 8] &= ~bit;
+		}
+
+		// Only a block that changes state moves its segment's count
+		if (wasUsed != used)
+		{
+			uint32_t& segmentUsed = this->_segmentUsed[block / SEGMENT_BLOCKS];
+			if (used && segmentUsed++ == 0)
+			{
+				this->_freeSegments--;
+			}
+			else if (!used && --segmentUsed == 0)
+			{
+				this->_freeSegments++;
+			}
+		}
+	}
+
+	if (used)
+	{
+		this->_freeBlocks -= length;
+	}
+	else
+	{
+		this->_freeBlocks += length;
+	}
+
+	if (!writeThrough)
+	{
+		return;
+	}
+
+	uint32_t firstByte = start / 8;
+	uint32_t lastByte = (start + length - 1) / 8;
+	this->blkdevsim->write(this->_bitmapAddress + firstByte, lastByte - firstByte + 1, (const char *)&this->_bitmap[firstByte]);
+}
+
+
+/**
+ @brief		Finds the smallest free run that can hold count blocks (best fit). If there is no such run,
+			the largest free run is returned instead.
+ @param		count		The number of blocks wanted
+ @return	The free run found, with a length of 0 if the device is full
+ */
+BlockAllocator::extent BlockAllocator::findRun(uint32_t count) const
+{
+	extent bestFit = { 0, 0 };
+	extent largest = { 0, 0 };
+
+	uint32_t block = 0;
+	while (block < this->_blockCount)
+	{
+		// Skipping fully used words and bytes at once
+		if (block % 64 == 0 && (block / 8) + 8 <= this->_bitmap.size())
+		{
+			uint64_t word;
+			memcpy(&word, &this->_bitmap[block / 8], sizeof(word));
+			if (word == UINT64_MAX)
+			{
+				block += 64;
+				continue;
+			}
+		}
+		if (block % 8 == 0 && this->_bitmap[block / 8] == 0xFF)
+		{
+			block += 8;
+			continue;
+		}
+
+		if (!this->isFree(block))
+		{
+			block++;
+			continue;
+		}
+
+		uint32_t runStart = block;
+		while (block < this->_blockCount && this->isFree(block))
+		{
+			block++;
+		}
+		uint32_t runLength = block - runStart;
+
+		if (runLength >= count && (bestFit.length == 0 || runLength < bestFit.length))
+		{
+			bestFit = { runStart, runLength };
+
+			if (runLength == count)		// Can't do better than an exact fit
+			{
+				break;
+			}
+		}
+		if (runLength > largest.length)
+		{
+			largest = { runStart, runLength };
+		}
+	}
+
+	return bestFit.length != 0 ? bestFit : largest;
+}
+
+
+/**
+ @brief		Allocates count blocks and appends them to the given extent list. The blocks right after goal are
+			taken first so a growing file stays contiguous, then the rest is placed in the best fitting free run.
+ @param		count		The number of blocks to allocate
+ @param		goal		The block the allocation should preferably start at (0 for no preference)
+ @param		extents		The extent list to append the allocated blocks to, merging with its last extent when adjacent
+ @return	void
+ */
+void BlockAllocator::allocate(uint32_t count, uint32_t goal, extent_list& extents)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	if (count > this->_freeBlocks)
+	{
+		throw std::runtime_error(RED "Not enough free space" RESET);
+	}
+
+	uint32_t remaining = count;
+
+	// Growing in place right after the goal block
+	if (goal != 0)
+	{
+		uint32_t length = 0;
+		while (length < remaining && goal + length < this->_blockCount && this->isFree(goal + length))
+		{
+			length++;
+		}
+
+		if (length > 0)
+		{
+			this->markRange(goal, length, true);
+			extents.push_back({ goal, length });
+			remaining -= length;
+		}
+	}
+
+	while (remaining > 0)
+	{
+		extent run = this->findRun(remaining);
+		run.length = std::min(run.length, remaining);
+
+		this->markRange(run.start, run.length, true);
+		extents.push_back(run);
+		remaining -= run.length;
+	}
+
+	// Merging adjacent extents
+	extent_list merged;
+	for (const extent& ext : extents)
+	{
+		if (!merged.empty() && merged.back().start + merged.back().length == ext.start)
+		{
+			merged.back().length += ext.length;
+		}
+		else
+		{
+			merged.push_back(ext);
+		}
+	}
+	extents.swap(merged);
+}
+
+
+/**
+ @brief		Allocates count contiguous blocks in the lowest free run that holds them and ends by the given block (first
+			fit from the start of the device), for moving data towards the start.
+ @param		count		The number of blocks to allocate
+ @param		limit		The block the run has to end before
+ @param		ext			Set to the allocated blocks
+ @return	True if the blocks were allocated, false when no such run is free.
+ */
+bool BlockAllocator::allocateBelow(uint32_t count, uint32_t limit, extent& ext)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	uint32_t runStart = 0;
+	uint32_t runLength = 0;
+	for (uint32_t block = 0; block < std::min(limit, this->_blockCount) && count > 0; block++)
+	{
+		// Skipping fully used bytes at once
+		if (block % 8 == 0 && runLength == 0 && this->_bitmap[block / 8] == 0xFF)
+		{
+			block += 7;
+			continue;
+		}
+
+		if (!this->isFree(block))
+		{
+			runLength = 0;
+			continue;
+		}
+
+		if (runLength == 0)
+		{
+			runStart = block;
+		}
+		if (++runLength == count)
+		{
+			this->markRange(runStart, count, true);
+			ext = { runStart, count };
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/**
+ @brief		Allocates count blocks at the head of the log and appends them to the given extent list. The log fills a
+			segment from its start and then moves on to the next segment with no block in use, so writes made one
+			after the other land one after the other on the device, whatever they belong to. Fewer blocks are
+			allocated when no free segment is left.
+ @param		count		The number of blocks to allocate
+ @param		extents		The extent list to append the allocated blocks to, merging with its last extent when adjacent
+ @return	The blocks allocated
+ */
+uint32_t BlockAllocator::append(uint32_t count, extent_list& extents)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	uint32_t taken = 0;
+
+	while (taken < count)
+	{
+		extent run;
+		if (this->takeRun(count - taken, run) == 0)
+		{
+			break;
+		}
+
+		if (!extents.empty() && extents.back().start + extents.back().length == run.start)
+		{
+			extents.back().length += run.length;
+		}
+		else
+		{
+			extents.push_back(run);
+		}
+		taken += run.length;
+	}
+
+	return taken;
+}
+
+
+/**
+ @brief		Allocates up to count contiguous blocks at the head of the log (see append).
+ @param		count		The most blocks to allocate
+ @param		ext			Set to the allocated blocks
+ @return	The blocks allocated, fewer when the log segment ends first and 0 when no free segment is left
+ */
+uint32_t BlockAllocator::appendRun(uint32_t count, extent& ext)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	return this->takeRun(count, ext);
+}
+
+
+// appendRun() with the lock held. A block of the log segment taken by another allocation is skipped.
+uint32_t BlockAllocator::takeRun(uint32_t count, extent& ext)
+{
+	while (count > 0)
+	{
+		if (this->_logHead >= this->_logEnd && !this->openSegment())
+		{
+			return 0;
+		}
+		if (!this->isFree(this->_logHead))
+		{
+			this->_logHead++;
+			continue;
+		}
+
+		uint32_t length = 0;
+		while (length < count && this->_logHead + length < this->_logEnd && this->isFree(this->_logHead + length))
+		{
+			length++;
+		}
+
+		this->markRange(this->_logHead, length, true);
+		ext = { this->_logHead, length };
+		this->_logHead += length;
+		return length;
+	}
+
+	return 0;
+}
+
+
+/**
+ @brief		Moves the head of the log to the next segment with no block in use, going round the device.
+ @return	False if every segment has blocks in use
+ */
+bool BlockAllocator::openSegment()
+{
+	uint32_t segments = this->_segmentUsed.size();
+	uint32_t next = this->_logEnd / SEGMENT_BLOCKS;		// The one after the segment just filled
+
+	for (uint32_t i = 0; i < segments; i++)
+	{
+		uint32_t segment = (next + i) % segments;
+		if (this->_segmentUsed[segment] == 0)
+		{
+			this->_logHead = segment * SEGMENT_BLOCKS;
+			this->_logEnd = this->_logHead + SEGMENT_BLOCKS;
+			return true;
+		}
+	}
+
+	this->_logHead = this->_logEnd;
+	return false;
+}
+
+
+/**
+ @brief		Returns the blocks of the given extent to the free space.
+ @param		ext		The extent to release
+ @return	void
+ */
+void BlockAllocator::release(const extent& ext)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	this->markRange(ext.start, ext.length, false);
+}
+
+
+/**
+ @brief		Marks the blocks of the given extent as used, for rebuilding the bitmap from the blocks in use.
+ @param		ext		The extent to mark
+ @return	void
+ */
+void BlockAllocator::reserve(const extent& ext)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	this->markRange(ext.start, ext.length, true);
+}
+
+
+/**
+ @brief		Marks the blocks of the given extent as used if none of them is.
+ @param		ext		The extent to take
+ @return	True if the extent was free and is now used, false if it is left as it was
+ */
+bool BlockAllocator::claim(const extent& ext)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+	{
+		if (block >= this->_blockCount || !this->isFree(block))
+		{
+			return false;
+		}
+	}
+
+	this->markRange(ext.start, ext.length, true);
+	return true;
+}
+
+
+/**
+ @brief		Discards every free run of blocks on the device. The lock is held throughout, so no block is handed out
+			(and written) while its range is being discarded.
+ @return	The number of blocks discarded
+ */
+uint32_t BlockAllocator::discardFree()
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	uint32_t runLength = 0;
+	for (uint32_t block = 0; block <= this->_blockCount; block++)
+	{
+		if (block < this->_blockCount && this->isFree(block))
+		{
+			runLength++;
+			continue;
+		}
+
+		if (runLength > 0)
+		{
+			this->blkdevsim->discard((uint64_t)(block - runLength) * BLOCK_SIZE, (uint64_t)runLength * BLOCK_SIZE);
+			runLength = 0;
+		}
+	}
+
+	return this->_freeBlocks;
+}
+
+
+/**
+ @brief		Returns where the used blocks would end if they were packed at the start of the device - the first block
+			with at least as many free blocks before it as used blocks from it on.
+ @return	The block number
+ */
+uint32_t BlockAllocator::packedEnd() const
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	uint32_t usedBlocks = this->_blockCount - this->_freeBlocks;
+	uint32_t freeBefore = 0;
+	uint32_t usedBefore = 0;
+	for (uint32_t block = 0; block < this->_blockCount; block++)
+	{
+		if (freeBefore >= usedBlocks - usedBefore)
+		{
+			return block;
+		}
+
+		if (this->isFree(block))
+		{
+			freeBefore++;
+		}
+		else
+		{
+			usedBefore++;
+		}
+	}
+
+	return this->_blockCount;
+}
+
+
+/**
+ @brief		Copies the used block count of every segment.
+ @param		used		Set to the counts, in segment order
+ @return	void
+ */
+void BlockAllocator::segmentUsage(std::vector<uint32_t>& used) const
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	used = this->_segmentUsed;
+}
+
+
+// The segment the log is filling, UINT32_MAX when none is open
+uint32_t BlockAllocator::logSegment() const
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	return this->_logHead < this->_logEnd ? this->_logHead / SEGMENT_BLOCKS : UINT32_MAX;
+}
+
+
+/**
+ @brief		Walks the bitmap and collects free space and fragmentation statistics.
+ @return	The collected statistics
+ */
+BlockAllocator::space_stats BlockAllocator::stats() const
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	space_stats stats = { this->_blockCount, this->_freeBlocks, 0, 0 };
+
+	uint32_t runLength = 0;
+	for (uint32_t block = 0; block <= this->_blockCount; block++)
+	{
+		if (block < this->_blockCount && this->isFree(block))
+		{
+			runLength++;
+			continue;
+		}
+
+		if (runLength > 0)
+		{
+			stats.freeExtents++;
+			stats.largestFreeExtent = std::max(stats.largestFreeExtent, runLength);
+			runLength = 0;
+		}
+	}
+
+	return stats;
+}
@@ -0,0 +1,84 @@
+#ifndef __ALLOCATOR_H__
+#define __ALLOCATOR_H__
+
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+#include "blkdev.h"
+#include "arena.h"
+
+
+class BlockAllocator
+{
+public:
+	BlockAllocator(BlockDevice *blkdevsim_);
+
+	struct extent
+	{
+		uint32_t start;
+		uint32_t length;
+	};
+	typedef std::vector<extent, ArenaAllocator<extent>> extent_list;		// Local to an operation, on its arena
+
+	struct space_stats
+	{
+		uint32_t totalBlocks;
+		uint32_t freeBlocks;
+		uint32_t freeExtents;
+		uint32_t largestFreeExtent;
+	};
+
+	void format(uint64_t bitmapAddress, uint32_t blockCount, uint32_t reservedBlocks);
+	void load(uint64_t bitmapAddress, uint32_t blockCount);
+	void grow(uint32_t blockCount, uint32_t reservedTail = 0);
+
+	void allocate(uint32_t count, uint32_t goal, extent_list& extents);
+	bool allocateBelow(uint32_t count, uint32_t limit, extent& ext);
+	uint32_t append(uint32_t count, extent_list& extents);
+	uint32_t appendRun(uint32_t count, extent& ext);
+	void release(const extent& ext);
+	void reserve(const extent& ext);
+	bool claim(const extent& ext);
+	uint32_t discardFree();
+
+	space_stats stats() const;
+	uint32_t packedEnd() const;
+	void segmentUsage(std::vector<uint32_t>& used) const;
+	uint32_t logSegment() const;
+	uint32_t freeSegments() const { std::lock_guard<std::mutex> lock(this->_mutex); return this->_freeSegments; }
+	uint32_t segmentCount() const { std::lock_guard<std::mutex> lock(this->_mutex); return this->_segmentUsed.size(); }
+	uint32_t freeBlocks() const { std::lock_guard<std::mutex> lock(this->_mutex); return this->_freeBlocks; }
+	uint32_t blockCount() const { std::lock_guard<std::mutex> lock(this->_mutex); return this->_blockCount; }
+	uint64_t bitmapAddress() const { std::lock_guard<std::mutex> lock(this->_mutex); return this->_bitmapAddress; }
+
+	static int bitmapSize(uint32_t blockCount);
+
+	// The device is cut into segments for the log (see append), a segment is only written to by the log while none
+	// of its blocks is in use
+	static const uint32_t SEGMENT_BLOCKS = 256;
+
+private:
+	bool isFree(uint32_t block) const;
+	void markRange(uint32_t start, uint32_t length, bool used, bool writeThrough = true);
+	void resizeBitmap(uint32_t blockCount);
+	extent findRun(uint32_t count) const;
+	void countSegments();
+	bool openSegment();
+	uint32_t takeRun(uint32_t count, extent& ext);
+
+	BlockDevice *blkdevsim;
+
+	mutable std::mutex _mutex;		// Every public operation holds it, so allocations never hand out a block twice
+
+	uint64_t _bitmapAddress;
+	uint32_t _blockCount;
+	uint32_t _freeBlocks;
+	std::vector<uint8_t> _bitmap;		// In-memory copy of the on-disk bitmap, a set bit marks a used block
+
+	std::vector<uint32_t> _segmentUsed;		// The used blocks of every segment, a partial last segment counts as full
+	uint32_t _freeSegments;		// Segments with no block in use
+	uint32_t _logHead;		// The block the log goes on from
+	uint32_t _logEnd;		// The end of the segment the log fills, equal to the head when none is open
+};
+
+#endif // __ALLOCATOR_H__
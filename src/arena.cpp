@@ -0,0 +1,106 @@
+#include "arena.h"
+#include <algorithm>
+#include <new>
+
+
+const size_t Arena::CHUNK_SIZE;
+
+
+Arena::Arena() : _chunk(0), _offset(0), _depth(0)
+{
+}
+
+
+Arena& Arena::local()
+{
+	static thread_local Arena arena;
+	return arena;
+}
+
+
+Arena::Scope::Scope() : arena(Arena::local())
+{
+	this->arena._depth++;
+}
+
+
+// Everything allocated on the arena since the outermost scope opened is released at once
+Arena::Scope::~Scope()
+{
+	if (--this->arena._depth == 0)
+	{
+		this->arena._chunk = 0;
+		this->arena._offset = 0;
+	}
+}
+
+
+/**
+ @brief		Allocates memory for the current operation, from the heap when no scope is open.
+ @param		size			The number of bytes
+ @param		alignment		The alignment of the memory, a power of two
+ @return	The memory
+ */
+void *Arena::allocate(size_t size, size_t alignment)
+{
+	if (this->_depth == 0)
+	{
+		return ::operator new(size);
+	}
+
+	// The current chunk first, then the next ones that are big enough, a new chunk when none is
+	for (; this->_chunk < this->_chunks.size(); this->_chunk++, this->_offset = 0)
+	{
+		chunk& current = this->_chunks[this->_chunk];
+		uintptr_t base = (uintptr_t)current.memory.get();
+		size_t offset = ((base + this->_offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+
+		if (offset + size <= current.size)
+		{
+			this->_offset = offset + size;
+			return current.memory.get() + offset;
+		}
+	}
+
+	size_t chunkSize = std::max(CHUNK_SIZE, size + alignment);
+	this->_chunks.push_back(chunk{ std::unique_ptr<char[]>(new char[chunkSize]), chunkSize });
+	this->_offset = 0;
+
+	return this->allocate(size, alignment);
+}
+
+
+/**
+ @brief		Frees memory from allocate(). Arena memory is only reclaimed right away when it is the last allocation
+			(a vector that grew), the rest waits for the end of the operation.
+ @param		p			The memory
+ @param		size		The number of bytes it was allocated with
+ @return	void
+ */
+void Arena::deallocate(void *p, size_t size)
+{
+	if (!this->owns(p))
+	{
+		::operator delete(p);
+		return;
+	}
+
+	if (this->_chunk < this->_chunks.size() && (char *)p + size == this->_chunks[this->_chunk].memory.get() + this->_offset)
+	{
+		this->_offset = (char *)p - this->_chunks[this->_chunk].memory.get();
+	}
+}
+
+
+bool Arena::owns(const void *p) const
+{
+	for (const chunk& current : this->_chunks)
+	{
+		if (p >= current.memory.get() && p < current.memory.get() + current.size)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
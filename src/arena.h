@@ -0,0 +1,73 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <vector>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A per-thread bump allocator for the temporaries of a single file system operation. Memory is carved out of big
+// chunks and given back all at once when the outermost Arena::Scope of the thread ends. The chunks are kept for the
+// next operation, so in the steady state an operation doesn't touch the heap. Allocations made while the thread has
+// no scope open go to the heap.
+class Arena
+{
+public:
+	// Opened at the start of every public MyFs operation. Only the outermost scope of the thread resets the arena, so
+	// nothing allocated on the arena may outlive the operation.
+	class Scope
+	{
+	public:
+		Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+		~Scope();
+
+	private:
+		Arena& arena;
+	};
+
+	static Arena& local();
+
+	void *allocate(size_t size, size_t alignment);
+	void deallocate(void *p, size_t size);
+
+	static const size_t CHUNK_SIZE = 64 * 1024;
+
+
+private:
+	struct chunk
+	{
+		std::unique_ptr<char[]> memory;
+		size_t size;
+	};
+
+	Arena();
+	bool owns(const void *p) const;
+
+	std::vector<chunk> _chunks;
+	size_t _chunk;			// The chunk allocations are carved from
+	size_t _offset;			// Its first free byte
+	uint32_t _depth;		// The scopes open on the thread
+};
+
+
+// A standard allocator on the arena of the thread, for containers local to an operation
+template <typename T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	ArenaAllocator() {}
+	template <typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+	T *allocate(size_t n) { return (T *)Arena::local().allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T *p, size_t n) { Arena::local().deallocate(p, n * sizeof(T)); }
+
+	template <typename U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+	template <typename U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+#endif // __ARENA_H__
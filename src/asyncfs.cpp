@@ -0,0 +1,306 @@
+#include "asyncfs.h"
+
+
+// The innermost plug the calling thread holds
+static thread_local AsyncFs::plug *currentPlug = nullptr;
+
+
+/**
+ @brief		Constructor - Starts the workers.
+ @param		fs_			The file system to run the operations on
+ @param		threads		The number of workers, 0 for one per hardware thread
+ */
+AsyncFs::AsyncFs(MyFs& fs_, unsigned threads) : fs(fs_), _inFlight(0), _pool(threads)
+{
+}
+
+
+/**
+ @brief		Destructor - Waits for every operation submitted to complete.
+ */
+AsyncFs::~AsyncFs()
+{
+	this->drain();
+}
+
+
+/**
+ @brief		Constructor - Starts holding back the operations the thread submits.
+ @param		afs_		The front end the operations are submitted to
+ */
+AsyncFs::plug::plug(AsyncFs& afs_) : afs(afs_), previous(currentPlug)
+{
+	currentPlug = this;
+}
+
+
+/**
+ @brief		Destructor - Hands the operations held back to the workers.
+ */
+AsyncFs::plug::~plug()
+{
+	currentPlug = this->previous;
+	this->afs._pool.push(this->tasks);
+}
+
+
+/**
+ @brief		Returns the key a path is ordered on - its components joined by single '/'s after a leading one, which
+			names the same file as the path does.
+ @param		path		The path the operation names
+ @return	The key
+ */
+std::string AsyncFs::orderKey(const std::string& path)
+{
+	std::string key;
+	key.reserve(path.length() + 1);
+	size_t position = 0;
+
+	while (position < path.length())
+	{
+		if (path[position] == '/')
+		{
+			position++;
+			continue;
+		}
+
+		size_t end = path.find('/', position);
+		if (end == std::string::npos)
+		{
+			end = path.length();
+		}
+
+		key += '/';
+		key.append(path, position, end - position);
+		position = end;
+	}
+
+	return key.empty() ? "/" : key;
+}
+
+
+/**
+ @brief		Queues an operation on its file, or starts it right away when nothing it conflicts with is running or
+			waiting.
+ @param		key			The key of the file the operation is ordered on
+ @param		mode		Whether the operation only reads the file
+ @param		run			The operation
+ @return	void
+ */
+void AsyncFs::enqueue(const std::string& key, access mode, WorkPool::task run)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		file_queue& queue = this->_files[key];
+		this->_inFlight++;
+
+		// Anything waiting goes first, even a read behind a waiting change
+		bool ready = queue.waiting.empty() && !queue.writer && (mode == ACCESS_READ || queue.readers == 0);
+		if (!ready)
+		{
+			queue.waiting.push_back(pending_op{ mode, std::move(run) });
+			return;
+		}
+
+		if (mode == ACCESS_READ)
+		{
+			queue.readers++;
+		}
+		else
+		{
+			queue.writer = true;
+		}
+	}
+
+	this->dispatch(std::move(run));
+}
+
+
+/**
+ @brief		Marks an operation of a file complete, and starts the operations waiting for it - a change on its own, or
+			every read up to the next change.
+ @param		key			The key of the file the operation was ordered on
+ @param		mode		Whether the operation only read the file
+ @return	void
+ */
+void AsyncFs::complete(const std::string& key, access mode)
+{
+	std::vector<WorkPool::task> ready;
+	{
+		std::lock_guard<std::mutex> lock(this->_mutex);
+		std::unordered_map<std::string, file_queue>::iterator it = this->_files.find(key);
+		file_queue& queue = it->second;
+
+		if (mode == ACCESS_READ)
+		{
+			queue.readers--;
+		}
+		else
+		{
+			queue.writer = false;
+		}
+
+		while (!queue.waiting.empty() && !queue.writer)
+		{
+			pending_op& next = queue.waiting.front();
+			if (next.mode == ACCESS_WRITE)
+			{
+				if (queue.readers > 0)
+				{
+					break;
+				}
+				queue.writer = true;
+			}
+			else
+			{
+				queue.readers++;
+			}
+
+			ready.push_back(std::move(next.run));
+			queue.waiting.pop_front();
+		}
+
+		if (queue.readers == 0 && !queue.writer && queue.waiting.empty())
+		{
+			this->_files.erase(it);
+		}
+
+		if (--this->_inFlight == 0)
+		{
+			this->_idle.notify_all();
+		}
+	}
+
+	this->_pool.push(ready);
+}
+
+
+// Hands a ready operation to the workers, or to the plug the thread holds
+void AsyncFs::dispatch(WorkPool::task run)
+{
+	if (currentPlug != nullptr && &currentPlug->afs == this)
+	{
+		currentPlug->tasks.push_back(std::move(run));
+		return;
+	}
+
+	this->_pool.push(std::move(run));
+}
+
+
+/**
+ @brief		Waits for every operation submitted so far to complete. Operations held back by a plug of the calling
+			thread never complete before the plug is gone.
+ @return	void
+ */
+void AsyncFs::drain()
+{
+	std::unique_lock<std::mutex> lock(this->_mutex);
+	this->_idle.wait(lock, [this]() { return this->_inFlight == 0; });
+}
+
+
+/**
+ @brief		Reads a byte range of a file into a buffer, which has to stay alive until the read completes.
+ @param		path		The file path
+ @param		offset		The file offset to start reading from
+ @param		length		The number of bytes to read
+ @param		buf			The buffer to read into
+ @return	A future of the number of bytes read
+ */
+std::future<uint32_t> AsyncFs::read(const std::string& path, uint32_t offset, uint32_t length, char *buf)
+{
+	return this->submit(path, ACCESS_READ, [path, offset, length, buf](MyFs& fs)
+	{
+		return fs.read(path, offset, length, buf);
+	});
+}
+
+
+/**
+ @brief		Writes data into a file at the given offset.
+ @param		path		The file path
+ @param		offset		The file offset to start writing at
+ @param		data		The data to write
+ @return	A future that is ready once the data is written
+ */
+std::future<void> AsyncFs::write(const std::string& path, uint32_t offset, std::string data)
+{
+	return this->submit(path, ACCESS_WRITE, [path, offset, data = std::move(data)](MyFs& fs)
+	{
+		fs.write(path, offset, data.length(), data.data());
+	});
+}
+
+
+/**
+ @brief		Appends data to the end of a file.
+ @param		path		The file path
+ @param		data		The data to append
+ @return	A future that is ready once the data is appended
+ */
+std::future<void> AsyncFs::append(const std::string& path, std::string data)
+{
+	return this->submit(path, ACCESS_WRITE, [path, data = std::move(data)](MyFs& fs)
+	{
+		fs.append(path, data.length(), data.data());
+	});
+}
+
+
+/**
+ @brief		Reads the whole content of a file.
+ @param		path		The file path
+ @return	A future of the file content
+ */
+std::future<std::string> AsyncFs::get_content(const std::string& path)
+{
+	return this->submit(path, ACCESS_READ, [path](MyFs& fs)
+	{
+		return fs.get_content(path);
+	});
+}
+
+
+/**
+ @brief		Replaces the content of a file.
+ @param		path		The file path
+ @param		content		The new content
+ @return	A future that is ready once the content is written
+ */
+std::future<void> AsyncFs::set_content(const std::string& path, std::string content)
+{
+	return this->submit(path, ACCESS_WRITE, [path, content = std::move(content)](MyFs& fs) mutable
+	{
+		fs.set_content(path, content);
+	});
+}
+
+
+/**
+ @brief		Creates a file or a directory.
+ @param		path			The path of the new file
+ @param		directory		Whether to create a directory
+ @return	A future that is ready once the file exists
+ */
+std::future<void> AsyncFs::create_file(const std::string& path, bool directory)
+{
+	return this->submit(path, ACCESS_WRITE, [path, directory](MyFs& fs)
+	{
+		fs.create_file(path, directory);
+	});
+}
+
+
+/**
+ @brief		Removes a file, or an empty directory.
+ @param		path		The file path
+ @return	A future that is ready once the file is gone
+ */
+std::future<void> AsyncFs::remove_file(const std::string& path)
+{
+	return this->submit(path, ACCESS_WRITE, [path](MyFs& fs)
+	{
+		fs.remove_file(path);
+	});
+}
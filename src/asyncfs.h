@@ -0,0 +1,149 @@
+#ifndef __ASYNCFS_H__
+#define __ASYNCFS_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <type_traits>
+#include <stdint.h>
+#include "myfs.h"
+#include "workpool.h"
+
+
+// An asynchronous front end of a MyFs. Every operation is queued on a work pool and returns a future of its result,
+// an error is thrown from the future's get(). Operations on different files run concurrently, and so do reads of the
+// same file. Operations on the same file that conflict (a change and anything else) run in the order they were
+// submitted - a change waits for the operations of the file before it and holds off the ones after it.
+// Files are told apart by their path with the repeated and trailing '/'s dropped, the way the file system reads it,
+// so "a", "/a" and "//a/" are ordered as one file. MyFs has no "." or ".." entries, they are names like any other.
+// The file system has to outlive the front end.
+class AsyncFs
+{
+public:
+	AsyncFs(MyFs& fs_, unsigned threads = 0);		// 0 for one worker per hardware thread
+	AsyncFs(const AsyncFs&) = delete;
+	AsyncFs& operator=(const AsyncFs&) = delete;
+	~AsyncFs();
+
+	enum access
+	{
+		ACCESS_READ,		// Runs alongside the other reads of the file
+		ACCESS_WRITE		// Runs alone, in submission order
+	};
+
+	// Holds back the operations the calling thread submits until it is destroyed, then hands them to the workers
+	// together with a single wake-up. The per-file order is set at submission all the same.
+	class plug
+	{
+	public:
+		plug(AsyncFs& afs_);
+		plug(const plug&) = delete;
+		plug& operator=(const plug&) = delete;
+		~plug();
+
+	private:
+		AsyncFs& afs;
+		plug *previous;
+		std::vector<WorkPool::task> tasks;
+
+		friend class AsyncFs;
+	};
+
+	std::future<uint32_t> read(const std::string& path, uint32_t offset, uint32_t length, char *buf);
+	std::future<void> write(const std::string& path, uint32_t offset, std::string data);
+	std::future<void> append(const std::string& path, std::string data);
+	std::future<std::string> get_content(const std::string& path);
+	std::future<void> set_content(const std::string& path, std::string content);
+	std::future<void> create_file(const std::string& path, bool directory);
+	std::future<void> remove_file(const std::string& path);
+
+	// Queues any operation on the file system, ordered with the others on the same path
+	template <typename F>
+	std::future<std::invoke_result_t<F, MyFs&>> submit(const std::string& path, access mode, F op);
+
+	void drain();
+
+	WorkPool::pool_stats stats() const { return this->_pool.stats(); }
+
+
+private:
+	struct pending_op
+	{
+		access mode;
+		WorkPool::task run;
+	};
+
+	// The operations of a file that are running and the ones waiting for them
+	struct file_queue
+	{
+		uint32_t readers;
+		bool writer;
+		std::deque<pending_op> waiting;
+	};
+
+	static std::string orderKey(const std::string& path);
+	void enqueue(const std::string& key, access mode, WorkPool::task run);
+	void complete(const std::string& key, access mode);
+	void dispatch(WorkPool::task run);
+
+	MyFs& fs;
+
+	std::mutex _mutex;		// Guards the file queues and the in-flight count
+	std::condition_variable _idle;
+	std::unordered_map<std::string, file_queue> _files;
+	size_t _inFlight;		// Submitted and not complete yet
+
+	WorkPool _pool;		// Last, so its workers stop before the rest goes away
+};
+
+
+/**
+ @brief		Queues an operation on the file system. It runs on a worker once every conflicting operation submitted
+			before it on the same path completes.
+ @param		path		The path the operation is ordered on
+ @param		mode		Whether the operation only reads the file
+ @param		op			The operation, called with the file system
+ @return	A future of what the operation returns
+ */
+template <typename F>
+std::future<std::invoke_result_t<F, MyFs&>> AsyncFs::submit(const std::string& path, access mode, F op)
+{
+	typedef std::invoke_result_t<F, MyFs&> result_type;
+
+	// A task has to be copyable, the promise isn't
+	std::shared_ptr<std::promise<result_type>> promise = std::make_shared<std::promise<result_type>>();
+	std::future<result_type> future = promise->get_future();
+	std::string key = orderKey(path);
+
+	this->enqueue(key, mode, [this, key, mode, promise, op = std::move(op)]() mutable
+	{
+		try
+		{
+			if constexpr (std::is_void_v<result_type>)
+			{
+				op(this->fs);
+				promise->set_value();
+			}
+			else
+			{
+				promise->set_value(op(this->fs));
+			}
+		}
+		catch (...)
+		{
+			promise->set_exception(std::current_exception());
+		}
+
+		this->complete(key, mode);
+	});
+
+	return future;
+}
+
+#endif // __ASYNCFS_H__
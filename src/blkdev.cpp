@@ -4,63 +4,307 @@
 #include <sys/mman.h>
 #include <string.h>
 #include "blkdev.h"
+#include "filedev.h"
+#include "uringdev.h"
+#include "stripedev.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdexcept>
 #include <errno.h>
+#include <algorithm>
 
 
-BlockDeviceSimulator::BlockDeviceSimulator(std::string fname)
+/**
+ @brief		Opens the device with the backend the options ask for. A comma separated list of image files opens them
+			as one device set (see StripedDevice), an image of a set can't be opened on its own.
+ @param		fname		The image file, or the image files of the set
+ @param		opts		The device options
+ @return	The device
+ */
+BlockDevice *BlockDevice::open(const std::string& fname, const options& opts)
 {
+	if (fname.find(',') != std::string::npos)
+	{
+		std::vector<std::string> fnames;
+		size_t start = 0;
+
+		while (true)
+		{
+			size_t end = fname.find(',', start);
+			fnames.push_back(fname.substr(start, end == std::string::npos ? std::string::npos : end - start));
+			if (fnames.back().empty())
+			{
+				throw std::runtime_error("Empty image file name in the device set " + fname);
+			}
+			if (end == std::string::npos)
+			{
+				break;
+			}
+			start = end + 1;
+		}
+
+		return new StripedDevice(fnames, opts);
+	}
+
+	BlockDevice *device = openImage(fname, opts);
+	if (StripedDevice::isMember(device))
+	{
+		delete device;
+		throw std::runtime_error("The image " + fname + " is a part of a device set, open it with the rest of the set");
+	}
+
+	return device;
+}
+
+
+// Opens a single image file with the backend the options ask for
+BlockDevice *BlockDevice::openImage(const std::string& fname, const options& opts)
+{
+	switch (opts.backend)
+	{
+	case BACKEND_PREAD:
+		return new FileBlockDevice(fname, opts);
+	case BACKEND_URING:
+		return new UringBlockDevice(fname, opts);
+	default:
+		return new BlockDeviceSimulator(fname, opts);
+	}
+}
+
+
+// Runs the requests one by one, backends that can queue requests to the kernel override it
+void BlockDevice::submit(const io_request *requests, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const io_request& request = requests[i];
+
+		if (request.write)
+		{
+			this->write(request.addr, request.size, request.data);
+		}
+		else
+		{
+			this->read(request.addr, request.size, request.buffer);
+		}
+	}
+}
+
+
+// Opens the image file, creating it with the given size if it doesn't exist. The file stays sparse until blocks are written.
+int BlockDevice::openFile(const std::string& fname, uint64_t createSize, int flags)
+{
+	int fd;
+
 	// if file doesn't exist, create it
 	if (access(fname.c_str(), F_OK) == -1)
 	{
-		fd = open(fname.c_str(), O_CREAT | O_RDWR | O_EXCL, 0664);
+		fd = ::open(fname.c_str(), O_CREAT | O_RDWR | O_EXCL | flags, 0664);
 
 		if (fd == -1)
 		{
 			throw std::runtime_error(std::string("open-create failed: ") + strerror(errno));
 		}
 
-		if (lseek(fd, DEVICE_SIZE-1, SEEK_SET) == -1)
+		if (ftruncate(fd, createSize) == -1)
 		{
-			throw std::runtime_error("Could not seek");
+			close(fd);
+			throw std::runtime_error(std::string("Could not size the device: ") + strerror(errno));
 		}
-
-		::write(fd, "\0", 1);
 	}
 	else
 	{
-		fd = open(fname.c_str(), O_RDWR);
+		fd = ::open(fname.c_str(), O_RDWR | flags);
 		if (fd == -1)
 		{
 			throw std::runtime_error(std::string("open failed: ") + strerror(errno));
 		}
 	}
 
-	filemap = (unsigned char *)mmap(NULL, DEVICE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return fd;
+}
+
+
+void BlockDevice::checkBounds(uint64_t addr, size_t size, uint64_t deviceSize)
+{
+	if (addr > deviceSize || size > deviceSize - addr)
+	{
+		throw std::runtime_error("access out of device bounds");
+	}
+}
+
+
+// Gives the range of the image file back to the host filesystem, it reads as zeros afterwards. A filesystem that
+// can't punch holes keeps the data, nothing depends on the range being zeroed.
+void BlockDevice::punchHole(int fd, uint64_t addr, size_t size)
+{
+	if (size == 0)
+	{
+		return;
+	}
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, addr, size) == -1 &&
+		errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+		throw std::runtime_error(std::string("Could not punch a hole in the device: ") + strerror(errno));
+	}
+}
+
+
+BlockDeviceSimulator::BlockDeviceSimulator(std::string fname) : BlockDeviceSimulator(fname, options())
+{
+}
+
+
+BlockDeviceSimulator::BlockDeviceSimulator(std::string fname, const options& opts_) : opts(opts_), pins(0)
+{
+	fd = openFile(fname, opts.size, 0);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		throw std::runtime_error(std::string("stat failed: ") + strerror(errno));
+	}
+	mapSize = st.st_size;
+
+	filemap = (unsigned char *)mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | (opts.populate ? MAP_POPULATE : 0), fd, 0);
 	if (filemap == (unsigned char *)-1)
 	{
 		throw std::runtime_error(strerror(errno));
 	}
+
+	advise();
 }
 
 
 BlockDeviceSimulator::~BlockDeviceSimulator()
 {
-	munmap(filemap, DEVICE_SIZE);
+	munmap(filemap, mapSize);
 	close(fd);
 }
 
 
-void BlockDeviceSimulator::read(int addr, int size, char *ans)
+void BlockDeviceSimulator::read(uint64_t addr, size_t size, char *ans)
 {
 	memcpy(ans, filemap + addr, size);
 }
 
 
-void BlockDeviceSimulator::write(int addr, int size, const char *data)
+void BlockDeviceSimulator::write(uint64_t addr, size_t size, const char *data)
 {
 	memcpy(filemap + addr, data, size);
 }
+
+
+// Writes the dirty pages of the range back to the file and waits for them, the range is widened to whole pages
+void BlockDeviceSimulator::flush(uint64_t addr, size_t size)
+{
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t start = addr - (addr % pageSize);
+	uint64_t end = std::min<uint64_t>(addr + size, mapSize);
+
+	if (start < end && msync(filemap + start, end - start, MS_SYNC) == -1)
+	{
+		throw std::runtime_error(std::string("msync failed: ") + strerror(errno));
+	}
+}
+
+
+// The mapping is shared, the pages of the hole are dropped from it too
+void BlockDeviceSimulator::discard(uint64_t addr, size_t size)
+{
+	checkBounds(addr, size, mapSize);
+	punchHole(fd, addr, size);
+}
+
+
+const char *BlockDeviceSimulator::view(uint64_t addr, size_t size) const
+{
+	if (addr + size > mapSize)
+	{
+		throw std::runtime_error("view out of device bounds");
+	}
+
+	return (const char *)filemap + addr;
+}
+
+
+// Views handed out by view() point straight into the mapping, so it must not be remapped while any are pinned
+void BlockDeviceSimulator::pin()
+{
+	pins++;
+}
+
+
+void BlockDeviceSimulator::unpin()
+{
+	pins--;
+}
+
+
+uint64_t BlockDeviceSimulator::size() const
+{
+	return mapSize;
+}
+
+
+// Grows the backing file and the mapping online. The mapping may move, so pinned views forbid growing.
+void BlockDeviceSimulator::grow(uint64_t newSize)
+{
+	if (newSize <= mapSize)
+	{
+		return;
+	}
+	if (pins > 0)
+	{
+		throw std::runtime_error("Can't grow the device while views of it are in use");
+	}
+
+	if (ftruncate(fd, newSize) == -1)
+	{
+		throw std::runtime_error(std::string("Could not grow the device: ") + strerror(errno));
+	}
+
+	unsigned char *newMap = (unsigned char *)mremap(filemap, mapSize, newSize, MREMAP_MAYMOVE);
+	if (newMap == (unsigned char *)-1)
+	{
+		ftruncate(fd, mapSize);
+		throw std::runtime_error(std::string("Could not remap the device: ") + strerror(errno));
+	}
+
+	uint64_t oldSize = mapSize;
+	filemap = newMap;
+	mapSize = newSize;
+
+	advise();
+
+#ifdef MADV_POPULATE_READ
+	// mremap doesn't honour MAP_POPULATE, pre-faulting the new part by hand
+	if (opts.populate)
+	{
+		uint64_t pageSize = sysconf(_SC_PAGESIZE);
+		uint64_t start = oldSize - (oldSize % pageSize);
+		madvise(filemap + start, mapSize - start, MADV_POPULATE_READ);
+	}
+#endif
+}
+
+
+// The hints are best effort, a kernel or file system that doesn't support them just ignores them
+void BlockDeviceSimulator::advise()
+{
+	if (opts.hugePages)
+	{
+		madvise(filemap, mapSize, MADV_HUGEPAGE);
+	}
+
+	if (opts.pattern == ACCESS_SEQUENTIAL)
+	{
+		madvise(filemap, mapSize, MADV_SEQUENTIAL);
+	}
+	else if (opts.pattern == ACCESS_RANDOM)
+	{
+		madvise(filemap, mapSize, MADV_RANDOM);
+	}
+}
@@ -2,23 +2,121 @@
 #define __BLKDEVSIM__H__
 
 #include <string>
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
 
 
-class BlockDeviceSimulator
+// The storage MyFs runs on, addressed by 64-bit byte offsets. A device that can't hand out pointers into its storage
+// (viewable() is false) has its content copied by the callers that want zero-copy access.
+class BlockDevice
+{
+public:
+	enum backend_type
+	{
+		BACKEND_MMAP,		// BlockDeviceSimulator - a shared mapping of the image, every access is a memcpy
+		BACKEND_PREAD,		// FileBlockDevice - a pread/pwrite system call per access
+		BACKEND_URING		// UringBlockDevice - io_uring, batches go to the kernel in a single submission
+	};
+
+	enum access_pattern
+	{
+		ACCESS_NORMAL,
+		ACCESS_SEQUENTIAL,
+		ACCESS_RANDOM
+	};
+
+	struct options
+	{
+		backend_type backend = BACKEND_MMAP;
+		uint64_t size = DEFAULT_DEVICE_SIZE;		// Only used when the backing file is created
+		bool populate = false;						// mmap: Pre-fault the whole mapping (MAP_POPULATE)
+		bool hugePages = false;						// mmap: Ask for transparent huge pages (MADV_HUGEPAGE)
+		access_pattern pattern = ACCESS_NORMAL;		// mmap: MADV_SEQUENTIAL / MADV_RANDOM read-ahead hint
+		uint32_t queueDepth = 64;					// io_uring: Ring entries, the most requests in flight at once
+		uint32_t stripeChunk = 64 * 1024;			// Device sets: The bytes that go to an image before the next one, only used when the set is created
+	};
+
+	// How the device spreads its bytes over the images behind it
+	struct stripe_layout
+	{
+		uint32_t width;			// The images, 1 for a single image
+		uint32_t chunkSize;		// The bytes that go to an image before the next one, 0 for a single image
+		uint64_t setId;			// Tells device sets apart, 0 for a single image
+	};
+
+	// One read or write of a batch
+	struct io_request
+	{
+		bool write;
+		uint64_t addr;
+		size_t size;
+		char *buffer;			// Where a read goes
+		const char *data;		// What a write writes
+	};
+
+	static BlockDevice *open(const std::string& fname, const options& opts);		// A comma separated list opens a device set
+
+	virtual ~BlockDevice() {}
+
+	virtual void read(uint64_t addr, size_t size, char *ans) = 0;
+	virtual void write(uint64_t addr, size_t size, const char *data) = 0;
+	virtual void submit(const io_request *requests, size_t count);
+	virtual void flush(uint64_t addr, size_t size) = 0;
+	virtual void discard(uint64_t addr, size_t size) {}		// The range holds nothing anymore, it may read as zeros
+
+	virtual bool viewable() const { return false; }
+	virtual const char *view(uint64_t addr, size_t size) const { return nullptr; }
+	virtual void pin() {}
+	virtual void unpin() {}
+
+	virtual uint64_t size() const = 0;
+	virtual void grow(uint64_t newSize) = 0;
+
+	virtual stripe_layout layout() const { return stripe_layout{ 1, 0, 0 }; }
+
+	static const uint64_t DEFAULT_DEVICE_SIZE = 1024 * 1024;
+
+
+protected:
+	static BlockDevice *openImage(const std::string& fname, const options& opts);
+	static int openFile(const std::string& fname, uint64_t createSize, int flags);
+	static void checkBounds(uint64_t addr, size_t size, uint64_t deviceSize);
+	static void punchHole(int fd, uint64_t addr, size_t size);
+};
+
+
+class BlockDeviceSimulator : public BlockDevice
 {
 public:
 	BlockDeviceSimulator(std::string fname);
-	~BlockDeviceSimulator();
+	BlockDeviceSimulator(std::string fname, const options& opts);
+	~BlockDeviceSimulator() override;
 
-	void read(int addr, int size, char *ans);
-	void write(int addr, int size, const char *data);
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
 
-	static const int DEVICE_SIZE = 1024 * 1024;
+	// Zero-copy access to the mapping, valid only while the device is pinned
+	bool viewable() const override { return true; }
+	const char *view(uint64_t addr, size_t size) const override;
+	void pin() override;
+	void unpin() override;
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
 
 
 private:
+	void advise();
+
 	int fd;
 	unsigned char *filemap;
+	uint64_t mapSize;
+	options opts;
+	std::atomic<int> pins;		// Live views into the mapping, the mapping can't move while there are any
 };
 
 #endif // __BLKDEVSIM__H__
@@ -0,0 +1,368 @@
+#include "blockcache.h"
+#include "Helper.h"
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <string.h>
+
+
+/**
+ @brief		Constructor - Sets up an empty cache in front of the device.
+ @param		device_			The device to cache
+ @param		capacity_		The number of blocks the cache holds
+ @param		blockSize_		The size of a cache block in bytes
+ */
+BlockCache::BlockCache(BlockDevice *device_, uint32_t capacity_, uint32_t blockSize_) :
+	device(device_), capacity(capacity_), blockSize(blockSize_), _hand(0),
+	_hits(0), _misses(0), _evictions(0), _writeBacks(0), _blocksWritten(0)
+{
+	if (this->capacity == 0 || this->blockSize == 0)
+	{
+		throw std::runtime_error(RED "The block cache needs at least one block" RESET);
+	}
+
+	this->_frames.resize(this->capacity, frame{ 0, false, false, false });
+	this->_data.resize((size_t)this->capacity * this->blockSize);
+	this->_index.reserve(this->capacity);
+}
+
+
+/**
+ @brief		Destructor - Writes the dirty blocks back to the device. Making them durable is left to the owner of the
+			device, like for any other write.
+ */
+BlockCache::~BlockCache()
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	this->writeBack(this->_dirtyBlocks.begin(), this->_dirtyBlocks.end());
+}
+
+
+/**
+ @brief		Reads from the device through the cache, loading the missing blocks.
+ @param		addr		The device address to read from
+ @param		size		The number of bytes to read
+ @param		ans			The buffer to read into
+ @return	void
+ */
+void BlockCache::read(uint64_t addr, size_t size, char *ans)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	if (addr + size > this->device->size())
+	{
+		throw std::runtime_error(RED "Read out of device bounds" RESET);
+	}
+
+	while (size > 0)
+	{
+		uint64_t block = addr / this->blockSize;
+		uint32_t offset = addr % this->blockSize;
+		size_t chunk = std::min<size_t>(size, this->blockSize - offset);
+
+		uint32_t index = this->lookup(block, true);
+		memcpy(ans, this->frameData(index) + offset, chunk);
+
+		addr += chunk;
+		ans += chunk;
+		size -= chunk;
+	}
+}
+
+
+/**
+ @brief		Writes to the cached blocks and marks them dirty. Blocks that are overwritten whole aren't read first.
+ @param		addr		The device address to write to
+ @param		size		The number of bytes to write
+ @param		data		The data to write
+ @return	void
+ */
+void BlockCache::write(uint64_t addr, size_t size, const char *data)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	if (addr + size > this->device->size())
+	{
+		throw std::runtime_error(RED "Write out of device bounds" RESET);
+	}
+
+	while (size > 0)
+	{
+		uint64_t block = addr / this->blockSize;
+		uint32_t offset = addr % this->blockSize;
+		size_t chunk = std::min<size_t>(size, this->blockSize - offset);
+		bool whole = offset == 0 && chunk >= this->blockLength(block);
+
+		uint32_t index = this->lookup(block, !whole);
+		memcpy(this->frameData(index) + offset, data, chunk);
+
+		if (!this->_frames[index].dirty)
+		{
+			this->_frames[index].dirty = true;
+			this->_dirtyBlocks.insert(block);
+		}
+
+		addr += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+}
+
+
+/**
+ @brief		Writes the dirty blocks of the range back to the device and flushes the range on the device.
+ @param		addr		The address of the range
+ @param		size		The size of the range
+ @return	void
+ */
+void BlockCache::flush(uint64_t addr, size_t size)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	if (size > 0)
+	{
+		uint64_t firstBlock = addr / this->blockSize;
+		uint64_t endBlock = (addr + size - 1) / this->blockSize + 1;
+
+		this->writeBack(this->_dirtyBlocks.lower_bound(firstBlock), this->_dirtyBlocks.lower_bound(endBlock));
+	}
+
+	this->device->flush(addr, size);
+}
+
+
+/**
+ @brief		Discards a range of the device. The cached blocks it covers whole are dropped, dirty or not, and the part
+			of the ones it covers partly is zeroed in the cache, the way it reads from the device afterwards.
+ @param		addr		The address of the range
+ @param		size		The size of the range
+ @return	void
+ */
+void BlockCache::discard(uint64_t addr, size_t size)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	if (size == 0)
+	{
+		return;
+	}
+
+	uint64_t end = addr + size;
+	for (uint64_t block = addr / this->blockSize; block <= (end - 1) / this->blockSize; block++)
+	{
+		std::unordered_map<uint64_t, uint32_t>::iterator it = this->_index.find(block);
+		if (it == this->_index.end())
+		{
+			continue;
+		}
+
+		frame& f = this->_frames[it->second];
+		uint64_t blockStart = block * this->blockSize;
+		uint64_t first = std::max(addr, blockStart);
+		uint64_t last = std::min(end, blockStart + this->blockLength(block));
+
+		if (first == blockStart && last == blockStart + this->blockLength(block))
+		{
+			if (f.dirty)
+			{
+				this->_dirtyBlocks.erase(block);
+			}
+			f.valid = false;
+			f.dirty = false;
+			this->_index.erase(it);
+		}
+		else
+		{
+			memset(this->frameData(it->second) + (first - blockStart), 0, last - first);
+		}
+	}
+
+	this->device->discard(addr, size);
+}
+
+
+uint64_t BlockCache::size() const
+{
+	return this->device->size();
+}
+
+
+/**
+ @brief		Grows the device. The cached blocks stay valid, the addresses they cache don't move.
+ @param		newSize		The new device size in bytes
+ @return	void
+ */
+void BlockCache::grow(uint64_t newSize)
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+	this->device->grow(newSize);
+}
+
+
+/**
+ @brief		Returns the cache counters and occupancy.
+ @return	The cache statistics
+ */
+BlockCache::cache_stats BlockCache::stats()
+{
+	std::lock_guard<std::mutex> lock(this->_mutex);
+
+	BlockCache::cache_stats stats;
+	stats.hits = this->_hits;
+	stats.misses = this->_misses;
+	stats.evictions = this->_evictions;
+	stats.writeBacks = this->_writeBacks;
+	stats.blocksWritten = this->_blocksWritten;
+	stats.cachedBlocks = this->_index.size();
+	stats.dirtyBlocks = this->_dirtyBlocks.size();
+	stats.capacity = this->capacity;
+	stats.blockSize = this->blockSize;
+
+	return stats;
+}
+
+
+/**
+ @brief		Returns the frame caching the given block, taking a frame for it on a miss.
+ @param		block		The block number
+ @param		load		Whether to read the block from the device on a miss (false when it's about to be overwritten)
+ @return	The frame index
+ */
+uint32_t BlockCache::lookup(uint64_t block, bool load)
+{
+	std::unordered_map<uint64_t, uint32_t>::iterator it = this->_index.find(block);
+	if (it != this->_index.end())
+	{
+		this->_hits++;
+		this->_frames[it->second].referenced = true;
+		return it->second;
+	}
+
+	this->_misses++;
+
+	uint32_t index = this->evict();
+	uint32_t length = this->blockLength(block);
+	char *data = this->frameData(index);
+
+	if (load)
+	{
+		this->device->read(block * this->blockSize, length, data);
+	}
+	memset(data + length, 0, this->blockSize - length);		// Past the end of the device
+
+	this->_frames[index] = frame{ block, true, true, false };
+	this->_index[block] = index;
+
+	return index;
+}
+
+
+/**
+ @brief		Frees a frame with the CLOCK algorithm - the hand skips (and clears) recently referenced frames and takes
+			the first one that wasn't referenced since it last passed. A dirty victim is written back first.
+ @return	The index of the free frame
+ */
+uint32_t BlockCache::evict()
+{
+	while (true)
+	{
+		uint32_t index = this->_hand;
+		frame& victim = this->_frames[index];
+		this->_hand = (this->_hand + 1) % this->capacity;
+
+		if (!victim.valid)
+		{
+			return index;
+		}
+
+		if (victim.referenced)
+		{
+			victim.referenced = false;
+			continue;
+		}
+
+		if (victim.dirty)
+		{
+			this->writeBackRun(victim.block);
+		}
+
+		this->_index.erase(victim.block);
+		victim.valid = false;
+		this->_evictions++;
+
+		return index;
+	}
+}
+
+
+/**
+ @brief		Writes back the dirty block together with the dirty blocks adjacent to it.
+ @param		block		The dirty block number
+ @return	void
+ */
+void BlockCache::writeBackRun(uint64_t block)
+{
+	std::set<uint64_t>::iterator first = this->_dirtyBlocks.find(block);
+	std::set<uint64_t>::iterator last = std::next(first);
+
+	while (first != this->_dirtyBlocks.begin() && *std::prev(first) == *first - 1)
+	{
+		first--;
+	}
+	while (last != this->_dirtyBlocks.end() && *last == *std::prev(last) + 1)
+	{
+		last++;
+	}
+
+	this->writeBack(first, last);
+}
+
+
+/**
+ @brief		Writes the given dirty blocks back to the device, one device write per run of adjacent blocks,
+			and marks them clean.
+ @param		first		The first dirty block to write
+ @param		last		The dirty block after the last one to write
+ @return	void
+ */
+void BlockCache::writeBack(std::set<uint64_t>::iterator first, std::set<uint64_t>::iterator last)
+{
+	std::vector<char> run;
+
+	std::set<uint64_t>::iterator it = first;
+	while (it != last)
+	{
+		uint64_t start = *it;
+		uint64_t count = 0;
+
+		run.clear();
+		while (it != last && *it == start + count)
+		{
+			uint32_t index = this->_index.at(*it);
+			const char *data = this->frameData(index);
+
+			run.insert(run.end(), data, data + this->blockLength(*it));
+			this->_frames[index].dirty = false;
+
+			count++;
+			it++;
+		}
+
+		this->device->write(start * this->blockSize, run.size(), run.data());
+		this->_writeBacks++;
+		this->_blocksWritten += count;
+	}
+
+	this->_dirtyBlocks.erase(first, last);
+}
+
+
+/**
+ @brief		Returns the number of bytes of the block inside the device, less than a block only for the last block.
+ @param		block		The block number
+ @return	The block length in bytes
+ */
+uint32_t BlockCache::blockLength(uint64_t block) const
+{
+	return std::min<uint64_t>(this->blockSize, this->device->size() - block * this->blockSize);
+}
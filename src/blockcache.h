@@ -0,0 +1,85 @@
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <stdint.h>
+#include "blkdev.h"
+
+
+// A fixed-size write-back cache of device blocks in front of another device. Blocks are evicted with the CLOCK
+// algorithm, and dirty blocks only reach the device when they are evicted or flushed, together with the dirty blocks
+// next to them in a single write.
+class BlockCache : public BlockDevice
+{
+public:
+	BlockCache(BlockDevice *device_, uint32_t capacity_, uint32_t blockSize_ = DEFAULT_BLOCK_SIZE);
+	~BlockCache() override;
+
+	struct cache_stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t writeBacks;		// Device writes, every one covering a run of adjacent dirty blocks
+		uint64_t blocksWritten;
+		uint32_t cachedBlocks;
+		uint32_t dirtyBlocks;
+		uint32_t capacity;
+		uint32_t blockSize;
+	};
+
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
+
+	stripe_layout layout() const override { return this->device->layout(); }
+
+	cache_stats stats();
+
+	static const uint32_t DEFAULT_BLOCK_SIZE = 4096;
+
+
+private:
+	struct frame
+	{
+		uint64_t block;
+		bool valid;
+		bool referenced;		// Set on every access, cleared as the clock hand passes
+		bool dirty;
+	};
+
+	uint32_t lookup(uint64_t block, bool load);
+	uint32_t evict();
+	void writeBack(std::set<uint64_t>::iterator first, std::set<uint64_t>::iterator last);
+	void writeBackRun(uint64_t block);
+
+	char *frameData(uint32_t index) { return &this->_data[(size_t)index * this->blockSize]; }
+	uint32_t blockLength(uint64_t block) const;
+
+	BlockDevice *device;
+	uint32_t capacity;
+	uint32_t blockSize;
+
+	std::mutex _mutex;		// Every public operation holds it
+
+	std::vector<frame> _frames;
+	std::vector<char> _data;		// The frames' block data, blockSize bytes each
+	std::unordered_map<uint64_t, uint32_t> _index;		// Block number -> frame
+	std::set<uint64_t> _dirtyBlocks;		// Ordered, so runs of adjacent dirty blocks are found by walking it
+	uint32_t _hand;
+
+	uint64_t _hits;
+	uint64_t _misses;
+	uint64_t _evictions;
+	uint64_t _writeBacks;
+	uint64_t _blocksWritten;
+};
+
+#endif // __BLOCKCACHE_H__
@@ -0,0 +1,931 @@
+#include "checksumdev.h"
+#include "crc32c.h"
+#include "Helper.h"
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <string.h>
+
+
+const uint32_t ChecksumDevice::STRIPES;
+const uint32_t ChecksumDevice::RUN_BLOCKS;		// Passed by reference to std::min
+const uint32_t ChecksumDevice::MAX_REPORTED;
+const uint32_t ChecksumDevice::REGION_BLOCKS;
+
+static const uint32_t SUMS_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+static const uint32_t VERIFY_BATCH = 64;		// Blocks summed together on a read
+static const uint32_t READ_BACK_BLOCKS = 16;	// Blocks a discard reads back at once, on the stack
+
+
+/**
+ @brief		Constructor - Passes the accesses to the given device, without sums until enable().
+ @param		device_		The device to pass the accesses to
+ */
+ChecksumDevice::ChecksumDevice(BlockDevice *device_) :
+	device(device_), _enabled(false), _tableAddress(0), _coveredBlocks(0), _errors(0)
+{
+}
+
+
+/**
+ @brief		Returns the number of blocks the checksum table of a device takes - a 32-bit sum for each of its blocks.
+ @param		blockCount		The number of blocks on the device
+ @return	The number of table blocks
+ */
+uint32_t ChecksumDevice::tableBlocks(uint32_t blockCount)
+{
+	return ((uint64_t)blockCount * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+
+/**
+ @brief		Starts keeping sums of the blocks before the table. Nothing else may access the device meanwhile.
+ @param		tableAddress	Where the table is, block aligned - the blocks before it are summed
+ @param		blockCount		The number of blocks on the device, the table has room for a sum of each
+ @param		rebuild			Whether to sum the blocks as they are instead of loading the table, when the table on
+							the device isn't to be trusted (a new table, or a crash under a version without the
+							bitmap). A loaded table only has the blocks of its marked regions summed again.
+ @param		threads			The threads to sum with, 0 for one per hardware thread
+ @return	void
+ */
+void ChecksumDevice::enable(uint64_t tableAddress, uint32_t blockCount, bool rebuild, unsigned threads)
+{
+	this->_enabled.store(false, std::memory_order_release);
+
+	uint32_t covered = tableAddress / BLOCK_SIZE;
+	if (tableAddress % BLOCK_SIZE != 0 || covered + tableBlocks(blockCount) > blockCount ||
+		(uint64_t)blockCount * BLOCK_SIZE > this->device->size())
+	{
+		throw std::runtime_error("The checksum table is out of the device");
+	}
+
+	this->setTable(tableAddress, blockCount);
+
+	if (rebuild)
+	{
+		// The whole table is written by the next sync, with an empty bitmap
+		this->sumFromDevice(0, covered, threads);
+		for (std::atomic<bool>& dirty : this->_dirtyPages)
+		{
+			dirty.store(true, std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		std::vector<uint32_t> table((uint64_t)covered + this->_intent.size());
+		this->device->read(tableAddress, table.size() * sizeof(uint32_t), (char *)table.data());
+		for (uint32_t block = 0; block < covered; block++)
+		{
+			this->_sums[block].store(table[block], std::memory_order_relaxed);
+		}
+
+		// A marked region may have been written after its sums were, its blocks are summed as they are. It stays
+		// marked on the device until the next sync.
+		for (uint32_t region = 0; region < this->_marked.size(); region++)
+		{
+			this->_intent[region / 32] = table[covered + region / 32];
+			if (this->_intent[region / 32] & (1U << (region % 32)))
+			{
+				this->_marked[region].store(true, std::memory_order_relaxed);
+				uint32_t first = region * REGION_BLOCKS;
+				this->sumFromDevice(first, std::min(REGION_BLOCKS, covered - first), threads);
+			}
+		}
+	}
+
+	this->_enabled.store(true, std::memory_order_release);
+}
+
+
+/**
+ @brief		Stops keeping sums. Nothing else may access the device meanwhile.
+ @return	void
+ */
+void ChecksumDevice::disable()
+{
+	this->_enabled.store(false, std::memory_order_release);
+
+	std::vector<std::atomic<uint32_t>> sums;
+	std::vector<std::atomic<bool>> dirtyPages;
+	std::vector<uint32_t> intent;
+	std::vector<std::atomic<bool>> marked;
+	std::vector<bool> unmarking;
+	this->_sums.swap(sums);
+	this->_dirtyPages.swap(dirtyPages);
+	this->_intent.swap(intent);
+	this->_marked.swap(marked);
+	this->_unmarking.swap(unmarking);
+	this->_tableAddress = 0;
+	this->_coveredBlocks = 0;
+}
+
+
+/**
+ @brief		Marks every region on the device, a crash from here on has every block summed again at the next mount. For
+			changes the table on the device can't follow, like moving it. Nothing else may access the device
+			meanwhile.
+ @return	void
+ */
+void ChecksumDevice::markAll()
+{
+	if (!this->enabled() || this->_intent.empty())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->_intentMutex);
+	for (uint32_t region = 0; region < this->_marked.size(); region++)
+	{
+		this->_intent[region / 32] |= 1U << (region % 32);
+		this->_marked[region].store(true, std::memory_order_relaxed);
+	}
+	this->writeBitmap(0, this->_intent.size() - 1);
+}
+
+
+/**
+ @brief		Moves the table after the device grew. The sums kept so far stay, the blocks that are summed only now (the
+			added ones and the old table) are summed as they are. The whole table is written by the next sync, with an
+			empty bitmap - the old table should be marked everywhere (see markAll) until nothing points at it any more.
+			Nothing else may access the device meanwhile.
+ @param		tableAddress	The new table address, past the old table
+ @param		blockCount		The new number of blocks on the device
+ @param		threads			The threads to sum with, 0 for one per hardware thread
+ @return	void
+ */
+void ChecksumDevice::relocate(uint64_t tableAddress, uint32_t blockCount, unsigned threads)
+{
+	uint32_t covered = tableAddress / BLOCK_SIZE;
+	uint32_t oldCovered = this->_coveredBlocks;
+	if (!this->enabled() || covered < oldCovered || tableAddress % BLOCK_SIZE != 0 ||
+		covered + tableBlocks(blockCount) > blockCount || (uint64_t)blockCount * BLOCK_SIZE > this->device->size())
+	{
+		throw std::runtime_error("The checksum table can't move there");
+	}
+
+	std::vector<std::atomic<uint32_t>> oldSums;
+	oldSums.swap(this->_sums);
+	this->setTable(tableAddress, blockCount);
+
+	for (uint32_t block = 0; block < oldCovered; block++)
+	{
+		this->_sums[block].store(oldSums[block].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	for (std::atomic<bool>& dirty : this->_dirtyPages)
+	{
+		dirty.store(true, std::memory_order_relaxed);
+	}
+
+	this->sumFromDevice(oldCovered, covered - oldCovered, threads);
+}
+
+
+/**
+ @brief		Writes the sums that changed since the last sync to the table and clears the bits of the regions they
+			cover. The blocks of the marked regions are flushed first, then the sums, then the bitmap, so a cleared bit
+			never stands for sums the device doesn't hold. A region written while the sync runs keeps its bit.
+ @return	void
+ */
+void ChecksumDevice::sync()
+{
+	if (!this->enabled())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->_syncMutex);
+	uint32_t regions = this->_marked.size();
+
+	// With every stripe held no write is between marking its region and summing its blocks. The regions are unmarked
+	// here, a write from now on marks its region again.
+	{
+		stripe_guard guard(*this, ~0ULL);
+		for (uint32_t region = 0; region < regions; region++)
+		{
+			this->_unmarking[region] = this->_marked[region].exchange(false, std::memory_order_acq_rel);
+		}
+	}
+
+	// Adjacent regions in a single flush
+	for (uint32_t region = 0; region < regions; )
+	{
+		if (!this->_unmarking[region])
+		{
+			region++;
+			continue;
+		}
+
+		uint32_t end = region + 1;
+		while (end < regions && this->_unmarking[end])
+		{
+			end++;
+		}
+
+		uint64_t start = (uint64_t)region * REGION_BLOCKS * BLOCK_SIZE;
+		uint64_t stop = std::min<uint64_t>((uint64_t)end * REGION_BLOCKS, this->_coveredBlocks) * BLOCK_SIZE;
+		this->device->flush(start, stop - start);
+		region = end;
+	}
+
+	uint32_t firstWritten = UINT32_MAX;
+	uint32_t lastWritten = 0;
+	for (uint32_t index = 0; index < this->_dirtyPages.size(); index++)
+	{
+		if (!this->_dirtyPages[index].exchange(false, std::memory_order_acq_rel))
+		{
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> intentLock(this->_intentMutex);
+			this->writePage(index);
+		}
+		firstWritten = std::min(firstWritten, index);
+		lastWritten = index;
+	}
+
+	if (firstWritten != UINT32_MAX)
+	{
+		this->device->flush(this->_tableAddress + (uint64_t)firstWritten * BLOCK_SIZE,
+			(uint64_t)(lastWritten - firstWritten + 1) * BLOCK_SIZE);
+	}
+
+	std::lock_guard<std::mutex> intentLock(this->_intentMutex);
+	uint32_t firstWord = UINT32_MAX;
+	uint32_t lastWord = 0;
+	for (uint32_t region = 0; region < regions; region++)
+	{
+		if (this->_unmarking[region] && !this->_marked[region].load(std::memory_order_acquire))
+		{
+			this->_intent[region / 32] &= ~(1U << (region % 32));
+			firstWord = std::min(firstWord, region / 32);
+			lastWord = region / 32;
+		}
+	}
+
+	if (firstWord != UINT32_MAX)
+	{
+		this->writeBitmap(firstWord, lastWord);
+	}
+}
+
+
+/**
+ @brief		Checks every summed block against its sum, on several threads. The blocks are read without any lock (in
+			place when the device has a mapping), a block that doesn't match is checked again under its stripe lock,
+			so a write in flight isn't taken for corruption.
+ @param		threads		The threads to check with, 0 for one per hardware thread
+ @return	What was checked and the bad blocks found
+ */
+ChecksumDevice::scrub_stats ChecksumDevice::scrub(unsigned threads) const
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	scrub_stats stats = {};
+	std::mutex badMutex;
+	std::vector<uint32_t> bad;
+	bool viewable = this->device->viewable();
+
+	if (threads == 0)
+	{
+		threads = std::max(1U, std::thread::hardware_concurrency());
+	}
+	stats.threads = std::max<uint64_t>(1, std::min<uint64_t>(threads, (this->_coveredBlocks + RUN_BLOCKS - 1) / RUN_BLOCKS));
+
+	// Viewed in place when the device has a mapping, it can't move while pinned
+	if (viewable)
+	{
+		this->device->pin();
+	}
+
+	try
+	{
+		this->forRuns(0, this->_coveredBlocks, stats.threads, [&](uint32_t first, uint32_t count, char *buffer)
+		{
+			uint32_t sums[VERIFY_BATCH];
+			char copy[BLOCK_SIZE];
+			const char *blocks = buffer;
+
+			if (viewable)
+			{
+				blocks = this->device->view((uint64_t)first * BLOCK_SIZE, (uint64_t)count * BLOCK_SIZE);
+			}
+			else
+			{
+				this->device->read((uint64_t)first * BLOCK_SIZE, (uint64_t)count * BLOCK_SIZE, buffer);
+			}
+
+			for (uint32_t done = 0; done < count; done += VERIFY_BATCH)
+			{
+				uint32_t batch = std::min(count - done, VERIFY_BATCH);
+				Crc32c::computeBlocks(blocks + (uint64_t)done * BLOCK_SIZE, BLOCK_SIZE, batch, sums);
+
+				for (uint32_t i = 0; i < batch; i++)
+				{
+					uint32_t block = first + done + i;
+					if (sums[i] != this->_sums[block].load(std::memory_order_relaxed) && !this->recheck(block, copy))
+					{
+						std::lock_guard<std::mutex> lock(badMutex);
+						bad.push_back(block);
+					}
+				}
+			}
+		});
+	}
+	catch (...)
+	{
+		if (viewable)
+		{
+			this->device->unpin();
+		}
+		throw;
+	}
+
+	if (viewable)
+	{
+		this->device->unpin();
+	}
+
+	std::sort(bad.begin(), bad.end());
+	stats.blocks = this->_coveredBlocks;
+	stats.bytes = (uint64_t)this->_coveredBlocks * BLOCK_SIZE;
+	stats.badBlocks = bad.size();
+	stats.firstBad.assign(bad.begin(), bad.begin() + std::min<size_t>(bad.size(), MAX_REPORTED));
+	stats.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
+
+
+void ChecksumDevice::read(uint64_t addr, size_t size, char *ans)
+{
+	this->device->read(addr, size, ans);
+
+	if (this->enabled())
+	{
+		this->verify(addr, size, ans);
+	}
+}
+
+
+void ChecksumDevice::write(uint64_t addr, size_t size, const char *data)
+{
+	if (!this->enabled())
+	{
+		this->device->write(addr, size, data);
+		return;
+	}
+
+	stripe_guard guard(*this, this->stripeMask(addr, size));
+	this->mark(addr, size);
+	this->device->write(addr, size, data);
+	this->update(addr, size, data);
+}
+
+
+/**
+ @brief		Submits the batch to the device as a single batch. The blocks of every write stay locked until their sums
+			are updated, the reads are checked once the batch completes.
+ @param		requests		The requests
+ @param		count			The number of requests
+ @return	void
+ */
+void ChecksumDevice::submit(const io_request *requests, size_t count)
+{
+	if (!this->enabled())
+	{
+		this->device->submit(requests, count);
+		return;
+	}
+
+	uint64_t mask = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (requests[i].write)
+		{
+			mask |= this->stripeMask(requests[i].addr, requests[i].size);
+		}
+	}
+
+	{
+		stripe_guard guard(*this, mask);
+		for (size_t i = 0; i < count; i++)
+		{
+			if (requests[i].write)
+			{
+				this->mark(requests[i].addr, requests[i].size);
+			}
+		}
+		this->device->submit(requests, count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (requests[i].write)
+			{
+				this->update(requests[i].addr, requests[i].size, requests[i].data);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!requests[i].write)
+		{
+			this->verify(requests[i].addr, requests[i].size, requests[i].buffer);
+		}
+	}
+}
+
+
+void ChecksumDevice::flush(uint64_t addr, size_t size)
+{
+	this->device->flush(addr, size);
+}
+
+
+/**
+ @brief		Discards the range on the device. The range may or may not read as zeros afterwards, so its blocks are
+			summed as they read.
+ @param		addr		The start of the range
+ @param		size		The size of the range
+ @return	void
+ */
+void ChecksumDevice::discard(uint64_t addr, size_t size)
+{
+	if (!this->enabled())
+	{
+		this->device->discard(addr, size);
+		return;
+	}
+
+	stripe_guard guard(*this, this->stripeMask(addr, size));
+	this->mark(addr, size);
+	this->device->discard(addr, size);
+	this->update(addr, size, nullptr);
+}
+
+
+/**
+ @brief		Returns a pointer into the device once the blocks it covers check out.
+ @param		addr		The start of the range
+ @param		size		The size of the range
+ @return	The pointer to the range
+ */
+const char *ChecksumDevice::view(uint64_t addr, size_t size) const
+{
+	uint32_t first;
+	uint32_t end;
+	if (!this->enabled() || !this->coveredRange(addr, size, first, end))
+	{
+		return this->device->view(addr, size);
+	}
+
+	// The covered blocks are viewed whole
+	uint64_t start = std::min<uint64_t>(addr, (uint64_t)first * BLOCK_SIZE);
+	uint64_t stop = std::max<uint64_t>(addr + size, (uint64_t)end * BLOCK_SIZE);
+	const char *mapped = this->device->view(start, stop - start);
+
+	this->verifyBlocks(first, end - first, mapped + ((uint64_t)first * BLOCK_SIZE - start), nullptr);
+	return mapped + (addr - start);
+}
+
+
+uint64_t ChecksumDevice::size() const
+{
+	return this->device->size();
+}
+
+
+// The added blocks are summed once the file system moves the table past them (see relocate)
+void ChecksumDevice::grow(uint64_t newSize)
+{
+	this->device->grow(newSize);
+}
+
+
+/**
+ @brief		Clips a byte range to the summed blocks.
+ @param		addr		The start of the range
+ @param		size		The size of the range
+ @param		first		Set to the first block the range touches
+ @param		end			Set past the last summed block the range touches
+ @return	Whether the range touches any summed block
+ */
+bool ChecksumDevice::coveredRange(uint64_t addr, size_t size, uint32_t& first, uint32_t& end) const
+{
+	if (size == 0 || addr >= (uint64_t)this->_coveredBlocks * BLOCK_SIZE)
+	{
+		return false;
+	}
+
+	first = addr / BLOCK_SIZE;
+	end = std::min<uint64_t>((addr + size + BLOCK_SIZE - 1) / BLOCK_SIZE, this->_coveredBlocks);
+	return true;
+}
+
+
+// The stripes of the summed blocks a range touches, one bit per stripe
+uint64_t ChecksumDevice::stripeMask(uint64_t addr, size_t size) const
+{
+	uint32_t first;
+	uint32_t end;
+	if (!this->coveredRange(addr, size, first, end))
+	{
+		return 0;
+	}
+	if (end - first >= STRIPES)
+	{
+		return ~0ULL;
+	}
+
+	uint64_t mask = 0;
+	for (uint32_t block = first; block < end; block++)
+	{
+		mask |= 1ULL << (block % STRIPES);
+	}
+	return mask;
+}
+
+
+/**
+ @brief		Sets the bits of the regions a write (or a discard) is about to touch, with its stripes held, and flushes
+			them. Most writes find their regions marked already and touch nothing.
+ @param		addr		The start of the range
+ @param		size		The size of the range
+ @return	void
+ */
+void ChecksumDevice::mark(uint64_t addr, size_t size)
+{
+	uint32_t first;
+	uint32_t end;
+	if (!this->coveredRange(addr, size, first, end))
+	{
+		return;
+	}
+
+	uint32_t region = first / REGION_BLOCKS;
+	uint32_t lastRegion = (end - 1) / REGION_BLOCKS;
+	while (region <= lastRegion && this->_marked[region].load(std::memory_order_acquire))
+	{
+		region++;
+	}
+	if (region > lastRegion)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->_intentMutex);
+	for (uint32_t next = region; next <= lastRegion; next++)
+	{
+		this->_intent[next / 32] |= 1U << (next % 32);
+	}
+	this->writeBitmap(region / 32, lastRegion / 32);
+
+	for (; region <= lastRegion; region++)
+	{
+		this->_marked[region].store(true, std::memory_order_release);
+	}
+}
+
+
+/**
+ @brief		Writes the table blocks holding a run of bitmap words and flushes them. The bitmap follows the last sum in
+			the table, in the entries of the table's own blocks. Called with the intent mutex held.
+ @param		firstWord		The first word
+ @param		lastWord		The last word
+ @return	void
+ */
+void ChecksumDevice::writeBitmap(uint32_t firstWord, uint32_t lastWord)
+{
+	uint32_t firstPage = (this->_coveredBlocks + firstWord) / SUMS_PER_BLOCK;
+	uint32_t lastPage = (this->_coveredBlocks + lastWord) / SUMS_PER_BLOCK;
+
+	for (uint32_t index = firstPage; index <= lastPage; index++)
+	{
+		this->writePage(index);
+	}
+	this->device->flush(this->_tableAddress + (uint64_t)firstPage * BLOCK_SIZE,
+		(uint64_t)(lastPage - firstPage + 1) * BLOCK_SIZE);
+}
+
+
+/**
+ @brief		Writes a table block as the sums and the bitmap are in memory, the entries past both are left zero. Called
+			with the intent mutex held.
+ @param		index		The table block
+ @return	void
+ */
+void ChecksumDevice::writePage(uint32_t index)
+{
+	uint32_t page[SUMS_PER_BLOCK];
+	uint32_t first = index * SUMS_PER_BLOCK;
+
+	for (uint32_t i = 0; i < SUMS_PER_BLOCK; i++)
+	{
+		uint32_t entry = first + i;
+		if (entry < this->_coveredBlocks)
+		{
+			page[i] = this->_sums[entry].load(std::memory_order_relaxed);
+		}
+		else
+		{
+			page[i] = (entry - this->_coveredBlocks < this->_intent.size()) ? this->_intent[entry - this->_coveredBlocks] : 0;
+		}
+	}
+
+	this->device->write(this->_tableAddress + (uint64_t)index * BLOCK_SIZE, BLOCK_SIZE, (const char *)page);
+}
+
+
+/**
+ @brief		Sizes the sums, the dirty table blocks and the bitmap for a table, all of them zero. The bitmap has a bit
+			per REGION_BLOCKS summed blocks, and always fits in the entries of the table's own blocks.
+ @param		tableAddress	Where the table is, block aligned
+ @param		blockCount		The number of blocks on the device
+ @return	void
+ */
+void ChecksumDevice::setTable(uint64_t tableAddress, uint32_t blockCount)
+{
+	uint32_t covered = tableAddress / BLOCK_SIZE;
+	uint32_t regions = (covered + REGION_BLOCKS - 1) / REGION_BLOCKS;
+
+	std::vector<std::atomic<uint32_t>> sums(covered);
+	std::vector<std::atomic<bool>> dirtyPages(tableBlocks(blockCount));
+	std::vector<uint32_t> intent((regions + 31) / 32);
+	std::vector<std::atomic<bool>> marked(regions);
+	std::vector<bool> unmarking(regions);
+	this->_sums.swap(sums);
+	this->_dirtyPages.swap(dirtyPages);
+	this->_intent.swap(intent);
+	this->_marked.swap(marked);
+	this->_unmarking.swap(unmarking);
+	this->_tableAddress = tableAddress;
+	this->_coveredBlocks = covered;
+}
+
+
+/**
+ @brief		Sums the blocks a write (or a discard) touched, with their stripes held. A block the range only partly
+			covers is read back whole.
+ @param		addr		The start of the range
+ @param		size		The size of the range
+ @param		data		What was written, nullptr to read every block back
+ @return	void
+ */
+void ChecksumDevice::update(uint64_t addr, size_t size, const char *data)
+{
+	uint32_t first;
+	uint32_t end;
+	if (!this->coveredRange(addr, size, first, end))
+	{
+		return;
+	}
+
+	uint32_t sums[VERIFY_BATCH];
+	char copy[READ_BACK_BLOCKS * BLOCK_SIZE];		// On the stack, a write allocates nothing
+	uint32_t block = first;
+
+	while (block < end)
+	{
+		uint64_t blockStart = (uint64_t)block * BLOCK_SIZE;
+		uint32_t count = 1;
+
+		if (data != nullptr && blockStart >= addr && blockStart + BLOCK_SIZE <= addr + size)
+		{
+			count = std::min<uint64_t>({ (addr + size - blockStart) / BLOCK_SIZE, end - block, VERIFY_BATCH });
+			Crc32c::computeBlocks(data + (blockStart - addr), BLOCK_SIZE, count, sums);
+		}
+		else
+		{
+			// Only the partial head and tail blocks of a write are read back, a discard reads back all of its blocks
+			if (data == nullptr)
+			{
+				count = std::min(end - block, READ_BACK_BLOCKS);
+			}
+			this->device->read(blockStart, (uint64_t)count * BLOCK_SIZE, copy);
+			Crc32c::computeBlocks(copy, BLOCK_SIZE, count, sums);
+		}
+
+		this->store(block, count, sums);
+		block += count;
+	}
+}
+
+
+// Sets the sums of a run of blocks and marks their table blocks dirty
+void ChecksumDevice::store(uint32_t first, uint32_t count, const uint32_t *sums)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		this->_sums[first + i].store(sums[i], std::memory_order_relaxed);
+	}
+	for (uint32_t page = first / SUMS_PER_BLOCK; page <= (first + count - 1) / SUMS_PER_BLOCK; page++)
+	{
+		this->_dirtyPages[page].store(true, std::memory_order_relaxed);
+	}
+}
+
+
+// Sums a run of blocks as they are on the device, on several threads
+void ChecksumDevice::sumFromDevice(uint32_t first, uint32_t count, unsigned threads)
+{
+	if (threads == 0)
+	{
+		threads = std::max(1U, std::thread::hardware_concurrency());
+	}
+
+	this->forRuns(first, count, threads, [this](uint32_t runFirst, uint32_t runCount, char *buffer)
+	{
+		std::vector<uint32_t> sums(runCount);
+		this->device->read((uint64_t)runFirst * BLOCK_SIZE, (uint64_t)runCount * BLOCK_SIZE, buffer);
+		Crc32c::computeBlocks(buffer, BLOCK_SIZE, runCount, sums.data());
+		this->store(runFirst, runCount, sums.data());
+	});
+}
+
+
+/**
+ @brief		Checks the blocks a read covered. A block the read only partly covered is read whole and checked, and the
+			read's part of it is taken from that copy.
+ @param		addr		The start of the range
+ @param		size		The size of the range
+ @param		data		What was read, blocks that had to be checked again are replaced by what the check read
+ @return	void
+ */
+void ChecksumDevice::verify(uint64_t addr, size_t size, char *data) const
+{
+	uint32_t first;
+	uint32_t end;
+	if (!this->coveredRange(addr, size, first, end))
+	{
+		return;
+	}
+
+	uint32_t block = first;
+	while (block < end)
+	{
+		uint64_t blockStart = (uint64_t)block * BLOCK_SIZE;
+
+		if (blockStart >= addr && blockStart + BLOCK_SIZE <= addr + size)
+		{
+			uint32_t count = std::min<uint64_t>((addr + size - blockStart) / BLOCK_SIZE, end - block);
+			char *blocks = data + (blockStart - addr);
+			this->verifyBlocks(block, count, blocks, blocks);
+			block += count;
+			continue;
+		}
+
+		char copy[BLOCK_SIZE];
+		this->device->read(blockStart, BLOCK_SIZE, copy);
+		this->verifyBlocks(block, 1, copy, copy);
+
+		uint64_t start = std::max(addr, blockStart);
+		uint64_t stop = std::min<uint64_t>(addr + size, blockStart + BLOCK_SIZE);
+		memcpy(data + (start - addr), copy + (start - blockStart), stop - start);
+		block++;
+	}
+}
+
+
+/**
+ @brief		Checks a run of whole blocks against their sums. A block that doesn't match is read again under its stripe
+			lock before it's taken for bad, it may have been read in the middle of a write.
+ @param		first			The first block
+ @param		count			The number of blocks
+ @param		blocks			The content of the blocks
+ @param		repaired		Where the blocks read again are copied to, nullptr to not copy them
+ @return	void
+ */
+void ChecksumDevice::verifyBlocks(uint32_t first, uint32_t count, const char *blocks, char *repaired) const
+{
+	uint32_t sums[VERIFY_BATCH];
+	char copy[BLOCK_SIZE];
+
+	for (uint32_t done = 0; done < count; done += VERIFY_BATCH)
+	{
+		uint32_t batch = std::min(count - done, VERIFY_BATCH);
+		Crc32c::computeBlocks(blocks + (uint64_t)done * BLOCK_SIZE, BLOCK_SIZE, batch, sums);
+
+		for (uint32_t i = 0; i < batch; i++)
+		{
+			uint32_t block = first + done + i;
+			if (sums[i] == this->_sums[block].load(std::memory_order_relaxed))
+			{
+				continue;
+			}
+
+			if (!this->recheck(block, copy))
+			{
+				this->_errors++;
+				throw std::runtime_error("Checksum mismatch in block " + std::to_string(block) + " of the device");
+			}
+			if (repaired != nullptr)
+			{
+				memcpy(repaired + (uint64_t)(done + i) * BLOCK_SIZE, copy, BLOCK_SIZE);
+			}
+		}
+	}
+}
+
+
+/**
+ @brief		Reads a block again with its stripe held, so no write is in the middle of it, and checks it.
+ @param		block		The block
+ @param		copy		Filled with the block, BLOCK_SIZE bytes
+ @return	Whether the block matches its sum
+ */
+bool ChecksumDevice::recheck(uint32_t block, char *copy) const
+{
+	std::shared_lock<std::shared_mutex> lock(this->_stripes[block % STRIPES]);
+
+	this->device->read((uint64_t)block * BLOCK_SIZE, BLOCK_SIZE, copy);
+	return Crc32c::compute(copy, BLOCK_SIZE) == this->_sums[block].load(std::memory_order_relaxed);
+}
+
+
+/**
+ @brief		Runs a job over a range of blocks in runs of RUN_BLOCKS, on the calling thread and threads - 1 more. Every
+			thread takes the next run when it's done with one. The first error a job throws is rethrown once every
+			thread stopped.
+ @param		first		The first block
+ @param		count		The number of blocks
+ @param		threads		The number of threads
+ @param		job			Called with every run and a buffer of RUN_BLOCKS blocks of the thread's own
+ @return	void
+ */
+void ChecksumDevice::forRuns(uint32_t first, uint32_t count, unsigned threads, const run_job& job) const
+{
+	std::atomic<uint64_t> next(0);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+
+	auto work = [&]()
+	{
+		try
+		{
+			std::vector<char> buffer((size_t)RUN_BLOCKS * BLOCK_SIZE);
+			for (uint64_t start = next.fetch_add(RUN_BLOCKS); start < count; start = next.fetch_add(RUN_BLOCKS))
+			{
+				job(first + start, std::min<uint64_t>(RUN_BLOCKS, count - start), buffer.data());
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error)
+			{
+				error = std::current_exception();
+			}
+			next = count;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	threads = std::max<uint64_t>(1, std::min<uint64_t>(threads, (count + RUN_BLOCKS - 1) / RUN_BLOCKS));
+	for (unsigned i = 1; i < threads; i++)
+	{
+		workers.emplace_back(work);
+	}
+	work();
+
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+
+/**
+ @brief		Constructor - Takes the stripe locks of the mask exclusively.
+ @param		checksumDevice_		The device whose stripes to lock
+ @param		mask_				The stripes, one bit per stripe
+ */
+ChecksumDevice::stripe_guard::stripe_guard(const ChecksumDevice& checksumDevice_, uint64_t mask_) :
+	checksumDevice(checksumDevice_), mask(mask_)
+{
+	for (uint32_t stripe = 0; stripe < STRIPES; stripe++)
+	{
+		if (this->mask & (1ULL << stripe))
+		{
+			this->checksumDevice._stripes[stripe].lock();
+		}
+	}
+}
+
+
+ChecksumDevice::stripe_guard::~stripe_guard()
+{
+	for (uint32_t stripe = 0; stripe < STRIPES; stripe++)
+	{
+		if (this->mask & (1ULL << stripe))
+		{
+			this->checksumDevice._stripes[stripe].unlock();
+		}
+	}
+}
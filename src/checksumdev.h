@@ -0,0 +1,114 @@
+#ifndef __CHECKSUMDEV_H__
+#define __CHECKSUMDEV_H__
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include "blkdev.h"
+
+
+// Passes every access through to another device and keeps a CRC32C of every block below the checksum table. A write
+// sums the blocks it leaves behind, and a read or a view checks the blocks it covers and fails on a block that doesn't
+// match its sum. Until enable() it only passes the accesses through.
+// The sums are kept in memory and written to the table by sync(), at every journal checkpoint. A write-intent bitmap
+// in the table's unused tail covers what happened since: a region's bit is set on the device before its blocks are
+// first written after a sync, and cleared by the sync that wrote their sums. After a crash only the marked regions are
+// summed again, every other block is checked against the sum the table holds for it.
+class ChecksumDevice : public BlockDevice
+{
+public:
+	ChecksumDevice(BlockDevice *device_);
+
+	struct scrub_stats
+	{
+		uint32_t blocks;					// Checked
+		uint64_t bytes;
+		uint32_t badBlocks;
+		std::vector<uint32_t> firstBad;		// The first MAX_REPORTED bad blocks, in block order
+		unsigned threads;
+		uint64_t nanoseconds;
+	};
+
+	void enable(uint64_t tableAddress, uint32_t blockCount, bool rebuild, unsigned threads = 0);
+	void disable();
+	void markAll();
+	void relocate(uint64_t tableAddress, uint32_t blockCount, unsigned threads = 0);
+	void sync();
+	scrub_stats scrub(unsigned threads = 0) const;
+
+	bool enabled() const { return this->_enabled.load(std::memory_order_acquire); }
+	uint64_t errors() const { return this->_errors; }
+
+	static uint32_t tableBlocks(uint32_t blockCount);
+
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void submit(const io_request *requests, size_t count) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
+
+	bool viewable() const override { return this->device->viewable(); }
+	const char *view(uint64_t addr, size_t size) const override;
+	void pin() override { this->device->pin(); }
+	void unpin() override { this->device->unpin(); }
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
+
+	stripe_layout layout() const override { return this->device->layout(); }
+
+	static const uint32_t STRIPES = 64;				// Locks over the blocks, block % STRIPES
+	static const uint32_t RUN_BLOCKS = 4096;		// A task of a parallel scan
+	static const uint32_t MAX_REPORTED = 16;
+	static const uint32_t REGION_BLOCKS = 256;		// Blocks a bit of the write-intent bitmap stands for
+
+
+private:
+	// Holds the stripe locks of a mask exclusively, taken in stripe order
+	class stripe_guard
+	{
+	public:
+		stripe_guard(const ChecksumDevice& checksumDevice_, uint64_t mask_);
+		stripe_guard(const stripe_guard&) = delete;
+		stripe_guard& operator=(const stripe_guard&) = delete;
+		~stripe_guard();
+
+	private:
+		const ChecksumDevice& checksumDevice;
+		uint64_t mask;
+	};
+
+	typedef std::function<void(uint32_t first, uint32_t count, char *buffer)> run_job;
+
+	bool coveredRange(uint64_t addr, size_t size, uint32_t& first, uint32_t& end) const;
+	uint64_t stripeMask(uint64_t addr, size_t size) const;
+	void mark(uint64_t addr, size_t size);
+	void writeBitmap(uint32_t firstWord, uint32_t lastWord);
+	void writePage(uint32_t index);
+	void setTable(uint64_t tableAddress, uint32_t blockCount);
+	void update(uint64_t addr, size_t size, const char *data);
+	void store(uint32_t first, uint32_t count, const uint32_t *sums);
+	void sumFromDevice(uint32_t first, uint32_t count, unsigned threads);
+	void verify(uint64_t addr, size_t size, char *data) const;
+	void verifyBlocks(uint32_t first, uint32_t count, const char *blocks, char *repaired) const;
+	bool recheck(uint32_t block, char *copy) const;
+	void forRuns(uint32_t first, uint32_t count, unsigned threads, const run_job& job) const;
+
+	BlockDevice *device;
+	std::atomic<bool> _enabled;
+	uint64_t _tableAddress;
+	uint32_t _coveredBlocks;		// The blocks before the table, the ones with sums
+	std::vector<std::atomic<uint32_t>> _sums;
+	std::vector<std::atomic<bool>> _dirtyPages;		// Table blocks whose sums changed since the last sync
+	std::vector<uint32_t> _intent;		// The write-intent bitmap as on the device, a bit per region
+	std::vector<std::atomic<bool>> _marked;		// Regions whose bit is set on the device, until a sync clears it
+	std::vector<bool> _unmarking;		// The regions the running sync clears, unless they're written again
+	mutable std::shared_mutex _stripes[STRIPES];		// Shared by a recheck, exclusive while blocks and sums change
+	std::mutex _intentMutex;		// Held while the bitmap changes and while table blocks are written
+	std::mutex _syncMutex;
+	mutable std::atomic<uint64_t> _errors;		// Mismatches reads ran into
+};
+
+#endif // __CHECKSUMDEV_H__
@@ -0,0 +1,227 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+
+const size_t Crc32c::INTERLEAVE;
+
+static const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;		// Reflected
+
+
+// Slicing-by-8 tables, tables[k][b] is the sum of byte b followed by k zero bytes
+struct crc_tables
+{
+	uint32_t tables[8][256];
+
+	crc_tables(uint32_t polynomial)
+	{
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			uint32_t crc = b;
+			for (int bit = 0; bit < 8; bit++)
+			{
+				crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+			}
+			this->tables[0][b] = crc;
+		}
+
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			for (int k = 1; k < 8; k++)
+			{
+				uint32_t previous = this->tables[k - 1][b];
+				this->tables[k][b] = (previous >> 8) ^ this->tables[0][previous & 0xFF];
+			}
+		}
+	}
+};
+
+
+static const crc_tables& softwareTables()
+{
+	static const crc_tables tables(CRC32C_POLYNOMIAL);
+	return tables;
+}
+
+
+/**
+ @brief		Sums a buffer, or continues the sum of the bytes before it.
+ @param		data		The bytes to sum
+ @param		size		The number of bytes
+ @param		crc			The sum of the bytes before, 0 to start a new sum
+ @param		impl		The implementation to sum with, the fastest one the CPU has by default
+ @return	The CRC32C of the bytes
+ */
+uint32_t Crc32c::compute(const char *data, size_t size, uint32_t crc, implementation impl)
+{
+	if (impl == CRC_SSE42)
+	{
+		return computeSse42((const uint8_t *)data, size, crc);
+	}
+
+	return computeSoftware((const uint8_t *)data, size, crc);
+}
+
+
+/**
+ @brief		Sums each of a run of equal-sized blocks on its own. With SSE4.2 several blocks are summed side by side,
+			which hides the latency of the instruction that a single sum waits on.
+ @param		data			The first block
+ @param		blockSize		The size of every block
+ @param		count			The number of blocks
+ @param		sums			Filled with the sum of every block, in order
+ @param		impl			The implementation to sum with, the fastest one the CPU has by default
+ @return	void
+ */
+void Crc32c::computeBlocks(const char *data, size_t blockSize, size_t count, uint32_t *sums, implementation impl)
+{
+	if (impl == CRC_SSE42)
+	{
+		computeBlocksSse42((const uint8_t *)data, blockSize, count, sums);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		sums[i] = computeSoftware((const uint8_t *)data + i * blockSize, blockSize, 0);
+	}
+}
+
+
+/**
+ @brief		Returns the fastest implementation the CPU supports, checked once.
+ @return	The implementation
+ */
+Crc32c::implementation Crc32c::best()
+{
+#ifdef CRC32C_X86
+	static const implementation impl = __builtin_cpu_supports("sse4.2") ? CRC_SSE42 : CRC_SOFTWARE;
+	return impl;
+#else
+	return CRC_SOFTWARE;
+#endif
+}
+
+
+const char *Crc32c::name(implementation impl)
+{
+	return (impl == CRC_SSE42) ? "SSE4.2" : "software";
+}
+
+
+uint32_t Crc32c::computeSoftware(const uint8_t *data, size_t size, uint32_t crc)
+{
+	const uint32_t (*tables)[256] = softwareTables().tables;
+	crc = ~crc;
+
+	while (size >= 8)
+	{
+		uint32_t low;
+		uint32_t high;
+		memcpy(&low, data, sizeof(low));
+		memcpy(&high, data + 4, sizeof(high));
+		low ^= crc;
+
+		crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^
+			tables[4][low >> 24] ^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^
+			tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+
+		data += 8;
+		size -= 8;
+	}
+
+	while (size-- > 0)
+	{
+		crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+	}
+
+	return ~crc;
+}
+
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+uint32_t Crc32c::computeSse42(const uint8_t *data, size_t size, uint32_t crc)
+{
+	uint64_t sum = ~crc;
+
+	while (size >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		sum = _mm_crc32_u64(sum, word);
+		data += 8;
+		size -= 8;
+	}
+
+	uint32_t tail = (uint32_t)sum;
+	while (size-- > 0)
+	{
+		tail = _mm_crc32_u8(tail, *data++);
+	}
+
+	return ~tail;
+}
+
+
+__attribute__((target("sse4.2")))
+void Crc32c::computeBlocksSse42(const uint8_t *data, size_t blockSize, size_t count, uint32_t *sums)
+{
+	size_t i = 0;
+
+	if (blockSize % 8 == 0)
+	{
+		for (; i + INTERLEAVE <= count; i += INTERLEAVE)
+		{
+			const uint8_t *first = data + i * blockSize;
+			const uint8_t *second = first + blockSize;
+			const uint8_t *third = second + blockSize;
+			uint64_t a = 0xFFFFFFFF;
+			uint64_t b = 0xFFFFFFFF;
+			uint64_t c = 0xFFFFFFFF;
+
+			for (size_t offset = 0; offset < blockSize; offset += 8)
+			{
+				uint64_t words[INTERLEAVE];
+				memcpy(&words[0], first + offset, 8);
+				memcpy(&words[1], second + offset, 8);
+				memcpy(&words[2], third + offset, 8);
+				a = _mm_crc32_u64(a, words[0]);
+				b = _mm_crc32_u64(b, words[1]);
+				c = _mm_crc32_u64(c, words[2]);
+			}
+
+			sums[i] = ~(uint32_t)a;
+			sums[i + 1] = ~(uint32_t)b;
+			sums[i + 2] = ~(uint32_t)c;
+		}
+	}
+
+	for (; i < count; i++)
+	{
+		sums[i] = computeSse42(data + i * blockSize, blockSize, 0);
+	}
+}
+
+#else
+
+uint32_t Crc32c::computeSse42(const uint8_t *data, size_t size, uint32_t crc)
+{
+	return computeSoftware(data, size, crc);
+}
+
+
+void Crc32c::computeBlocksSse42(const uint8_t *data, size_t blockSize, size_t count, uint32_t *sums)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		sums[i] = computeSoftware(data + i * blockSize, blockSize, 0);
+	}
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// CRC32C (the Castagnoli polynomial, as in iSCSI and ext4), with the SSE4.2 crc32 instruction when the CPU has it and
+// a slicing-by-8 table otherwise. Both give the same sums.
+class Crc32c
+{
+public:
+	enum implementation
+	{
+		CRC_SOFTWARE,
+		CRC_SSE42
+	};
+
+	static uint32_t compute(const char *data, size_t size, uint32_t crc = 0, implementation impl = best());
+	static void computeBlocks(const char *data, size_t blockSize, size_t count, uint32_t *sums,
+		implementation impl = best());
+
+	static implementation best();
+	static const char *name(implementation impl);
+
+private:
+	static uint32_t computeSoftware(const uint8_t *data, size_t size, uint32_t crc);
+	static uint32_t computeSse42(const uint8_t *data, size_t size, uint32_t crc);
+	static void computeBlocksSse42(const uint8_t *data, size_t blockSize, size_t count, uint32_t *sums);
+
+	static const size_t INTERLEAVE = 3;		// Blocks summed side by side, the instruction takes 3 cycles and issues every one
+};
+
+#endif // __CRC32C_H__
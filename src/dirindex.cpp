@@ -0,0 +1,606 @@
+#include "dirindex.h"
+#include "metrics.h"
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+
+
+// Starts with a zero byte, which the sorted entry array of an older directory never does (names aren't empty)
+static const char INDEX_MAGIC[4] = { '\0', 'D', 'I', 'X' };
+
+const uint32_t DirIndex::NODE_ENTRIES;
+
+
+/**
+ @brief		Constructor - Reads the header of the index kept in the given directory data.
+ @param		store_		The directory data, holding an index (see isIndex)
+ */
+DirIndex::DirIndex(node_store& store_) : store(store_)
+{
+	if (!isIndex(this->store))
+	{
+		throw std::runtime_error(RED "Corrupted directory" RESET);
+	}
+
+	this->store.read(0, sizeof(this->_header), (char *)&this->_header);
+}
+
+
+/**
+ @brief		Checks whether the given directory data holds an index, rather than the sorted entry array directories
+			were kept as before, or nothing at all.
+ @param		store		The directory data
+ @return	True if the data starts with an index header, false otherwise.
+ */
+bool DirIndex::isIndex(node_store& store)
+{
+	if (store.size() < HEADER_SIZE)
+	{
+		return false;
+	}
+
+	char magic[sizeof(INDEX_MAGIC)];
+	store.read(0, sizeof(magic), magic);
+
+	return memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0;
+}
+
+
+/**
+ @brief		Builds the data of an index holding the given entries, bottom up. The nodes are filled to
+			BUILD_ENTRIES, with the entries spread evenly between the nodes of a level.
+ @param		entries		The entries, sorted by name
+ @param		count		The number of entries
+ @param		data		Filled with the directory data
+ @return	void
+ */
+void DirIndex::build(const dir_entry *entries, uint32_t count, image& data)
+{
+	index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.entryCount = count;
+
+	data.assign(HEADER_SIZE, '\0');
+
+	// The entries of the level being built, then the (lowest name, node) pairs pointing at its nodes
+	std::vector<dir_entry, ArenaAllocator<dir_entry>> level(entries, entries + count);
+	std::vector<dir_entry, ArenaAllocator<dir_entry>> parents;
+	uint16_t height = 0;
+
+	while (true)
+	{
+		uint32_t nodes = std::max<uint32_t>(1, (level.size() + BUILD_ENTRIES - 1) / BUILD_ENTRIES);
+		uint32_t first = header.nodeCount + 1;
+		parents.clear();
+
+		for (uint32_t i = 0; i < nodes; i++)
+		{
+			size_t start = level.size() * i / nodes;
+			size_t end = level.size() * (i + 1) / nodes;
+
+			node n;
+			memset(&n, 0, sizeof(n));
+			n.level = height;
+			n.count = end - start;
+			n.next = (height == 0 && i + 1 < nodes) ? first + i + 1 : 0;
+			std::copy(level.begin() + start, level.begin() + end, n.entries);
+
+			data.resize(HEADER_SIZE + (size_t)(first + i) * NODE_SIZE, '\0');
+			memcpy(data.data() + nodeOffset(first + i), &n, sizeof(n));
+
+			dir_entry parent;
+			memset(&parent, 0, sizeof(parent));
+			if (n.count > 0)
+			{
+				memcpy(parent.name, n.entries[0].name, MAX_FILE_NAME);
+			}
+			parent.inode = first + i;
+			parents.push_back(parent);
+		}
+
+		header.nodeCount += nodes;
+		if (nodes == 1)
+		{
+			break;
+		}
+
+		level.swap(parents);
+		height++;
+	}
+
+	header.root = header.nodeCount;
+	header.levels = height;
+	memcpy(data.data(), &header, sizeof(header));
+}
+
+
+/**
+ @brief		Looks a name up.
+ @param		name		The name (doesn't have to be null terminated)
+ @param		length		The length of the name
+ @return	The inode of the entry, or NOT_FOUND
+ */
+uint32_t DirIndex::find(const char *name, size_t length)
+{
+	if (length > MAX_FILE_NAME)
+	{
+		return NOT_FOUND;
+	}
+
+	char key[MAX_FILE_NAME] = { 0 };
+	memcpy(key, name, length);
+
+	node leaf;
+	path_step path[MAX_LEVELS];
+	this->descend(key, leaf, path);
+
+	uint32_t index = lowerBound(leaf, key);
+	if (index < leaf.count && compare(leaf.entries[index].name, key) == 0)
+	{
+		return leaf.entries[index].inode;
+	}
+
+	return NOT_FOUND;
+}
+
+
+/**
+ @brief		Adds an entry, splitting the nodes on the way up that are full.
+ @param		entry		The entry, its name zero padded
+ @return	True if the entry was added, false when the name already exists.
+ */
+bool DirIndex::insert(const dir_entry& entry)
+{
+	node leaf;
+	path_step path[MAX_LEVELS];
+	uint32_t number = this->descend(entry.name, leaf, path);
+
+	uint32_t index = lowerBound(leaf, entry.name);
+	if (index < leaf.count && compare(leaf.entries[index].name, entry.name) == 0)
+	{
+		return false;
+	}
+
+	this->insertInto(path, this->_header.levels, number, leaf, index, entry);
+	this->_header.entryCount++;
+	this->writeHeader();
+
+	return true;
+}
+
+
+/**
+ @brief		Removes an entry, rebalancing the nodes on the way up that fall below MIN_ENTRIES.
+ @param		name		The name (doesn't have to be null terminated)
+ @param		length		The length of the name
+ @return	True if the entry was removed, false when there is no such name.
+ */
+bool DirIndex::remove(const char *name, size_t length)
+{
+	if (length > MAX_FILE_NAME)
+	{
+		return false;
+	}
+
+	char key[MAX_FILE_NAME] = { 0 };
+	memcpy(key, name, length);
+
+	node leaf;
+	path_step path[MAX_LEVELS];
+	uint32_t number = this->descend(key, leaf, path);
+
+	uint32_t index = lowerBound(leaf, key);
+	if (index >= leaf.count || compare(leaf.entries[index].name, key) != 0)
+	{
+		return false;
+	}
+
+	std::copy(leaf.entries + index + 1, leaf.entries + leaf.count, leaf.entries + index);
+	leaf.count--;
+
+	if (this->_header.levels == 0 || leaf.count >= MIN_ENTRIES)
+	{
+		this->writeNode(number, leaf, index);
+	}
+	else
+	{
+		this->rebalance(path, this->_header.levels, number, leaf);
+	}
+
+	this->_header.entryCount--;
+	this->writeHeader();
+
+	return true;
+}
+
+
+/**
+ @brief		Finds the first entry whose name comes after the given one, to iterate the entries in name order from it.
+ @param		after		The name to start after, MAX_FILE_NAME zero padded bytes (all zeros to start at the first entry)
+ @param		leaf		Set to the leaf holding the entry
+ @param		index		Set to the index of the entry in the leaf
+ @return	True if there is such an entry, false otherwise.
+ */
+bool DirIndex::seek(const char *after, node& leaf, uint32_t& index)
+{
+	path_step path[MAX_LEVELS];
+	this->descend(after, leaf, path);
+
+	index = std::upper_bound(leaf.entries, leaf.entries + leaf.count, after, [](const char *key, const dir_entry& entry)
+	{
+		return compare(key, entry.name) < 0;
+	}) - leaf.entries;
+
+	while (index >= leaf.count)
+	{
+		if (!this->next(leaf))
+		{
+			return false;
+		}
+		index = 0;
+	}
+
+	return true;
+}
+
+
+/**
+ @brief		Moves to the next leaf.
+ @param		leaf		The current leaf, replaced by the next one
+ @return	True if there is a next leaf, false when the given one is the last.
+ */
+bool DirIndex::next(node& leaf)
+{
+	if (leaf.next == 0)
+	{
+		return false;
+	}
+
+	this->readNode(leaf.next, leaf);
+	return true;
+}
+
+
+/**
+ @brief		Returns the offset of a node in the directory data.
+ @param		number		The node number
+ @return	The offset of the node
+ */
+uint32_t DirIndex::nodeOffset(uint32_t number)
+{
+	return HEADER_SIZE + (number - 1) * NODE_SIZE;
+}
+
+
+// Names are compared as their zero padded bytes, the order the entries were always kept in
+int DirIndex::compare(const char *a, const char *b)
+{
+	return memcmp(a, b, MAX_FILE_NAME);
+}
+
+
+/**
+ @brief		Returns the child of an internal node whose subtree holds the given name - the last one whose lowest name
+			isn't past it. The lowest name of the first child is never compared, it may be stale.
+ @param		n		The internal node
+ @param		key		The name, MAX_FILE_NAME zero padded bytes
+ @return	The index of the child entry
+ */
+uint32_t DirIndex::childIndex(const node& n, const char *key)
+{
+	if (n.count <= 1)
+	{
+		return 0;
+	}
+
+	return std::upper_bound(n.entries + 1, n.entries + n.count, key, [](const char *name, const dir_entry& entry)
+	{
+		return compare(name, entry.name) < 0;
+	}) - n.entries - 1;
+}
+
+
+/**
+ @brief		Returns the index of the first entry of a node whose name isn't before the given one.
+ @param		n		The node
+ @param		key		The name, MAX_FILE_NAME zero padded bytes
+ @return	The index, n.count when every name is before it
+ */
+uint32_t DirIndex::lowerBound(const node& n, const char *key)
+{
+	return std::lower_bound(n.entries, n.entries + n.count, key, [](const dir_entry& entry, const char *name)
+	{
+		return compare(entry.name, name) < 0;
+	}) - n.entries;
+}
+
+
+void DirIndex::readNode(uint32_t number, node& n)
+{
+	if (number == 0 || number > this->_header.nodeCount)
+	{
+		throw std::runtime_error(RED "Corrupted directory" RESET);
+	}
+
+	Metrics::count(Metrics::COUNTER_INDEX_NODES_READ);
+	this->store.read(nodeOffset(number), sizeof(n), (char *)&n);
+
+	if (n.count > NODE_ENTRIES)
+	{
+		throw std::runtime_error(RED "Corrupted directory" RESET);
+	}
+}
+
+
+/**
+ @brief		Writes a node back - its level, count and link, and its entries from the given one on.
+ @param		number		The node number
+ @param		n			The node
+ @param		from		The first entry that changed
+ @return	void
+ */
+void DirIndex::writeNode(uint32_t number, const node& n, uint32_t from)
+{
+	uint32_t offset = nodeOffset(number);
+
+	this->store.write(offset, offsetof(node, entries), (const char *)&n);
+	if (from < n.count)
+	{
+		this->store.write(offset + offsetof(node, entries) + from * sizeof(dir_entry), (n.count - from) * sizeof(dir_entry),
+			(const char *)&n.entries[from]);
+	}
+}
+
+
+void DirIndex::writeHeader()
+{
+	this->store.write(0, sizeof(this->_header), (const char *)&this->_header);
+}
+
+
+/**
+ @brief		Takes a node off the free list, or adds one at the end of the data. The data grows by half its size at a
+			time, so a growing directory keeps few extents.
+ @return	The node number
+ */
+uint32_t DirIndex::allocateNode()
+{
+	if (this->_header.freeList != 0)
+	{
+		uint32_t number = this->_header.freeList;
+		node head;
+		this->store.read(nodeOffset(number), offsetof(node, entries), (char *)&head);
+		this->_header.freeList = head.next;
+
+		return number;
+	}
+
+	uint32_t number = this->_header.nodeCount + 1;
+	uint64_t needed = (uint64_t)nodeOffset(number) + NODE_SIZE;
+	if (this->store.size() < needed)
+	{
+		uint64_t size = std::max<uint64_t>(needed, nodeOffset(number + number / 2));
+		if (size > UINT32_MAX)
+		{
+			throw std::runtime_error(RED "Directory is too large" RESET);
+		}
+		this->store.grow(size);
+	}
+
+	this->_header.nodeCount = number;
+	return number;
+}
+
+
+void DirIndex::freeNode(uint32_t number)
+{
+	node head;
+	head.level = 0;
+	head.count = 0;
+	head.next = this->_header.freeList;
+	this->store.write(nodeOffset(number), offsetof(node, entries), (const char *)&head);
+
+	this->_header.freeList = number;
+}
+
+
+/**
+ @brief		Walks from the root down to the leaf that holds (or would hold) the given name.
+ @param		key		The name, MAX_FILE_NAME zero padded bytes
+ @param		leaf	Set to the leaf
+ @param		path	Set to the internal nodes passed and the child taken in each, root first (_header.levels steps)
+ @return	The node number of the leaf
+ */
+uint32_t DirIndex::descend(const char *key, node& leaf, path_step *path)
+{
+	uint32_t number = this->_header.root;
+
+	for (uint32_t depth = 0; depth < this->_header.levels; depth++)
+	{
+		this->readNode(number, leaf);
+		if (leaf.level == 0 || depth >= MAX_LEVELS)
+		{
+			throw std::runtime_error(RED "Corrupted directory" RESET);
+		}
+
+		path[depth].node = number;
+		path[depth].index = childIndex(leaf, key);
+		number = leaf.entries[path[depth].index].inode;
+	}
+
+	this->readNode(number, leaf);
+	return number;
+}
+
+
+/**
+ @brief		Inserts an entry into a node. A full node is split in half, the upper half going to a new node that is
+			inserted into the parent in turn, and a split root gets a new root above it.
+ @param		path		The path to the node (see descend)
+ @param		depth		The number of steps of the path above the node
+ @param		number		The node number
+ @param		n			The node
+ @param		index		Where the entry goes in the node
+ @param		entry		The entry (a child pointer when the node is internal)
+ @return	void
+ */
+void DirIndex::insertInto(path_step *path, int depth, uint32_t number, node& n, uint32_t index, const dir_entry& entry)
+{
+	if (n.count < NODE_ENTRIES)
+	{
+		std::copy_backward(n.entries + index, n.entries + n.count, n.entries + n.count + 1);
+		n.entries[index] = entry;
+		n.count++;
+		this->writeNode(number, n, index);
+		return;
+	}
+
+	dir_entry all[NODE_ENTRIES + 1];
+	std::copy(n.entries, n.entries + index, all);
+	all[index] = entry;
+	std::copy(n.entries + index, n.entries + n.count, all + index + 1);
+
+	uint32_t leftCount = (NODE_ENTRIES + 1) / 2;
+	uint32_t sibling = this->allocateNode();
+
+	node right;
+	memset(&right, 0, sizeof(right));
+	right.level = n.level;
+	right.count = NODE_ENTRIES + 1 - leftCount;
+	right.next = n.level == 0 ? n.next : 0;
+	std::copy(all + leftCount, all + NODE_ENTRIES + 1, right.entries);
+
+	n.count = leftCount;
+	std::copy(all, all + leftCount, n.entries);
+	if (n.level == 0)
+	{
+		n.next = sibling;
+	}
+
+	this->writeNode(sibling, right, 0);
+	this->writeNode(number, n, std::min(index, leftCount));
+
+	dir_entry separator;
+	memcpy(separator.name, right.entries[0].name, MAX_FILE_NAME);
+	separator.inode = sibling;
+
+	if (depth > 0)
+	{
+		node parent;
+		this->readNode(path[depth - 1].node, parent);
+		this->insertInto(path, depth - 1, path[depth - 1].node, parent, path[depth - 1].index + 1, separator);
+		return;
+	}
+
+	// The root was split, the tree grows a level
+	if (this->_header.levels + 1 >= MAX_LEVELS)
+	{
+		throw std::runtime_error(RED "Directory is too large" RESET);
+	}
+
+	uint32_t rootNumber = this->allocateNode();
+	node root;
+	memset(&root, 0, sizeof(root));
+	root.level = n.level + 1;
+	root.count = 2;
+	memcpy(root.entries[0].name, n.entries[0].name, MAX_FILE_NAME);
+	root.entries[0].inode = number;
+	root.entries[1] = separator;
+	this->writeNode(rootNumber, root, 0);
+
+	this->_header.root = rootNumber;
+	this->_header.levels++;
+}
+
+
+/**
+ @brief		Refills a node that fell below MIN_ENTRIES from a neighbour under the same parent: the two are merged
+			when they fit in one node, otherwise an entry moves over from the neighbour. A merge takes an entry out of
+			the parent, which is rebalanced in turn, and a root left with a single child is replaced by it.
+ @param		path		The path to the node (see descend)
+ @param		depth		The number of steps of the path above the node, at least 1
+ @param		number		The node number
+ @param		n			The node, changed but not written yet
+ @return	void
+ */
+void DirIndex::rebalance(path_step *path, int depth, uint32_t number, node& n)
+{
+	const path_step& up = path[depth - 1];
+	node parent;
+	this->readNode(up.node, parent);
+
+	if (parent.count < 2)
+	{
+		this->writeNode(number, n, 0);
+		return;
+	}
+
+	// The pair is the node and its left neighbour, or its right one for the first child
+	bool hasLeft = up.index > 0;
+	uint32_t rightIndex = hasLeft ? up.index : up.index + 1;
+	uint32_t leftNumber = parent.entries[rightIndex - 1].inode;
+	uint32_t rightNumber = parent.entries[rightIndex].inode;
+
+	node neighbour;
+	this->readNode(hasLeft ? leftNumber : rightNumber, neighbour);
+	node& left = hasLeft ? neighbour : n;
+	node& right = hasLeft ? n : neighbour;
+
+	// The lowest name of an internal node may be stale, the separator in the parent is the one to move around
+	if (right.level > 0)
+	{
+		memcpy(right.entries[0].name, parent.entries[rightIndex].name, MAX_FILE_NAME);
+	}
+
+	if (left.count + right.count <= NODE_ENTRIES)
+	{
+		std::copy(right.entries, right.entries + right.count, left.entries + left.count);
+		left.count += right.count;
+		if (left.level == 0)
+		{
+			left.next = right.next;
+		}
+		this->writeNode(leftNumber, left, 0);
+		this->freeNode(rightNumber);
+
+		std::copy(parent.entries + rightIndex + 1, parent.entries + parent.count, parent.entries + rightIndex);
+		parent.count--;
+
+		if (depth == 1 && parent.count == 1)
+		{
+			// The root is left with a single child, which becomes the root
+			this->_header.root = parent.entries[0].inode;
+			this->_header.levels--;
+			this->freeNode(up.node);
+		}
+		else if (depth == 1 || parent.count >= MIN_ENTRIES)
+		{
+			this->writeNode(up.node, parent, rightIndex);
+		}
+		else
+		{
+			this->rebalance(path, depth - 1, up.node, parent);
+		}
+		return;
+	}
+
+	if (hasLeft)
+	{
+		std::copy_backward(right.entries, right.entries + right.count, right.entries + right.count + 1);
+		right.entries[0] = left.entries[left.count - 1];
+		right.count++;
+		left.count--;
+	}
+	else
+	{
+		left.entries[left.count++] = right.entries[0];
+		std::copy(right.entries + 1, right.entries + right.count, right.entries);
+		right.count--;
+	}
+	memcpy(parent.entries[rightIndex].name, right.entries[0].name, MAX_FILE_NAME);
+
+	this->writeNode(leftNumber, left, 0);
+	this->writeNode(rightNumber, right, 0);
+	this->writeNode(up.node, parent, rightIndex);
+}
@@ -0,0 +1,105 @@
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+#include "Helper.h"
+#include "arena.h"
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// The entries of a directory as a B+tree keyed by name, kept in the directory's own data: a header, then nodes of
+// NODE_SIZE bytes. Leaves hold the entries sorted by name and are chained left to right, internal nodes hold the
+// lowest name under each of their children. A full node is split in two, a node that drops below a third full
+// borrows an entry from a neighbour or merges with it. Freed nodes are kept on a free list, the data never shrinks.
+class DirIndex
+{
+public:
+	struct dir_entry
+	{
+		char name[MAX_FILE_NAME];		// Not null terminated when the name is exactly MAX_FILE_NAME long
+		uint32_t inode;			// The child node number in an internal node
+	};
+
+	// The data of the directory. The caller holds the directory lock (exclusively to change it) and the transaction.
+	class node_store
+	{
+	public:
+		virtual ~node_store() {}
+
+		virtual uint32_t size() = 0;
+		virtual void read(uint32_t offset, uint32_t length, char *data) = 0;
+		virtual void write(uint32_t offset, uint32_t length, const char *data) = 0;
+		virtual void grow(uint32_t size) = 0;		// The bytes past the old size are undefined until written
+	};
+
+	static const uint32_t HEADER_SIZE = 64;
+	static const uint32_t NODE_SIZE = 1024;
+	static const uint32_t NODE_ENTRIES = (NODE_SIZE - 8) / sizeof(dir_entry);
+	static const uint32_t NOT_FOUND = 0xFFFFFFFF;
+
+	struct node
+	{
+		uint16_t level;			// 0 for a leaf
+		uint16_t count;
+		uint32_t next;			// The next leaf, or the next node on the free list (0 for none)
+		dir_entry entries[NODE_ENTRIES];
+	};
+
+	typedef std::vector<char, ArenaAllocator<char>> image;
+
+	DirIndex(node_store& store_);
+
+	static bool isIndex(node_store& store);
+	static void build(const dir_entry *entries, uint32_t count, image& data);
+
+	uint32_t count() const { return this->_header.entryCount; }
+	uint32_t find(const char *name, size_t length);
+	bool insert(const dir_entry& entry);
+	bool remove(const char *name, size_t length);
+
+	bool seek(const char *after, node& leaf, uint32_t& index);
+	bool next(node& leaf);
+
+
+private:
+	struct index_header
+	{
+		char magic[4];
+		uint32_t root;
+		uint32_t levels;		// Of internal nodes above the leaves
+		uint32_t nodeCount;		// Nodes in the data, free ones included (node numbers start at 1)
+		uint32_t freeList;
+		uint32_t entryCount;
+	};
+	static_assert(sizeof(index_header) <= HEADER_SIZE, "index_header must fit in the header");
+
+	static const uint32_t MIN_ENTRIES = NODE_ENTRIES / 3;
+	static const uint32_t BUILD_ENTRIES = NODE_ENTRIES * 3 / 4;		// A built node leaves room for a few inserts
+	static const int MAX_LEVELS = 16;
+
+	struct path_step
+	{
+		uint32_t node;
+		uint32_t index;		// The child taken
+	};
+
+	static uint32_t nodeOffset(uint32_t number);
+	static int compare(const char *a, const char *b);
+	static uint32_t childIndex(const node& n, const char *key);
+	static uint32_t lowerBound(const node& n, const char *key);
+
+	void readNode(uint32_t number, node& n);
+	void writeNode(uint32_t number, const node& n, uint32_t from);
+	void writeHeader();
+	uint32_t allocateNode();
+	void freeNode(uint32_t number);
+	uint32_t descend(const char *key, node& leaf, path_step *path);
+	void insertInto(path_step *path, int depth, uint32_t number, node& n, uint32_t index, const dir_entry& entry);
+	void rebalance(path_step *path, int depth, uint32_t number, node& n);
+
+	node_store& store;
+	index_header _header;
+};
+
+#endif // __DIRINDEX_H__
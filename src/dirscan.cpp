@@ -0,0 +1,309 @@
+#include "dirscan.h"
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86
+#endif
+
+
+const size_t DirScan::VECTOR_BYTES;
+
+
+/**
+ @brief		Splits a glob pattern into the literal prefix the vector compare checks and the rest.
+			A pattern without wildcards is a whole name, its prefix takes in the terminating zero (unless the name is
+			exactly MAX_FILE_NAME long) so only that name passes.
+ @param		glob			The pattern, '*' matches any run of characters and '?' a single one
+ @param		compiled		Filled with the compiled pattern
+ @return	void
+ */
+void DirScan::compile(const std::string& glob, pattern& compiled)
+{
+	size_t wildcard = glob.find_first_of("*?");
+	size_t literalLength = (wildcard == std::string::npos) ? glob.length() : wildcard;
+
+	compiled.glob = glob;
+	memset(compiled.prefix, 0, sizeof(compiled.prefix));
+	memset(compiled.suffix, 0, sizeof(compiled.suffix));
+	compiled.prefixLength = 0;
+	compiled.suffixLength = 0;
+	compiled.complete = true;
+	compiled.simple = false;
+	compiled.impossible = literalLength > MAX_FILE_NAME;
+
+	// The empty pattern lists everything
+	if (compiled.impossible || glob.empty())
+	{
+		return;
+	}
+
+	memcpy(compiled.prefix, glob.data(), literalLength);
+
+	if (wildcard == std::string::npos)
+	{
+		compiled.prefixLength = std::min<size_t>(literalLength + 1, MAX_FILE_NAME);
+	}
+	else
+	{
+		compiled.prefixLength = literalLength;
+		compiled.complete = glob.compare(wildcard, std::string::npos, "*") == 0;
+
+		size_t lastStar = glob.find_last_of('*');
+		if (lastStar != std::string::npos && glob.find('?', lastStar) == std::string::npos &&
+			glob.length() - lastStar - 1 <= MAX_FILE_NAME)
+		{
+			compiled.suffixLength = glob.length() - lastStar - 1;
+			memcpy(compiled.suffix, glob.data() + lastStar + 1, compiled.suffixLength);
+			compiled.simple = lastStar == wildcard && glob.find('?') == std::string::npos;
+		}
+	}
+}
+
+
+/**
+ @brief		Collects the indices of the entries whose names match the pattern.
+ @param		entries			The first entry, every entry starts with its zero padded name
+ @param		count			The number of entries
+ @param		stride			The size of an entry, at least VECTOR_BYTES
+ @param		compiled		The compiled pattern
+ @param		matches			Cleared and filled with the matching indices, in order (its capacity is reused)
+ @param		level			The instruction set to compare with, the best one the CPU has by default
+ @return	void
+ */
+void DirScan::scan(const char *entries, size_t count, size_t stride, const pattern& compiled,
+	match_list& matches, simd_level level)
+{
+	matches.clear();
+	if (compiled.impossible)
+	{
+		return;
+	}
+	matches.reserve(count);
+
+	if (compiled.prefixLength == 0)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			matches.push_back(i);
+		}
+	}
+	else if (level == SIMD_AVX2)
+	{
+		scanPrefixAvx2(entries, count, stride, compiled, matches);
+	}
+	else if (level == SIMD_SSE2)
+	{
+		scanPrefixSse2(entries, count, stride, compiled, matches);
+	}
+	else
+	{
+		scanPrefixScalar(entries, count, stride, compiled, matches);
+	}
+
+	if (compiled.complete)
+	{
+		return;
+	}
+
+	// Only the entries that share the prefix and the suffix get the full match, in place
+	size_t kept = 0;
+	for (uint32_t index : matches)
+	{
+		const char *name = entries + index * stride;
+		size_t nameLength = strnlen(name, MAX_FILE_NAME);
+
+		if (nameLength < compiled.prefixLength + compiled.suffixLength ||
+			memcmp(name + nameLength - compiled.suffixLength, compiled.suffix, compiled.suffixLength) != 0)
+		{
+			continue;
+		}
+
+		if (compiled.simple || match(compiled.glob.data(), compiled.glob.length(), name, nameLength))
+		{
+			matches[kept++] = index;
+		}
+	}
+	matches.resize(kept);
+}
+
+
+/**
+ @brief		Matches a name against a glob pattern, backtracking to the last '*' on a mismatch.
+ @param		glob			The pattern
+ @param		globLength		The length of the pattern
+ @param		name			The name (doesn't have to be null terminated)
+ @param		nameLength		The length of the name
+ @return	Whether the whole name matches
+ */
+bool DirScan::match(const char *glob, size_t globLength, const char *name, size_t nameLength)
+{
+	size_t g = 0;
+	size_t n = 0;
+	size_t starGlob = std::string::npos;		// Just past the last '*' seen
+	size_t starName = 0;						// Where the name was when it was seen
+
+	while (n < nameLength)
+	{
+		if (g < globLength && glob[g] == '*')
+		{
+			starGlob = ++g;
+			starName = n;
+		}
+		else if (g < globLength && (glob[g] == '?' || glob[g] == name[n]))
+		{
+			g++;
+			n++;
+		}
+		else if (starGlob != std::string::npos)
+		{
+			// Let the last '*' take one more character
+			g = starGlob;
+			n = ++starName;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	while (g < globLength && glob[g] == '*')
+	{
+		g++;
+	}
+
+	return g == globLength;
+}
+
+
+bool DirScan::isPattern(const std::string& name)
+{
+	return name.find_first_of("*?") != std::string::npos;
+}
+
+
+/**
+ @brief		Returns the widest compare the CPU supports, checked once.
+ @return	The instruction set level
+ */
+DirScan::simd_level DirScan::best()
+{
+#if defined(DIRSCAN_X86) && defined(__SSE2__)
+	static const simd_level level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+	return level;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+
+void DirScan::scanPrefixScalar(const char *entries, size_t count, size_t stride, const pattern& compiled,
+	match_list& candidates)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (memcmp(entries + i * stride, compiled.prefix, compiled.prefixLength) == 0)
+		{
+			candidates.push_back(i);
+		}
+	}
+}
+
+
+#if defined(DIRSCAN_X86) && defined(__SSE2__)
+
+/**
+ @brief		Compares the prefix against one entry per 16-byte compare. A prefix longer than VECTOR_BYTES finishes with
+			a memcmp on the entries whose first VECTOR_BYTES bytes match.
+ @param		entries			The first entry
+ @param		count			The number of entries
+ @param		stride			The size of an entry
+ @param		compiled		The compiled pattern, with a non-empty prefix
+ @param		candidates		The indices of the entries that start with the prefix are appended to it
+ @return	void
+ */
+void DirScan::scanPrefixSse2(const char *entries, size_t count, size_t stride, const pattern& compiled,
+	match_list& candidates)
+{
+	size_t vectorLength = std::min(compiled.prefixLength, VECTOR_BYTES);
+	size_t tailLength = compiled.prefixLength - vectorLength;
+	uint32_t mask = (1U << vectorLength) - 1;
+	__m128i prefix = _mm_loadu_si128((const __m128i *)compiled.prefix);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *name = entries + i * stride;
+		uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)name), prefix));
+
+		if ((equal & mask) == mask && memcmp(name + VECTOR_BYTES, compiled.prefix + VECTOR_BYTES, tailLength) == 0)
+		{
+			candidates.push_back(i);
+		}
+	}
+}
+
+
+/**
+ @brief		Like scanPrefixSse2, but two entries share each 32-byte compare.
+ @param		entries			The first entry
+ @param		count			The number of entries
+ @param		stride			The size of an entry
+ @param		compiled		The compiled pattern, with a non-empty prefix
+ @param		candidates		The indices of the entries that start with the prefix are appended to it
+ @return	void
+ */
+__attribute__((target("avx2")))
+void DirScan::scanPrefixAvx2(const char *entries, size_t count, size_t stride, const pattern& compiled,
+	match_list& candidates)
+{
+	size_t vectorLength = std::min(compiled.prefixLength, VECTOR_BYTES);
+	size_t tailLength = compiled.prefixLength - vectorLength;
+	uint32_t mask = (1U << vectorLength) - 1;
+	__m256i prefix = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)compiled.prefix));
+
+	auto check = [&](size_t index, uint32_t equal)
+	{
+		if ((equal & mask) == mask &&
+			memcmp(entries + index * stride + VECTOR_BYTES, compiled.prefix + VECTOR_BYTES, tailLength) == 0)
+		{
+			candidates.push_back(index);
+		}
+	};
+
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		const char *first = entries + i * stride;
+		__m256i names = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)first)),
+			_mm_loadu_si128((const __m128i *)(first + stride)), 1);
+		uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(names, prefix));
+
+		check(i, equal);
+		check(i + 1, equal >> VECTOR_BYTES);
+	}
+
+	// An odd count leaves one entry
+	if (i < count)
+	{
+		__m128i name = _mm_loadu_si128((const __m128i *)(entries + i * stride));
+		check(i, _mm_movemask_epi8(_mm_cmpeq_epi8(name, _mm256_castsi256_si128(prefix))));
+	}
+}
+
+#else
+
+void DirScan::scanPrefixSse2(const char *entries, size_t count, size_t stride, const pattern& compiled,
+	match_list& candidates)
+{
+	scanPrefixScalar(entries, count, stride, compiled, candidates);
+}
+
+
+void DirScan::scanPrefixAvx2(const char *entries, size_t count, size_t stride, const pattern& compiled,
+	match_list& candidates)
+{
+	scanPrefixScalar(entries, count, stride, compiled, candidates);
+}
+
+#endif
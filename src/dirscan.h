@@ -0,0 +1,57 @@
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+#include "Helper.h"
+#include "arena.h"
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Filters an array of fixed-stride entries that start with a zero padded MAX_FILE_NAME name (directory entries) by a
+// glob pattern ('*' and '?'). The literal prefix of the pattern is compared against many entries at once with
+// SSE2/AVX2, only the entries that pass it are matched against the rest of the pattern.
+class DirScan
+{
+public:
+	enum simd_level
+	{
+		SIMD_NONE,
+		SIMD_SSE2,
+		SIMD_AVX2
+	};
+
+	struct pattern
+	{
+		std::string glob;					// Empty matches every name
+		char prefix[MAX_FILE_NAME];			// The literal bytes up to the first wildcard, zero padded
+		size_t prefixLength;				// The bytes of prefix every match starts with
+		char suffix[MAX_FILE_NAME];			// The literal bytes after the last '*' (none when they hold a '?')
+		size_t suffixLength;
+		bool complete;						// Passing the prefix compare is a match, the rest of the pattern is "*" or nothing
+		bool simple;						// The pattern is prefix*suffix, the two compares decide the match
+		bool impossible;					// The literal part is longer than any name
+	};
+	typedef std::vector<uint32_t, ArenaAllocator<uint32_t>> match_list;
+
+	static void compile(const std::string& glob, pattern& compiled);
+	static void scan(const char *entries, size_t count, size_t stride, const pattern& compiled,
+		match_list& matches, simd_level level = best());
+	static bool match(const char *glob, size_t globLength, const char *name, size_t nameLength);
+	static bool isPattern(const std::string& name);
+
+	static simd_level best();
+
+private:
+	static void scanPrefixScalar(const char *entries, size_t count, size_t stride, const pattern& compiled,
+		match_list& candidates);
+	static void scanPrefixSse2(const char *entries, size_t count, size_t stride, const pattern& compiled,
+		match_list& candidates);
+	static void scanPrefixAvx2(const char *entries, size_t count, size_t stride, const pattern& compiled,
+		match_list& candidates);
+
+	static const size_t VECTOR_BYTES = 16;		// The name bytes a single compare covers, longer prefixes finish with memcmp
+};
+
+#endif // __DIRSCAN_H__
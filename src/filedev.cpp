@@ -0,0 +1,113 @@
+#include <unistd.h>
+#include <string.h>
+#include "filedev.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <errno.h>
+
+
+FileBlockDevice::FileBlockDevice(std::string fname, const options& opts)
+{
+	fd = openFile(fname, opts.size, 0);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		throw std::runtime_error(std::string("stat failed: ") + strerror(errno));
+	}
+	fileSize = st.st_size;
+}
+
+
+FileBlockDevice::~FileBlockDevice()
+{
+	close(fd);
+}
+
+
+void FileBlockDevice::read(uint64_t addr, size_t size, char *ans)
+{
+	checkBounds(addr, size, fileSize);
+
+	// pread may return less than asked for, carrying on from where it stopped
+	while (size > 0)
+	{
+		ssize_t done = pread(fd, ans, size, addr);
+		if (done == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (done <= 0)
+		{
+			throw std::runtime_error(std::string("pread failed: ") + (done == 0 ? "unexpected end of file" : strerror(errno)));
+		}
+
+		addr += done;
+		ans += done;
+		size -= done;
+	}
+}
+
+
+void FileBlockDevice::write(uint64_t addr, size_t size, const char *data)
+{
+	checkBounds(addr, size, fileSize);
+
+	while (size > 0)
+	{
+		ssize_t done = pwrite(fd, data, size, addr);
+		if (done == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (done <= 0)
+		{
+			throw std::runtime_error(std::string("pwrite failed: ") + (done == 0 ? "nothing written" : strerror(errno)));
+		}
+
+		addr += done;
+		data += done;
+		size -= done;
+	}
+}
+
+
+// fdatasync has no range, the whole file is flushed whatever range is asked for
+void FileBlockDevice::flush(uint64_t addr, size_t size)
+{
+	if (fdatasync(fd) == -1)
+	{
+		throw std::runtime_error(std::string("fdatasync failed: ") + strerror(errno));
+	}
+}
+
+
+void FileBlockDevice::discard(uint64_t addr, size_t size)
+{
+	checkBounds(addr, size, fileSize);
+	punchHole(fd, addr, size);
+}
+
+
+uint64_t FileBlockDevice::size() const
+{
+	return fileSize;
+}
+
+
+void FileBlockDevice::grow(uint64_t newSize)
+{
+	if (newSize <= fileSize)
+	{
+		return;
+	}
+
+	if (ftruncate(fd, newSize) == -1)
+	{
+		throw std::runtime_error(std::string("Could not grow the device: ") + strerror(errno));
+	}
+	fileSize = newSize;
+}
@@ -0,0 +1,28 @@
+#ifndef __FILEDEV_H__
+#define __FILEDEV_H__
+
+#include "blkdev.h"
+
+
+// A device reached through pread/pwrite on the image file - a system call per access instead of page faults
+class FileBlockDevice : public BlockDevice
+{
+public:
+	FileBlockDevice(std::string fname, const options& opts);
+	~FileBlockDevice() override;
+
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
+
+
+private:
+	int fd;
+	std::atomic<uint64_t> fileSize;
+};
+
+#endif // __FILEDEV_H__
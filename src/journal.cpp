@@ -0,0 +1,558 @@
+#include "journal.h"
+#include "Helper.h"
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+
+
+const char *Journal::JOURNAL_MAGIC = "JRNL";
+thread_local Journal::transaction *Journal::_current = nullptr;
+
+
+/**
+ @brief		Constructor - Initializes the journal. The region is set up by format() or replay().
+ @param		blkdevsim_		The block device
+ @param		allocator_		The allocator freed blocks are handed back to once they are out of the log
+ @param		checksums_		The checksum device whose sums are written to its table at every checkpoint
+ */
+Journal::Journal(BlockDevice *blkdevsim_, BlockAllocator *allocator_, ChecksumDevice *checksums_) :
+	blkdevsim(blkdevsim_), allocator(allocator_), checksums(checksums_), _address(0), _blocks(0), _sequence(1), _head(0),
+	_committedHead(0), _pendingTransactions(0), _transactionCount(0), _commitCount(0), _checkpointCount(0),
+	_discardedBlocks(0), _loggedBytes(0), _appliedBytes(0)
+{
+}
+
+
+/**
+ @brief		Opens a transaction for the calling thread, or joins the one it already has on this journal.
+ @param		journal_		The journal the transaction is logged to
+ */
+Journal::transaction::transaction(Journal& journal_) :
+	journal(journal_), nested(_current != nullptr && &_current->journal == &journal_), previous(_current), recordCount(0)
+{
+	if (!this->nested)
+	{
+		_current = this;
+	}
+}
+
+
+/**
+ @brief		Destructor - Ends the transaction and appends it to the log. A failed flush leaves the transaction pending,
+			it is retried at the next commit point.
+ */
+Journal::transaction::~transaction()
+{
+	if (this->nested)
+	{
+		return;
+	}
+
+	_current = this->previous;
+
+	try
+	{
+		this->journal.end(*this);
+	}
+	catch (const std::exception&)
+	{
+	}
+}
+
+
+/**
+ @brief		Starts an empty journal in the given region.
+ @param		address		The address of the journal region, block aligned
+ @param		blocks		The size of the region in blocks, the first one holds the journal superblock
+ @return	void
+ */
+void Journal::format(uint64_t address, uint32_t blocks)
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+
+	this->_address = address;
+	this->_blocks = blocks;
+	this->_sequence = 1;
+	this->_head = 0;
+	this->_committedHead = 0;
+	this->_pending.clear();
+	this->_pending.reserve(this->capacity());		// Never more than the log holds, an ending transaction never grows it
+	this->_pendingTransactions = 0;
+	this->_dirtyData.clear();
+	this->_released.clear();
+
+	this->writeSuperblock();
+}
+
+
+/**
+ @brief		Redoes every complete transaction left in the log by an instance that didn't shut down cleanly, and
+			empties the log. The log ends at the first transaction that is torn or from an older generation.
+ @param		address		The address of the journal region
+ @param		blocks		The size of the region in blocks
+ @return	The number of replayed transactions
+ */
+uint32_t Journal::replay(uint64_t address, uint32_t blocks)
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+
+	this->_address = address;
+	this->_blocks = blocks;
+
+	journal_superblock superblock;
+	this->blkdevsim->read(this->_address, sizeof(superblock), (char *)&superblock);
+	if (strncmp(superblock.magic, JOURNAL_MAGIC, sizeof(superblock.magic)) != 0 || superblock.blocks != blocks)
+	{
+		throw std::runtime_error(RED "The journal is corrupted" RESET);
+	}
+
+	this->_sequence = superblock.sequence;
+	this->_head = 0;
+	this->_committedHead = 0;
+	this->_pending.clear();
+	this->_pending.reserve(this->capacity());
+	this->_pendingTransactions = 0;
+
+	uint32_t replayed = 0;
+	std::vector<char> log;
+
+	while (this->_head + sizeof(transaction_header) <= this->capacity())
+	{
+		transaction_header header;
+		this->blkdevsim->read(this->logAddress() + this->_head, sizeof(header), (char *)&header);
+
+		if (header.magic != TRANSACTION_MAGIC || header.sequence != this->_sequence ||
+			header.length > this->capacity() - this->_head - sizeof(header))
+		{
+			break;
+		}
+
+		log.resize(header.length);
+		this->blkdevsim->read(this->logAddress() + this->_head + sizeof(header), log.size(), log.data());
+		if (checksum(log.data(), log.size()) != header.checksum)
+		{
+			break;		// Torn by the crash, it was never whole in the log
+		}
+
+		this->apply(log.data(), log.size());
+		this->_head += sizeof(header) + header.length;
+		this->_sequence++;
+		replayed++;
+	}
+
+	this->_head = 0;
+	if (replayed > 0)
+	{
+		this->blkdevsim->flush(0, this->blkdevsim->size());
+		this->writeSuperblock();
+	}
+
+	return replayed;
+}
+
+
+/**
+ @brief		Reads from the device as the calling thread sees it: with the pending records and the records of its own
+			transaction laid over the home locations.
+ @param		addr		The address to read from
+ @param		size		The number of bytes to read
+ @param		data		The buffer to read into
+ @return	void
+ */
+void Journal::read(uint64_t addr, size_t size, char *data)
+{
+	{
+		std::shared_lock<std::shared_mutex> lock(this->_mutex);
+		this->blkdevsim->read(addr, size, data);
+		overlay(this->_pending.data(), this->_pending.size(), addr, size, data);
+	}
+
+	if (_current != nullptr && &_current->journal == this)
+	{
+		overlay(_current->log.data(), _current->log.size(), addr, size, data);
+	}
+}
+
+
+/**
+ @brief		Stages a metadata write in the transaction of the calling thread. A write made outside of a transaction
+			is logged as a transaction of its own.
+ @param		addr		The home address of the data
+ @param		size		The number of bytes to write
+ @param		data		The data to write
+ @return	void
+ */
+void Journal::write(uint64_t addr, size_t size, const char *data)
+{
+	if (_current == nullptr || &_current->journal != this)
+	{
+		transaction txn(*this);
+		this->write(addr, size, data);
+		return;
+	}
+
+	std::vector<char, ArenaAllocator<char>>& log = _current->log;
+	if (sizeof(transaction_header) + log.size() + recordSize(size) > this->capacity())
+	{
+		throw std::runtime_error(RED "Transaction doesn't fit in the journal" RESET);
+	}
+
+	record_header header = { addr, (uint32_t)size, 0 };
+	size_t position = log.size();
+	log.resize(position + recordSize(size), 0);
+	memcpy(&log[position], &header, sizeof(header));
+	memcpy(&log[position + sizeof(header)], data, size);
+
+	_current->recordCount++;
+}
+
+
+/**
+ @brief		Notes file data written straight to the device. It is flushed before the next commit, so a committed
+			transaction never points at data that isn't on the device.
+ @param		addr		The address the data was written at
+ @param		size		The number of bytes written
+ @return	void
+ */
+void Journal::dirty(uint64_t addr, size_t size)
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+
+	// Sequential writes keep extending the last range
+	if (!this->_dirtyData.empty() && addr <= this->_dirtyData.back().second && addr + size >= this->_dirtyData.back().first)
+	{
+		this->_dirtyData.back().first = std::min(this->_dirtyData.back().first, addr);
+		this->_dirtyData.back().second = std::max(this->_dirtyData.back().second, addr + size);
+	}
+	else
+	{
+		this->_dirtyData.emplace_back(addr, addr + size);
+	}
+}
+
+
+/**
+ @brief		Frees blocks once the transaction freeing them is out of the log. Until the next checkpoint a replay may
+			still write the old records, and an older version of the metadata may still point at them.
+ @param		ext		The blocks to free
+ @return	void
+ */
+void Journal::release(const BlockAllocator::extent& ext)
+{
+	if (_current != nullptr && &_current->journal == this)
+	{
+		_current->released.push_back(ext);
+		return;
+	}
+
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+	this->_released.push_back(ext);
+}
+
+
+/**
+ @brief		Appends an ended transaction to the log. The log is checkpointed first when the transaction doesn't fit,
+			and a commit is made every COMMIT_INTERVAL transactions.
+ @param		txn		The transaction
+ @return	void
+ */
+void Journal::end(transaction& txn)
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+
+	if (!txn.log.empty())
+	{
+		transaction_header header;
+		header.magic = TRANSACTION_MAGIC;
+		header.recordCount = txn.recordCount;
+		header.sequence = this->_sequence;
+		header.length = txn.log.size();
+		header.checksum = checksum(txn.log.data(), txn.log.size());
+
+		if (this->_head + sizeof(header) + header.length > this->capacity())
+		{
+			this->checkpointLocked();
+		}
+
+		// The header goes in last, a transaction cut short by a crash doesn't pass the checksum anyway
+		this->blkdevsim->write(this->logAddress() + this->_head + sizeof(header), txn.log.size(), txn.log.data());
+		this->blkdevsim->write(this->logAddress() + this->_head, sizeof(header), (const char *)&header);
+
+		this->_head += sizeof(header) + header.length;
+		this->_sequence++;
+		this->_pending.insert(this->_pending.end(), txn.log.begin(), txn.log.end());
+		this->_pendingTransactions++;
+		this->_transactionCount++;
+		this->_loggedBytes += sizeof(header) + header.length;
+	}
+
+	this->_released.insert(this->_released.end(), txn.released.begin(), txn.released.end());
+
+	if (this->_pendingTransactions >= COMMIT_INTERVAL)
+	{
+		this->commitLocked();
+	}
+}
+
+
+/**
+ @brief		Makes every transaction in the log durable and moves their records to their home locations.
+ @return	void
+ */
+void Journal::commit()
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+	this->commitLocked();
+}
+
+
+/**
+ @brief		Commits, writes every home location back to the device and empties the log. Blocks freed since the last
+			checkpoint are handed back to the allocator, and the block sums are written to the checksum table.
+ @return	void
+ */
+void Journal::checkpoint()
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+	this->checkpointLocked();
+}
+
+
+/**
+ @brief		Checkpoints, then punches the whole free space out of the device. A checkpoint only discards the blocks
+			freed since the previous one, a device page they share with blocks freed by another stays allocated.
+ @return	void
+ */
+void Journal::trim()
+{
+	std::unique_lock<std::shared_mutex> lock(this->_mutex);
+	this->checkpointLocked();
+	this->_discardedBlocks += this->allocator->discardFree();
+}
+
+
+/**
+ @brief		commit() with the journal lock already held.
+ @return	void
+ */
+void Journal::commitLocked()
+{
+	if (this->_pendingTransactions == 0 && this->_dirtyData.empty())
+	{
+		return;
+	}
+
+	// The data goes first, then the log. Only the touched pages are flushed, not the whole mapping.
+	std::sort(this->_dirtyData.begin(), this->_dirtyData.end());
+	for (size_t i = 0; i < this->_dirtyData.size(); i++)
+	{
+		uint64_t start = this->_dirtyData[i].first;
+		uint64_t end = this->_dirtyData[i].second;
+
+		while (i + 1 < this->_dirtyData.size() && this->_dirtyData[i + 1].first <= end)
+		{
+			end = std::max(end, this->_dirtyData[++i].second);
+		}
+
+		this->blkdevsim->flush(start, end - start);
+	}
+	this->_dirtyData.clear();
+
+	if (this->_head > this->_committedHead)
+	{
+		this->blkdevsim->flush(this->logAddress() + this->_committedHead, this->_head - this->_committedHead);
+		this->_committedHead = this->_head;
+	}
+
+	// The transactions are durable, a crash from here on is redone by replay()
+	this->apply(this->_pending.data(), this->_pending.size());
+	this->_pending.clear();
+	this->_pendingTransactions = 0;
+	this->_commitCount++;
+}
+
+
+/**
+ @brief		checkpoint() with the journal lock already held.
+ @return	void
+ */
+void Journal::checkpointLocked()
+{
+	this->commitLocked();
+
+	// The log is only emptied once the home locations it would redo are on the device
+	this->blkdevsim->flush(0, this->blkdevsim->size());
+	this->writeSuperblock();
+	this->_head = 0;
+	this->_committedHead = 0;
+
+	// The freed blocks are punched out of the device too, adjacent ones in a single discard
+	std::sort(this->_released.begin(), this->_released.end(), [](const BlockAllocator::extent& a, const BlockAllocator::extent& b)
+	{
+		return a.start < b.start;
+	});
+	for (size_t i = 0; i < this->_released.size(); i++)
+	{
+		const BlockAllocator::extent& ext = this->_released[i];
+		this->allocator->release(ext);
+
+		uint64_t start = ext.start;
+		uint64_t end = ext.start + ext.length;
+		while (i + 1 < this->_released.size() && this->_released[i + 1].start == end)
+		{
+			this->allocator->release(this->_released[++i]);
+			end += this->_released[i].length;
+		}
+
+		this->blkdevsim->discard(start * BLOCK_SIZE, (end - start) * BLOCK_SIZE);
+		this->_discardedBlocks += end - start;
+	}
+	this->_released.clear();
+
+	// The sums of everything written so far, the discards included, reach the table
+	this->checksums->sync();
+	this->_checkpointCount++;
+}
+
+
+/**
+ @brief		Collects the journal counters.
+ @return	The collected statistics
+ */
+Journal::journal_stats Journal::stats()
+{
+	std::shared_lock<std::shared_mutex> lock(this->_mutex);
+
+	journal_stats stats;
+	stats.transactions = this->_transactionCount;
+	stats.commits = this->_commitCount;
+	stats.checkpoints = this->_checkpointCount;
+	stats.discardedBlocks = this->_discardedBlocks;
+	stats.loggedBytes = this->_loggedBytes;
+	stats.appliedBytes = this->_appliedBytes;
+	stats.pendingTransactions = this->_pendingTransactions;
+	stats.usedBytes = this->_head;
+	stats.capacity = this->capacity();
+
+	return stats;
+}
+
+
+/**
+ @brief		Writes the journal superblock, starting the log at the next sequence number, and flushes it.
+ @return	void
+ */
+void Journal::writeSuperblock()
+{
+	journal_superblock superblock;
+	memset(&superblock, 0, sizeof(superblock));
+	memcpy(superblock.magic, JOURNAL_MAGIC, sizeof(superblock.magic));
+	superblock.blocks = this->_blocks;
+	superblock.sequence = this->_sequence;
+
+	this->blkdevsim->write(this->_address, sizeof(superblock), (const char *)&superblock);
+	this->blkdevsim->flush(this->_address, sizeof(superblock));
+}
+
+
+/**
+ @brief		Writes logged records to their home locations.
+ @param		log			The records
+ @param		length		The length of the records in bytes
+ @return	void
+ */
+void Journal::apply(const char *log, size_t length)
+{
+	for (size_t position = 0; position < length; )
+	{
+		record_header header;
+		memcpy(&header, log + position, sizeof(header));
+
+		if (header.address + header.length > this->blkdevsim->size())
+		{
+			throw std::runtime_error(RED "The journal is corrupted" RESET);
+		}
+
+		this->blkdevsim->write(header.address, header.length, log + position + sizeof(header));
+		this->_appliedBytes += header.length;
+		position += recordSize(header.length);
+	}
+}
+
+
+/**
+ @brief		Copies the parts of the logged records that fall inside the given range over it, later records last.
+ @param		log			The records
+ @param		length		The length of the records in bytes
+ @param		addr		The address of the range
+ @param		size		The size of the range
+ @param		data		The range contents read from the device
+ @return	void
+ */
+void Journal::overlay(const char *log, size_t length, uint64_t addr, size_t size, char *data)
+{
+	for (size_t position = 0; position < length; )
+	{
+		record_header header;
+		memcpy(&header, &log[position], sizeof(header));
+
+		uint64_t start = std::max(addr, header.address);
+		uint64_t end = std::min(addr + size, header.address + header.length);
+		if (start < end)
+		{
+			memcpy(data + (start - addr), &log[position + sizeof(header) + (start - header.address)], end - start);
+		}
+
+		position += recordSize(header.length);
+	}
+}
+
+
+/**
+ @brief		Returns the address the log starts at, right after the journal superblock.
+ @return	The log address
+ */
+uint64_t Journal::logAddress() const
+{
+	return this->_address + BLOCK_SIZE;
+}
+
+
+/**
+ @brief		Returns the size of the log in bytes.
+ @return	The log capacity
+ */
+uint32_t Journal::capacity() const
+{
+	return (this->_blocks - 1) * BLOCK_SIZE;
+}
+
+
+/**
+ @brief		FNV-1a over the given bytes.
+ @param		data		The bytes
+ @param		length		The number of bytes
+ @return	The checksum
+ */
+uint32_t Journal::checksum(const char *data, size_t length)
+{
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		hash = (hash ^ (unsigned char)data[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+
+/**
+ @brief		Returns the size a record takes in the log, the data is padded to keep the headers aligned.
+ @param		length		The length of the record data
+ @return	The record size in bytes
+ */
+size_t Journal::recordSize(uint32_t length)
+{
+	return sizeof(record_header) + ((length + 7) & ~7);
+}
@@ -0,0 +1,141 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <stdint.h>
+#include "blkdev.h"
+#include "allocator.h"
+#include "checksumdev.h"
+
+
+// A redo journal for metadata writes. The writes of an operation are staged in its transaction and appended to the
+// journal region when it ends. Their home locations are only written at the next commit point, after the journal
+// has been flushed, so the device never holds part of a transaction outside the journal.
+class Journal
+{
+public:
+	Journal(BlockDevice *blkdevsim_, BlockAllocator *allocator_, ChecksumDevice *checksums_);
+
+	// Collects the metadata writes the calling thread makes through the journal while it is alive.
+	// A transaction opened while the thread already has one joins the outer transaction.
+	class transaction
+	{
+	public:
+		transaction(Journal& journal_);
+		transaction(const transaction&) = delete;
+		transaction& operator=(const transaction&) = delete;
+		~transaction();
+
+	private:
+		friend class Journal;
+
+		Journal& journal;
+		bool nested;
+		transaction *previous;		// The transaction the thread had open on another journal
+		std::vector<char, ArenaAllocator<char>> log;		// Records in their on-disk format
+		uint32_t recordCount;
+		BlockAllocator::extent_list released;
+	};
+
+	struct journal_stats
+	{
+		uint64_t transactions;
+		uint64_t commits;
+		uint64_t checkpoints;
+		uint64_t discardedBlocks;		// Free blocks punched out of the device by the checkpoints and trims
+		uint64_t loggedBytes;			// Written to the log
+		uint64_t appliedBytes;			// Written to the home locations
+		uint32_t pendingTransactions;
+		uint32_t usedBytes;
+		uint32_t capacity;
+	};
+
+	void format(uint64_t address, uint32_t blocks);
+	uint32_t replay(uint64_t address, uint32_t blocks);
+
+	void read(uint64_t addr, size_t size, char *data);
+	void write(uint64_t addr, size_t size, const char *data);
+	void dirty(uint64_t addr, size_t size);
+	void release(const BlockAllocator::extent& ext);
+
+	void commit();
+	void checkpoint();
+	void trim();
+
+	journal_stats stats();
+	uint64_t address() const { return this->_address; }
+	uint32_t blocks() const { return this->_blocks; }
+
+	static const uint32_t DEFAULT_BLOCKS = 256;
+	static const uint32_t COMMIT_INTERVAL = 16;		// Transactions batched into one commit
+
+
+private:
+	struct journal_superblock
+	{
+		char magic[4];
+		uint32_t blocks;
+		uint64_t sequence;		// The sequence number of the first transaction in the log
+	};
+
+	struct transaction_header
+	{
+		uint32_t magic;
+		uint32_t recordCount;
+		uint64_t sequence;
+		uint32_t length;		// The length of the records following the header
+		uint32_t checksum;
+	};
+
+	struct record_header
+	{
+		uint64_t address;
+		uint32_t length;
+		uint32_t reserved;
+	};
+
+	void end(transaction& txn);
+	void commitLocked();
+	void checkpointLocked();
+	void writeSuperblock();
+	void apply(const char *log, size_t length);
+
+	uint64_t logAddress() const;
+	uint32_t capacity() const;
+
+	static void overlay(const char *log, size_t length, uint64_t addr, size_t size, char *data);
+	static uint32_t checksum(const char *data, size_t length);
+	static size_t recordSize(uint32_t length);
+
+	BlockDevice *blkdevsim;
+	BlockAllocator *allocator;
+	ChecksumDevice *checksums;
+
+	std::shared_mutex _mutex;		// Shared for reads through the pending records, exclusive for everything else
+
+	uint64_t _address;
+	uint32_t _blocks;
+	uint64_t _sequence;		// The sequence number of the next transaction
+	uint32_t _head;			// The log offset the next transaction is appended at
+	uint32_t _committedHead;	// The log offset up to which the log is flushed
+
+	std::vector<char> _pending;		// Records of the transactions since the last commit, not yet at their home locations
+	uint32_t _pendingTransactions;
+	std::vector<std::pair<uint64_t, uint64_t>> _dirtyData;		// Data ranges written since the last commit
+	std::vector<BlockAllocator::extent> _released;		// Blocks freed since the last checkpoint
+
+	uint64_t _transactionCount;
+	uint64_t _commitCount;
+	uint64_t _checkpointCount;
+	uint64_t _discardedBlocks;
+	uint64_t _loggedBytes;
+	uint64_t _appliedBytes;
+
+	static thread_local transaction *_current;
+	static const char *JOURNAL_MAGIC;
+	static const uint32_t TRANSACTION_MAGIC = 0x4E585254;		// "TRXN"
+};
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,256 @@
+#include "lz4.h"
+#include "Helper.h"
+#include <stdexcept>
+#include <string.h>
+
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+
+/**
+ @brief		Hashes a 4-byte sequence into the match finder table (Knuth's multiplicative hash).
+ @param		sequence		The 4 bytes, read as a little endian integer
+ @return	The table index
+ */
+uint32_t Lz4::hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+
+/**
+ @brief		Compresses a buffer into a single LZ4 block.
+ @param		src			The data to compress
+ @param		size		The size of the data
+ @param		dst			The buffer to compress into
+ @param		capacity	The size of the output buffer, compressBound(size) always fits
+ @return	The compressed size, 0 if the output buffer is too small
+ */
+size_t Lz4::compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	const uint8_t *base = (const uint8_t *)src;
+	const uint8_t *end = base + size;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;		// Start of the literals not yet written
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *outEnd = out + capacity;
+
+	uint32_t table[1 << HASH_LOG];		// Sequence hash -> the last position it was seen at
+	memset(table, 0, sizeof(table));
+
+	if (size > MATCH_FIND_LIMIT)
+	{
+		const uint8_t *matchLimit = end - MATCH_FIND_LIMIT;
+		const uint8_t *matchEnd = end - LAST_LITERALS;
+
+		while (ip < matchLimit)
+		{
+			uint32_t sequence = read32(ip);
+			uint32_t slot = hash(sequence);
+			const uint8_t *ref = base + table[slot];
+			table[slot] = ip - base;
+
+			if (ref >= ip || (size_t)(ip - ref) > MAX_DISTANCE || read32(ref) != sequence)
+			{
+				ip++;
+				continue;
+			}
+
+			size_t matchLength = MIN_MATCH;
+			while (ip + matchLength < matchEnd && ref[matchLength] == ip[matchLength])
+			{
+				matchLength++;
+			}
+
+			// Taking in the bytes before the match that match as well
+			while (ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+				matchLength++;
+			}
+
+			if (!writeSequence(out, outEnd, anchor, ip - anchor, ip - ref, matchLength))
+			{
+				return 0;
+			}
+
+			ip += matchLength;
+			anchor = ip;
+		}
+	}
+
+	// The last sequence is literals only
+	size_t literalLength = end - anchor;
+	if ((size_t)(outEnd - out) < 1 + literalLength + (literalLength / 255) + 1)
+	{
+		return 0;
+	}
+
+	uint8_t *token = out++;
+	*token = (literalLength >= 15 ? 15 : literalLength) << 4;
+	if (literalLength >= 15)
+	{
+		writeLength(out, literalLength - 15);
+	}
+	memcpy(out, anchor, literalLength);
+	out += literalLength;
+
+	return out - (uint8_t *)dst;
+}
+
+
+/**
+ @brief		Writes one sequence - the token, the literals, the match offset and the rest of the match length.
+ @param		out				The output position, advanced past the sequence
+ @param		outEnd			The end of the output buffer
+ @param		literals		The literals preceding the match
+ @param		literalLength	The number of literals
+ @param		offset			The distance back to the match source
+ @param		matchLength		The match length, at least MIN_MATCH
+ @return	Whether the sequence fit in the output buffer
+ */
+bool Lz4::writeSequence(uint8_t *& out, const uint8_t *outEnd, const uint8_t *literals, size_t literalLength,
+	size_t offset, size_t matchLength)
+{
+	size_t needed = 1 + literalLength + (literalLength / 255) + 1 + 2 + ((matchLength - MIN_MATCH) / 255) + 1;
+	if ((size_t)(outEnd - out) < needed)
+	{
+		return false;
+	}
+
+	uint8_t *token = out++;
+
+	*token = (literalLength >= 15 ? 15 : literalLength) << 4;
+	if (literalLength >= 15)
+	{
+		writeLength(out, literalLength - 15);
+	}
+	memcpy(out, literals, literalLength);
+	out += literalLength;
+
+	*out++ = offset & 0xFF;
+	*out++ = offset >> 8;
+
+	size_t extraMatch = matchLength - MIN_MATCH;
+	*token |= extraMatch >= 15 ? 15 : extraMatch;
+	if (extraMatch >= 15)
+	{
+		writeLength(out, extraMatch - 15);
+	}
+
+	return true;
+}
+
+
+// Lengths past the 4 bits of the token continue in bytes of 255, ended by a byte below 255
+void Lz4::writeLength(uint8_t *& out, size_t length)
+{
+	while (length >= 255)
+	{
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+}
+
+
+/**
+ @brief		Decompresses a single LZ4 block. Every length and offset is checked, so a corrupted block throws
+			instead of reading or writing out of bounds.
+ @param		src			The compressed block
+ @param		size		The size of the compressed block
+ @param		dst			The buffer to decompress into
+ @param		capacity	The size of the output buffer
+ @return	The decompressed size
+ */
+size_t Lz4::decompress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *ipEnd = ip + size;
+	uint8_t *base = (uint8_t *)dst;
+	uint8_t *op = base;
+	uint8_t *opEnd = base + capacity;
+
+	while (ip < ipEnd)
+	{
+		uint8_t token = *ip++;
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15)
+		{
+			uint8_t byte;
+			do
+			{
+				if (ip >= ipEnd)
+				{
+					throw std::runtime_error(RED "Corrupted compressed data" RESET);
+				}
+				byte = *ip++;
+				literalLength += byte;
+			} while (byte == 255);
+		}
+
+		if (literalLength > (size_t)(ipEnd - ip) || literalLength > (size_t)(opEnd - op))
+		{
+			throw std::runtime_error(RED "Corrupted compressed data" RESET);
+		}
+		memcpy(op, ip, literalLength);
+		op += literalLength;
+		ip += literalLength;
+
+		if (ip == ipEnd)		// The last sequence has no match
+		{
+			break;
+		}
+
+		if (ipEnd - ip < 2)
+		{
+			throw std::runtime_error(RED "Corrupted compressed data" RESET);
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t matchLength = (token & 15) + MIN_MATCH;
+		if ((token & 15) == 15)
+		{
+			uint8_t byte;
+			do
+			{
+				if (ip >= ipEnd)
+				{
+					throw std::runtime_error(RED "Corrupted compressed data" RESET);
+				}
+				byte = *ip++;
+				matchLength += byte;
+			} while (byte == 255);
+		}
+
+		if (offset == 0 || offset > (size_t)(op - base) || matchLength > (size_t)(opEnd - op))
+		{
+			throw std::runtime_error(RED "Corrupted compressed data" RESET);
+		}
+
+		// A match may overlap the bytes it produces (a run), those are copied one at a time
+		const uint8_t *match = op - offset;
+		if (offset >= matchLength)
+		{
+			memcpy(op, match, matchLength);
+		}
+		else
+		{
+			for (size_t i = 0; i < matchLength; i++)
+			{
+				op[i] = match[i];
+			}
+		}
+		op += matchLength;
+	}
+
+	return op - base;
+}
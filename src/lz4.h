@@ -0,0 +1,30 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// An in-tree LZ4 block compressor - greedy matching through a small hash table of 4-byte sequences, in the
+// standard LZ4 block format (token, literals, 16-bit offset, match length).
+class Lz4
+{
+public:
+	static size_t compressBound(size_t size) { return size + (size / 255) + 16; }
+	static size_t compress(const char *src, size_t size, char *dst, size_t capacity);
+	static size_t decompress(const char *src, size_t size, char *dst, size_t capacity);
+
+private:
+	static bool writeSequence(uint8_t *& out, const uint8_t *outEnd, const uint8_t *literals, size_t literalLength,
+		size_t offset, size_t matchLength);
+	static void writeLength(uint8_t *& out, size_t length);
+	static uint32_t hash(uint32_t sequence);
+
+	static const int HASH_LOG = 12;
+	static const size_t MIN_MATCH = 4;
+	static const size_t LAST_LITERALS = 5;		// The block always ends with at least this many literals
+	static const size_t MATCH_FIND_LIMIT = 12;	// No match starts in the last bytes of the block
+	static const size_t MAX_DISTANCE = 65535;
+};
+
+#endif // __LZ4_H__
@@ -0,0 +1,82 @@
+#include "metereddev.h"
+#include "metrics.h"
+
+
+/**
+ @brief		Constructor - Meters the accesses to the given device.
+ @param		device_		The device to pass the accesses to
+ */
+MeteredDevice::MeteredDevice(BlockDevice *device_) : device(device_)
+{
+}
+
+
+void MeteredDevice::read(uint64_t addr, size_t size, char *ans)
+{
+	Metrics::Timer timer(Metrics::OP_DEVICE_READ);
+
+	this->device->read(addr, size, ans);
+	Metrics::count(Metrics::COUNTER_DEVICE_BYTES_READ, size);
+	Metrics::count(Metrics::COUNTER_DEVICE_REQUESTS);
+}
+
+
+void MeteredDevice::write(uint64_t addr, size_t size, const char *data)
+{
+	Metrics::Timer timer(Metrics::OP_DEVICE_WRITE);
+
+	this->device->write(addr, size, data);
+	Metrics::count(Metrics::COUNTER_DEVICE_BYTES_WRITTEN, size);
+	Metrics::count(Metrics::COUNTER_DEVICE_REQUESTS);
+}
+
+
+/**
+ @brief		Submits the batch to the device as a single batch, so a device that batches keeps doing it. The batch is
+			timed as a whole, its requests are counted one by one.
+ @param		requests		The requests
+ @param		count			The number of requests
+ @return	void
+ */
+void MeteredDevice::submit(const io_request *requests, size_t count)
+{
+	Metrics::Timer timer(Metrics::OP_DEVICE_SUBMIT);
+	uint64_t bytesRead = 0;
+	uint64_t bytesWritten = 0;
+
+	this->device->submit(requests, count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		(requests[i].write ? bytesWritten : bytesRead) += requests[i].size;
+	}
+	Metrics::count(Metrics::COUNTER_DEVICE_BYTES_READ, bytesRead);
+	Metrics::count(Metrics::COUNTER_DEVICE_BYTES_WRITTEN, bytesWritten);
+	Metrics::count(Metrics::COUNTER_DEVICE_REQUESTS, count);
+}
+
+
+void MeteredDevice::flush(uint64_t addr, size_t size)
+{
+	Metrics::Timer timer(Metrics::OP_DEVICE_FLUSH);
+
+	this->device->flush(addr, size);
+}
+
+
+void MeteredDevice::discard(uint64_t addr, size_t size)
+{
+	this->device->discard(addr, size);
+}
+
+
+uint64_t MeteredDevice::size() const
+{
+	return this->device->size();
+}
+
+
+void MeteredDevice::grow(uint64_t newSize)
+{
+	this->device->grow(newSize);
+}
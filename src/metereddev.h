@@ -0,0 +1,35 @@
+#ifndef __METEREDDEV_H__
+#define __METEREDDEV_H__
+
+#include "blkdev.h"
+
+
+// Passes every access through to another device, timing the reads, writes, batches and flushes and counting the
+// bytes they move (see Metrics). Zero-copy views aren't device accesses and aren't counted.
+class MeteredDevice : public BlockDevice
+{
+public:
+	MeteredDevice(BlockDevice *device_);
+
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void submit(const io_request *requests, size_t count) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
+
+	bool viewable() const override { return this->device->viewable(); }
+	const char *view(uint64_t addr, size_t size) const override { return this->device->view(addr, size); }
+	void pin() override { this->device->pin(); }
+	void unpin() override { this->device->unpin(); }
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
+
+	stripe_layout layout() const override { return this->device->layout(); }
+
+
+private:
+	BlockDevice *device;
+};
+
+#endif // __METEREDDEV_H__
@@ -0,0 +1,408 @@
+#include "metrics.h"
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define METRICS_TSC
+#endif
+
+
+std::atomic<bool> Metrics::_timing(true);
+std::atomic<bool> Metrics::_tracing(false);
+std::atomic<uint64_t> Metrics::_traceStart(0);
+
+const size_t Metrics::MAX_TRACE_EVENTS;
+
+
+static const char *OPERATION_NAMES[Metrics::OPERATION_COUNT] =
+{
+	"format", "lookup", "create", "remove", "rename", "get_content", "set_content", "view_content", "read", "write",
+	"append", "list_dir", "get_stats", "compress", "snapshot", "grow", "sync", "compact", "clean", "scrub",
+	"device_read", "device_write", "device_submit", "device_flush"
+};
+
+static const char *COUNTER_NAMES[Metrics::COUNTER_COUNT] =
+{
+	"path_lookups", "directory_loads", "entries_scanned", "index_nodes_read", "device_bytes_read", "device_bytes_written",
+	"device_requests"
+};
+
+
+Metrics::Timer::Timer(operation op_) : op(op_), start(Metrics::timing() ? Metrics::now() : 0)
+{
+}
+
+
+Metrics::Timer::~Timer()
+{
+	if (this->start == 0)
+	{
+		Metrics::recordUntimed(this->op);
+		return;
+	}
+
+	Metrics::record(this->op, this->start, Metrics::now() - this->start);
+}
+
+
+static uint64_t steadyNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ @brief		Measures the TSC frequency against the steady clock, over a millisecond. The TSC is only used when the CPU
+			says it is invariant (ticks at the same rate in every core and power state).
+ @return	The nanoseconds in a TSC tick, 0 when the steady clock is used instead
+ */
+static double calibrateTsc()
+{
+#ifdef METRICS_TSC
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+	{
+		return 0;
+	}
+
+	uint64_t startNs = steadyNs();
+	uint64_t startTicks = __rdtsc();
+	while (steadyNs() - startNs < 1000000)
+	{
+	}
+
+	return (double)(steadyNs() - startNs) / (__rdtsc() - startTicks);
+#else
+	return 0;
+#endif
+}
+
+
+static const double NS_PER_TICK = calibrateTsc();
+
+
+// A steady clock read costs a few tens of ns, a TSC read a fraction of that, which matters when timing every device access
+uint64_t Metrics::now()
+{
+#ifdef METRICS_TSC
+	if (NS_PER_TICK != 0)
+	{
+		return (uint64_t)(__rdtsc() * NS_PER_TICK);
+	}
+#endif
+
+	return steadyNs();
+}
+
+
+Metrics::registry& Metrics::instance()
+{
+	static registry metricsRegistry;
+	return metricsRegistry;
+}
+
+
+/**
+ @brief		Returns the slots of the calling thread, registering them on its first use. When the thread exits, what it
+			counted is folded into the registry's retired slots.
+ @return	The thread's slots
+ */
+Metrics::thread_slots& Metrics::local()
+{
+	struct holder
+	{
+		thread_slots *slots;
+
+		holder() : slots(new thread_slots())
+		{
+			registry& reg = instance();
+			std::lock_guard<std::mutex> lock(reg.mutex);
+			this->slots->tid = ++reg.nextTid;
+			reg.threads.push_back(this->slots);
+		}
+
+		~holder()
+		{
+			registry& reg = instance();
+			std::lock_guard<std::mutex> lock(reg.mutex);
+			merge(reg.retired, *this->slots);
+			reg.threads.erase(std::find(reg.threads.begin(), reg.threads.end(), this->slots));
+			delete this->slots;
+		}
+	};
+
+	static thread_local holder threadSlots;
+	return *threadSlots.slots;
+}
+
+
+// Only the owning thread writes its slots, a plain load and store is enough and cheaper than an atomic add
+void Metrics::add(std::atomic<uint64_t>& slot, uint64_t amount)
+{
+	slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+
+void Metrics::count(counter c, uint64_t amount)
+{
+	add(local().counters[c], amount);
+}
+
+
+/**
+ @brief		Records one timed operation in the thread's histogram, and in its trace while tracing.
+ @param		op			The operation
+ @param		start		When it started, in ns
+ @param		duration	How long it took, in ns
+ @return	void
+ */
+void Metrics::record(operation op, uint64_t start, uint64_t duration)
+{
+	thread_slots& slots = local();
+	operation_slot& slot = slots.operations[op];
+
+	int bucket = duration == 0 ? 0 : std::min(63 - __builtin_clzll(duration), HISTOGRAM_BUCKETS - 1);
+	add(slot.count, 1);
+	add(slot.totalNs, duration);
+	add(slot.buckets[bucket], 1);
+	if (duration > slot.maxNs.load(std::memory_order_relaxed))
+	{
+		slot.maxNs.store(duration, std::memory_order_relaxed);
+	}
+
+	if (tracing())
+	{
+		uint64_t traceStart = _traceStart.load(std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(slots.traceMutex);
+
+		if (start >= traceStart && slots.trace.size() < MAX_TRACE_EVENTS)
+		{
+			slots.trace.push_back(trace_event{ op, start - traceStart, duration });
+		}
+	}
+}
+
+
+// Counts an operation that wasn't timed, it lands in no histogram bucket
+void Metrics::recordUntimed(operation op)
+{
+	add(local().operations[op].count, 1);
+}
+
+
+void Metrics::merge(thread_slots& into, thread_slots& from)
+{
+	for (int op = 0; op < OPERATION_COUNT; op++)
+	{
+		operation_slot& target = into.operations[op];
+		operation_slot& source = from.operations[op];
+
+		add(target.count, source.count.load(std::memory_order_relaxed));
+		add(target.totalNs, source.totalNs.load(std::memory_order_relaxed));
+		target.maxNs.store(std::max(target.maxNs.load(std::memory_order_relaxed),
+			source.maxNs.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			add(target.buckets[i], source.buckets[i].load(std::memory_order_relaxed));
+		}
+	}
+
+	for (int c = 0; c < COUNTER_COUNT; c++)
+	{
+		add(into.counters[c], from.counters[c].load(std::memory_order_relaxed));
+	}
+
+	std::lock_guard<std::mutex> lock(from.traceMutex);
+	std::lock_guard<std::mutex> intoLock(into.traceMutex);
+	into.trace.insert(into.trace.end(), from.trace.begin(), from.trace.end());
+}
+
+
+void Metrics::clear(thread_slots& slots)
+{
+	for (int op = 0; op < OPERATION_COUNT; op++)
+	{
+		operation_slot& slot = slots.operations[op];
+
+		slot.count.store(0, std::memory_order_relaxed);
+		slot.totalNs.store(0, std::memory_order_relaxed);
+		slot.maxNs.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			slot.buckets[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	for (int c = 0; c < COUNTER_COUNT; c++)
+	{
+		slots.counters[c].store(0, std::memory_order_relaxed);
+	}
+}
+
+
+/**
+ @brief		Sums the counters and histograms of every thread, live and exited.
+ @return	The totals
+ */
+Metrics::metrics_snapshot Metrics::collect()
+{
+	thread_slots total{};
+	registry& reg = instance();
+
+	{
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		merge(total, reg.retired);
+		for (thread_slots *slots : reg.threads)
+		{
+			merge(total, *slots);
+		}
+	}
+
+	metrics_snapshot snapshot;
+	for (int op = 0; op < OPERATION_COUNT; op++)
+	{
+		operation_stats& stats = snapshot.operations[op];
+		operation_slot& slot = total.operations[op];
+
+		stats.count = slot.count.load(std::memory_order_relaxed);
+		stats.totalNs = slot.totalNs.load(std::memory_order_relaxed);
+		stats.maxNs = slot.maxNs.load(std::memory_order_relaxed);
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			stats.buckets[i] = slot.buckets[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	for (int c = 0; c < COUNTER_COUNT; c++)
+	{
+		snapshot.counters[c] = total.counters[c].load(std::memory_order_relaxed);
+	}
+
+	return snapshot;
+}
+
+
+// Zeroes every counter and histogram. Counts made by other threads while it runs may be lost.
+void Metrics::reset()
+{
+	registry& reg = instance();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+
+	clear(reg.retired);
+	for (thread_slots *slots : reg.threads)
+	{
+		clear(*slots);
+	}
+}
+
+
+// The operations that were counted while timing was on
+uint64_t Metrics::operation_stats::timed() const
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total += this->buckets[i];
+	}
+
+	return total;
+}
+
+
+/**
+ @brief		Returns an upper bound of the given latency percentile - the top of the histogram bucket it falls in.
+ @param		fraction		The percentile, between 0 and 1
+ @return	The latency in ns, 0 when nothing was recorded
+ */
+uint64_t Metrics::operation_stats::percentile(double fraction) const
+{
+	uint64_t rank = (uint64_t)(fraction * this->timed());
+	uint64_t seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += this->buckets[i];
+		if (seen > rank)
+		{
+			return std::min<uint64_t>((2ULL << i) - 1, this->maxNs);
+		}
+	}
+
+	return this->maxNs;
+}
+
+
+const char *Metrics::operationName(operation op)
+{
+	return OPERATION_NAMES[op];
+}
+
+
+const char *Metrics::counterName(counter c)
+{
+	return COUNTER_NAMES[c];
+}
+
+
+// Starts a new trace, dropping the events of the previous one
+void Metrics::startTrace()
+{
+	registry& reg = instance();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+
+	for (thread_slots *slots : reg.threads)
+	{
+		std::lock_guard<std::mutex> traceLock(slots->traceMutex);
+		slots->trace.clear();
+	}
+	reg.retired.trace.clear();
+
+	_traceStart.store(now(), std::memory_order_relaxed);
+	_tracing.store(true, std::memory_order_relaxed);
+}
+
+
+void Metrics::stopTrace()
+{
+	_tracing.store(false, std::memory_order_relaxed);
+}
+
+
+/**
+ @brief		Writes the recorded events in the Chrome trace event format, one complete ("X") event per operation.
+ @param		out		The stream to write to
+ @return	void
+ */
+void Metrics::writeTrace(std::ostream& out)
+{
+	registry& reg = instance();
+	std::lock_guard<std::mutex> lock(reg.mutex);
+	bool first = true;
+
+	auto writeEvents = [&](thread_slots& slots)
+	{
+		std::lock_guard<std::mutex> traceLock(slots.traceMutex);
+
+		for (const trace_event& event : slots.trace)
+		{
+			out << (first ? "\n" : ",\n") << "  { \"name\": \"" << OPERATION_NAMES[event.op] << "\", \"cat\": \""
+				<< (event.op >= OP_DEVICE_READ ? "device" : "myfs") << "\", \"ph\": \"X\", \"ts\": "
+				<< event.start / 1000 << "." << event.start % 1000 / 100 << ", \"dur\": "
+				<< event.duration / 1000 << "." << event.duration % 1000 / 100
+				<< ", \"pid\": 1, \"tid\": " << slots.tid << " }";
+			first = false;
+		}
+	};
+
+	out << "{ \"traceEvents\": [";
+	writeEvents(reg.retired);
+	for (thread_slots *slots : reg.threads)
+	{
+		writeEvents(*slots);
+	}
+	out << "\n], \"displayTimeUnit\": \"ns\" }" << std::endl;
+}
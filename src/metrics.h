@@ -0,0 +1,160 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Process-wide instrumentation of the file system operations and the device accesses under them. Every thread counts
+// into slots only it writes (relaxed atomics, so they can be read at any time), collect() sums the threads.
+// Operations are timed into log2 latency histograms. While tracing is on, every timed operation is also recorded as
+// a Chrome trace event (chrome://tracing, Perfetto). Timing costs two clock reads per operation, it can be turned off,
+// the operations and counters are still counted.
+class Metrics
+{
+public:
+	enum operation
+	{
+		OP_FORMAT,
+		OP_LOOKUP,			// getEntryInfo and isFileExists
+		OP_CREATE,
+		OP_REMOVE,
+		OP_RENAME,
+		OP_GET_CONTENT,
+		OP_SET_CONTENT,
+		OP_VIEW_CONTENT,
+		OP_READ,
+		OP_WRITE,
+		OP_APPEND,
+		OP_LIST_DIR,
+		OP_GET_STATS,
+		OP_COMPRESS,
+		OP_SNAPSHOT,		// Creating, deleting and listing snapshots
+		OP_GROW,
+		OP_SYNC,
+		OP_COMPACT,			// A compaction step
+		OP_CLEAN,			// A segment cleaning step
+		OP_SCRUB,
+		OP_DEVICE_READ,
+		OP_DEVICE_WRITE,
+		OP_DEVICE_SUBMIT,
+		OP_DEVICE_FLUSH,
+		OPERATION_COUNT
+	};
+
+	enum counter
+	{
+		COUNTER_PATH_LOOKUPS,			// Path components resolved
+		COUNTER_DIRECTORY_LOADS,		// Directories read into the dentry cache
+		COUNTER_ENTRIES_SCANNED,		// Directory entries read by directory loads and listings
+		COUNTER_INDEX_NODES_READ,		// Directory index nodes read by lookups, changes and listings
+		COUNTER_DEVICE_BYTES_READ,
+		COUNTER_DEVICE_BYTES_WRITTEN,
+		COUNTER_DEVICE_REQUESTS,		// Reads and writes, a batch counts every request in it
+		COUNTER_COUNT
+	};
+
+	static const int HISTOGRAM_BUCKETS = 40;		// Bucket i holds the latencies in [2^i, 2^(i+1)) ns
+
+	struct operation_stats
+	{
+		uint64_t count;
+		uint64_t totalNs;			// Of the timed ones, see timed()
+		uint64_t maxNs;
+		uint64_t buckets[HISTOGRAM_BUCKETS];
+
+		uint64_t timed() const;
+		uint64_t percentile(double fraction) const;
+	};
+
+	struct metrics_snapshot
+	{
+		operation_stats operations[OPERATION_COUNT];
+		uint64_t counters[COUNTER_COUNT];
+	};
+
+	// Times an operation from its construction to its destruction
+	class Timer
+	{
+	public:
+		Timer(operation op_);
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+		~Timer();
+
+	private:
+		operation op;
+		uint64_t start;			// 0 when timing is off
+	};
+
+	static void count(counter c, uint64_t amount = 1);
+	static metrics_snapshot collect();
+	static void reset();
+
+	static const char *operationName(operation op);
+	static const char *counterName(counter c);
+
+	static void setTiming(bool enabled) { _timing.store(enabled, std::memory_order_relaxed); }
+	static bool timing() { return _timing.load(std::memory_order_relaxed); }
+
+	static void startTrace();
+	static void stopTrace();
+	static bool tracing() { return _tracing.load(std::memory_order_relaxed); }
+	static void writeTrace(std::ostream& out);
+
+	static const size_t MAX_TRACE_EVENTS = 1 << 20;		// Per thread, later events are dropped
+
+
+private:
+	struct trace_event
+	{
+		operation op;
+		uint64_t start;			// ns since the trace started
+		uint64_t duration;
+	};
+
+	struct operation_slot
+	{
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> totalNs;
+		std::atomic<uint64_t> maxNs;
+		std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+	};
+
+	struct thread_slots
+	{
+		uint32_t tid;
+		operation_slot operations[OPERATION_COUNT];
+		std::atomic<uint64_t> counters[COUNTER_COUNT];
+
+		std::mutex traceMutex;		// Only taken while tracing, the trace is read by other threads
+		std::vector<trace_event> trace;
+	};
+
+	struct registry
+	{
+		std::mutex mutex;
+		std::vector<thread_slots *> threads;
+		thread_slots retired;		// What the threads that exited counted
+		uint32_t nextTid;
+	};
+
+	static registry& instance();
+	static thread_slots& local();
+	static void record(operation op, uint64_t start, uint64_t duration);
+	static void recordUntimed(operation op);
+	static void add(std::atomic<uint64_t>& slot, uint64_t amount);
+	static void merge(thread_slots& into, thread_slots& from);
+	static void clear(thread_slots& slots);
+	static uint64_t now();
+
+	static std::atomic<bool> _timing;
+	static std::atomic<bool> _tracing;
+	static std::atomic<uint64_t> _traceStart;
+};
+
+#endif // __METRICS_H__
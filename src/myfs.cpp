@@ -1,268 +1,5298 @@
 #include "myfs.h"
+#include "lz4.h"
+#include "metrics.h"
 #include <string.h>
 #include <iostream>
 #include <math.h>
 #include <sstream>
+#include <algorithm>
+#include <stddef.h>
+#include <chrono>
 
 
 const char *MyFs::MYFS_MAGIC = "MYFS";
+const uint32_t MyFs::COMPRESSED_CHUNK_SIZE;		// Passed by reference to std::min
+const uint32_t MyFs::ROOT_INODE;				// Passed by reference to addTableEntry
+const uint32_t MyFs::COMPACT_MAX_STEP_BLOCKS;	// Passed by reference to std::min
 
 
 /**
- @brief		Constructor - Initializes the block device simulator and the file count.
- @param		blkdevsim_		The block device simulator
+ @brief		Constructor - Initializes the block device simulator, the file count and the block allocator.
+ @param		blkdevsim_		The block device
  */
-MyFs::MyFs(BlockDeviceSimulator *blkdevsim_) : blkdevsim(blkdevsim_), _fileCount(0)
+MyFs::MyFs(BlockDevice *blkdevsim_) :
+	_checksumDevice(blkdevsim_),
+	_meteredDevice(&this->_checksumDevice),
+	blkdevsim(&this->_meteredDevice),
+	_fileCount(0),
+	_compactInode(0),
+	_compactMoved(false),
+	_compactLimit(0),
+	_cleanInode(0),
+	_cleanMoved(false),
+	_readOnly(false),
+	_tableAddress(TABLE_START_ADDRESS),
+	_inlineAddress(0),
+	_snapshotList(0),
+	_inodeMap(0),
+	_compression(false),
+	_dedup(false),
+	_log(false),
+	_allocator(&this->_meteredDevice),
+	_journal(&this->_meteredDevice, &this->_allocator, &this->_checksumDevice),
+	_cleanerRunning(false),
+	_cleanerWanted(false),
+	_cleanerRetryAt(0),
+	_userBytes(0),
+	_dataBytes(0),
+	_logBlocks(0),
+	_logFallbackBlocks(0),
+	_logDryAt(0),
+	_cleanerPasses(0),
+	_cleanerBlocksMoved(0),
+	_segmentsCleaned(0),
+	_cleanerNs(0),
+	_defragBlocks(0)
 {
+	Arena::Scope scope;
 	struct myfs_header header;
 	blkdevsim->read(0, sizeof(header), (char *)&header);
 	
+	bool magicFound = strncmp(header.magic, MYFS_MAGIC, sizeof(header.magic)) == 0;
+	bool legacyVersion = (header.version == TEXT_TABLE_VERSION) || (header.version == SLOT_TABLE_VERSION) ||
+		(header.version == FLAT_TABLE_VERSION) || (header.version == FIXED_BITMAP_VERSION) ||
+		(header.version == UNJOURNALED_VERSION);
+	bool blockDataVersion = header.version == BLOCK_DATA_VERSION;		// Mounted like the current version, then migrated
+	bool currentLayout = (header.version == CURR_VERSION) || (header.version == INLINE_DATA_VERSION) ||
+		(header.version == COMPRESSED_DATA_VERSION) || (header.version == SHARED_BLOCKS_VERSION) ||
+		(header.version == FLAT_DIRECTORY_VERSION) || (header.version == SINGLE_DEVICE_VERSION) ||
+		(header.version == STRIPED_VERSION) || (header.version == SINGLE_MAP_VERSION) ||
+		(header.version == UNMARKED_SUMS_VERSION) || (header.version == EAGER_SNAPSHOT_VERSION) ||
+		(header.version == HASHED_DEDUP_VERSION);
+
 	// If didn't find file system instance
-	if ((strncmp(header.magic, MYFS_MAGIC, sizeof(header.magic)) != 0) || ((header.version != CURR_VERSION)))
+	if (!magicFound || (!currentLayout && !legacyVersion && !blockDataVersion))
 	{
 		std::cout << CYAN "Did not find myfs instance on blkdev" << std::endl;
 		std::cout << GREEN "Creating..." RESET << std::endl;
 		format();
 		std::cout << GREEN "Finished!" RESET << std::endl;
 	}
+	else if (legacyVersion)		// If found an instance using an older layout
+	{
+		std::cout << CYAN "Found an older myfs instance on blkdev" << std::endl;
+		std::cout << GREEN "Migrating..." RESET << std::endl;
+		if (header.version == FIXED_BITMAP_VERSION)
+		{
+			migrateTableLocation(header);
+		}
+		else if (header.version == UNJOURNALED_VERSION)
+		{
+			migrateJournal(header);
+		}
+		else
+		{
+			migrateLegacyInstance(header);
+		}
+		std::cout << GREEN "Finished!" RESET << std::endl;
+	}
 	else		// If file system instance already exists
 	{
-		// Fetching the file count from the memory
-		char fetchedFileCount[FILE_COUNT_SIZE];
-		this->blkdevsim->read(FILE_COUNT_ADDRESS, FILE_COUNT_SIZE, fetchedFileCount);
-		this->_fileCount = std::stoi(fetchedFileCount);
+		if ((uint64_t)header.blockCount * BLOCK_SIZE > this->blkdevsim->size())
+		{
+			throw std::runtime_error(RED "The device is smaller than the file system on it" RESET);
+		}
+
+		this->checkDeviceSet(header);
+
+		// After a crash only the regions the bitmap marks are summed again, the rest are checked against the table.
+		// Older versions only wrote the table at a clean unmount, their blocks are summed as they are after a crash.
+		// Checked from here on, the journal replay included.
+		if ((header.version == CURR_VERSION || header.version == HASHED_DEDUP_VERSION ||
+			header.version == EAGER_SNAPSHOT_VERSION || header.version == UNMARKED_SUMS_VERSION ||
+			header.version == SINGLE_MAP_VERSION) &&
+			(header.options & HEADER_OPTION_CHECKSUMS))
+		{
+			BlockAllocator::extent table = checksumTable(header.blockCount);
+			this->_checksumDevice.enable(blockAddress(table.start), header.blockCount, header.state != STATE_CLEAN &&
+				(header.version == UNMARKED_SUMS_VERSION || header.version == SINGLE_MAP_VERSION));
+		}
+
+		this->_fileCount = header.fileCount;
+		this->_inlineAddress = blockDataVersion ? 0 : header.inlineAddress;
+		this->_compression = currentLayout && (header.options & HEADER_OPTION_COMPRESS);		// Zero before version 0x0A
+		this->_dedup = currentLayout && (header.options & HEADER_OPTION_DEDUP);
+		this->_log = currentLayout && (header.options & HEADER_OPTION_LOG);
+		this->_snapshotList = (header.version == CURR_VERSION || header.version == HASHED_DEDUP_VERSION ||
+			header.version == EAGER_SNAPSHOT_VERSION || header.version == UNMARKED_SUMS_VERSION ||
+			header.version == SINGLE_MAP_VERSION || header.version == STRIPED_VERSION ||
+			header.version == SINGLE_DEVICE_VERSION || header.version == FLAT_DIRECTORY_VERSION) ? header.snapshotList : 0;
+		this->_inodeMap = (header.version == CURR_VERSION || header.version == HASHED_DEDUP_VERSION ||
+			header.version == EAGER_SNAPSHOT_VERSION || header.version == UNMARKED_SUMS_VERSION ||
+			header.version == SINGLE_MAP_VERSION || header.version == STRIPED_VERSION ||
+			header.version == SINGLE_DEVICE_VERSION) ? header.inodeMap : 0;
+		this->_allocator.load(header.bitmapAddress, header.blockCount);
+
+		uint32_t replayed = this->_journal.replay(header.journalAddress, header.journalBlocks);
+		this->loadInodeMap(header.version == CURR_VERSION);
+
+		// Older versions took every reference of a snapshot with it, their snapshot entries all hold theirs
+		if (header.version != CURR_VERSION && header.version != HASHED_DEDUP_VERSION && this->_snapshotList != 0)
+		{
+			this->freezeSnapshots();
+		}
+
+		if (replayed > 0 || header.state != STATE_CLEAN)
+		{
+			std::cout << CYAN "The device wasn't unmounted cleanly, replayed " << replayed << " journal transactions" << std::endl;
+			std::cout << GREEN "Recovering..." RESET << std::endl;
+			this->recover();
+			std::cout << GREEN "Finished!" RESET << std::endl;
+		}
+
+		// A version 0x08 instance only lacks the inline records, the journal is replayed first
+		if (blockDataVersion)
+		{
+			std::cout << CYAN "Found an older myfs instance on blkdev" << std::endl;
+			std::cout << GREEN "Migrating..." RESET << std::endl;
+			this->createInlineArea(0);
+			this->_journal.checkpoint();
+			std::cout << GREEN "Finished!" RESET << std::endl;
+		}
+
+		// Older versions have no inode map, their directories are converted to indexes as they change
+		if (this->_inodeMap == 0)
+		{
+			this->createInodeMap(0);
+		}
+
+		// Older versions have no dedup index on the device, it is built from the blocks once
+		this->loadSnapshots();
+		this->loadBlockRefs(header.version != CURR_VERSION);
 	}
+
+	this->loadFreeInodes();
+
+	// Marking the device as in use until the destructor runs
+	this->writeHeader();
+
+	if (this->_log)
+	{
+		this->startCleaner();
+	}
+}
+
+
+/**
+ @brief		Constructor - Mounts a snapshot of the file system on the device, read-only. The journal isn't replayed and
+			the device is left untouched, so this works next to the instance mounting the live file system. The
+			snapshot mustn't be deleted while it's mounted.
+ @param		blkdevsim_		The block device
+ @param		snapshot		The name of the snapshot
+ */
+MyFs::MyFs(BlockDevice *blkdevsim_, const std::string& snapshot) :
+	_checksumDevice(blkdevsim_),
+	_meteredDevice(&this->_checksumDevice),
+	blkdevsim(&this->_meteredDevice),
+	_fileCount(0),
+	_compactInode(0),
+	_compactMoved(false),
+	_compactLimit(0),
+	_cleanInode(0),
+	_cleanMoved(false),
+	_readOnly(true),
+	_tableAddress(TABLE_START_ADDRESS),
+	_inlineAddress(0),
+	_snapshotList(0),
+	_inodeMap(0),
+	_compression(false),
+	_dedup(false),
+	_log(false),
+	_allocator(&this->_meteredDevice),
+	_journal(&this->_meteredDevice, &this->_allocator, &this->_checksumDevice),
+	_cleanerRunning(false),
+	_cleanerWanted(false),
+	_cleanerRetryAt(0),
+	_userBytes(0),
+	_dataBytes(0),
+	_logBlocks(0),
+	_logFallbackBlocks(0),
+	_logDryAt(0),
+	_cleanerPasses(0),
+	_cleanerBlocksMoved(0),
+	_segmentsCleaned(0),
+	_cleanerNs(0),
+	_defragBlocks(0)
+{
+	Arena::Scope scope;
+	struct myfs_header header;
+	blkdevsim->read(0, sizeof(header), (char *)&header);
+
+	if (memcmp(header.magic, MYFS_MAGIC, sizeof(header.magic)) != 0 ||
+		(header.version != CURR_VERSION && header.version != HASHED_DEDUP_VERSION &&
+		header.version != EAGER_SNAPSHOT_VERSION && header.version != UNMARKED_SUMS_VERSION &&
+		header.version != SINGLE_MAP_VERSION && header.version != STRIPED_VERSION &&
+		header.version != SINGLE_DEVICE_VERSION && header.version != FLAT_DIRECTORY_VERSION))
+	{
+		throw std::runtime_error(RED "Did not find a myfs instance with snapshots on blkdev" RESET);
+	}
+	this->checkDeviceSet(header);
+
+	this->_allocator.load(header.bitmapAddress, header.blockCount);
+	this->_snapshotList = header.snapshotList;
+
+	struct snapshot_list list;
+	this->readSnapshotList(list);
+	int index = findSnapshot(list, snapshot);
+	if (index == -1)
+	{
+		throw std::runtime_error(RED "Snapshot not found" RESET);
+	}
+
+	this->_fileCount = list.snapshots[index].fileCount;
+	this->_tableAddress = blockAddress(list.snapshots[index].tableBlock);
+	this->_inlineAddress = this->_tableAddress + TABLE_SIZE;
+	this->readSnapshotChunks(list.snapshots[index], this->_inodeChunks);
 }
 
 
 /**
- @brief		Destructor - Writes the file count into the memory before exiting the program.
+ @brief		Destructor - Stops the cleaner, checkpoints the journal and marks the device clean before exiting the
+			program.
  */
 MyFs::~MyFs()
 {
-	// Writing the file count into the memory before exiting the program
-	std::string fileCount = std::to_string(this->_fileCount);
-	fileCount.append(FILE_COUNT_SIZE - fileCount.length(), '\0');
+	this->stopCleaner();
+
+	// A mounted snapshot never wrote anything
+	if (this->_readOnly)
+	{
+		return;
+	}
 
-	this->blkdevsim->write(FILE_COUNT_ADDRESS, FILE_COUNT_SIZE, (fileCount).c_str());
+	// Emptying the journal and writing the file count into the header before exiting the program
+	try
+	{
+		this->_journal.checkpoint();
+		this->writeHeader(true);
+	}
+	catch (const std::runtime_error& e)
+	{
+		std::cout << e.what() << std::endl;
+	}
 	std::cout << CYAN << "\n\nSaved file count to memory (" << this->_fileCount << ")\n" << RESET << std::endl;
 }
 
 
 /**
- @brief		Formats the block device simulator and puts the header in place.
+ @brief		Formats the block device simulator, puts the header in place, resets the block bitmap, creates the journal
+			and the root directory. The inline records go right after the table, in the same page, and the bitmap
+			after them.
  @return	void
  */
 void MyFs::format()
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_FORMAT);
+
+	this->checkWritable();
+
+	// The device size is chosen when the backing file is created, the file system takes all of it
+	uint64_t blockCount = this->blkdevsim->size() / BLOCK_SIZE;
+	uint64_t bitmapAddress = blockAddress(blocksFor(INLINE_START_ADDRESS + INLINE_AREA_SIZE));
+	uint64_t reservedBlocks = blocksFor(bitmapAddress + BlockAllocator::bitmapSize(std::min<uint64_t>(blockCount, UINT32_MAX)));
+
+	if (blockCount > UINT32_MAX)
+	{
+		throw std::runtime_error(RED "Device is too large" RESET);
+	}
+	if (blockCount <= reservedBlocks + Journal::DEFAULT_BLOCKS + INODE_MAP_BLOCKS +
+		ChecksumDevice::tableBlocks(std::min<uint64_t>(blockCount, UINT32_MAX)))
+	{
+		throw std::runtime_error(RED "Device is too small" RESET);
+	}
+
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+
+	// The header, the table, the inline records and the bitmap itself are never handed out by the allocator, and
+	// neither is the checksum table at the end of the device. Every block is summed as it is, whatever was on the
+	// device before included.
+	BlockAllocator::extent table = checksumTable(blockCount);
+	this->_allocator.format(bitmapAddress, blockCount, reservedBlocks);
+	this->_allocator.reserve(table);
+	this->_checksumDevice.enable(blockAddress(table.start), blockCount, true);
+	this->_inlineAddress = INLINE_START_ADDRESS;
+	this->_snapshotList = 0;
+	this->_snapshots.clear();
+	this->createJournal(reservedBlocks);
+	this->createInodeMap(reservedBlocks + this->_journal.blocks());
+	this->clearTable(ROOT_INODE);
+
+	{
+		std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+		this->_fileCount = 0;
+		this->_freeInodes.clear();
+	}
+	this->_compactInode = 0;		// Only touched under the device lock
+	this->_compactMoved = false;
+	this->_compactLimit = 0;
+	this->_cleanInode = 0;
+	this->_cleanMoved = false;
+	this->_cleanVictims.clear();
+	this->_cleanStuck.clear();
+	{
+		std::unique_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+		this->_dentryCache.clear();
+		this->_loadedDirectories.clear();
+		this->_largeDirectories.clear();
+	}
+	{
+		std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+		this->_blockRefs.clear();
+		this->_dedupIndex.clear();
+		this->_indexedBlocks.clear();
+		this->_freeDedupSlots.clear();
+	}
+
+	this->addTableEntry("", ROOT_INODE, ENTRY_FLAG_DIRECTORY);
+
+	this->_journal.checkpoint();
+	this->writeHeader();
+}
+
+
+/**
+ @brief		Writes the header (magic, version, mount state, file count, block bitmap, journal and inline records
+			location, inode map, device set) to the device and flushes it.
+ @param		clean		Whether the device is left consistent without a journal replay
+ @return	void
+ */
+void MyFs::writeHeader(bool clean)
 {
 	struct myfs_header header;
-	strncpy(header.magic, MYFS_MAGIC, sizeof(header.magic));
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MYFS_MAGIC, sizeof(header.magic));
 	header.version = CURR_VERSION;
-	blkdevsim->write(0, sizeof(header), (const char*)&header);
+	header.state = clean ? STATE_CLEAN : STATE_MOUNTED;
+	{
+		std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+		header.fileCount = this->_fileCount;
+	}
+	header.blockCount = this->_allocator.blockCount();
+	header.bitmapAddress = this->_allocator.bitmapAddress();
+	header.journalAddress = this->_journal.address();
+	header.journalBlocks = this->_journal.blocks();
+	header.inlineAddress = this->_inlineAddress;
+	header.snapshotList = this->_snapshotList;
+	header.inodeMap = this->_inodeMap;
+	header.options = (this->_compression ? HEADER_OPTION_COMPRESS : 0) | (this->_dedup ? HEADER_OPTION_DEDUP : 0) |
+		(this->_log ? HEADER_OPTION_LOG : 0) | (this->_checksumDevice.enabled() ? HEADER_OPTION_CHECKSUMS : 0);
+
+	BlockDevice::stripe_layout layout = this->blkdevsim->layout();
+	header.stripeWidth = layout.width;
+	header.stripeChunk = layout.chunkSize;
+	header.stripeSetId = layout.setId;
+
+	// The table is on the device before a header points at it, and the header's own sum reaches it before the device
+	// is marked clean
+	this->_checksumDevice.sync();
+	this->blkdevsim->write(0, sizeof(header), (const char*)&header);
+	if (clean)
+	{
+		this->_checksumDevice.sync();
+	}
+	this->blkdevsim->flush(0, sizeof(header));
 }
 
 
 /**
- @brief		returns the entry info of the given file in the system.
- @param		fileName		The name of the file to search for its entry info
- @return	The entry info of the given file in the system.
+ @brief		Checks the file system is mounted on the device it was made on - the same device set, or a single image.
+			The images of a set are in the order of their labels, a set with other images, another chunk size or
+			other images in it would scramble the blocks.
+ @param		header		The header read from the device
+ @return	void
  */
-MyFs::EntryInfo MyFs::getEntryInfo(const std::string& fileName)
+void MyFs::checkDeviceSet(const struct myfs_header& header)
 {
-	for (int i = TABLE_START_ADDRESS; i < this->_fileCount * TABLE_ENTRY_SIZE; i+=TABLE_ENTRY_SIZE)
-	{
-		char entry[TABLE_ENTRY_SIZE];
-		this->blkdevsim->read(i, TABLE_ENTRY_SIZE, entry);
+	BlockDevice::stripe_layout layout = this->blkdevsim->layout();
 
-		std::vector<std::string> entryTokens = splitEntry(entry);		// Splitting the entry into its 3 sections
-		if (entryTokens.at(FILE_NAME_INDEX) == fileName)
-		{
-			return MyFs::EntryInfo(std::to_string(i), entryTokens);
-		}
+	// The fields are zero before version 0x0E, which only ran on a single image
+	bool striped = (header.version == CURR_VERSION || header.version == HASHED_DEDUP_VERSION ||
+		header.version == EAGER_SNAPSHOT_VERSION || header.version == UNMARKED_SUMS_VERSION ||
+		header.version == SINGLE_MAP_VERSION || header.version == STRIPED_VERSION) && header.stripeWidth > 1;
+
+	if (!striped && layout.width > 1)
+	{
+		throw std::runtime_error(RED "The file system was made on a single image, not on a device set" RESET);
+	}
+	if (striped && (layout.width != header.stripeWidth || layout.chunkSize != header.stripeChunk ||
+		layout.setId != header.stripeSetId))
+	{
+		throw std::runtime_error(RED "The file system was made on another device set (" +
+			std::to_string(header.stripeWidth) + " images in " + std::to_string(header.stripeChunk / 1024) + "K chunks)" RESET);
 	}
+}
 
-	return MyFs::EntryInfo(ENTRY_NOT_FOUND, std::vector<std::string>());		// Returning an empty pair
+
+// The checksum table takes the last blocks of the device, its place follows from the device size alone
+BlockAllocator::extent MyFs::checksumTable(uint32_t blockCount)
+{
+	uint32_t tableBlocks = ChecksumDevice::tableBlocks(blockCount);
+	return BlockAllocator::extent{ blockCount - tableBlocks, tableBlocks };
 }
 
 
 /**
- @brief		Creates a new entry using the parameters and adds it to the files table.
- @param		fileName		The name of the file to use in the entry
- @param		fileAddress		The address of the file to use in the entry
- @param		fileSize		The size of the file to use in the entry
+ @brief		Sets whether new file content is compressed by default and records it in the header. Files that are
+			already compressed stay compressed either way.
+ @param		enabled		Whether to compress
  @return	void
  */
-void MyFs::addTableEntry(const std::string& fileName, const int& fileAddress, const int& fileSize)
+void MyFs::setCompression(bool enabled)
 {
-	std::string entry = fileName + "|" + std::to_string(fileAddress) + "|" + std::to_string(fileSize);
-	entry.append(TABLE_ENTRY_SIZE - entry.length(), '\0');
+	Arena::Scope scope;
 
-	// Writing a new entry to the table
-	this->blkdevsim->write(TABLE_START_ADDRESS + (this->_fileCount * TABLE_ENTRY_SIZE), TABLE_ENTRY_SIZE, entry.c_str());
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+	this->_compression = enabled;
+	this->writeHeader();
 }
 
 
 /**
- @brief		Edits the entry of the given file in the files table.
- @param		entryToEdit		The name of the file to edit its entry
- @param		fileName		The updated name of the file to use in the entry
- @param		fileAddress		The updated address of the file to use in the entry
- @param		fileSize		The updated size of the file to use in the entry
+ @brief		Sets whether new file content shares identical blocks with the files already stored, and records it in
+			the header. Files that already share blocks keep doing so either way.
+ @param		enabled		Whether to deduplicate
  @return	void
  */
-void MyFs::editTableEntry(const std::string& entryToEdit, const std::string& fileName, const int& fileAddress, const int& fileSize)
+void MyFs::setDedup(bool enabled)
 {
-	MyFs::EntryInfo entryInfo = this->getEntryInfo(entryToEdit);
+	Arena::Scope scope;
 
-	// Checking if the entry was found
-	if (entryInfo.first == ENTRY_NOT_FOUND)
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+	this->_dedup = enabled;
+	this->writeHeader();
+}
+
+
+/**
+ @brief		Sets whether blocks are allocated at the head of the log and records it in the header. In log-structured
+			mode an overwrite goes to new blocks too, so the device sees the writes one after the other, and the
+			segment cleaner runs in the background to keep free segments for the log. Blocks already written stay
+			where they are either way.
+ @param		enabled		Whether to write log-structured
+ @return	void
+ */
+void MyFs::setLogStructured(bool enabled)
+{
+	Arena::Scope scope;
+
+	// Stopped before any lock is taken, a cleaning step takes them
+	if (!enabled)
 	{
-		throw std::runtime_error(RED "File not found" RESET);
+		this->stopCleaner();
 	}
 
-	std::string updatedEntry = fileName + "|" + std::to_string(fileAddress) + "|" + std::to_string(fileSize);
-	updatedEntry.append(TABLE_ENTRY_SIZE - updatedEntry.length(), '\0');
+	{
+		std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+		this->checkWritable();
+		this->_log = enabled;
+		this->writeHeader();
+	}
 
-	// Overwriting the old entry and replacing it with the updated one
-	this->blkdevsim->write(std::stoi(entryInfo.first), TABLE_ENTRY_SIZE, updatedEntry.c_str());
+	if (enabled)
+	{
+		this->startCleaner();
+	}
 }
 
 
 /**
- @brief		Checks if the given file exists in the system.
- @param		fileName		The name of the file to check if it exists
- @return	True if the file exists, false otherwise.
+ @brief		Sets whether every block is checked against its CRC32C sum, and records it in the header. Turning it on sums
+			every block, and needs the blocks at the end of the device the checksum table goes to to be free.
+ @param		enabled		Whether to keep sums
+ @return	void
  */
-bool MyFs::isFileExists(const std::string& fileName)
+void MyFs::setChecksums(bool enabled)
 {
-	// Iterating over the table searching for the given fileName
-	for (int i = TABLE_START_ADDRESS; i < this->_fileCount * TABLE_ENTRY_SIZE; i+=TABLE_ENTRY_SIZE)
+	Arena::Scope scope;
+
+	// Nothing may access the device while the sums are set up or dropped
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	if (enabled == this->_checksumDevice.enabled())
 	{
-		char entry[TABLE_ENTRY_SIZE];
-		this->blkdevsim->read(i, TABLE_ENTRY_SIZE, entry);
+		return;
+	}
 
-		std::vector<std::string> entryTokens = splitEntry(entry);		// Splitting the entry into its 3 sections
-		if (entryTokens.at(FILE_NAME_INDEX) == fileName)
+	uint32_t blockCount = this->_allocator.blockCount();
+	BlockAllocator::extent table = checksumTable(blockCount);
+
+	if (enabled)
+	{
+		if (!this->_allocator.claim(table))
 		{
-			return true;
+			throw std::runtime_error(RED "The end of the device is in use, compact the file system first" RESET);
 		}
+		this->_checksumDevice.enable(blockAddress(table.start), blockCount, true);
+	}
+	else
+	{
+		this->_checksumDevice.disable();
+		this->_allocator.release(table);
 	}
 
-	return false;
+	this->writeHeader();
 }
 
 
 /**
- @brief		Creates a new file in the system and allocates it an entry in the files table.
- @param		path_str		The name of the file to create
- @param		directory		Whether the file is a directory or not
+ @brief		Grows the device and the file system on it online. The new blocks are added to the free space.
+ @param		newSize		The new device size in bytes
  @return	void
  */
-void MyFs::create_file(const std::string& path_str, const bool& directory)
+void MyFs::grow(uint64_t newSize)
 {
-	if (path_str.length() > MAX_FILE_NAME)		// Checking if the file name length is valid
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_GROW);
+
+	// The mapping may move, every other operation has to be out of the device. Taken before the size is checked, a
+	// concurrent grow could shrink the device back otherwise.
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+
+	this->checkWritable();
+
+	uint64_t blockCount = newSize / BLOCK_SIZE;
+
+	if (blockCount <= this->_allocator.blockCount())
 	{
-		throw std::runtime_error(RED "File name is too long" RESET);
+		throw std::runtime_error(RED "The device can only grow" RESET);
 	}
-	else if (this->isFileExists(path_str))		// Checking if the file name already exists in the system
+	if (blockCount > UINT32_MAX)
 	{
-		throw std::runtime_error(RED "A file with this name already exists" RESET);
+		throw std::runtime_error(RED "Device is too large" RESET);
 	}
 
-	this->addTableEntry(path_str, TABLE_END_ADDRESS + (this->_fileCount * FILE_SIZE), 0);
+	this->blkdevsim->grow(blockCount * BLOCK_SIZE);
+
+	// The checksum table moves to the new end of the device, its old blocks are summed and freed. Until the header
+	// points at the new table a crash sums every block again.
+	if (this->_checksumDevice.enabled())
+	{
+		this->_checksumDevice.markAll();
+
+		BlockAllocator::extent oldTable = checksumTable(this->_allocator.blockCount());
+		BlockAllocator::extent newTable = checksumTable(blockCount);
 
-	this->_fileCount++;
+		this->_allocator.grow(blockCount, newTable.length);
+		this->_checksumDevice.relocate(blockAddress(newTable.start), blockCount);
+		this->_allocator.release(oldTable);
+	}
+	else
+	{
+		this->_allocator.grow(blockCount);
+	}
+
+	// The bitmap may have moved, it has to be on the device before the header points at it
+	this->_journal.checkpoint();
+	this->writeHeader();
 }
 
 
 /**
- @brief		Returns the whole content of the file indicated by path_str param.
- @param		path_str		The file path to get its content
- @return	The content of the file
+ @brief		Makes every operation completed so far durable, without waiting for the next commit point.
+ @return	void
  */
-std::string MyFs::get_content(const std::string& path_str)
+void MyFs::sync()
 {
-	MyFs::EntryInfo entryInfo = this->getEntryInfo(path_str);
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_SYNC);
 
-	// Checking if the entry was found
-	if (entryInfo.first == ENTRY_NOT_FOUND)
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+
+	// A mounted snapshot has nothing to commit
+	if (!this->_readOnly)
 	{
-		throw std::runtime_error(RED "File not found" RESET);
+		this->_journal.commit();
 	}
+}
 
-	// Reading the file contents and saving into a variable
-	char fileContents[MAX_FILE_SIZE];
-	this->blkdevsim->read(std::stoi(entryInfo.second.at(FILE_ADDRESS_INDEX)), MAX_FILE_SIZE, fileContents);
-	
-	return fileContents;
+
+/**
+ @brief		Checks every block of the device against its CRC32C sum, on several threads. Operations go on meanwhile,
+			only growing the device waits for the scrub.
+ @param		threads		The threads to check with, 0 for one per hardware thread
+ @return	What was checked, how long it took and the bad blocks found
+ */
+ChecksumDevice::scrub_stats MyFs::scrub(unsigned threads)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_SCRUB);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+
+	if (!this->_checksumDevice.enabled())
+	{
+		throw std::runtime_error(RED "The file system has no checksums" RESET);
+	}
+
+	return this->_checksumDevice.scrub(threads);
 }
 
 
+// Tells relocateFile() which blocks to move and where to
+class MyFs::relocation
+{
+public:
+	// The blocks from start on (at most length) that all move or all stay, and whether they move
+	virtual uint32_t run(uint32_t start, uint32_t length, bool& moves) const = 0;
+
+	// Allocates up to count contiguous blocks to move to, returns how many (0 when none could be found)
+	virtual uint32_t allocate(uint32_t count, BlockAllocator::extent& target) = 0;
+
+protected:
+	~relocation() = default;
+};
+
+
+// Compaction moves the blocks at or past the limit to free blocks before it
+class MyFs::compaction : public MyFs::relocation
+{
+public:
+	compaction(BlockAllocator& allocator_, uint32_t limit_) : allocator(allocator_), limit(limit_) {}
+
+	uint32_t run(uint32_t start, uint32_t length, bool& moves) const override
+	{
+		moves = start >= this->limit;
+		return moves ? length : std::min(length, this->limit - start);
+	}
+
+	uint32_t allocate(uint32_t count, BlockAllocator::extent& target) override
+	{
+		return this->allocator.allocateBelow(count, this->limit, target) ? count : 0;
+	}
+
+private:
+	BlockAllocator& allocator;
+	uint32_t limit;
+};
+
+
+// Cleaning moves the blocks of the victim segments to the head of the log
+class MyFs::segment_cleaning : public MyFs::relocation
+{
+public:
+	segment_cleaning(BlockAllocator& allocator_, const std::vector<uint32_t>& victims_) :
+		allocator(allocator_), victims(victims_) {}
+
+	uint32_t run(uint32_t start, uint32_t length, bool& moves) const override
+	{
+		uint32_t segment = start / BlockAllocator::SEGMENT_BLOCKS;
+		moves = std::binary_search(this->victims.begin(), this->victims.end(), segment);
+		return std::min(length, (segment + 1) * BlockAllocator::SEGMENT_BLOCKS - start);
+	}
+
+	uint32_t allocate(uint32_t count, BlockAllocator::extent& target) override
+	{
+		return this->allocator.appendRun(count, target);
+	}
+
+private:
+	BlockAllocator& allocator;
+	const std::vector<uint32_t>& victims;		// Sorted
+};
+
+
 /**
- @brief		Overwrites the whole content of the given file and sets it a new content.
- @param		path_str		The file path to set its content
- @param		content			The new content of the file
- @return	void
+ @brief		Runs one bounded step of the compaction: moves up to maxBlocks blocks of the files to free blocks near the
+			start of the device, so the free space gathers at its end. A pass starts by finding where the data
+			would end if it were packed, and moves only the blocks past that point, to the free blocks before it,
+			so a block is moved about once. A step holds off only the file it is moving, every other operation goes
+			on. The files are visited in inode order over successive steps, and a pass that moves nothing ends the
+			compaction: the whole free space is punched out of the device then.
+			Shared blocks (deduplicated and snapshotted files) and the metadata regions are left where they are.
+ @param		maxBlocks		The most blocks to move in this step
+ @param		movedBlocks		Set to the blocks moved
+ @return	True while there is more to compact, false once the compaction is done
  */
-void MyFs::set_content(const std::string& path_str, std::string& content)
+bool MyFs::compact_step(uint32_t maxBlocks, uint32_t& movedBlocks)
 {
-	// Checking if the content length is valid
-	if (content.length() > MAX_FILE_SIZE)
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_COMPACT);
+
+	std::lock_guard<std::mutex> compactLock(this->_compactMutex);
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	maxBlocks = std::min(std::max(maxBlocks, 1U), COMPACT_MAX_STEP_BLOCKS);
+	movedBlocks = 0;
+
+	uint32_t fileCount;
 	{
-		std::runtime_error(RED "Content too long" RESET);
+		std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+		fileCount = this->_fileCount;
 	}
 
-	// Iterating over the files table searching for the given path_str
-	MyFs::EntryInfo entryInfo = this->getEntryInfo(path_str);
-	int actualContentLength = content.length();
-	content = content.append(MAX_FILE_SIZE - content.length(), '\0');		// Padding the content with \0 to erase previous content
+	// A pass starts with a checkpoint, the blocks freed since the last one (moved away from by the previous pass
+	// too) are only free after it
+	if (this->_compactLimit == 0)
+	{
+		this->_journal.checkpoint();
+		this->_compactLimit = this->_allocator.packedEnd();
+	}
+	compaction compacting(this->_allocator, this->_compactLimit);
 
-	// Checking if the entry was found. Creating a file with the given name if not.
-	if (entryInfo.first == ENTRY_NOT_FOUND)
+	// Bounding the inodes a step reads, a stretch of small or unused ones shouldn't make a long step
+	for (uint32_t visited = 0; visited < INODE_CHUNK_INODES && movedBlocks < maxBlocks; visited++)
 	{
-		this->create_file(path_str, false);
-		entryInfo = this->getEntryInfo(path_str);
+		if (this->_compactInode >= fileCount)
+		{
+			bool moved = this->_compactMoved;
+			this->_compactInode = 0;
+			this->_compactMoved = false;
+			this->_compactLimit = 0;
+
+			if (!moved)
+			{
+				this->_journal.trim();
+				return false;
+			}
+			return true;
+		}
+
+		uint32_t budget = maxBlocks - movedBlocks;
+		uint32_t moved;
+		{
+			std::unique_lock<std::shared_mutex> fileLock(this->inodeLock(this->_compactInode));
+			Journal::transaction txn(this->_journal);
+			moved = this->relocateFile(this->_compactInode, compacting, budget);
+		}
+
+		movedBlocks += moved;
+		if (moved > 0)
+		{
+			this->_compactMoved = true;
+		}
+
+		// A file that used up the budget may have more to move, the next step picks it up again
+		if (moved < budget)
+		{
+			this->_compactInode++;
+		}
 	}
 
-	// Updating the file entry
-	this->editTableEntry(path_str, entryInfo.second.at(FILE_NAME_INDEX), std::stoi(entryInfo.second.at(FILE_ADDRESS_INDEX)), actualContentLength);
-	this->blkdevsim->write(std::stoi(entryInfo.second.at(FILE_ADDRESS_INDEX)), MAX_FILE_SIZE - 1, content.c_str());
+	return true;
 }
 
 
 /**
- @brief		Returns a list of a files in a directory.
- @param		path_str		The directory path to list its files
- @return	a list of dir_list_entry structures, one for each file in the directory.
+ @brief		Moves up to maxBlocks blocks of a file to the blocks the given relocation picks, in file order. A piece
+			that finds no free run big enough is tried in smaller pieces. The data is copied before the entry points
+			at the new blocks, and the old ones are released with the journal. The caller holds the file lock
+			exclusively and a transaction.
+ @param		inode		The inode of the file
+ @param		how			Which blocks move, and where to
+ @param		maxBlocks	The most blocks to move
+ @return	The blocks moved
  */
-MyFs::dir_list MyFs::list_dir(const std::string& path_str)
+uint32_t MyFs::relocateFile(uint32_t inode, relocation& how, uint32_t maxBlocks)
 {
-	if (path_str == "/")		// current working directory
+	MyFs::EntryInfo entryInfo = this->readTableEntry(inode);
+	struct table_entry& entry = entryInfo.second;
+
+	if (!(entry.flags & ENTRY_FLAG_USED) || entry.address == 0 ||
+		(entry.flags & (ENTRY_FLAG_INLINE | ENTRY_FLAG_DEDUP | ENTRY_FLAG_SNAPSHOT)) || this->sharedWithSnapshots(inode))
+	{
+		return 0;
+	}
+
+	BlockAllocator::extent_list extents;
+	this->loadExtents(entry, extents);
+
+	BlockAllocator::extent_list relocated;		// The new extent list
+	BlockAllocator::extent_list sources;		// The moved pieces, and where each went
+	BlockAllocator::extent_list targets;
+	uint32_t moved = 0;
+
+	auto appendExtent = [&relocated](const BlockAllocator::extent& ext)
 	{
-		dir_list directoryList;
+		if (!relocated.empty() && relocated.back().start + relocated.back().length == ext.start)
+		{
+			relocated.back().length += ext.length;
+		}
+		else
+		{
+			relocated.push_back(ext);
+		}
+	};
 
-		// Iterating over the files table searching for the given path_str
-		for (int i = TABLE_START_ADDRESS; i < this->_fileCount * TABLE_ENTRY_SIZE; i+=TABLE_ENTRY_SIZE)
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		uint32_t done = 0;
+		while (done < ext.length)
 		{
-			char entry[TABLE_ENTRY_SIZE];
-			this->blkdevsim->read(i, TABLE_ENTRY_SIZE, entry);
+			bool moves;
+			uint32_t runEnd = done + how.run(ext.start + done, ext.length - done, moves);
+
+			uint32_t piece = moves ? std::min(runEnd - done, maxBlocks - moved) : 0;
+			while (done < runEnd && moved < maxBlocks && piece > 0)
+			{
+				piece = std::min({ piece, runEnd - done, maxBlocks - moved });
 
-			std::vector<std::string> entryTokens = splitEntry(entry);		// Splitting the entry into its 3 sections
+				BlockAllocator::extent target;
+				uint32_t length = how.allocate(piece, target);
+				if (length == 0)
+				{
+					piece /= 2;
+					continue;
+				}
 
-			dir_list_entry dle;
-			dle.name = entryTokens.at(FILE_NAME_INDEX);
-			dle.is_dir = false;
-			dle.file_size = std::stoi(entryTokens.at(FILE_SIZE_INDEX));
+				sources.push_back({ ext.start + done, length });
+				targets.push_back(target);
+				appendExtent(target);
+				done += length;
+				moved += length;
+			}
 
-			directoryList.push_back(dle);
+			// What stays, or what found no room
+			if (done < runEnd)
+			{
+				appendExtent({ ext.start + done, runEnd - done });
+				done = runEnd;
+			}
 		}
+	}
 
-		return directoryList;
+	// Moving pieces apart may leave more extents than a map chain holds, the file stays where it is then
+	if (relocated.size() > MAX_FILE_EXTENTS)
+	{
+		for (const BlockAllocator::extent& target : targets)
+		{
+			this->_allocator.release(target);
+		}
+		return 0;
 	}
-	else
+
+	bool metadata = entry.flags & ENTRY_FLAG_DIRECTORY;
+	std::vector<char, ArenaAllocator<char>> buffer;
+	for (size_t i = 0; i < sources.size(); i++)
 	{
-		// TODO: Add implementation for folders...
+		buffer.resize((size_t)sources[i].length * BLOCK_SIZE);
+		this->readExtents({ sources[i] }, 0, buffer.size(), buffer.data(), metadata);
+		this->writeExtents({ targets[i] }, 0, buffer.size(), buffer.data(), metadata);
 	}
 
-	throw std::runtime_error(RED "not implemented" RESET);
+	// The extent map blocks are moved too
+	BlockAllocator::extent_list mapBlocks;
+	this->loadMapBlocks(entry, mapBlocks);
+	bool keepsMap = relocated.size() > 1 || (entry.flags & ENTRY_FLAG_COMPRESSED);
+	for (BlockAllocator::extent& mapBlock : mapBlocks)
+	{
+		BlockAllocator::extent mapTarget;
+		bool mapMoves = false;
+		how.run(mapBlock.start, 1, mapMoves);
+		if (moved < maxBlocks && keepsMap && mapMoves && how.allocate(1, mapTarget) == 1)
+		{
+			this->releaseBlocks(mapBlock);
+			mapBlock.start = mapTarget.start;
+			moved++;
+		}
+	}
+
+	if (moved == 0)
+	{
+		return 0;
+	}
+
+	this->storeExtents(entry, relocated, mapBlocks);
+	this->writeTableEntry(entryInfo);
+
+	for (const BlockAllocator::extent& source : sources)
+	{
+		this->releaseBlocks(source);
+	}
+
+	return moved;
+}
+
+
+/**
+ @brief		Runs one bounded step of the segment cleaner: moves up to maxBlocks blocks out of the victim segments to
+			the head of the log, so the segments end up with no block in use and the log can fill them again. A
+			pass picks the least used segments (those the log would spend the most writes on, a segment mostly in
+			use isn't worth copying) and visits the files in inode order over successive steps, like compaction, with
+			which it takes turns. The blocks moved away from are only free after the checkpoint that ends the pass.
+			Shared blocks and the metadata regions are left where they are, a segment that they keep in use isn't
+			picked again before its use changes.
+ @param		maxBlocks		The most blocks to move in this step
+ @param		movedBlocks		Set to the blocks moved
+ @return	True while there is more to clean, false once a pass finds no victim or moves nothing
+ */
+bool MyFs::clean_step(uint32_t maxBlocks, uint32_t& movedBlocks)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_CLEAN);
+
+	std::lock_guard<std::mutex> compactLock(this->_compactMutex);
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	maxBlocks = std::min(std::max(maxBlocks, 1U), COMPACT_MAX_STEP_BLOCKS);
+	movedBlocks = 0;
+	bool more = true;
+
+	// A pass starts with a checkpoint, the segments emptied by the overwrites since the last one are free after it
+	// and needn't be cleaned
+	if (this->_cleanVictims.empty())
+	{
+		this->_journal.checkpoint();
+		more = this->pickVictims();
+		if (more)
+		{
+			this->_cleanerPasses++;
+		}
+	}
+
+	uint32_t fileCount;
+	{
+		std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+		fileCount = this->_fileCount;
+	}
+
+	segment_cleaning cleaning(this->_allocator, this->_cleanVictims);
+	for (uint32_t visited = 0; more && visited < INODE_CHUNK_INODES && movedBlocks < maxBlocks; visited++)
+	{
+		if (this->_cleanInode >= fileCount)
+		{
+			this->_journal.checkpoint();
+
+			std::vector<uint32_t> used;
+			this->_allocator.segmentUsage(used);
+			for (uint32_t segment : this->_cleanVictims)
+			{
+				if (used[segment] == 0)
+				{
+					this->_segmentsCleaned++;
+					this->_cleanStuck.erase(segment);
+				}
+				else
+				{
+					this->_cleanStuck[segment] = used[segment];
+				}
+			}
+
+			more = this->_cleanMoved;
+			this->_cleanInode = 0;
+			this->_cleanMoved = false;
+			this->_cleanVictims.clear();
+			break;
+		}
+
+		uint32_t budget = maxBlocks - movedBlocks;
+		uint32_t moved;
+		{
+			std::unique_lock<std::shared_mutex> fileLock(this->inodeLock(this->_cleanInode));
+			Journal::transaction txn(this->_journal);
+			moved = this->relocateFile(this->_cleanInode, cleaning, budget);
+		}
+
+		movedBlocks += moved;
+		if (moved > 0)
+		{
+			this->_cleanMoved = true;
+		}
+
+		if (moved < budget)
+		{
+			this->_cleanInode++;
+		}
+	}
+
+	this->_cleanerBlocksMoved += movedBlocks;
+	this->_cleanerNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+
+	return more;
+}
+
+
+/**
+ @brief		Picks the victim segments of a cleaning pass: the least used ones that are neither free, nor the log's
+			current segment, nor more than CLEAN_MAX_USED percent used, nor left as they were by an earlier pass.
+ @return	False if there is no segment worth cleaning
+ */
+bool MyFs::pickVictims()
+{
+	std::vector<uint32_t> used;
+	this->_allocator.segmentUsage(used);
+	uint32_t logSegment = this->_allocator.logSegment();
+
+	std::vector<std::pair<uint32_t, uint32_t>> candidates;		// <used blocks, segment>
+	for (uint32_t segment = 0; segment < used.size(); segment++)
+	{
+		std::unordered_map<uint32_t, uint32_t>::const_iterator stuck = this->_cleanStuck.find(segment);
+		if (segment == logSegment || used[segment] == 0 ||
+			used[segment] * 100 > BlockAllocator::SEGMENT_BLOCKS * CLEAN_MAX_USED ||
+			(stuck != this->_cleanStuck.end() && stuck->second == used[segment]))
+		{
+			continue;
+		}
+		candidates.push_back({ used[segment], segment });
+	}
+
+	size_t count = std::min<size_t>(candidates.size(), CLEAN_PASS_SEGMENTS);
+	std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+
+	this->_cleanVictims.clear();
+	for (size_t i = 0; i < count; i++)
+	{
+		this->_cleanVictims.push_back(candidates[i].second);
+	}
+	std::sort(this->_cleanVictims.begin(), this->_cleanVictims.end());
+
+	return !this->_cleanVictims.empty();
+}
+
+
+/**
+ @brief		Starts the cleaner thread, unless it is running already. It takes a first look right away, the log may be
+			short of free segments already.
+ @return	void
+ */
+void MyFs::startCleaner()
+{
+	std::lock_guard<std::mutex> control(this->_cleanerControl);
+	if (this->_cleaner.joinable())
+	{
+		return;
+	}
+
+	this->_cleanerRunning = true;
+	this->_cleanerWanted = true;
+	this->_cleanerRetryAt = 0;
+	this->_cleaner = std::thread(&MyFs::runCleaner, this);
+}
+
+
+/**
+ @brief		Stops the cleaner thread, after the step it is running. The caller holds none of the file system locks.
+ @return	void
+ */
+void MyFs::stopCleaner()
+{
+	std::lock_guard<std::mutex> control(this->_cleanerControl);
+	if (!this->_cleaner.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->_cleanerMutex);
+		this->_cleanerRunning = false;
+	}
+	this->_cleanerWake.notify_one();
+	this->_cleaner.join();
+}
+
+
+// Asks the cleaner thread for a round of cleaning
+void MyFs::wakeCleaner()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->_cleanerMutex);
+		this->_cleanerWanted = true;
+	}
+	this->_cleanerWake.notify_one();
+}
+
+
+/**
+ @brief		The cleaner thread. Every time it is woken it cleans step by step, the other operations going on between
+			the steps, until 1/CLEANER_HIGH_WATER of the segments are free. A round that gets nowhere holds off the
+			next one until the log has taken another segment's worth of blocks.
+ @return	void
+ */
+void MyFs::runCleaner()
+{
+	std::unique_lock<std::mutex> lock(this->_cleanerMutex);
+
+	while (true)
+	{
+		this->_cleanerWake.wait(lock, [this]() { return !this->_cleanerRunning || this->_cleanerWanted; });
+		if (!this->_cleanerRunning)
+		{
+			return;
+		}
+		this->_cleanerWanted = false;
+		lock.unlock();
+
+		bool progress = true;
+		try
+		{
+			uint32_t moved;
+			while (progress && this->_cleanerRunning &&
+				this->_allocator.freeSegments() * CLEANER_HIGH_WATER < this->_allocator.segmentCount())
+			{
+				progress = this->clean_step(COMPACT_STEP_BLOCKS, moved);
+			}
+		}
+		catch (const std::exception&)
+		{
+			progress = false;		// Out of space for the copies, or a device error
+		}
+
+		if (!progress)
+		{
+			this->_cleanerRetryAt = this->_logBlocks + BlockAllocator::SEGMENT_BLOCKS;
+		}
+
+		lock.lock();
+	}
+}
+
+
+/**
+ @brief		Converts a version 0x06 instance (16 bytes header, table right after it) in place by moving the table
+			behind the larger header. The bitmap stays where it was, the journal, the inline records and the inode
+			map are taken from the free space.
+ @param		header		The header found on the device
+ @return	void
+ */
+void MyFs::migrateTableLocation(const struct myfs_header& header)
+{
+	if (TABLE_START_ADDRESS + (header.fileCount * TABLE_ENTRY_SIZE) > TABLE_END_ADDRESS)
+	{
+		throw std::runtime_error(RED "Can't migrate, the files table is too full for the new header" RESET);
+	}
+
+	std::vector<char> table(header.fileCount * TABLE_ENTRY_SIZE);
+	this->blkdevsim->read(LEGACY_TABLE_START_ADDRESS, table.size(), table.data());
+	this->blkdevsim->write(TABLE_START_ADDRESS, table.size(), table.data());
+	this->clearTable(header.fileCount);
+
+	this->_fileCount = header.fileCount;
+	this->_allocator.load(BITMAP_START_ADDRESS, header.blockCount);
+	this->createJournal(0);
+	this->createInlineArea(0);
+	this->createInodeMap(0);
+	this->writeHeader();
+}
+
+
+/**
+ @brief		Converts a version 0x07 instance in place by giving it a journal region, inline records and an inode
+			map taken from the free space.
+ @param		header		The header found on the device
+ @return	void
+ */
+void MyFs::migrateJournal(const struct myfs_header& header)
+{
+	if ((uint64_t)header.blockCount * BLOCK_SIZE > this->blkdevsim->size())
+	{
+		throw std::runtime_error(RED "The device is smaller than the file system on it" RESET);
+	}
+
+	// Slots past the file count may hold leftovers of the table move from version 0x06
+	this->clearTable(header.fileCount);
+
+	this->_fileCount = header.fileCount;
+	this->_allocator.load(header.bitmapAddress, header.blockCount);
+	this->createJournal(0);
+	this->createInlineArea(0);
+	this->createInodeMap(0);
+	this->writeHeader();
+}
+
+
+/**
+ @brief		Allocates a contiguous journal region and starts an empty journal in it.
+ @param		goal		The block the region should preferably start at (0 for no preference)
+ @return	void
+ */
+void MyFs::createJournal(uint32_t goal)
+{
+	BlockAllocator::extent_list region;
+	this->_allocator.allocate(Journal::DEFAULT_BLOCKS, goal, region);
+
+	if (region.size() != 1)
+	{
+		for (const BlockAllocator::extent& ext : region)
+		{
+			this->_allocator.release(ext);
+		}
+		throw std::runtime_error(RED "Not enough contiguous space for the journal" RESET);
+	}
+
+	this->_journal.format(blockAddress(region.front().start), region.front().length);
+}
+
+
+/**
+ @brief		Allocates a contiguous region for the inline records of an instance that didn't have them.
+			No entry is inline yet, so the region isn't cleared.
+ @param		goal		The block the region should preferably start at (0 for no preference)
+ @return	void
+ */
+void MyFs::createInlineArea(uint32_t goal)
+{
+	BlockAllocator::extent_list region;
+	this->_allocator.allocate(blocksFor(INLINE_AREA_SIZE), goal, region);
+
+	if (region.size() != 1)
+	{
+		for (const BlockAllocator::extent& ext : region)
+		{
+			this->_allocator.release(ext);
+		}
+		throw std::runtime_error(RED "Not enough contiguous space for the inline records" RESET);
+	}
+
+	this->_inlineAddress = blockAddress(region.front().start);
+}
+
+
+/**
+ @brief		Allocates an empty inode map. It is on the device before the header points at it.
+ @param		goal		The block the map should preferably start at (0 for no preference)
+ @return	void
+ */
+void MyFs::createInodeMap(uint32_t goal)
+{
+	uint32_t start = this->allocateRegion(INODE_MAP_BLOCKS, goal, RED "Not enough contiguous space for the inode map" RESET);
+
+	std::vector<char> zeros((size_t)INODE_MAP_BLOCKS * BLOCK_SIZE, '\0');
+	this->blkdevsim->write(blockAddress(start), zeros.size(), zeros.data());
+	this->blkdevsim->flush(blockAddress(start), zeros.size());
+
+	this->_inodeMap = start;
+	this->_inodeChunks.assign(MAX_INODE_CHUNKS, 0);
+	this->_dedupChunks.clear();
+}
+
+
+/**
+ @brief		Reads the inode map into memory, through the journal. The dedup index chunks at its end are moved out of
+			the inode chunks.
+ @param		dedupChunks		Whether the map lists dedup index chunks, older versions have none
+ @return	void
+ */
+void MyFs::loadInodeMap(bool dedupChunks)
+{
+	this->_inodeChunks.assign(MAX_INODE_CHUNKS, 0);
+	this->_dedupChunks.clear();
+
+	if (this->_inodeMap == 0)
+	{
+		return;
+	}
+
+	this->_journal.read(blockAddress(this->_inodeMap), MAX_INODE_CHUNKS * sizeof(uint32_t), (char *)this->_inodeChunks.data());
+
+	for (uint32_t chunk = MAX_INODE_CHUNKS; dedupChunks && chunk > 0 && this->_inodeChunks[chunk - 1] != 0; chunk--)
+	{
+		this->_dedupChunks.push_back(this->_inodeChunks[chunk - 1]);
+		this->_inodeChunks[chunk - 1] = 0;
+	}
+}
+
+
+/**
+ @brief		Takes an inode chunk for the given part of the inodes past the table, unless it already has one. The chunk
+			is cleared like file data, so it is on the device before the map entry pointing at it commits. The caller
+			holds the table mutex and a transaction.
+ @param		chunk		The index of the chunk in the inode map
+ @return	void
+ */
+void MyFs::addInodeChunk(uint32_t chunk)
+{
+	static const char zeros[INODE_CHUNK_BLOCKS * BLOCK_SIZE] = { 0 };
+
+	// A free entry is left before the dedup index chunks, where they end
+	if (chunk + 1 >= MAX_INODE_CHUNKS - this->_dedupChunks.size())
+	{
+		throw std::runtime_error(RED "Files table is full" RESET);
+	}
+	if (this->_inodeChunks[chunk] != 0)
+	{
+		return;
+	}
+
+	uint32_t start = this->allocateRegion(INODE_CHUNK_BLOCKS, 0, RED "Not enough contiguous space for the inode table" RESET);
+	this->blkdevsim->write(blockAddress(start), sizeof(zeros), zeros);
+	this->_journal.dirty(blockAddress(start), sizeof(zeros));
+
+	this->_journal.write(blockAddress(this->_inodeMap) + chunk * sizeof(uint32_t), sizeof(start), (const char *)&start);
+	this->_inodeChunks[chunk] = start;
+}
+
+
+/**
+ @brief		Allocates a contiguous run of blocks.
+ @param		count		The number of blocks
+ @param		goal		The block the run should preferably start at (0 for no preference)
+ @param		error		The message to throw with when the free space has no such run
+ @return	The first block of the run
+ */
+uint32_t MyFs::allocateRegion(uint32_t count, uint32_t goal, const char *error)
+{
+	BlockAllocator::extent_list region;
+	this->allocateBlocks(count, goal, region);
+
+	if (region.size() != 1)
+	{
+		for (const BlockAllocator::extent& ext : region)
+		{
+			this->_allocator.release(ext);
+		}
+		throw std::runtime_error(error);
+	}
+
+	return region.front().start;
+}
+
+
+/**
+ @brief		Zeroes the files table from the given slot on, so no stale entry looks used.
+ @param		firstInode		The first slot to clear
+ @return	void
+ */
+void MyFs::clearTable(uint32_t firstInode)
+{
+	static const char zeros[TABLE_END_ADDRESS - TABLE_START_ADDRESS] = { 0 };
+
+	if (firstInode < TABLE_SLOTS)
+	{
+		this->blkdevsim->write(inodeAddress(firstInode), (TABLE_SLOTS - firstInode) * TABLE_ENTRY_SIZE, zeros);
+	}
+}
+
+
+/**
+ @brief		Rebuilds what isn't journaled after a crash: the block bitmap and the file count are derived from the
+			files table, the inode chunks and the snapshots, which the journal replay left consistent.
+ @return	void
+ */
+void MyFs::recover()
+{
+	uint32_t blockCount = this->_allocator.blockCount();
+	uint64_t bitmapAddress = this->_allocator.bitmapAddress();
+
+	this->_allocator.format(bitmapAddress, blockCount, blocksFor(TABLE_END_ADDRESS));
+	this->_allocator.reserve({ (uint32_t)(bitmapAddress / BLOCK_SIZE), blocksFor(BlockAllocator::bitmapSize(blockCount)) });
+	this->_allocator.reserve({ (uint32_t)(this->_journal.address() / BLOCK_SIZE), this->_journal.blocks() });
+	if (this->_inlineAddress != 0)
+	{
+		this->_allocator.reserve({ (uint32_t)(this->_inlineAddress / BLOCK_SIZE), blocksFor(INLINE_AREA_SIZE) });
+	}
+	if (this->_checksumDevice.enabled())
+	{
+		this->_allocator.reserve(checksumTable(blockCount));
+	}
+
+	// The chunks are taken in inode order, the inodes end with the first missing one
+	uint32_t inodeCount = TABLE_SLOTS;
+	if (this->_inodeMap != 0)
+	{
+		this->_allocator.reserve({ this->_inodeMap, INODE_MAP_BLOCKS });
+		for (uint32_t chunk = 0; chunk < MAX_INODE_CHUNKS && this->_inodeChunks[chunk] != 0; chunk++)
+		{
+			this->_allocator.reserve({ this->_inodeChunks[chunk], INODE_CHUNK_BLOCKS });
+			inodeCount += INODE_CHUNK_INODES;
+		}
+	}
+	for (uint32_t chunk : this->_dedupChunks)
+	{
+		this->_allocator.reserve({ chunk, DEDUP_CHUNK_BLOCKS });
+	}
+
+	this->_fileCount = 0;
+
+	BlockAllocator::extent_list extents;
+	BlockAllocator::extent_list mapBlocks;
+	std::unordered_set<uint32_t> sharedBlocks;		// The shared blocks seen so far, reserved only once
+
+	// Reserves the blocks of a file, or of a file in a snapshot (shared is true for both then)
+	auto reserveFile = [&](const struct table_entry& entry, bool shared)
+	{
+		this->loadExtents(entry, extents);
+		this->loadMapBlocks(entry, mapBlocks);
+		extents.insert(extents.end(), mapBlocks.begin(), mapBlocks.end());
+
+		for (const BlockAllocator::extent& ext : extents)
+		{
+			if (!shared)
+			{
+				this->_allocator.reserve(ext);
+				continue;
+			}
+
+			for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+			{
+				if (sharedBlocks.insert(block).second)
+				{
+					this->_allocator.reserve({ block, 1 });
+				}
+			}
+		}
+	};
+
+	for (uint32_t inode = 0; inode < inodeCount; inode++)
+	{
+		struct table_entry entry = this->readTableEntry(inode).second;
+		if (!(entry.flags & ENTRY_FLAG_USED))
+		{
+			continue;
+		}
+
+		this->_fileCount = inode + 1;
+		reserveFile(entry, entry.flags & (ENTRY_FLAG_DEDUP | ENTRY_FLAG_SNAPSHOT));
+	}
+
+	if (this->_snapshotList != 0)
+	{
+		struct snapshot_list list;
+		this->readSnapshotList(list);
+		this->_allocator.reserve({ this->_snapshotList, 1 });
+
+		std::vector<uint32_t> chunks;
+		for (uint32_t i = 0; i < list.count; i++)
+		{
+			this->_allocator.reserve({ list.snapshots[i].tableBlock, SNAPSHOT_BLOCKS });
+
+			this->readSnapshotChunks(list.snapshots[i], chunks);
+			if (list.snapshots[i].inodeMap != 0)
+			{
+				this->_allocator.reserve({ list.snapshots[i].inodeMap, INODE_MAP_BLOCKS });
+				for (uint32_t chunk = 0; chunk < chunksFor(list.snapshots[i].fileCount); chunk++)
+				{
+					this->_allocator.reserve({ chunks[chunk], INODE_CHUNK_BLOCKS });
+				}
+			}
+
+			for (uint32_t inode = 0; inode < list.snapshots[i].fileCount; inode++)
+			{
+				// An entry not marked ENTRY_FLAG_FROZEN uses the blocks of the live file, reserved with it
+				struct table_entry entry = this->readSnapshotEntry(list.snapshots[i], chunks, inode);
+				if ((entry.flags & ENTRY_FLAG_USED) && (entry.flags & ENTRY_FLAG_FROZEN))
+				{
+					reserveFile(entry, true);
+				}
+			}
+		}
+	}
+
+	this->_journal.checkpoint();
+}
+
+
+/**
+ @brief		Converts an instance using an older layout (version 0x03 "name|address|size" text entries or version 0x04
+			binary entries with fixed 1 KiB data slots, or the version 0x05 flat namespace) to the current layout.
+			The files are read into memory, the device is formatted and the files are written back into the root directory.
+ @param		header		The header found on the device
+ @return	void
+ */
+void MyFs::migrateLegacyInstance(const struct myfs_header& header)
+{
+	std::vector<std::pair<std::string, struct table_entry>> entries;		// <file name, legacy entry>
+
+	if (header.version == TEXT_TABLE_VERSION)
+	{
+		char fetchedFileCount[FILE_COUNT_SIZE + 1] = { 0 };
+		this->blkdevsim->read(FILE_COUNT_ADDRESS, FILE_COUNT_SIZE, fetchedFileCount);
+
+		int fileCount = 0;
+		try
+		{
+			fileCount = std::stoi(fetchedFileCount);
+		}
+		catch (const std::logic_error&)		// The old instance was never closed gracefully, nothing to migrate
+		{
+		}
+
+		for (int i = 0; i < fileCount && LEGACY_TABLE_START_ADDRESS + ((i + 1) * TABLE_ENTRY_SIZE) <= TABLE_END_ADDRESS; i++)
+		{
+			char textEntry[TABLE_ENTRY_SIZE];
+			this->blkdevsim->read(LEGACY_TABLE_START_ADDRESS + (i * TABLE_ENTRY_SIZE), TABLE_ENTRY_SIZE, textEntry);
+
+			std::vector<std::string> entryTokens = splitEntry(std::string(textEntry, strnlen(textEntry, TABLE_ENTRY_SIZE)));
+			if (entryTokens.size() != 3)
+			{
+				continue;		// Skipping a corrupted entry
+			}
+
+			struct table_entry entry;
+			memset(&entry, 0, sizeof(entry));
+			entry.address = std::stoi(entryTokens.at(FILE_ADDRESS_INDEX));
+			entry.size = std::stoi(entryTokens.at(FILE_SIZE_INDEX));
+
+			entries.emplace_back(entryTokens.at(FILE_NAME_INDEX), entry);
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < header.fileCount && LEGACY_TABLE_START_ADDRESS + ((i + 1) * TABLE_ENTRY_SIZE) <= TABLE_END_ADDRESS; i++)
+		{
+			struct table_entry entry;
+			this->blkdevsim->read(LEGACY_TABLE_START_ADDRESS + (i * TABLE_ENTRY_SIZE), TABLE_ENTRY_SIZE, (char *)&entry);
+
+			if (entry.flags & ENTRY_FLAG_USED)
+			{
+				entries.emplace_back(std::string(entry.name, strnlen(entry.name, MAX_FILE_NAME)), entry);
+			}
+		}
+	}
+
+	// Reading the contents out of the old data slots (or extents) before the format overwrites them
+	std::vector<std::string> contents;
+	for (const auto& entry : entries)
+	{
+		if (header.version == FLAT_TABLE_VERSION)
+		{
+			std::string content(entry.second.size, '\0');
+			this->readData(entry.second, &content[0]);
+			contents.push_back(content);
+		}
+		else
+		{
+			std::string content(std::min<uint32_t>(entry.second.size, LEGACY_SLOT_SIZE), '\0');
+			this->blkdevsim->read(entry.second.address, content.length(), &content[0]);
+			contents.push_back(content);
+		}
+	}
+
+	format();
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		// Flat namespace names could contain '/', which is a path separator now
+		std::replace(entries[i].first.begin(), entries[i].first.end(), '/', '_');
+		this->set_content(entries[i].first, contents[i]);
+	}
+}
+
+
+/**
+ @brief		Returns the address of the inode chunk holding the given inode, which is past the table.
+ @param		inode		The inode number
+ @return	The address of the chunk
+ */
+uint64_t MyFs::chunkAddress(uint32_t inode) const
+{
+	uint32_t chunk = (inode - TABLE_SLOTS) / INODE_CHUNK_INODES;
+
+	if (chunk >= this->_inodeChunks.size() || this->_inodeChunks[chunk] == 0)
+	{
+		throw std::runtime_error(RED "Corrupted inode number" RESET);
+	}
+
+	return blockAddress(this->_inodeChunks[chunk]);
+}
+
+
+/**
+ @brief		Returns the address of the table entry of the given inode, in the table or in its inode chunk.
+ @param		inode		The inode number
+ @return	The address of the inode table entry
+ */
+uint64_t MyFs::inodeAddress(uint32_t inode) const
+{
+	if (inode < TABLE_SLOTS)
+	{
+		return this->_tableAddress + (inode * TABLE_ENTRY_SIZE);
+	}
+
+	return this->chunkAddress(inode) + ((inode - TABLE_SLOTS) % INODE_CHUNK_INODES) * TABLE_ENTRY_SIZE;
+}
+
+
+/**
+ @brief		Returns the address of the inline record of the given inode, in the inline records or in its inode chunk.
+ @param		inode		The inode number
+ @return	The address of the inode's inline record
+ */
+uint64_t MyFs::inlineAddress(uint32_t inode) const
+{
+	if (inode < TABLE_SLOTS)
+	{
+		return this->_inlineAddress + ((uint64_t)inode * INLINE_DATA_SIZE);
+	}
+
+	return this->chunkAddress(inode) + INODE_CHUNK_TABLE_SIZE + ((inode - TABLE_SLOTS) % INODE_CHUNK_INODES) * INLINE_DATA_SIZE;
+}
+
+
+/**
+ @brief		Returns the number of inode chunks the given number of inodes needs.
+ @param		fileCount		The number of inodes
+ @return	The number of chunks
+ */
+uint32_t MyFs::chunksFor(uint32_t fileCount)
+{
+	return fileCount <= TABLE_SLOTS ? 0 : (fileCount - TABLE_SLOTS + INODE_CHUNK_INODES - 1) / INODE_CHUNK_INODES;
+}
+
+
+/**
+ @brief		Reads the table entry of the given inode.
+ @param		inode		The inode number
+ @return	The entry info of the inode
+ */
+MyFs::EntryInfo MyFs::readTableEntry(uint32_t inode)
+{
+	MyFs::EntryInfo entryInfo;
+	entryInfo.first = inode;
+	this->_journal.read(this->inodeAddress(inode), TABLE_ENTRY_SIZE, (char *)&entryInfo.second);
+
+	return entryInfo;
+}
+
+
+/**
+ @brief		Writes the given entry back to its place in the files table.
+ @param		entryInfo		The inode and the entry to write
+ @return	void
+ */
+void MyFs::writeTableEntry(const MyFs::EntryInfo& entryInfo)
+{
+	this->_journal.write(this->inodeAddress(entryInfo.first), TABLE_ENTRY_SIZE, (const char *)&entryInfo.second);
+}
+
+
+/**
+ @brief		Compares two dentry cache keys.
+ @param		other		The key to compare to
+ @return	True if both keys name the same entry, false otherwise.
+ */
+bool MyFs::dentry_key::operator==(const dentry_key& other) const
+{
+	return this->parent == other.parent && memcmp(this->name, other.name, MAX_FILE_NAME) == 0;
+}
+
+
+/**
+ @brief		Hashes a dentry cache key (FNV-1a over the parent inode and the name).
+ @param		key		The key to hash
+ @return	The hash of the key
+ */
+size_t MyFs::dentry_key_hash::operator()(const dentry_key& key) const
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char *bytes = (const unsigned char *)&key;
+
+	for (size_t i = 0; i < sizeof(key); i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+
+/**
+ @brief		Builds a dentry cache key without allocating.
+ @param		parent		The inode of the containing directory
+ @param		name		The entry name (doesn't have to be null terminated)
+ @param		length		The length of the name, at most MAX_FILE_NAME
+ @return	The key
+ */
+MyFs::dentry_key MyFs::makeDentryKey(uint32_t parent, const char *name, size_t length)
+{
+	dentry_key key;
+	memset(&key, 0, sizeof(key));
+	key.parent = parent;
+	memcpy(key.name, name, length);
+
+	return key;
+}
+
+
+// The data of a directory as its index (or the sorted entry array it was kept as before) reads and writes it, through
+// the journal. The caller holds the directory lock, exclusively with a transaction to change it.
+class MyFs::directory_store : public DirIndex::node_store
+{
+public:
+	directory_store(MyFs& fs_, const MyFs::EntryInfo& entryInfo_) : entryInfo(entryInfo_), fs(fs_)
+	{
+		this->reload();
+	}
+
+	uint32_t size() override
+	{
+		return this->entryInfo.second.size;
+	}
+
+	void read(uint32_t offset, uint32_t length, char *data) override
+	{
+		this->fs.readExtents(this->extents, offset, length, data, true);
+	}
+
+	void write(uint32_t offset, uint32_t length, const char *data) override
+	{
+		this->fs.writeExtents(this->extents, offset, length, data, true);
+	}
+
+	// Nothing is written past the old end, the index only reads the nodes it wrote
+	void grow(uint32_t size) override
+	{
+		this->fs.resizeExtents(this->entryInfo.second, this->extents, size);
+		this->entryInfo.second.size = size;
+		this->fs.writeTableEntry(this->entryInfo);
+	}
+
+	// Picks the entry up again after its data was replaced
+	void reload()
+	{
+		this->fs.loadExtents(this->entryInfo.second, this->extents);
+	}
+
+	MyFs::EntryInfo entryInfo;
+
+private:
+	MyFs& fs;
+	BlockAllocator::extent_list extents;
+};
+
+
+/**
+ @brief		Reads all the entries of the given directory into the dentry cache, once per directory. A directory with
+			more than DENTRY_LOAD_LIMIT entries is only marked large, its names are looked up one at a time.
+			Takes the directory lock shared and the dentry cache lock, so the caller must hold neither.
+ @param		directory		The inode of the directory
+ @return	void
+ */
+void MyFs::loadDirectory(uint32_t directory)
+{
+	{
+		std::shared_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+		if (this->_loadedDirectories.count(directory) || this->_largeDirectories.count(directory))
+		{
+			return;
+		}
+	}
+
+	dir_entries entries;
+	bool large = false;
+	std::shared_lock<std::shared_mutex> directoryLock(this->inodeLock(directory));
+
+	MyFs::EntryInfo directoryInfo = this->readTableEntry(directory);
+	if (directoryInfo.second.flags & ENTRY_FLAG_DIRECTORY)
+	{
+		directory_store store(*this, directoryInfo);
+		large = DirIndex::isIndex(store) && DirIndex(store).count() > DENTRY_LOAD_LIMIT;
+		if (!large)
+		{
+			this->readDirectory(store, entries);
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+	if (large)
+	{
+		this->_largeDirectories.insert(directory);
+	}
+	else if (this->_loadedDirectories.insert(directory).second)
+	{
+		Metrics::count(Metrics::COUNTER_DIRECTORY_LOADS);
+		Metrics::count(Metrics::COUNTER_ENTRIES_SCANNED, entries.size());
+		for (const dir_entry& entry : entries)
+		{
+			this->_dentryCache[makeDentryKey(directory, entry.name, strnlen(entry.name, MAX_FILE_NAME))] = entry.inode;
+		}
+	}
+}
+
+
+/**
+ @brief		Looks up a name inside a directory through the dentry cache. A name of a large directory that isn't
+			cached yet is searched for in the directory's index, and cached when found.
+ @param		parent		The inode of the directory to search in
+ @param		name		The name to search for (doesn't have to be null terminated)
+ @param		length		The length of the name
+ @return	The inode of the entry, or INODE_NOT_FOUND
+ */
+uint32_t MyFs::lookup(uint32_t parent, const char *name, size_t length)
+{
+	if (length > MAX_FILE_NAME)
+	{
+		return INODE_NOT_FOUND;
+	}
+
+	Metrics::count(Metrics::COUNTER_PATH_LOOKUPS);
+	this->loadDirectory(parent);
+
+	dentry_key key = makeDentryKey(parent, name, length);
+	{
+		std::shared_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+		auto it = this->_dentryCache.find(key);
+		if (it != this->_dentryCache.end())
+		{
+			return it->second;
+		}
+		if (!this->_largeDirectories.count(parent))
+		{
+			return INODE_NOT_FOUND;
+		}
+	}
+
+	// Cached before the directory is unlocked, so a concurrent change to the name can't be overwritten
+	std::shared_lock<std::shared_mutex> directoryLock(this->inodeLock(parent));
+	uint32_t inode = this->findDirEntry(parent, name, length);
+	if (inode != INODE_NOT_FOUND)
+	{
+		std::unique_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+		this->_dentryCache[key] = inode;
+	}
+
+	return inode;
+}
+
+
+/**
+ @brief		Resolves a path ("/dir/file", "dir/file" and "/" are all accepted) to an inode, one component at a time.
+ @param		path_str		The path to resolve
+ @return	The inode the path points to, or INODE_NOT_FOUND
+ */
+uint32_t MyFs::resolvePath(std::string_view path_str)
+{
+	uint32_t inode = ROOT_INODE;
+	size_t position = 0;
+
+	while (position < path_str.length() && inode != INODE_NOT_FOUND)
+	{
+		if (path_str[position] == '/')
+		{
+			position++;
+			continue;
+		}
+
+		size_t end = path_str.find('/', position);
+		if (end == std::string::npos)
+		{
+			end = path_str.length();
+		}
+
+		inode = this->lookup(inode, path_str.data() + position, end - position);
+		position = end;
+	}
+
+	return inode;
+}
+
+
+/**
+ @brief		Resolves the directory containing the last component of the given path.
+ @param		path_str		The path of the file
+ @param		fileName		Set to the last component of the path
+ @return	The inode of the containing directory
+ */
+uint32_t MyFs::resolveParent(std::string_view path_str, std::string_view& fileName)
+{
+	size_t end = path_str.find_last_not_of('/');
+	if (end == std::string::npos)
+	{
+		throw std::runtime_error(RED "Invalid path" RESET);
+	}
+
+	size_t start = path_str.find_last_of('/', end);
+	start = (start == std::string::npos) ? 0 : start + 1;
+	fileName = path_str.substr(start, end - start + 1);
+
+	uint32_t parent = this->resolvePath(path_str.substr(0, start));
+	if (parent == INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "Directory not found" RESET);
+	}
+
+	std::shared_lock<std::shared_mutex> parentLock(this->inodeLock(parent));
+	if (!(this->readTableEntry(parent).second.flags & ENTRY_FLAG_DIRECTORY))
+	{
+		throw std::runtime_error(RED "Not a directory" RESET);
+	}
+
+	return parent;
+}
+
+
+/**
+ @brief		Reads all the entries of the given directory, sorted by name. The caller holds the directory lock.
+ @param		store			The directory data
+ @param		entries			Filled with the directory entries
+ @return	void
+ */
+void MyFs::readDirectory(directory_store& store, dir_entries& entries)
+{
+	entries.clear();
+
+	if (!DirIndex::isIndex(store))
+	{
+		entries.resize(store.size() / sizeof(dir_entry));
+		store.read(0, entries.size() * sizeof(dir_entry), (char *)entries.data());
+		return;
+	}
+
+	DirIndex index(store);
+	DirIndex::node leaf;
+	uint32_t position;
+	char start[MAX_FILE_NAME] = { 0 };
+
+	entries.reserve(index.count());
+	if (index.seek(start, leaf, position))
+	{
+		do
+		{
+			entries.insert(entries.end(), leaf.entries + position, leaf.entries + leaf.count);
+			position = 0;
+		} while (index.next(leaf));
+	}
+}
+
+
+/**
+ @brief		Makes a directory ready to be changed through its index. A directory still kept as a sorted entry array,
+			or sharing its blocks with a snapshot, is rewritten as an index on new blocks. The caller holds the
+			directory lock exclusively and a transaction.
+ @param		store			The directory data, reloaded when rewritten
+ @return	void
+ */
+void MyFs::prepareDirectory(directory_store& store)
+{
+	this->shareWithSnapshots(store.entryInfo);
+
+	bool shared = store.entryInfo.second.flags & (ENTRY_FLAG_SNAPSHOT | ENTRY_FLAG_DEDUP | ENTRY_FLAG_COMPRESSED);
+	if (DirIndex::isIndex(store) && !shared)
+	{
+		return;
+	}
+
+	dir_entries entries;
+	this->readDirectory(store, entries);
+
+	DirIndex::image data;
+	DirIndex::build(entries.data(), entries.size(), data);
+	this->writeData(store.entryInfo, data.data(), data.size(), 0);
+	store.reload();
+}
+
+
+/**
+ @brief		Searches a directory for a name, without the dentry cache. The caller holds the directory lock.
+ @param		directory		The inode of the directory
+ @param		name			The name to search for (doesn't have to be null terminated)
+ @param		length			The length of the name, at most MAX_FILE_NAME
+ @return	The inode of the entry, or INODE_NOT_FOUND
+ */
+uint32_t MyFs::findDirEntry(uint32_t directory, const char *name, size_t length)
+{
+	directory_store store(*this, this->readTableEntry(directory));
+
+	if (DirIndex::isIndex(store))
+	{
+		uint32_t inode = DirIndex(store).find(name, length);
+		return inode == DirIndex::NOT_FOUND ? INODE_NOT_FOUND : inode;
+	}
+
+	dir_entries entries;
+	this->readDirectory(store, entries);
+
+	char key[MAX_FILE_NAME] = { 0 };
+	memcpy(key, name, length);
+	for (const dir_entry& entry : entries)
+	{
+		if (memcmp(entry.name, key, MAX_FILE_NAME) == 0)
+		{
+			return entry.inode;
+		}
+	}
+
+	return INODE_NOT_FOUND;
+}
+
+
+/**
+ @brief		Adds an entry to the index of the given directory and to the dentry cache.
+			The caller holds the directory lock exclusively and a transaction.
+ @param		directory		The inode of the directory
+ @param		name			The name of the new entry
+ @param		inode			The inode the new entry points to
+ @return	void
+ */
+void MyFs::insertDirEntry(uint32_t directory, std::string_view name, uint32_t inode)
+{
+	directory_store store(*this, this->readTableEntry(directory));
+	this->prepareDirectory(store);
+
+	dir_entry newEntry;
+	memset(&newEntry, 0, sizeof(newEntry));
+	memcpy(newEntry.name, name.data(), name.length());
+	newEntry.inode = inode;
+
+	DirIndex index(store);
+	if (!index.insert(newEntry))
+	{
+		throw std::runtime_error(RED "A file with this name already exists" RESET);
+	}
+
+	std::unique_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+	this->_dentryCache[makeDentryKey(directory, name.data(), name.length())] = inode;
+
+	// Past the load limit the cache stops being complete for the directory, the names it misses are searched for
+	if (index.count() > DENTRY_LOAD_LIMIT && this->_loadedDirectories.erase(directory))
+	{
+		this->_largeDirectories.insert(directory);
+	}
+}
+
+
+/**
+ @brief		Removes an entry from the index of the given directory and from the dentry cache.
+			The caller holds the directory lock exclusively and a transaction.
+ @param		directory		The inode of the directory
+ @param		name			The name of the entry
+ @return	void
+ */
+void MyFs::removeDirEntry(uint32_t directory, std::string_view name)
+{
+	directory_store store(*this, this->readTableEntry(directory));
+	this->prepareDirectory(store);
+
+	if (!DirIndex(store).remove(name.data(), name.length()))
+	{
+		throw std::runtime_error(RED "File not found" RESET);
+	}
+
+	std::unique_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+	this->_dentryCache.erase(makeDentryKey(directory, name.data(), name.length()));
+}
+
+
+/**
+ @brief		returns the entry info of the given file in the system.
+ @param		path_str		The path of the file to search for its entry info
+ @return	The entry info of the given file in the system.
+ */
+MyFs::EntryInfo MyFs::getEntryInfo(const std::string& path_str)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_LOOKUP);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	uint32_t inode = this->resolvePath(path_str);
+
+	if (inode == INODE_NOT_FOUND)
+	{
+		MyFs::EntryInfo entryInfo;
+		entryInfo.first = ENTRY_NOT_FOUND;
+		memset(&entryInfo.second, 0, sizeof(entryInfo.second));
+		return entryInfo;
+	}
+
+	std::shared_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	return this->readTableEntry(inode);
+}
+
+
+/**
+ @brief		Creates a new entry using the parameters and adds it to the files table, or to a new inode chunk past it.
+			The inode is taken atomically, the caller is the one linking the entry into its directory.
+ @param		fileName		The name of the file to use in the entry
+ @param		parent			The inode of the directory containing the file
+ @param		flags			Extra entry flags (ENTRY_FLAG_DIRECTORY)
+ @return	The inode of the new entry
+ */
+int MyFs::addTableEntry(std::string_view fileName, const uint32_t& parent, const uint8_t& flags)
+{
+	std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+
+	// A removed inode is reused first. Past the table, the first inode of every chunk takes the chunk.
+	uint32_t inode = this->_freeInodes.empty() ? this->_fileCount : this->_freeInodes.back();
+	if (inode >= TABLE_SLOTS)
+	{
+		this->addInodeChunk((inode - TABLE_SLOTS) / INODE_CHUNK_INODES);
+	}
+
+	struct table_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	fileName.copy(entry.name, MAX_FILE_NAME);		// Not null terminated when the name fills the field
+	entry.flags = ENTRY_FLAG_USED | flags;
+	entry.parent = parent & 0xFFFF;
+	entry.parentHigh = parent >> 16;
+
+	// Writing a new entry to the table
+	this->_journal.write(this->inodeAddress(inode), TABLE_ENTRY_SIZE, (const char *)&entry);
+
+	if (inode == (uint32_t)this->_fileCount)
+	{
+		this->_fileCount++;
+	}
+	else
+	{
+		this->_freeInodes.pop_back();
+	}
+
+	return inode;
+}
+
+
+/**
+ @brief		Clears the table entry of an inode whose file is gone and makes the inode the next one reused.
+			The caller holds a transaction.
+ @param		inode		The inode
+ @return	void
+ */
+void MyFs::releaseInode(uint32_t inode)
+{
+	MyFs::EntryInfo entryInfo;
+	entryInfo.first = inode;
+	memset(&entryInfo.second, 0, sizeof(entryInfo.second));
+	this->writeTableEntry(entryInfo);
+
+	std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+	this->_freeInodes.insert(std::upper_bound(this->_freeInodes.begin(), this->_freeInodes.end(), inode,
+		std::greater<uint32_t>()), inode);
+}
+
+
+/**
+ @brief		Rebuilds the free inodes from the table - the unused ones below the file count.
+ @return	void
+ */
+void MyFs::loadFreeInodes()
+{
+	std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+	this->_freeInodes.clear();
+
+	for (int inode = this->_fileCount - 1; inode >= 0; inode--)
+	{
+		if (!(this->readTableEntry(inode).second.flags & ENTRY_FLAG_USED))
+		{
+			this->_freeInodes.push_back(inode);
+		}
+	}
+}
+
+
+/**
+ @brief		Checks if the given file exists in the system.
+ @param		path_str		The path of the file to check if it exists
+ @return	True if the file exists, false otherwise.
+ */
+bool MyFs::isFileExists(const std::string& path_str)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_LOOKUP);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	return this->resolvePath(path_str) != INODE_NOT_FOUND;
+}
+
+
+/**
+ @brief		Creates a new file in the system, allocates it an entry in the files table and links it into its directory.
+ @param		path_str		The path of the file to create
+ @param		directory		Whether the file is a directory or not
+ @return	void
+ */
+void MyFs::create_file(const std::string& path_str, const bool& directory)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_CREATE);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	bool created = false;
+	this->createEntry(path_str, directory, created);
+
+	if (!created)		// Checking if the file name already exists in the directory
+	{
+		throw std::runtime_error(RED "A file with this name already exists" RESET);
+	}
+}
+
+
+/**
+ @brief		Creates a file unless its directory already has an entry with that name. The existence check and the
+			insertion happen under the directory lock, so concurrent creators of one name end up with a single file.
+ @param		path_str		The path of the file to create
+ @param		directory		Whether the file is a directory or not
+ @param		created			Set to whether a new file was created
+ @return	The inode of the new file, or of the entry that already existed
+ */
+uint32_t MyFs::createEntry(const std::string& path_str, bool directory, bool& created)
+{
+	std::string_view fileName;
+	uint32_t parent = this->resolveParent(path_str, fileName);
+
+	if (fileName.length() > MAX_FILE_NAME)		// Checking if the file name length is valid
+	{
+		throw std::runtime_error(RED "File name is too long" RESET);
+	}
+
+	// Filling the dentry cache before taking the directory lock, it is complete for the directory from now on
+	// (unless the directory is large, its index is searched then)
+	this->loadDirectory(parent);
+	std::unique_lock<std::shared_mutex> parentLock(this->inodeLock(parent));
+	Journal::transaction txn(this->_journal);		// Ends before the directory is unlocked
+
+	uint32_t existing = INODE_NOT_FOUND;
+	bool loaded;
+	{
+		std::shared_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+		auto it = this->_dentryCache.find(makeDentryKey(parent, fileName.data(), fileName.length()));
+		if (it != this->_dentryCache.end())
+		{
+			existing = it->second;
+		}
+		loaded = this->_loadedDirectories.count(parent);
+	}
+	if (existing == INODE_NOT_FOUND && !loaded)
+	{
+		existing = this->findDirEntry(parent, fileName.data(), fileName.length());
+	}
+
+	created = existing == INODE_NOT_FOUND;
+	if (!created)
+	{
+		return existing;
+	}
+
+	int inode = this->addTableEntry(fileName, parent, directory ? ENTRY_FLAG_DIRECTORY : 0);
+
+	try
+	{
+		this->insertDirEntry(parent, fileName, inode);
+	}
+	catch (const std::runtime_error&)
+	{
+		this->releaseInode(inode);
+		throw;
+	}
+
+	return inode;
+}
+
+
+/**
+ @brief		Removes a file, or an empty directory. Its blocks are freed with the next checkpoint (and punched out of
+			the device then), and its inode is reused by the next file created. Every other operation is held off
+			while the file is removed, the file and its directory change together.
+ @param		path_str		The path of the file to remove
+ @return	void
+ */
+void MyFs::remove_file(const std::string& path_str)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_REMOVE);
+
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	std::string_view fileName;
+	uint32_t parent = this->resolveParent(path_str, fileName);
+	uint32_t inode = this->lookup(parent, fileName.data(), fileName.length());
+
+	if (inode == INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "File not found" RESET);
+	}
+
+	MyFs::EntryInfo entryInfo = this->readTableEntry(inode);
+	if (entryInfo.second.flags & ENTRY_FLAG_DIRECTORY)
+	{
+		directory_store store(*this, entryInfo);
+		bool empty = DirIndex::isIndex(store) ? DirIndex(store).count() == 0 : store.size() == 0;
+		if (!empty)
+		{
+			throw std::runtime_error(RED "Directory not empty" RESET);
+		}
+	}
+
+	Journal::transaction txn(this->_journal);
+	this->removeDirEntry(parent, fileName);
+	this->shareWithSnapshots(entryInfo);
+
+	BlockAllocator::extent_list extents;
+	BlockAllocator::extent_list mapBlocks;
+	this->loadExtents(entryInfo.second, extents);
+	this->loadMapBlocks(entryInfo.second, mapBlocks);
+	extents.insert(extents.end(), mapBlocks.begin(), mapBlocks.end());
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		this->releaseBlocks(ext);
+	}
+
+	this->releaseInode(inode);
+
+	std::unique_lock<std::shared_mutex> dentryLock(this->_dentryLock);
+	this->_loadedDirectories.erase(inode);
+	this->_largeDirectories.erase(inode);
+}
+
+
+/**
+ @brief		Moves a file to a new path, in the same directory or another one. The file keeps its inode and its data.
+			The new path must not exist yet, and a directory can't be moved under itself. Every other operation is
+			held off while the file is moved, both directories change together.
+ @param		old_path		The current path of the file
+ @param		new_path		The path to move it to
+ @return	void
+ */
+void MyFs::rename_file(const std::string& old_path, const std::string& new_path)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_RENAME);
+
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	std::string_view oldName;
+	uint32_t oldParent = this->resolveParent(old_path, oldName);
+	uint32_t inode = this->lookup(oldParent, oldName.data(), oldName.length());
+
+	if (inode == INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "File not found" RESET);
+	}
+
+	std::string_view newName;
+	uint32_t newParent = this->resolveParent(new_path, newName);
+
+	if (newName.length() > MAX_FILE_NAME)
+	{
+		throw std::runtime_error(RED "File name is too long" RESET);
+	}
+
+	uint32_t existing = this->lookup(newParent, newName.data(), newName.length());
+	if (existing == inode && newParent == oldParent && newName == oldName)
+	{
+		return;
+	}
+	if (existing != INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "A file with this name already exists" RESET);
+	}
+
+	// Walking up from the new directory, the moved directory mustn't be on the way to the root
+	MyFs::EntryInfo entryInfo = this->readTableEntry(inode);
+	if (entryInfo.second.flags & ENTRY_FLAG_DIRECTORY)
+	{
+		for (uint32_t ancestor = newParent; ; )
+		{
+			if (ancestor == inode)
+			{
+				throw std::runtime_error(RED "A directory can't be moved into itself" RESET);
+			}
+			if (ancestor == ROOT_INODE)
+			{
+				break;
+			}
+
+			struct table_entry ancestorEntry = this->readTableEntry(ancestor).second;
+			ancestor = ancestorEntry.parent | ((uint32_t)ancestorEntry.parentHigh << 16);
+		}
+	}
+
+	// Linked under the new name first, so a failure leaves the file where it was
+	Journal::transaction txn(this->_journal);
+	this->insertDirEntry(newParent, newName, inode);
+	this->removeDirEntry(oldParent, oldName);
+
+	memset(entryInfo.second.name, 0, MAX_FILE_NAME);
+	newName.copy(entryInfo.second.name, MAX_FILE_NAME);
+	entryInfo.second.parent = newParent & 0xFFFF;
+	entryInfo.second.parentHigh = newParent >> 16;
+	this->writeTableEntry(entryInfo);
+}
+
+
+/**
+ @brief		Returns the number of blocks needed to hold size bytes.
+ @param		size		The size in bytes
+ @return	The number of blocks
+ */
+uint32_t MyFs::blocksFor(uint64_t size)
+{
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+
+/**
+ @brief		Returns the device address of the given block.
+ @param		block		The block number
+ @return	The address of the block
+ */
+uint64_t MyFs::blockAddress(uint32_t block)
+{
+	return (uint64_t)block * BLOCK_SIZE;
+}
+
+
+/**
+ @brief		Returns the reader/writer lock of the given inode. Inodes share locks by stripe.
+ @param		inode		The inode to lock
+ @return	The lock of the inode
+ */
+std::shared_mutex& MyFs::inodeLock(uint32_t inode)
+{
+	return this->_inodeLocks[inode % INODE_LOCK_STRIPES];
+}
+
+
+/**
+ @brief		Reads the extent list of the given entry. A file made of a single extent keeps it inline in the entry,
+			longer lists are kept in a chain of extent map blocks.
+ @param		entry		The table entry of the file
+ @param		extents		Filled with the extents of the file, in file order
+ @return	void
+ */
+void MyFs::loadExtents(const struct table_entry& entry, BlockAllocator::extent_list& extents)
+{
+	extents.clear();
+
+	if (entry.address == 0)		// Empty file
+	{
+		return;
+	}
+
+	if (entry.flags & ENTRY_FLAG_EXTENT_MAP)
+	{
+		struct extent_map map;
+		uint32_t block = entry.address;
+		for (int i = 0; i < MAX_MAP_BLOCKS && block != 0; i++)
+		{
+			this->_journal.read(blockAddress(block), sizeof(map), (char *)&map);
+			extents.insert(extents.end(), map.extents, map.extents + std::min<uint32_t>(map.count, MAX_EXTENTS));
+			block = map.next;
+		}
+	}
+	else
+	{
+		extents.push_back({ entry.address, blocksFor(entry.size) });
+	}
+}
+
+
+/**
+ @brief		Collects the extent map blocks of the given entry, in chain order.
+ @param		entry		The table entry of the file
+ @param		blocks		Filled with the map blocks, one extent each, empty when the file has no map
+ @return	void
+ */
+void MyFs::loadMapBlocks(const struct table_entry& entry, BlockAllocator::extent_list& blocks)
+{
+	blocks.clear();
+
+	if (!(entry.flags & ENTRY_FLAG_EXTENT_MAP))
+	{
+		return;
+	}
+
+	uint32_t block = entry.address;
+	for (int i = 0; i < MAX_MAP_BLOCKS && block != 0; i++)
+	{
+		blocks.push_back({ block, 1 });
+		this->_journal.read(blockAddress(block) + offsetof(extent_map, next), sizeof(block), (char *)&block);
+	}
+}
+
+
+/**
+ @brief		Points the given entry at the given extent list, allocating or releasing its extent map blocks as needed.
+			A snapshotted file whose map a snapshot still references gets a new chain. The entry itself is not
+			written to the table.
+ @param		entry		The table entry of the file
+ @param		extents		The extents of the file, in file order
+ @return	void
+ */
+void MyFs::storeExtents(struct table_entry& entry, const BlockAllocator::extent_list& extents)
+{
+	BlockAllocator::extent_list mapBlocks;
+	this->loadMapBlocks(entry, mapBlocks);
+	this->storeExtents(entry, extents, mapBlocks);
+}
+
+
+/**
+ @brief		Points the given entry at the given extent list, kept in the given chain of extent map blocks. The chain
+			is grown with new blocks or cut short as the list needs, and only the map blocks whose content changes
+			are written. The entry itself is not written to the table.
+ @param		entry		The table entry of the file
+ @param		extents		The extents of the file, in file order
+ @param		mapBlocks	The map blocks to keep the list in, one extent each in chain order, updated in place
+ @return	void
+ */
+void MyFs::storeExtents(struct table_entry& entry, const BlockAllocator::extent_list& extents,
+	BlockAllocator::extent_list& mapBlocks)
+{
+	// A compressed file keeps its map even for a single extent, the entry size doesn't tell the stream's length
+	if (extents.size() <= 1 && !(entry.flags & ENTRY_FLAG_COMPRESSED))
+	{
+		// Releasing the extent map blocks, a single extent fits inline
+		for (const BlockAllocator::extent& mapBlock : mapBlocks)
+		{
+			this->releaseBlocks(mapBlock);
+		}
+		mapBlocks.clear();
+
+		entry.flags &= ~ENTRY_FLAG_EXTENT_MAP;
+		entry.address = extents.empty() ? 0 : extents.front().start;
+		return;
+	}
+
+	if (extents.size() > MAX_FILE_EXTENTS)
+	{
+		throw std::runtime_error(RED "File is too fragmented" RESET);
+	}
+
+	// A chain the snapshots still see is left to them, the file's own goes to new blocks
+	BlockAllocator::extent_list sharedChain;
+	if ((entry.flags & ENTRY_FLAG_SNAPSHOT) && this->sharesBlocks(mapBlocks))
+	{
+		sharedChain.swap(mapBlocks);
+	}
+
+	size_t needed = (extents.size() + MAX_EXTENTS - 1) / MAX_EXTENTS;
+	size_t existing = mapBlocks.size();
+	if (mapBlocks.size() < needed)
+	{
+		BlockAllocator::extent_list added;
+		this->allocateBlocks(needed - mapBlocks.size(), 0, added);
+		for (const BlockAllocator::extent& ext : added)
+		{
+			for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+			{
+				mapBlocks.push_back({ block, 1 });
+			}
+		}
+		if (entry.flags & ENTRY_FLAG_SNAPSHOT)
+		{
+			this->referenceBlocks(added);
+		}
+	}
+
+	for (const BlockAllocator::extent& mapBlock : sharedChain)
+	{
+		this->releaseBlocks(mapBlock);
+	}
+
+	struct extent_map map;
+	struct extent_map stored;
+	for (size_t i = 0; i < needed; i++)
+	{
+		size_t first = i * MAX_EXTENTS;
+		memset(&map, 0, sizeof(map));
+		map.count = std::min<size_t>(MAX_EXTENTS, extents.size() - first);
+		map.next = i + 1 < needed ? mapBlocks[i + 1].start : 0;
+		std::copy(extents.begin() + first, extents.begin() + first + map.count, map.extents);
+
+		// A write in the middle of the file leaves the blocks mapping the extents before it as they are
+		uint64_t address = blockAddress(mapBlocks[i].start);
+		if (i < existing)
+		{
+			this->_journal.read(address, sizeof(stored), (char *)&stored);
+		}
+		if (i >= existing || memcmp(&map, &stored, sizeof(map)) != 0)
+		{
+			this->_journal.write(address, sizeof(map), (const char *)&map);
+		}
+	}
+
+	for (size_t i = needed; i < mapBlocks.size(); i++)
+	{
+		this->releaseBlocks(mapBlocks[i]);
+	}
+	mapBlocks.resize(needed);
+
+	entry.address = mapBlocks.front().start;
+	entry.flags |= ENTRY_FLAG_EXTENT_MAP;
+}
+
+
+/**
+ @brief		Releases every block past the first blockCount blocks of the given extent list.
+ @param		extents		The extent list to truncate
+ @param		blockCount	The number of blocks to keep
+ @return	void
+ */
+void MyFs::truncateExtents(BlockAllocator::extent_list& extents, uint32_t blockCount)
+{
+	uint32_t kept = 0;
+	size_t i = 0;
+
+	for (; i < extents.size() && kept < blockCount; i++)
+	{
+		kept += extents[i].length;
+	}
+
+	// Cutting the last kept extent short
+	if (kept > blockCount)
+	{
+		uint32_t extra = kept - blockCount;
+		extents[i - 1].length -= extra;
+		this->releaseBlocks({ extents[i - 1].start + extents[i - 1].length, extra });
+	}
+
+	for (size_t j = i; j < extents.size(); j++)
+	{
+		this->releaseBlocks(extents[j]);
+	}
+	extents.resize(i);
+}
+
+
+/**
+ @brief		Reads a byte range of a file through its extent list, one device read per extent touched. The file data
+			reads are submitted to the device as a single batch.
+ @param		extents		The extents of the file, in file order
+ @param		offset		The file offset to start reading from
+ @param		length		The number of bytes to read, must not pass the allocated blocks
+ @param		data		The buffer to read into
+ @param		metadata	Whether the blocks hold metadata (directory entries), which is read through the journal
+ @return	void
+ */
+void MyFs::readExtents(const BlockAllocator::extent_list& extents, uint32_t offset, uint32_t length, char *data,
+	bool metadata)
+{
+	uint64_t extentOffset = 0;		// The file offset of the current extent
+	io_batch requests;
+
+	for (size_t i = 0; i < extents.size() && length > 0; i++)
+	{
+		uint64_t extentBytes = (uint64_t)extents[i].length * BLOCK_SIZE;
+
+		if (offset < extentOffset + extentBytes)
+		{
+			uint32_t chunk = std::min<uint64_t>(length, extentOffset + extentBytes - offset);
+			uint64_t address = blockAddress(extents[i].start) + (offset - extentOffset);
+			if (metadata)
+			{
+				this->_journal.read(address, chunk, data);
+			}
+			else
+			{
+				requests.push_back(BlockDevice::io_request{ false, address, chunk, data, nullptr });
+			}
+
+			data += chunk;
+			offset += chunk;
+			length -= chunk;
+		}
+
+		extentOffset += extentBytes;
+	}
+
+	if (!requests.empty())
+	{
+		this->blkdevsim->submit(requests.data(), requests.size());
+	}
+}
+
+
+/**
+ @brief		Writes a byte range of a file through its extent list, one device write per extent touched. The file data
+			writes are submitted to the device as a single batch.
+ @param		extents		The extents of the file, in file order
+ @param		offset		The file offset to start writing at
+ @param		length		The number of bytes to write, must not pass the allocated blocks
+ @param		data		The data to write
+ @param		metadata	Whether the blocks hold metadata (directory entries), which is written through the journal.
+						File data goes straight to the device and is flushed before the next commit.
+ @return	void
+ */
+void MyFs::writeExtents(const BlockAllocator::extent_list& extents, uint32_t offset, uint32_t length, const char *data,
+	bool metadata)
+{
+	uint64_t extentOffset = 0;		// The file offset of the current extent
+	io_batch requests;
+
+	for (size_t i = 0; i < extents.size() && length > 0; i++)
+	{
+		uint64_t extentBytes = (uint64_t)extents[i].length * BLOCK_SIZE;
+
+		if (offset < extentOffset + extentBytes)
+		{
+			uint32_t chunk = std::min<uint64_t>(length, extentOffset + extentBytes - offset);
+			uint64_t address = blockAddress(extents[i].start) + (offset - extentOffset);
+			if (metadata)
+			{
+				this->_journal.write(address, chunk, data);
+			}
+			else
+			{
+				requests.push_back(BlockDevice::io_request{ true, address, chunk, nullptr, data });
+			}
+
+			data += chunk;
+			offset += chunk;
+			length -= chunk;
+		}
+
+		extentOffset += extentBytes;
+	}
+
+	if (!requests.empty())
+	{
+		this->blkdevsim->submit(requests.data(), requests.size());
+	}
+
+	// Marked once written, so a commit never clears a range before the data is in it
+	for (const BlockDevice::io_request& request : requests)
+	{
+		this->_journal.dirty(request.addr, request.size);
+		this->_dataBytes += request.size;
+	}
+}
+
+
+/**
+ @brief		Grows or shrinks the extent list of a file to the number of blocks the given size needs. The file is
+			grown in place when the blocks after it are free, and the blocks past the new end are released when it
+			shrinks. The entry is pointed at the new extents but its size and the table are left untouched.
+ @param		entry		The table entry of the file
+ @param		extents		The extents of the file, updated in place
+ @param		size		The new size of the file
+ @return	void
+ */
+void MyFs::resizeExtents(struct table_entry& entry, BlockAllocator::extent_list& extents, uint32_t size)
+{
+	uint32_t oldBlocks = blocksFor(entry.size);
+	uint32_t newBlocks = blocksFor(size);
+
+	if (newBlocks > oldBlocks)
+	{
+		uint32_t goal = extents.empty() ? 0 : extents.back().start + extents.back().length;
+		this->allocateBlocks(newBlocks - oldBlocks, goal, extents);
+
+		try
+		{
+			this->storeExtents(entry, extents);
+		}
+		catch (const std::runtime_error&)
+		{
+			this->truncateExtents(extents, oldBlocks);		// Giving back the blocks allocated above
+			throw;
+		}
+	}
+	else if (newBlocks < oldBlocks)
+	{
+		this->truncateExtents(extents, newBlocks);
+		this->storeExtents(entry, extents);
+	}
+}
+
+
+/**
+ @brief		Reads the whole data of the given entry.
+ @param		entry		The table entry of the file
+ @param		data		The buffer to read into, at least entry.size bytes long
+ @return	void
+ */
+void MyFs::readData(const struct table_entry& entry, char *data)
+{
+	BlockAllocator::extent_list extents;
+	this->loadExtents(entry, extents);
+	this->readExtents(extents, 0, entry.size, data, entry.flags & ENTRY_FLAG_DIRECTORY);
+}
+
+
+/**
+ @brief		Reads a byte range of a file, from its inline record or through its extents.
+ @param		entryInfo		The inode and the entry of the file
+ @param		offset			The file offset to start reading from
+ @param		length			The number of bytes to read, must not pass the end of the file
+ @param		data			The buffer to read into
+ @return	void
+ */
+void MyFs::readFileRange(const MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, char *data)
+{
+	if (entryInfo.second.flags & ENTRY_FLAG_INLINE)
+	{
+		this->_journal.read(this->inlineAddress(entryInfo.first) + offset, length, data);
+		return;
+	}
+
+	BlockAllocator::extent_list extents;
+	this->loadExtents(entryInfo.second, extents);
+
+	if (entryInfo.second.flags & ENTRY_FLAG_COMPRESSED)
+	{
+		this->readCompressed(extents, entryInfo.second.size, offset, length, data);
+		return;
+	}
+
+	this->readExtents(extents, offset, length, data, entryInfo.second.flags & ENTRY_FLAG_DIRECTORY);
+}
+
+
+/**
+ @brief		Reads a byte range of a compressed file. The chunk headers are walked up to the range, and the chunks
+			inside it are decompressed straight into the buffer - only the chunks the range cuts through are
+			decompressed to a side buffer first.
+ @param		extents			The extents of the compressed stream
+ @param		fileSize		The logical size of the file
+ @param		offset			The file offset to start reading from
+ @param		length			The number of bytes to read, must not pass the end of the file
+ @param		data			The buffer to read into
+ @return	void
+ */
+void MyFs::readCompressed(const BlockAllocator::extent_list& extents, uint32_t fileSize, uint32_t offset,
+	uint32_t length, char *data)
+{
+	uint64_t streamSize = 0;
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		streamSize += (uint64_t)ext.length * BLOCK_SIZE;
+	}
+
+	uint64_t position = 0;		// Stream offset of the current chunk
+	uint32_t chunkStart = 0;		// File offset of the current chunk
+	std::vector<char> payload;
+	std::vector<char> chunk;
+
+	while (length > 0)
+	{
+		uint32_t header;
+		uint32_t chunkSize = std::min(COMPRESSED_CHUNK_SIZE, fileSize - chunkStart);
+
+		if (position + sizeof(header) > streamSize)
+		{
+			throw std::runtime_error(RED "Corrupted compressed data" RESET);
+		}
+		this->readExtents(extents, position, sizeof(header), (char *)&header, false);
+
+		uint32_t payloadSize = header & ~CHUNK_STORED_FLAG;
+		bool stored = header & CHUNK_STORED_FLAG;
+		if (position + sizeof(header) + payloadSize > streamSize || (stored && payloadSize != chunkSize))
+		{
+			throw std::runtime_error(RED "Corrupted compressed data" RESET);
+		}
+
+		if (offset < chunkStart + chunkSize)
+		{
+			uint32_t from = offset - chunkStart;
+			uint32_t count = std::min(length, chunkSize - from);
+
+			if (stored)
+			{
+				this->readExtents(extents, position + sizeof(header) + from, count, data, false);
+			}
+			else
+			{
+				payload.resize(payloadSize);
+				this->readExtents(extents, position + sizeof(header), payloadSize, payload.data(), false);
+
+				bool whole = count == chunkSize;
+				if (!whole)
+				{
+					chunk.resize(chunkSize);
+				}
+				char *target = whole ? data : chunk.data();
+
+				if (Lz4::decompress(payload.data(), payloadSize, target, chunkSize) != chunkSize)
+				{
+					throw std::runtime_error(RED "Corrupted compressed data" RESET);
+				}
+				if (!whole)
+				{
+					memcpy(data, chunk.data() + from, count);
+				}
+			}
+
+			data += count;
+			offset += count;
+			length -= count;
+		}
+
+		position += sizeof(header) + payloadSize;
+		chunkStart += chunkSize;
+	}
+}
+
+
+/**
+ @brief		Compresses file content into the chunked stream compressed files are stored as.
+ @param		data		The file content
+ @param		size		The size of the content
+ @return	The compressed stream
+ */
+std::vector<char> MyFs::compressData(const char *data, uint32_t size)
+{
+	std::vector<char> stream;
+
+	for (uint32_t chunkStart = 0; chunkStart < size; chunkStart += COMPRESSED_CHUNK_SIZE)
+	{
+		uint32_t chunkSize = std::min(COMPRESSED_CHUNK_SIZE, size - chunkStart);
+		size_t headerPosition = stream.size();
+		uint32_t header;
+
+		stream.resize(headerPosition + sizeof(header) + Lz4::compressBound(chunkSize));
+		char *payload = stream.data() + headerPosition + sizeof(header);
+		size_t payloadSize = Lz4::compress(data + chunkStart, chunkSize, payload, Lz4::compressBound(chunkSize));
+
+		// A chunk that doesn't shrink is stored as is
+		if (payloadSize == 0 || payloadSize >= chunkSize)
+		{
+			memcpy(payload, data + chunkStart, chunkSize);
+			payloadSize = chunkSize;
+			header = chunkSize | CHUNK_STORED_FLAG;
+		}
+		else
+		{
+			header = payloadSize;
+		}
+
+		memcpy(stream.data() + headerPosition, &header, sizeof(header));
+		stream.resize(headerPosition + sizeof(header) + payloadSize);
+	}
+
+	return stream;
+}
+
+
+/**
+ @brief		Replaces the whole data of the given entry and writes the entry back to the table. The new data goes to
+			newly allocated blocks (or to the inline record when it's small enough) and the old ones are released with
+			the transaction, so a crash leaves either the old or the new content.
+ @param		entryInfo		The inode and the entry of the file, updated with the new extents and size
+ @param		data			The new data
+ @param		size			The size of the new data
+ @param		storage			ENTRY_FLAG_COMPRESSED to store the data compressed (only done when it saves blocks),
+							ENTRY_FLAG_DEDUP to share the blocks that are already stored
+ @return	void
+ */
+void MyFs::writeData(MyFs::EntryInfo& entryInfo, const char *data, uint32_t size, uint8_t storage)
+{
+	BlockAllocator::extent_list oldExtents;
+	BlockAllocator::extent_list oldMapBlocks;
+	this->loadExtents(entryInfo.second, oldExtents);
+	this->loadMapBlocks(entryInfo.second, oldMapBlocks);
+
+	struct table_entry entry = entryInfo.second;
+	entry.flags &= ~(ENTRY_FLAG_EXTENT_MAP | ENTRY_FLAG_INLINE | ENTRY_FLAG_COMPRESSED | ENTRY_FLAG_DEDUP |
+		ENTRY_FLAG_SNAPSHOT);		// The old extent map blocks stay with the old extents
+
+	uint32_t storedSize = size;
+	std::vector<char> stream;
+	if ((storage & ENTRY_FLAG_COMPRESSED) && size > INLINE_DATA_SIZE && !(entry.flags & ENTRY_FLAG_DIRECTORY))
+	{
+		stream = compressData(data, size);
+
+		// The extent map block a compressed file always has counts against what compression saves
+		if (blocksFor(stream.size()) + 1 < blocksFor(size))
+		{
+			entry.flags |= ENTRY_FLAG_COMPRESSED;
+			data = stream.data();
+			storedSize = stream.size();
+		}
+	}
+
+	if (size > 0 && size <= INLINE_DATA_SIZE && !(entry.flags & ENTRY_FLAG_DIRECTORY))
+	{
+		// A small file goes to its inline record, which is journaled together with the entry
+		entry.flags |= ENTRY_FLAG_INLINE;
+		entry.address = 0;
+		this->_journal.write(this->inlineAddress(entryInfo.first), size, data);
+	}
+	else if ((storage & ENTRY_FLAG_DEDUP) && storedSize > 0 && !(entry.flags & ENTRY_FLAG_DIRECTORY) &&
+		this->writeDeduplicated(entry, data, storedSize))
+	{
+		entry.flags |= ENTRY_FLAG_DEDUP;
+	}
+	else
+	{
+		BlockAllocator::extent_list extents;
+		if (storedSize > 0)
+		{
+			this->allocateBlocks(blocksFor(storedSize), 0, extents);
+		}
+
+		try
+		{
+			this->storeExtents(entry, extents);
+		}
+		catch (const std::runtime_error&)
+		{
+			for (const BlockAllocator::extent& ext : extents)
+			{
+				this->_allocator.release(ext);		// Never referenced, no need to wait for the journal
+			}
+			throw;
+		}
+
+		this->writeExtents(extents, 0, storedSize, data, entry.flags & ENTRY_FLAG_DIRECTORY);
+	}
+
+	for (const BlockAllocator::extent& mapBlock : oldMapBlocks)
+	{
+		this->releaseBlocks(mapBlock);
+	}
+	for (const BlockAllocator::extent& ext : oldExtents)
+	{
+		this->releaseBlocks(ext);
+	}
+
+	// Updating the file entry
+	entry.size = size;
+	entryInfo.second = entry;
+	this->writeTableEntry(entryInfo);
+}
+
+
+/**
+ @brief		Returns how new content of the given file is stored - the way the file is stored now, plus the format-wide
+			compression and deduplication modes.
+ @param		entry		The table entry of the file
+ @return	The ENTRY_FLAG_COMPRESSED / ENTRY_FLAG_DEDUP flags to pass to writeData
+ */
+uint8_t MyFs::storageFlags(const struct table_entry& entry) const
+{
+	uint8_t storage = entry.flags & (ENTRY_FLAG_COMPRESSED | ENTRY_FLAG_DEDUP);
+
+	if (this->_compression)
+	{
+		storage |= ENTRY_FLAG_COMPRESSED;
+	}
+	if (this->_dedup)
+	{
+		storage |= ENTRY_FLAG_DEDUP;
+	}
+
+	return storage;
+}
+
+
+/**
+ @brief		Writes the data of a file sharing the blocks that are already stored with the same content. Every block is
+			hashed, a stored block with the same hash is compared byte for byte before it's shared, and only the
+			blocks that aren't stored yet are allocated and written. The entry is pointed at the resulting extents
+			but isn't written to the table.
+ @param		entry		The table entry of the file
+ @param		data		The data to write
+ @param		size		The size of the data, more than zero
+ @return	Whether the data was written, false (with nothing done) when sharing would fragment the file past
+			MAX_FILE_EXTENTS extents
+ */
+bool MyFs::writeDeduplicated(struct table_entry& entry, const char *data, uint32_t size)
+{
+	uint32_t blockCount = blocksFor(size);
+
+	// The last block is written padded with zeros, so it can be shared like any other
+	std::vector<char> padded((size_t)blockCount * BLOCK_SIZE, '\0');
+	memcpy(padded.data(), data, size);
+
+	std::vector<uint64_t> hashes(blockCount);
+	std::vector<uint32_t> blocks(blockCount, 0);		// The device block of every file block, 0 until it has one
+	std::vector<bool> shared(blockCount, false);
+	uint32_t newBlocks = 0;
+	{
+		std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+		char stored[BLOCK_SIZE];
+
+		for (uint32_t i = 0; i < blockCount; i++)
+		{
+			const char *block = padded.data() + (size_t)i * BLOCK_SIZE;
+			hashes[i] = hashBlock(block);
+
+			std::unordered_map<uint64_t, uint32_t>::iterator it = this->_dedupIndex.find(hashes[i]);
+			if (it != this->_dedupIndex.end())
+			{
+				this->blkdevsim->read(blockAddress(it->second), BLOCK_SIZE, stored);
+				if (memcmp(stored, block, BLOCK_SIZE) == 0)
+				{
+					blocks[i] = it->second;
+					shared[i] = true;
+					this->_blockRefs[it->second]++;
+					continue;
+				}
+			}
+
+			newBlocks++;
+		}
+	}
+
+	// Dropping the references taken above and the blocks allocated below, none of them is referenced yet
+	auto undo = [&]()
+	{
+		for (uint32_t i = 0; i < blockCount; i++)
+		{
+			if (shared[i])
+			{
+				this->releaseBlocks({ blocks[i], 1 });
+			}
+			else if (blocks[i] != 0)
+			{
+				this->_allocator.release({ blocks[i], 1 });
+			}
+		}
+	};
+
+	BlockAllocator::extent_list extents;
+	try
+	{
+		BlockAllocator::extent_list allocated;
+		if (newBlocks > 0)
+		{
+			this->allocateBlocks(newBlocks, 0, allocated);
+		}
+
+		// Handing out the new blocks, in order, to the file blocks that weren't found
+		size_t next = 0;
+		uint32_t offset = 0;
+		for (uint32_t i = 0; i < blockCount; i++)
+		{
+			if (!shared[i])
+			{
+				blocks[i] = allocated[next].start + offset;
+				if (++offset == allocated[next].length)
+				{
+					next++;
+					offset = 0;
+				}
+			}
+
+			if (!extents.empty() && extents.back().start + extents.back().length == blocks[i])
+			{
+				extents.back().length++;
+			}
+			else
+			{
+				extents.push_back({ blocks[i], 1 });
+			}
+		}
+
+		if (extents.size() > MAX_FILE_EXTENTS)
+		{
+			undo();
+			return false;
+		}
+
+		this->storeExtents(entry, extents);
+	}
+	catch (const std::runtime_error&)
+	{
+		undo();
+		throw;
+	}
+
+	// Writing the new blocks, a run of them landing on consecutive device blocks in a single request
+	io_batch requests;
+	for (uint32_t i = 0; i < blockCount; i++)
+	{
+		if (shared[i])
+		{
+			continue;
+		}
+
+		if (i > 0 && !shared[i - 1] && blocks[i - 1] + 1 == blocks[i])
+		{
+			requests.back().size += BLOCK_SIZE;
+		}
+		else
+		{
+			requests.push_back(BlockDevice::io_request{ true, blockAddress(blocks[i]), BLOCK_SIZE, nullptr,
+				padded.data() + (size_t)i * BLOCK_SIZE });
+		}
+	}
+
+	if (!requests.empty())
+	{
+		this->blkdevsim->submit(requests.data(), requests.size());
+	}
+	for (const BlockDevice::io_request& request : requests)
+	{
+		this->_journal.dirty(request.addr, request.size);
+	}
+
+	// The new blocks can be shared once their content is in place
+	std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+	for (uint32_t i = 0; i < blockCount; i++)
+	{
+		if (!shared[i])
+		{
+			this->_blockRefs[blocks[i]] = 1;
+			this->indexBlock(blocks[i], hashes[i]);
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ @brief		Releases a data extent with the journal. A block of a deduplicated file only loses a reference, and is
+			released (and dropped from the hash index) with its last one.
+ @param		ext		The extent to release
+ @return	void
+ */
+void MyFs::releaseBlocks(const BlockAllocator::extent& ext)
+{
+	BlockAllocator::extent_list released;
+	{
+		std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+
+		if (this->_blockRefs.empty())
+		{
+			released.push_back(ext);
+		}
+		else
+		{
+			for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+			{
+				std::unordered_map<uint32_t, uint32_t>::iterator it = this->_blockRefs.find(block);
+				if (it != this->_blockRefs.end())
+				{
+					if (--it->second > 0)
+					{
+						continue;
+					}
+					this->_blockRefs.erase(it);
+					this->unindexBlock(block);
+				}
+
+				if (!released.empty() && released.back().start + released.back().length == block)
+				{
+					released.back().length++;
+				}
+				else
+				{
+					released.push_back({ block, 1 });
+				}
+			}
+		}
+	}
+
+	for (const BlockAllocator::extent& run : released)
+	{
+		this->_journal.release(run);
+	}
+}
+
+
+/**
+ @brief		Returns whether any of the given blocks is referenced by more than one file or snapshot, so it must not be
+			written in place.
+ @param		extents		The blocks to check
+ @return	Whether one of them is shared
+ */
+bool MyFs::sharesBlocks(const BlockAllocator::extent_list& extents)
+{
+	std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+		{
+			std::unordered_map<uint32_t, uint32_t>::const_iterator it = this->_blockRefs.find(block);
+			if (it != this->_blockRefs.end() && it->second > 1)
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+/**
+ @brief		Gives newly allocated blocks of a snapshotted file the reference the file holds on every block of it.
+ @param		extents		The new blocks
+ @return	void
+ */
+void MyFs::referenceBlocks(const BlockAllocator::extent_list& extents)
+{
+	std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+		{
+			this->_blockRefs.emplace(block, 1);
+		}
+	}
+}
+
+
+/**
+ @brief		Claims the given blocks of a deduplicated file for writing in place - unless one of them is referenced by
+			more than one file or snapshot, they are dropped from the hash index, so no file starts sharing them.
+ @param		extents		The blocks to claim
+ @return	Whether they were claimed, false (with nothing done) when one of them is shared
+ */
+bool MyFs::claimBlocks(const BlockAllocator::extent_list& extents)
+{
+	std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+		{
+			std::unordered_map<uint32_t, uint32_t>::const_iterator it = this->_blockRefs.find(block);
+			if (it != this->_blockRefs.end() && it->second > 1)
+			{
+				return false;
+			}
+		}
+	}
+
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+		{
+			this->unindexBlock(block);
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ @brief		Hashes the given blocks of a deduplicated file as they are on the device and adds them to the hash index,
+			so other files can share them. A content already indexed keeps the block it has.
+ @param		extents		The blocks, written and referenced by the file alone
+ @return	void
+ */
+void MyFs::indexBlocks(const BlockAllocator::extent_list& extents)
+{
+	char block[BLOCK_SIZE];
+
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		for (uint32_t i = ext.start; i < ext.start + ext.length; i++)
+		{
+			this->blkdevsim->read(blockAddress(i), BLOCK_SIZE, block);
+			uint64_t hash = hashBlock(block);
+
+			std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+			this->indexBlock(i, hash);
+		}
+	}
+}
+
+
+/**
+ @brief		Adds a block to the hash index, unless a block with the same hash already is in it. Its slot is written
+			straight to the device like file data. A slot a crash leaves behind is cleared at mount once its block has
+			no references, and a stale hash only misses a share - shared content is compared byte for byte. An index
+			that can't take another chunk leaves the block out, it is only not shared. The caller holds the dedup
+			mutex.
+ @param		block		The block
+ @param		hash		The hash of its content
+ @return	void
+ */
+void MyFs::indexBlock(uint32_t block, uint64_t hash)
+{
+	if (!this->_dedupIndex.emplace(hash, block).second)
+	{
+		return;
+	}
+
+	if (this->_freeDedupSlots.empty() && !this->addDedupChunk())
+	{
+		this->_dedupIndex.erase(hash);
+		return;
+	}
+
+	uint32_t slot = this->_freeDedupSlots.back();
+	this->_freeDedupSlots.pop_back();
+
+	struct dedup_slot entry = { hash, block, 0 };
+	uint64_t address = this->dedupSlotAddress(slot);
+	this->blkdevsim->write(address, sizeof(entry), (const char *)&entry);
+	this->_journal.dirty(address, sizeof(entry));
+
+	this->_indexedBlocks[block] = { hash, slot };
+}
+
+
+/**
+ @brief		Drops a block from the hash index and frees its slot, if it is in the index. The caller holds the dedup
+			mutex.
+ @param		block		The block
+ @return	void
+ */
+void MyFs::unindexBlock(uint32_t block)
+{
+	std::unordered_map<uint32_t, indexed_block>::iterator it = this->_indexedBlocks.find(block);
+	if (it == this->_indexedBlocks.end())
+	{
+		return;
+	}
+
+	struct dedup_slot entry = { 0, 0, 0 };
+	uint64_t address = this->dedupSlotAddress(it->second.slot);
+	this->blkdevsim->write(address, sizeof(entry), (const char *)&entry);
+	this->_journal.dirty(address, sizeof(entry));
+
+	this->_dedupIndex.erase(it->second.hash);
+	this->_freeDedupSlots.push_back(it->second.slot);
+	this->_indexedBlocks.erase(it);
+}
+
+
+/**
+ @brief		Takes another chunk for the dedup index, at the end of the inode map, and frees its slots. The chunk is
+			cleared like file data, so it is on the device before the map entry pointing at it commits. The caller
+			holds the dedup mutex.
+ @return	Whether the chunk was taken, false when the inode map or the free space has no room for it
+ */
+bool MyFs::addDedupChunk()
+{
+	static const char zeros[DEDUP_CHUNK_BLOCKS * BLOCK_SIZE] = { 0 };
+
+	std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+
+	// A free entry is left after the inode chunks, where the dedup index chunks end
+	uint32_t chunk = MAX_INODE_CHUNKS - 1 - this->_dedupChunks.size();
+	if (this->_dedupChunks.size() + 1 >= MAX_INODE_CHUNKS || this->_inodeChunks[chunk] != 0 ||
+		this->_inodeChunks[chunk - 1] != 0)
+	{
+		return false;
+	}
+
+	uint32_t start;
+	try
+	{
+		start = this->allocateRegion(DEDUP_CHUNK_BLOCKS, 0, RED "Not enough contiguous space for the dedup index" RESET);
+	}
+	catch (const std::runtime_error&)
+	{
+		return false;
+	}
+	this->blkdevsim->write(blockAddress(start), sizeof(zeros), zeros);
+	this->_journal.dirty(blockAddress(start), sizeof(zeros));
+
+	this->_journal.write(blockAddress(this->_inodeMap) + chunk * sizeof(uint32_t), sizeof(start), (const char *)&start);
+	this->_dedupChunks.push_back(start);
+
+	uint32_t first = (this->_dedupChunks.size() - 1) * DEDUP_CHUNK_SLOTS;
+	for (uint32_t slot = first + DEDUP_CHUNK_SLOTS; slot > first; slot--)
+	{
+		this->_freeDedupSlots.push_back(slot - 1);
+	}
+
+	return true;
+}
+
+
+// The address of a slot of the dedup index
+uint64_t MyFs::dedupSlotAddress(uint32_t slot) const
+{
+	return blockAddress(this->_dedupChunks[slot / DEDUP_CHUNK_SLOTS]) + (slot % DEDUP_CHUNK_SLOTS) * sizeof(dedup_slot);
+}
+
+
+/**
+ @brief		Rebuilds the block reference counts from the extent lists of the deduplicated and snapshotted files and of
+			the snapshot entries holding references, and loads the hash index from the dedup index chunks. A slot whose
+			block has no references any more (written before a crash, by a transaction the crash lost) is cleared.
+			The snapshots and the inode map are loaded first.
+ @param		hashBlocks		Whether to build the index from the blocks of the deduplicated files instead, hashing
+							every one of them
+ @return	void
+ */
+void MyFs::loadBlockRefs(bool hashBlocks)
+{
+	std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+	this->_blockRefs.clear();
+	this->_dedupIndex.clear();
+	this->_indexedBlocks.clear();
+	this->_freeDedupSlots.clear();
+
+	BlockAllocator::extent_list extents;
+	BlockAllocator::extent_list mapBlocks;
+	std::vector<char> content;
+	for (int inode = 0; inode < this->_fileCount; inode++)
+	{
+		struct table_entry entry = this->readTableEntry(inode).second;
+		if (!(entry.flags & ENTRY_FLAG_USED) || !(entry.flags & (ENTRY_FLAG_DEDUP | ENTRY_FLAG_SNAPSHOT)))
+		{
+			continue;
+		}
+
+		this->loadExtents(entry, extents);
+		this->loadMapBlocks(entry, mapBlocks);
+
+		// A snapshotted file's own reference to its extent map, and to its data unless deduplication counts that below
+		if (entry.flags & ENTRY_FLAG_SNAPSHOT)
+		{
+			for (const BlockAllocator::extent& mapBlock : mapBlocks)
+			{
+				this->_blockRefs[mapBlock.start]++;
+			}
+			if (!(entry.flags & ENTRY_FLAG_DEDUP))
+			{
+				for (const BlockAllocator::extent& ext : extents)
+				{
+					for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+					{
+						this->_blockRefs[block]++;
+					}
+				}
+				continue;
+			}
+		}
+
+		for (const BlockAllocator::extent& ext : extents)
+		{
+			if (hashBlocks)
+			{
+				content.resize((size_t)ext.length * BLOCK_SIZE);
+				this->blkdevsim->read(blockAddress(ext.start), content.size(), content.data());
+			}
+
+			for (uint32_t i = 0; i < ext.length; i++)
+			{
+				uint32_t block = ext.start + i;
+				if (++this->_blockRefs[block] > 1)
+				{
+					continue;
+				}
+
+				if (hashBlocks)
+				{
+					this->indexBlock(block, hashBlock(content.data() + (size_t)i * BLOCK_SIZE));
+				}
+			}
+		}
+	}
+
+	// A snapshot references all the blocks of its entries marked ENTRY_FLAG_FROZEN
+	for (const frozen_snapshot& frozen : this->_snapshots)
+	{
+		for (uint32_t inode = 0; inode < frozen.snapshot.fileCount; inode++)
+		{
+			struct table_entry entry = this->readSnapshotEntry(frozen.snapshot, frozen.chunks, inode);
+			if (!(entry.flags & ENTRY_FLAG_USED) || !(entry.flags & ENTRY_FLAG_FROZEN))
+			{
+				continue;
+			}
+
+			this->loadExtents(entry, extents);
+			this->loadMapBlocks(entry, mapBlocks);
+			extents.insert(extents.end(), mapBlocks.begin(), mapBlocks.end());
+
+			for (const BlockAllocator::extent& ext : extents)
+			{
+				for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+				{
+					this->_blockRefs[block]++;
+				}
+			}
+		}
+	}
+
+	if (hashBlocks)
+	{
+		this->_journal.checkpoint();
+	}
+	else
+	{
+		std::vector<dedup_slot> slots(DEDUP_CHUNK_SLOTS);
+		for (uint32_t chunk = 0; chunk < this->_dedupChunks.size(); chunk++)
+		{
+			this->blkdevsim->read(blockAddress(this->_dedupChunks[chunk]), DEDUP_CHUNK_BLOCKS * BLOCK_SIZE,
+				(char *)slots.data());
+
+			for (uint32_t i = 0; i < DEDUP_CHUNK_SLOTS; i++)
+			{
+				uint32_t slot = chunk * DEDUP_CHUNK_SLOTS + i;
+				const struct dedup_slot& entry = slots[i];
+
+				if (entry.block != 0 && this->_blockRefs.count(entry.block) > 0 &&
+					this->_indexedBlocks.count(entry.block) == 0 && this->_dedupIndex.emplace(entry.hash, entry.block).second)
+				{
+					this->_indexedBlocks[entry.block] = { entry.hash, slot };
+					continue;
+				}
+
+				if (entry.block != 0)
+				{
+					struct dedup_slot cleared = { 0, 0, 0 };
+					this->blkdevsim->write(this->dedupSlotAddress(slot), sizeof(cleared), (const char *)&cleared);
+					this->_journal.dirty(this->dedupSlotAddress(slot), sizeof(cleared));
+				}
+				this->_freeDedupSlots.push_back(slot);
+			}
+		}
+		std::reverse(this->_freeDedupSlots.begin(), this->_freeDedupSlots.end());
+	}
+}
+
+
+/**
+ @brief		Takes a snapshot of the whole file system. Only the table, the inline records and the inode chunks are
+			copied, no file is looked at: the snapshot's entries point at the blocks the live files use, and it takes
+			its references on them as the live files change (see shareWithSnapshots). Writers are only held off
+			while the copy is taken, a transaction per inode chunk.
+ @param		name		The name of the snapshot
+ @return	void
+ */
+void MyFs::create_snapshot(const std::string& name)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_SNAPSHOT);
+
+	if (name.empty() || name.length() > MAX_FILE_NAME)
+	{
+		throw std::runtime_error(RED "Invalid snapshot name" RESET);
+	}
+
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	struct snapshot_list list;
+	this->readSnapshotList(list);
+
+	if (findSnapshot(list, name) != -1)
+	{
+		throw std::runtime_error(RED "Snapshot already exists" RESET);
+	}
+	if (list.count >= MAX_SNAPSHOTS)
+	{
+		throw std::runtime_error(RED "Too many snapshots" RESET);
+	}
+
+	// The list block is on the device, empty, before the header points at it
+	if (this->_snapshotList == 0)
+	{
+		BlockAllocator::extent_list listBlock;
+		this->allocateBlocks(1, 0, listBlock);
+
+		this->blkdevsim->write(blockAddress(listBlock.front().start), sizeof(list), (const char *)&list);
+		this->blkdevsim->flush(blockAddress(listBlock.front().start), sizeof(list));
+		this->_snapshotList = listBlock.front().start;
+		this->writeHeader();
+	}
+
+	int fileCount;
+	{
+		std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+		fileCount = this->_fileCount;
+	}
+
+	// The frozen copies: the table and the inline records, then an inode map and a chunk per chunk in use
+	uint32_t tableBlock = 0;
+	uint32_t frozenMap = 0;
+	std::vector<uint32_t> frozenChunks(MAX_INODE_CHUNKS, 0);
+	try
+	{
+		tableBlock = this->allocateRegion(SNAPSHOT_BLOCKS, 0, RED "Not enough contiguous space for the snapshot" RESET);
+		if (chunksFor(fileCount) > 0)
+		{
+			frozenMap = this->allocateRegion(INODE_MAP_BLOCKS, 0, RED "Not enough contiguous space for the snapshot" RESET);
+			for (uint32_t chunk = 0; chunk < chunksFor(fileCount); chunk++)
+			{
+				frozenChunks[chunk] = this->allocateRegion(INODE_CHUNK_BLOCKS, 0,
+					RED "Not enough contiguous space for the snapshot" RESET);
+			}
+		}
+	}
+	catch (const std::runtime_error&)
+	{
+		for (uint32_t start : frozenChunks)
+		{
+			if (start != 0)
+			{
+				this->_allocator.release({ start, INODE_CHUNK_BLOCKS });
+			}
+		}
+		if (frozenMap != 0)
+		{
+			this->_allocator.release({ frozenMap, INODE_MAP_BLOCKS });
+		}
+		if (tableBlock != 0)
+		{
+			this->_allocator.release({ tableBlock, SNAPSHOT_BLOCKS });
+		}
+		throw;
+	}
+
+	// Group 0 is the table with the inline records, group n the inode chunk n - 1
+	std::vector<char> frozen;
+	for (uint32_t group = 0; group <= chunksFor(fileCount); group++)
+	{
+		Journal::transaction txn(this->_journal);
+		uint64_t frozenAddress;
+
+		if (group == 0)
+		{
+			frozen.assign((size_t)SNAPSHOT_BLOCKS * BLOCK_SIZE, '\0');
+			this->_journal.read(TABLE_START_ADDRESS, TABLE_SIZE, frozen.data());
+			this->_journal.read(this->_inlineAddress, INLINE_AREA_SIZE, frozen.data() + TABLE_SIZE);
+			frozenAddress = blockAddress(tableBlock);
+		}
+		else
+		{
+			frozen.resize((size_t)INODE_CHUNK_BLOCKS * BLOCK_SIZE);
+			this->_journal.read(blockAddress(this->_inodeChunks[group - 1]), frozen.size(), frozen.data());
+			frozenAddress = blockAddress(frozenChunks[group - 1]);
+		}
+
+		// The frozen copy goes to new blocks like file data, flushed before the list entry pointing at it commits
+		this->blkdevsim->write(frozenAddress, frozen.size(), frozen.data());
+		this->_journal.dirty(frozenAddress, frozen.size());
+	}
+
+	{
+		Journal::transaction txn(this->_journal);
+
+		if (frozenMap != 0)
+		{
+			this->blkdevsim->write(blockAddress(frozenMap), MAX_INODE_CHUNKS * sizeof(uint32_t), (const char *)frozenChunks.data());
+			this->_journal.dirty(blockAddress(frozenMap), MAX_INODE_CHUNKS * sizeof(uint32_t));
+		}
+
+		struct snapshot_entry& snapshot = list.snapshots[list.count++];
+		memset(&snapshot, 0, sizeof(snapshot));
+		name.copy(snapshot.name, MAX_FILE_NAME);
+		snapshot.fileCount = fileCount;
+		snapshot.tableBlock = tableBlock;
+		snapshot.inodeMap = frozenMap;
+
+		this->_journal.write(blockAddress(this->_snapshotList), sizeof(list), (const char *)&list);
+	}
+
+	// A mounted snapshot is read without the journal, so everything goes to its home location now
+	this->_journal.checkpoint();
+
+	this->_snapshots.push_back({ list.snapshots[list.count - 1], frozenChunks });
+}
+
+
+/**
+ @brief		Takes the references of the snapshots that still see a file as it is, before the file first changes
+			after they were taken. Their entries of the inode are marked ENTRY_FLAG_FROZEN, newest first up to one
+			already marked (the older ones were marked with it), and the file is marked ENTRY_FLAG_SNAPSHOT, so the
+			change copies the blocks they keep instead of overwriting them. Once no snapshot is left, a marked file
+			drops the references it only held for them. The caller holds the file lock exclusively and a transaction.
+ @param		entryInfo		The inode and the entry of the file, written back to the table when marked
+ @return	void
+ */
+void MyFs::shareWithSnapshots(MyFs::EntryInfo& entryInfo)
+{
+	struct table_entry& entry = entryInfo.second;
+
+	if (this->_snapshots.empty())
+	{
+		if (entry.flags & ENTRY_FLAG_SNAPSHOT)
+		{
+			this->unshareFile(entryInfo);
+		}
+		return;
+	}
+
+	// Until an entry is marked the live file hasn't changed since the snapshot, so both use the same blocks
+	uint32_t sharing = 0;
+	for (size_t i = this->_snapshots.size(); i-- > 0;)
+	{
+		const frozen_snapshot& frozen = this->_snapshots[i];
+		if ((uint32_t)entryInfo.first >= frozen.snapshot.fileCount)
+		{
+			continue;
+		}
+
+		uint64_t address = this->snapshotEntryAddress(frozen.snapshot, frozen.chunks, entryInfo.first);
+		struct table_entry snapshotEntry;
+		this->_journal.read(address, TABLE_ENTRY_SIZE, (char *)&snapshotEntry);
+		if (snapshotEntry.flags & ENTRY_FLAG_FROZEN)
+		{
+			break;
+		}
+
+		snapshotEntry.flags |= ENTRY_FLAG_FROZEN;
+		this->_journal.write(address, TABLE_ENTRY_SIZE, (const char *)&snapshotEntry);
+		if ((snapshotEntry.flags & ENTRY_FLAG_USED) && snapshotEntry.address != 0)
+		{
+			sharing++;
+		}
+	}
+
+	if (sharing == 0)
+	{
+		return;
+	}
+
+	BlockAllocator::extent_list extents;
+	BlockAllocator::extent_list mapBlocks;
+	this->loadExtents(entry, extents);
+	this->loadMapBlocks(entry, mapBlocks);
+	{
+		std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+
+		// The file's own references are taken too, unless they are already counted
+		uint32_t added = sharing + ((entry.flags & (ENTRY_FLAG_DEDUP | ENTRY_FLAG_SNAPSHOT)) ? 0 : 1);
+		for (const BlockAllocator::extent& ext : extents)
+		{
+			for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+			{
+				this->_blockRefs[block] += added;
+			}
+		}
+
+		added = sharing + ((entry.flags & ENTRY_FLAG_SNAPSHOT) ? 0 : 1);
+		for (const BlockAllocator::extent& mapBlock : mapBlocks)
+		{
+			this->_blockRefs[mapBlock.start] += added;
+		}
+	}
+
+	if (!(entry.flags & ENTRY_FLAG_SNAPSHOT))
+	{
+		entry.flags |= ENTRY_FLAG_SNAPSHOT;
+		this->writeTableEntry(entryInfo);
+	}
+}
+
+
+/**
+ @brief		Returns whether a snapshot still uses the blocks of a file without holding references on them, so they
+			must stay where they are. The caller holds the file lock.
+ @param		inode		The inode of the file
+ @return	Whether a snapshot's entry of the inode isn't marked ENTRY_FLAG_FROZEN yet
+ */
+bool MyFs::sharedWithSnapshots(uint32_t inode)
+{
+	for (size_t i = this->_snapshots.size(); i-- > 0;)
+	{
+		const frozen_snapshot& frozen = this->_snapshots[i];
+		if (inode >= frozen.snapshot.fileCount)
+		{
+			continue;
+		}
+
+		struct table_entry snapshotEntry = this->readSnapshotEntry(frozen.snapshot, frozen.chunks, inode);
+		if (snapshotEntry.flags & ENTRY_FLAG_FROZEN)
+		{
+			return false;
+		}
+		if ((snapshotEntry.flags & ENTRY_FLAG_USED) && snapshotEntry.address != 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/**
+ @brief		Clears ENTRY_FLAG_SNAPSHOT from a file once no snapshot is left, dropping the references that only existed
+			for the snapshots. The blocks of a deduplicated file stay counted. The caller holds the file lock
+			exclusively and a transaction.
+ @param		entryInfo		The inode and the entry of the file, written back to the table
+ @return	void
+ */
+void MyFs::unshareFile(MyFs::EntryInfo& entryInfo)
+{
+	struct table_entry& entry = entryInfo.second;
+
+	BlockAllocator::extent_list extents;
+	BlockAllocator::extent_list mapBlocks;
+	this->loadExtents(entry, extents);
+	this->loadMapBlocks(entry, mapBlocks);
+	{
+		std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+
+		for (const BlockAllocator::extent& mapBlock : mapBlocks)
+		{
+			this->_blockRefs.erase(mapBlock.start);
+		}
+		if (!(entry.flags & ENTRY_FLAG_DEDUP))
+		{
+			for (const BlockAllocator::extent& ext : extents)
+			{
+				for (uint32_t block = ext.start; block < ext.start + ext.length; block++)
+				{
+					this->_blockRefs.erase(block);
+				}
+			}
+		}
+	}
+
+	entry.flags &= ~ENTRY_FLAG_SNAPSHOT;
+	this->writeTableEntry(entryInfo);
+}
+
+
+/**
+ @brief		Deletes a snapshot. Its frozen copies are released, and the blocks of its entries marked ENTRY_FLAG_FROZEN
+			lose the snapshot's reference, so the blocks only it was using are released. Its other entries use the
+			blocks of unchanged live files, which it holds nothing on. The live files drop the references they no
+			longer need as they change.
+ @param		name		The name of the snapshot
+ @return	void
+ */
+void MyFs::delete_snapshot(const std::string& name)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_SNAPSHOT);
+
+	std::unique_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+
+	struct snapshot_list list;
+	this->readSnapshotList(list);
+
+	int index = findSnapshot(list, name);
+	if (index == -1)
+	{
+		throw std::runtime_error(RED "Snapshot not found" RESET);
+	}
+	struct snapshot_entry snapshot = list.snapshots[index];
+	const std::vector<uint32_t>& chunks = this->_snapshots[index].chunks;
+
+	{
+		Journal::transaction txn(this->_journal);
+
+		BlockAllocator::extent_list extents;
+		BlockAllocator::extent_list mapBlocks;
+		for (uint32_t inode = 0; inode < snapshot.fileCount; inode++)
+		{
+			struct table_entry entry = this->readSnapshotEntry(snapshot, chunks, inode);
+			if (!(entry.flags & ENTRY_FLAG_USED) || !(entry.flags & ENTRY_FLAG_FROZEN))
+			{
+				continue;
+			}
+
+			this->loadExtents(entry, extents);
+			this->loadMapBlocks(entry, mapBlocks);
+			extents.insert(extents.end(), mapBlocks.begin(), mapBlocks.end());
+
+			for (const BlockAllocator::extent& ext : extents)
+			{
+				this->releaseBlocks(ext);
+			}
+		}
+
+		this->_journal.release({ snapshot.tableBlock, SNAPSHOT_BLOCKS });
+		if (snapshot.inodeMap != 0)
+		{
+			for (uint32_t chunk = 0; chunk < chunksFor(snapshot.fileCount); chunk++)
+			{
+				this->_journal.release({ chunks[chunk], INODE_CHUNK_BLOCKS });
+			}
+			this->_journal.release({ snapshot.inodeMap, INODE_MAP_BLOCKS });
+		}
+
+		std::copy(list.snapshots + index + 1, list.snapshots + list.count, list.snapshots + index);
+		list.count--;
+		memset(&list.snapshots[list.count], 0, sizeof(snapshot_entry));
+		this->_journal.write(blockAddress(this->_snapshotList), sizeof(list), (const char *)&list);
+	}
+
+	this->_snapshots.erase(this->_snapshots.begin() + index);
+}
+
+
+/**
+ @brief		Returns the names of the snapshots, oldest first.
+ @return	The snapshot names
+ */
+std::vector<std::string> MyFs::list_snapshots()
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_SNAPSHOT);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+
+	struct snapshot_list list;
+	this->readSnapshotList(list);
+
+	std::vector<std::string> names;
+	for (uint32_t i = 0; i < list.count; i++)
+	{
+		names.emplace_back(list.snapshots[i].name, strnlen(list.snapshots[i].name, MAX_FILE_NAME));
+	}
+
+	return names;
+}
+
+
+/**
+ @brief		Reads the snapshot list, an empty one when no snapshot was ever taken.
+ @param		list		Filled with the snapshot list
+ @return	void
+ */
+void MyFs::readSnapshotList(struct snapshot_list& list)
+{
+	memset(&list, 0, sizeof(list));
+
+	if (this->_snapshotList != 0)
+	{
+		this->_journal.read(blockAddress(this->_snapshotList), sizeof(list), (char *)&list);
+		list.count = std::min<uint32_t>(list.count, MAX_SNAPSHOTS);
+	}
+}
+
+
+/**
+ @brief		Looks a snapshot up by name.
+ @param		list		The snapshot list
+ @param		name		The name of the snapshot
+ @return	The index of the snapshot in the list, -1 if there is no such snapshot
+ */
+int MyFs::findSnapshot(const struct snapshot_list& list, const std::string& name)
+{
+	for (uint32_t i = 0; i < list.count; i++)
+	{
+		if (name == std::string(list.snapshots[i].name, strnlen(list.snapshots[i].name, MAX_FILE_NAME)))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/**
+ @brief		Reads the frozen inode map of a snapshot.
+ @param		snapshot	The snapshot
+ @param		chunks		Filled with the first block of every frozen inode chunk, MAX_INODE_CHUNKS long (0 past the
+						last one, all 0 when every inode of the snapshot is in the table)
+ @return	void
+ */
+void MyFs::readSnapshotChunks(const struct snapshot_entry& snapshot, std::vector<uint32_t>& chunks)
+{
+	chunks.assign(MAX_INODE_CHUNKS, 0);
+
+	if (snapshot.inodeMap != 0)
+	{
+		this->_journal.read(blockAddress(snapshot.inodeMap), MAX_INODE_CHUNKS * sizeof(uint32_t), (char *)chunks.data());
+	}
+}
+
+
+/**
+ @brief		Returns the address of an entry of a snapshot's frozen table, or of one of its frozen inode chunks.
+ @param		snapshot	The snapshot
+ @param		chunks		The snapshot's frozen inode chunks (see readSnapshotChunks)
+ @param		inode		The inode number
+ @return	The address of the entry
+ */
+uint64_t MyFs::snapshotEntryAddress(const struct snapshot_entry& snapshot, const std::vector<uint32_t>& chunks,
+	uint32_t inode)
+{
+	if (inode < TABLE_SLOTS)
+	{
+		return blockAddress(snapshot.tableBlock) + (inode * TABLE_ENTRY_SIZE);
+	}
+
+	uint32_t chunk = (inode - TABLE_SLOTS) / INODE_CHUNK_INODES;
+	if (chunk >= chunks.size() || chunks[chunk] == 0)
+	{
+		throw std::runtime_error(RED "Corrupted inode number" RESET);
+	}
+
+	return blockAddress(chunks[chunk]) + ((inode - TABLE_SLOTS) % INODE_CHUNK_INODES) * TABLE_ENTRY_SIZE;
+}
+
+
+/**
+ @brief		Reads an entry of a snapshot's frozen table, or of one of its frozen inode chunks.
+ @param		snapshot	The snapshot
+ @param		chunks		The snapshot's frozen inode chunks (see readSnapshotChunks)
+ @param		inode		The inode number
+ @return	The table entry
+ */
+struct MyFs::table_entry MyFs::readSnapshotEntry(const struct snapshot_entry& snapshot, const std::vector<uint32_t>& chunks,
+	uint32_t inode)
+{
+	struct table_entry entry;
+	this->_journal.read(this->snapshotEntryAddress(snapshot, chunks, inode), TABLE_ENTRY_SIZE, (char *)&entry);
+
+	return entry;
+}
+
+
+/**
+ @brief		Reads the snapshot list and the frozen inode map of every snapshot on it.
+ @return	void
+ */
+void MyFs::loadSnapshots()
+{
+	struct snapshot_list list;
+	this->readSnapshotList(list);
+
+	this->_snapshots.resize(list.count);
+	for (uint32_t i = 0; i < list.count; i++)
+	{
+		this->_snapshots[i].snapshot = list.snapshots[i];
+		this->readSnapshotChunks(list.snapshots[i], this->_snapshots[i].chunks);
+	}
+}
+
+
+/**
+ @brief		Marks every entry of the snapshots ENTRY_FLAG_FROZEN, on an instance of a version that took all the
+			references of a snapshot when the snapshot was taken. The entries are changed a chunk at a time, one
+			transaction per chunk.
+ @return	void
+ */
+void MyFs::freezeSnapshots()
+{
+	this->loadSnapshots();
+
+	for (const frozen_snapshot& frozen : this->_snapshots)
+	{
+		for (uint32_t first = 0; first < frozen.snapshot.fileCount; first += INODE_CHUNK_INODES)
+		{
+			Journal::transaction txn(this->_journal);
+
+			for (uint32_t inode = first; inode < std::min(frozen.snapshot.fileCount, first + INODE_CHUNK_INODES); inode++)
+			{
+				uint64_t address = this->snapshotEntryAddress(frozen.snapshot, frozen.chunks, inode);
+				struct table_entry entry;
+				this->_journal.read(address, TABLE_ENTRY_SIZE, (char *)&entry);
+
+				if (!(entry.flags & ENTRY_FLAG_FROZEN))
+				{
+					entry.flags |= ENTRY_FLAG_FROZEN;
+					this->_journal.write(address, TABLE_ENTRY_SIZE, (const char *)&entry);
+				}
+			}
+		}
+	}
+
+	this->_journal.checkpoint();
+}
+
+
+/**
+ @brief		Rejects changes to a mounted snapshot.
+ @return	void
+ */
+void MyFs::checkWritable() const
+{
+	if (this->_readOnly)
+	{
+		throw std::runtime_error(RED "The snapshot is read-only" RESET);
+	}
+}
+
+
+/**
+ @brief		Hashes the content of a block, a word at a time (non-cryptographic, equal hashes are verified by the
+			caller).
+ @param		block		The block content, BLOCK_SIZE bytes
+ @return	The 64-bit hash
+ */
+uint64_t MyFs::hashBlock(const char *block)
+{
+	static const uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+
+	uint64_t hash = BLOCK_SIZE;
+	for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, block + i, sizeof(word));
+
+		hash ^= word * PRIME_2;
+		hash = ((hash << 31) | (hash >> 33)) * PRIME_1;
+	}
+
+	// Mixing the last words into every bit
+	hash ^= hash >> 33;
+	hash *= PRIME_2;
+	hash ^= hash >> 29;
+	hash *= PRIME_1;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+
+/**
+ @brief		Allocates blocks for a file. Blocks freed since the last checkpoint are only handed back to the allocator
+			by a checkpoint, so one is taken first when the free space alone is too small.
+			In log-structured mode the blocks come from the head of the log, and the cleaner is woken when the free
+			segments run low. An allocation larger than a segment is sequential on its own and is left to the
+			allocator, which keeps it in few extents, and so is what the log can't give when it's out of segments.
+ @param		count		The number of blocks to allocate
+ @param		goal		The block the allocation should preferably start at (0 for no preference)
+ @param		extents		The extent list to append the allocated blocks to
+ @return	void
+ */
+void MyFs::allocateBlocks(uint32_t count, uint32_t goal, BlockAllocator::extent_list& extents)
+{
+	if (this->_allocator.freeBlocks() < count)
+	{
+		this->_journal.checkpoint();
+	}
+
+	if (!this->_log || count > BlockAllocator::SEGMENT_BLOCKS)
+	{
+		this->_allocator.allocate(count, goal, extents);
+		if (this->_log)
+		{
+			this->_logFallbackBlocks += count;
+		}
+		return;
+	}
+
+	BlockAllocator::extent_list appended;
+	uint32_t taken = this->_allocator.append(count, appended);
+
+	// Out of segments - the ones emptied since the last checkpoint are only free after one, which is worth taking
+	// once the log has moved on by a segment since the last time it ran dry
+	uint64_t allocated = this->_logBlocks + this->_logFallbackBlocks;
+	if (taken < count && allocated >= this->_logDryAt + BlockAllocator::SEGMENT_BLOCKS)
+	{
+		this->_logDryAt = allocated;
+		this->_journal.checkpoint();
+		taken += this->_allocator.append(count - taken, appended);
+	}
+
+	if (taken < count)
+	{
+		try
+		{
+			this->_allocator.allocate(count - taken, 0, appended);
+		}
+		catch (const std::runtime_error&)
+		{
+			for (const BlockAllocator::extent& ext : appended)
+			{
+				this->_allocator.release(ext);
+			}
+			throw;
+		}
+		this->_logFallbackBlocks += count - taken;
+	}
+
+	for (const BlockAllocator::extent& ext : appended)
+	{
+		if (!extents.empty() && extents.back().start + extents.back().length == ext.start)
+		{
+			extents.back().length += ext.length;
+		}
+		else
+		{
+			extents.push_back(ext);
+		}
+	}
+
+	this->_logBlocks += taken;
+	if (this->_cleanerRunning && !this->_cleanerWanted && this->_logBlocks >= this->_cleanerRetryAt &&
+		this->_allocator.freeSegments() * CLEANER_LOW_WATER < this->_allocator.segmentCount())
+	{
+		this->wakeCleaner();
+	}
+}
+
+
+/**
+ @brief		Writes a byte range of the given entry, growing the file if the range passes its end. Only the bytes in
+			the range are written, and the table entry is only rewritten when the file size changes. An inline file
+			growing past INLINE_DATA_SIZE is moved to blocks first. The blocks of the range a snapshotted or
+			deduplicated file still shares with a snapshot or another file are copied to new ones (copy on write),
+			the rest of the file is left where it is. The written blocks of a deduplicated file are hashed again.
+ @param		entryInfo		The inode and the entry of the file, updated with the new extents and size
+ @param		offset			The file offset to start writing at, a gap past the current end is filled with zeros
+ @param		length			The number of bytes to write
+ @param		data			The data to write
+ @return	void
+ */
+void MyFs::writeRange(MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, const char *data)
+{
+	if ((uint64_t)offset + length > UINT32_MAX)
+	{
+		throw std::runtime_error(RED "File too large" RESET);
+	}
+
+	uint32_t end = offset + length;
+	bool metadata = entryInfo.second.flags & ENTRY_FLAG_DIRECTORY;
+	bool isInline = entryInfo.second.flags & ENTRY_FLAG_INLINE;
+	bool snapshotted = entryInfo.second.flags & ENTRY_FLAG_SNAPSHOT;
+	bool deduplicated = entryInfo.second.flags & ENTRY_FLAG_DEDUP;
+
+	// Compressed files are never written in place, and neither is a snapshotted or deduplicated file that has no
+	// blocks to redirect (an empty or inline one, rewritten whole is as cheap)
+	if ((entryInfo.second.flags & ENTRY_FLAG_COMPRESSED) ||
+		((snapshotted || deduplicated) && (metadata || isInline || entryInfo.second.size == 0)))
+	{
+		this->rewriteFile(entryInfo, offset, length, data);
+		return;
+	}
+
+	// An empty or inline file that stays small is written in its inline record
+	if (!metadata && end <= INLINE_DATA_SIZE && (isInline || entryInfo.second.size == 0))
+	{
+		this->writeInline(entryInfo, offset, length, data);
+		return;
+	}
+
+	BlockAllocator::extent_list extents;
+	if (isInline)
+	{
+		this->promoteInline(entryInfo, extents);
+	}
+	else
+	{
+		this->loadExtents(entryInfo.second, extents);
+	}
+
+	uint32_t oldSize = entryInfo.second.size;
+	uint32_t start = std::min(offset, oldSize);
+	bool redirected = false;
+
+	// The blocks of the range a snapshot or another file still sees. A deduplicated file's are claimed otherwise, so
+	// no file starts sharing them while they're written
+	bool shared = false;
+	if ((snapshotted || deduplicated) && length > 0)
+	{
+		BlockAllocator::extent_list touched;
+		sliceExtents(extents, start / BLOCK_SIZE, std::min(blocksFor(end), blocksFor(oldSize)) - start / BLOCK_SIZE,
+			touched);
+		shared = deduplicated ? !this->claimBlocks(touched) : this->sharesBlocks(touched);
+	}
+
+	// In log-structured mode no block is written in place, the blocks of the range (and of the gap before it) are
+	// redirected to the head of the log - even the last block of the file when appending to it. Neither are shared
+	// blocks, the file's own copy of them is
+	if ((this->_log || shared) && !metadata && !isInline && length > 0)
+	{
+		this->redirectBlocks(entryInfo, extents, start, end - start);
+		redirected = true;
+	}
+	else if (end > oldSize)
+	{
+		uint32_t oldBlocks = blocksFor(oldSize);
+		this->resizeExtents(entryInfo.second, extents, end);
+
+		if (snapshotted || deduplicated)
+		{
+			BlockAllocator::extent_list grown;
+			sliceExtents(extents, oldBlocks, blocksFor(end) - oldBlocks, grown);
+			this->referenceBlocks(grown);
+		}
+	}
+
+	// Zeroing the gap between the old end of the file and the written range
+	static const char zeros[BLOCK_SIZE] = { 0 };
+	for (uint32_t gap = oldSize; gap < offset; gap += BLOCK_SIZE)
+	{
+		this->writeExtents(extents, gap, std::min<uint32_t>(BLOCK_SIZE, offset - gap), zeros, metadata);
+	}
+
+	this->writeExtents(extents, offset, length, data, metadata);
+
+	// Only the blocks written change their content, the rest of the file keeps its place in the hash index
+	if (deduplicated && length > 0)
+	{
+		BlockAllocator::extent_list written;
+		sliceExtents(extents, start / BLOCK_SIZE, blocksFor(end) - start / BLOCK_SIZE, written);
+		this->indexBlocks(written);
+	}
+
+	if (end > oldSize || redirected)
+	{
+		entryInfo.second.size = std::max(end, oldSize);
+		this->writeTableEntry(entryInfo);
+	}
+}
+
+
+/**
+ @brief		Moves the blocks holding a byte range of a file to newly allocated blocks, so the range can be written
+			without overwriting a block in place, and allocates the blocks of the part past the end of the file. The
+			parts of the first and last block the range leaves alone are copied over, the rest is left for the caller
+			to write. A file that would have more extents than its map chain holds is defragmented on the way: the
+			extents around the range are moved into the same new run, the smaller neighbour first, until the list
+			fits. The entry is pointed at the new blocks, but its size and the table are left untouched, and the old
+			blocks are released with the journal - a block shared with a snapshot only loses the file's reference.
+ @param		entryInfo		The inode and the entry of the file, updated with the new extents
+ @param		extents			The extents of the file, updated in place
+ @param		offset			The file offset of the range, at most the file size
+ @param		length			The length of the range
+ @return	void
+ */
+void MyFs::redirectBlocks(MyFs::EntryInfo& entryInfo, BlockAllocator::extent_list& extents, uint32_t offset,
+	uint32_t length)
+{
+	struct table_entry& entry = entryInfo.second;
+	uint32_t end = offset + length;
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t last = blocksFor(end);		// The end of the blocks the range covers
+
+	// The blocks of the file moved, [from, to) - those the range covers now, and the extents merged into them
+	uint32_t total = blocksFor(entry.size);
+	uint32_t from = first;
+	uint32_t to = std::min(last, total);
+
+	BlockAllocator::extent_list redirected;
+	BlockAllocator::extent_list old;
+	BlockAllocator::extent_list rest;
+	BlockAllocator::extent_list spliced;
+	size_t pieces = 1;		// The runs the moved blocks are expected to land in
+	while (true)
+	{
+		sliceExtents(extents, 0, from, spliced);
+		sliceExtents(extents, to, total - to, rest);
+		if (spliced.size() + pieces + rest.size() > MAX_FILE_EXTENTS && (from > 0 || to < total))
+		{
+			uint32_t before = spliced.empty() ? UINT32_MAX : spliced.back().length;
+			uint32_t after = rest.empty() ? UINT32_MAX : rest.front().length;
+			if (before <= after)
+			{
+				from -= before;
+			}
+			else
+			{
+				to += after;
+			}
+			continue;
+		}
+
+		this->allocateBlocks(std::max(last, to) - from, 0, redirected);
+		for (const BlockAllocator::extent_list *part : { &redirected, &rest })
+		{
+			for (const BlockAllocator::extent& ext : *part)
+			{
+				if (!spliced.empty() && spliced.back().start + spliced.back().length == ext.start)
+				{
+					spliced.back().length += ext.length;
+				}
+				else
+				{
+					spliced.push_back(ext);
+				}
+			}
+		}
+
+		if (spliced.size() <= MAX_FILE_EXTENTS)
+		{
+			break;
+		}
+
+		// The allocation came in more runs than expected
+		for (const BlockAllocator::extent& ext : redirected)
+		{
+			this->_allocator.release(ext);		// Never referenced, no need to wait for the journal
+		}
+		if (from == 0 && to == total)
+		{
+			throw std::runtime_error(RED "File is too fragmented" RESET);
+		}
+		pieces = redirected.size();
+		redirected.clear();
+	}
+	sliceExtents(extents, from, to - from, old);
+
+	// The bytes of the moved blocks outside the range, the tail ones only up to the end of the file
+	auto copyOver = [&](uint32_t at, uint32_t bytes)
+	{
+		char buffer[16 * BLOCK_SIZE];
+		for (uint32_t done = 0; done < bytes; done += sizeof(buffer))
+		{
+			uint32_t chunk = std::min<uint32_t>(sizeof(buffer), bytes - done);
+			this->readExtents(old, at + done, chunk, buffer, false);
+			this->writeExtents(redirected, at + done, chunk, buffer, false);
+		}
+	};
+	uint64_t tailEnd = std::min<uint64_t>((uint64_t)to * BLOCK_SIZE, entry.size);
+	copyOver(0, offset - from * BLOCK_SIZE);
+	copyOver(end - from * BLOCK_SIZE, tailEnd > end ? tailEnd - end : 0);
+
+	try
+	{
+		this->storeExtents(entry, spliced);
+	}
+	catch (const std::runtime_error&)
+	{
+		for (const BlockAllocator::extent& ext : redirected)
+		{
+			this->_allocator.release(ext);
+		}
+		throw;
+	}
+
+	if (entry.flags & (ENTRY_FLAG_SNAPSHOT | ENTRY_FLAG_DEDUP))
+	{
+		this->referenceBlocks(redirected);
+	}
+	for (const BlockAllocator::extent& ext : old)
+	{
+		this->releaseBlocks(ext);
+	}
+
+	this->_defragBlocks += (to - from) - (std::min(last, total) - first);
+	extents = spliced;
+}
+
+
+/**
+ @brief		Collects the extents of a run of blocks of a file.
+ @param		extents		The extents of the file, in file order
+ @param		first		The file block the run starts at
+ @param		count		The number of blocks in the run, which must be within the extents
+ @param		slice		Set to the extents of the run, in file order
+ @return	void
+ */
+void MyFs::sliceExtents(const BlockAllocator::extent_list& extents, uint32_t first, uint32_t count,
+	BlockAllocator::extent_list& slice)
+{
+	slice.clear();
+	uint32_t position = 0;		// The file block of the current extent
+
+	for (size_t i = 0; i < extents.size() && count > 0; i++)
+	{
+		if (first < position + extents[i].length)
+		{
+			uint32_t skip = first - position;
+			uint32_t length = std::min(extents[i].length - skip, count);
+			slice.push_back({ extents[i].start + skip, length });
+			first += length;
+			count -= length;
+		}
+		position += extents[i].length;
+	}
+}
+
+
+/**
+ @brief		Writes a byte range of a file kept in its inline record, which has to hold the whole range. The entry
+			becomes inline and is rewritten when the file grows.
+ @param		entryInfo		The inode and the entry of the file, updated with the new size
+ @param		offset			The file offset to start writing at, a gap past the current end is filled with zeros
+ @param		length			The number of bytes to write
+ @param		data			The data to write
+ @return	void
+ */
+void MyFs::writeInline(MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, const char *data)
+{
+	static const char zeros[INLINE_DATA_SIZE] = { 0 };
+
+	uint64_t address = this->inlineAddress(entryInfo.first);
+	uint32_t oldSize = entryInfo.second.size;
+	uint32_t end = offset + length;
+
+	if (offset > oldSize)
+	{
+		this->_journal.write(address + oldSize, offset - oldSize, zeros);
+	}
+	if (length > 0)
+	{
+		this->_journal.write(address + offset, length, data);
+	}
+
+	if (end > oldSize)
+	{
+		entryInfo.second.flags |= ENTRY_FLAG_INLINE;
+		entryInfo.second.size = end;
+		this->writeTableEntry(entryInfo);
+	}
+}
+
+
+/**
+ @brief		Moves the data of an inline file to newly allocated blocks. The entry is pointed at them but isn't written
+			to the table, the caller does that once the file has grown.
+ @param		entryInfo		The inode and the entry of the file, no longer inline on return
+ @param		extents			Filled with the extents now holding the data
+ @return	void
+ */
+void MyFs::promoteInline(MyFs::EntryInfo& entryInfo, BlockAllocator::extent_list& extents)
+{
+	uint32_t size = entryInfo.second.size;
+	char content[INLINE_DATA_SIZE];
+	this->_journal.read(this->inlineAddress(entryInfo.first), size, content);
+
+	entryInfo.second.flags &= ~ENTRY_FLAG_INLINE;
+	entryInfo.second.size = 0;
+	extents.clear();
+
+	this->resizeExtents(entryInfo.second, extents, size);
+	this->writeExtents(extents, 0, size, content, false);
+	entryInfo.second.size = size;
+}
+
+
+/**
+ @brief		Writes a byte range of a compressed file, or of a snapshotted or deduplicated one with no blocks to
+			redirect. A compressed stream can't be patched in place, so the file is read, changed in memory and
+			written to new blocks as a whole, like set_content does.
+ @param		entryInfo		The inode and the entry of the file, updated with the new extents and size
+ @param		offset			The file offset to start writing at, a gap past the current end is filled with zeros
+ @param		length			The number of bytes to write
+ @param		data			The data to write
+ @return	void
+ */
+void MyFs::rewriteFile(MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, const char *data)
+{
+	uint32_t oldSize = entryInfo.second.size;
+	std::vector<char> content(std::max(oldSize, offset + length));
+
+	this->readFileRange(entryInfo, 0, oldSize, content.data());
+	std::copy(data, data + length, content.begin() + offset);
+
+	this->writeData(entryInfo, content.data(), content.size(), this->storageFlags(entryInfo.second));
+}
+
+
+/**
+ @brief		Looks up a file for writing, creating it if it doesn't exist. The caller holds the device lock.
+ @param		path_str		The file path
+ @return	The inode of the file
+ */
+uint32_t MyFs::openForWrite(const std::string& path_str)
+{
+	uint32_t inode = this->resolvePath(path_str);
+
+	// Checking if the entry was found. Creating a file with the given name if not.
+	if (inode == INODE_NOT_FOUND)
+	{
+		bool created = false;
+		inode = this->createEntry(path_str, false, created);
+	}
+
+	return inode;
+}
+
+
+/**
+ @brief		Resolves a path that has to name an existing file. The caller holds the device lock.
+ @param		path_str		The file path
+ @return	The inode of the file
+ */
+uint32_t MyFs::resolveFile(const std::string& path_str)
+{
+	uint32_t inode = this->resolvePath(path_str);
+
+	// Checking if the entry was found
+	if (inode == INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "File not found" RESET);
+	}
+
+	return inode;
+}
+
+
+/**
+ @brief		Reads the table entry of a file that is about to be read or written, rejecting directories.
+			The caller holds the file lock.
+ @param		inode		The inode of the file
+ @return	The entry info of the file
+ */
+MyFs::EntryInfo MyFs::readFileEntry(uint32_t inode)
+{
+	MyFs::EntryInfo entryInfo = this->readTableEntry(inode);
+
+	if (entryInfo.second.flags & ENTRY_FLAG_DIRECTORY)
+	{
+		throw std::runtime_error(RED "Is a directory" RESET);
+	}
+
+	return entryInfo;
+}
+
+
+/**
+ @brief		Returns the whole content of the file indicated by path_str param.
+ @param		path_str		The file path to get its content
+ @return	The content of the file
+ */
+std::string MyFs::get_content(const std::string& path_str)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_GET_CONTENT);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	uint32_t inode = this->resolveFile(path_str);
+
+	std::shared_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+
+	// Reading the file contents straight into the returned string
+	std::string fileContents(entryInfo.second.size, '\0');
+	this->readFileRange(entryInfo, 0, entryInfo.second.size, &fileContents[0]);
+	
+	return fileContents;
+}
+
+
+/**
+ @brief		Returns a zero-copy view of the whole content of the file indicated by path_str param.
+			Writing to the file (or compacting it) while the view is alive changes what the view sees. Inline and
+			compressed files and devices that can't be viewed (a block cache) get the content copied into the view instead.
+ @param		path_str		The file path to view its content
+ @return	A view made of one segment per extent of the file, or of a single segment over the copy
+ */
+MyFs::file_view MyFs::view_content(const std::string& path_str)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_VIEW_CONTENT);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	uint32_t inode = this->resolveFile(path_str);
+
+	std::shared_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+
+	MyFs::file_view view(this->blkdevsim);
+	view._size = entryInfo.second.size;
+
+	// Inline data may still be in the journal's pending records instead of its home location, and compressed data
+	// has to be decompressed somewhere
+	if (!this->blkdevsim->viewable() || (entryInfo.second.flags & (ENTRY_FLAG_INLINE | ENTRY_FLAG_COMPRESSED)))
+	{
+		view._buffer.resize(entryInfo.second.size);
+		this->readFileRange(entryInfo, 0, entryInfo.second.size, view._buffer.data());
+		view._segments.emplace_back(view._buffer.data(), view._buffer.size());
+		return view;
+	}
+
+	BlockAllocator::extent_list extents;
+	this->loadExtents(entryInfo.second, extents);
+	view._segments.reserve(extents.size());
+
+	uint32_t remaining = entryInfo.second.size;
+	for (const BlockAllocator::extent& ext : extents)
+	{
+		uint32_t length = std::min<uint64_t>((uint64_t)ext.length * BLOCK_SIZE, remaining);
+		view._segments.emplace_back(this->blkdevsim->view(blockAddress(ext.start), length), length);
+		remaining -= length;
+	}
+
+	return view;
+}
+
+
+/**
+ @brief		Constructor - Pins the device so the mapping the view points into stays in place.
+ @param		blkdevsim_		The block device
+ */
+MyFs::file_view::file_view(BlockDevice *blkdevsim_) : blkdevsim(blkdevsim_), _size(0)
+{
+	this->blkdevsim->pin();
+}
+
+
+/**
+ @brief		Move constructor - Takes over the pin of the other view.
+ @param		other		The view to move from
+ */
+MyFs::file_view::file_view(file_view&& other) : blkdevsim(other.blkdevsim), _segments(std::move(other._segments)),
+	_buffer(std::move(other._buffer)), _size(other._size)
+{
+	other.blkdevsim = nullptr;
+	other._size = 0;
+}
+
+
+/**
+ @brief		Destructor - Unpins the device.
+ */
+MyFs::file_view::~file_view()
+{
+	if (this->blkdevsim != nullptr)
+	{
+		this->blkdevsim->unpin();
+	}
+}
+
+
+/**
+ @brief		Overwrites the whole content of the given file and sets it a new content.
+ @param		path_str		The file path to set its content
+ @param		content			The new content of the file
+ @return	void
+ */
+void MyFs::set_content(const std::string& path_str, std::string& content)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_SET_CONTENT);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+	uint32_t inode = this->openForWrite(path_str);
+
+	std::unique_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	Journal::transaction txn(this->_journal);
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+	this->shareWithSnapshots(entryInfo);
+	this->writeData(entryInfo, content.data(), content.length(), this->storageFlags(entryInfo.second));
+	this->_userBytes += content.length();
+}
+
+
+/**
+ @brief		Rewrites the content of the given file compressed, regardless of the compression mode. A file that
+			compression doesn't make smaller stays as it is.
+ @param		path_str		The file path to compress
+ @return	void
+ */
+void MyFs::compress_file(const std::string& path_str)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_COMPRESS);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+	uint32_t inode = this->resolveFile(path_str);
+
+	std::unique_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	Journal::transaction txn(this->_journal);
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+
+	if ((entryInfo.second.flags & (ENTRY_FLAG_COMPRESSED | ENTRY_FLAG_INLINE)) || entryInfo.second.size == 0)
+	{
+		return;
+	}
+
+	this->shareWithSnapshots(entryInfo);
+	std::vector<char> content(entryInfo.second.size);
+	this->readFileRange(entryInfo, 0, content.size(), content.data());
+	this->writeData(entryInfo, content.data(), content.size(), this->storageFlags(entryInfo.second) | ENTRY_FLAG_COMPRESSED);
+}
+
+
+/**
+ @brief		Reads a byte range of the given file (pread style). Only the blocks holding the range are touched.
+ @param		path_str		The file path to read from
+ @param		offset			The file offset to start reading from
+ @param		length			The maximal number of bytes to read
+ @param		buf				The buffer to read into, at least length bytes long
+ @return	The number of bytes read, less than length when the range passes the end of the file
+ */
+uint32_t MyFs::read(const std::string& path_str, uint32_t offset, uint32_t length, char *buf)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_READ);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	uint32_t inode = this->resolveFile(path_str);
+
+	std::shared_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+
+	if (offset >= entryInfo.second.size)
+	{
+		return 0;
+	}
+
+	length = std::min(length, entryInfo.second.size - offset);
+	this->readFileRange(entryInfo, offset, length, buf);
+
+	return length;
+}
+
+
+/**
+ @brief		Writes a byte range of the given file (pwrite style), creating the file if it doesn't exist.
+			Only the bytes in the range are written, and the file size is only updated when the file grows.
+ @param		path_str		The file path to write to
+ @param		offset			The file offset to start writing at
+ @param		length			The number of bytes to write
+ @param		buf				The data to write
+ @return	void
+ */
+void MyFs::write(const std::string& path_str, uint32_t offset, uint32_t length, const char *buf)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_WRITE);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+	uint32_t inode = this->openForWrite(path_str);
+
+	std::unique_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	Journal::transaction txn(this->_journal);
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+	this->shareWithSnapshots(entryInfo);
+	this->writeRange(entryInfo, offset, length, buf);
+	this->_userBytes += length;
+}
+
+
+/**
+ @brief		Appends data to the end of the given file, creating the file if it doesn't exist.
+ @param		path_str		The file path to append to
+ @param		length			The number of bytes to append
+ @param		buf				The data to append
+ @return	void
+ */
+void MyFs::append(const std::string& path_str, uint32_t length, const char *buf)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_APPEND);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	this->checkWritable();
+	uint32_t inode = this->openForWrite(path_str);
+
+	// The size is read under the file lock, so concurrent appends never overlap
+	std::unique_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+	Journal::transaction txn(this->_journal);
+	MyFs::EntryInfo entryInfo = this->readFileEntry(inode);
+	this->shareWithSnapshots(entryInfo);
+	this->writeRange(entryInfo, entryInfo.second.size, length, buf);
+	this->_userBytes += length;
+}
+
+
+/**
+ @brief		Returns a list of a files in a directory, sorted by name. Only the directory's own entries are read.
+ @param		path_str		The directory path to list its files
+ @return	a list of dir_list_entry structures, one for each file in the directory.
+ */
+MyFs::dir_list MyFs::list_dir(const std::string& path_str)
+{
+	dir_list directoryList;
+	this->list_dir(path_str, "", directoryList);
+
+	return directoryList;
+}
+
+
+/**
+ @brief		Returns the files of a directory whose names match a glob pattern ('*' and '?'), sorted by name.
+			The directory entries are filtered in bulk (see DirScan) before any of the files is looked at.
+ @param		path_str		The directory path to list its files
+ @param		pattern			The pattern, empty lists every file
+ @return	a list of dir_list_entry structures, one for each matching file.
+ */
+MyFs::dir_list MyFs::list_dir(const std::string& path_str, const std::string& pattern)
+{
+	dir_list directoryList;
+	this->list_dir(path_str, pattern, directoryList);
+
+	return directoryList;
+}
+
+
+/**
+ @brief		Fills a caller-provided list with the files of a directory whose names match a glob pattern, sorted by
+			name. The list is cleared first and keeps its capacity, a reused list costs no allocations.
+ @param		path_str		The directory path to list its files
+ @param		pattern			The pattern, empty lists every file
+ @param		directoryList	Filled with a dir_list_entry for each matching file
+ @return	void
+ */
+void MyFs::list_dir(const std::string& path_str, const std::string& pattern, dir_list& directoryList)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_LIST_DIR);
+	DirScan::pattern compiled;
+	DirScan::compile(pattern, compiled);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	uint32_t directory = this->resolvePath(path_str);
+
+	if (directory == INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "Directory not found" RESET);
+	}
+
+	char after[MAX_FILE_NAME] = { 0 };
+	directoryList.clear();
+	this->readDirPage(directory, compiled, after, SIZE_MAX, directoryList);
+}
+
+
+/**
+ @brief		Opens a cursor over the files of a directory whose names match a glob pattern (see list_dir).
+ @param		path_str		The directory path to list its files
+ @param		pattern			The pattern, empty lists every file
+ @param		pageSize		The most files in a page
+ @return	The cursor, positioned before the first file
+ */
+MyFs::dir_cursor MyFs::open_dir(const std::string& path_str, const std::string& pattern, size_t pageSize)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_LOOKUP);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+	uint32_t directory = this->resolvePath(path_str);
+
+	if (directory == INODE_NOT_FOUND)
+	{
+		throw std::runtime_error(RED "Directory not found" RESET);
+	}
+	{
+		std::shared_lock<std::shared_mutex> directoryLock(this->inodeLock(directory));
+		if (!(this->readTableEntry(directory).second.flags & ENTRY_FLAG_DIRECTORY))
+		{
+			throw std::runtime_error(RED "Not a directory" RESET);
+		}
+	}
+
+	return dir_cursor(this, directory, pattern, std::max<size_t>(pageSize, 1));
+}
+
+
+MyFs::dir_cursor::dir_cursor(MyFs *fs_, uint32_t directory_, const std::string& pattern, size_t pageSize_) :
+	fs(fs_), directory(directory_), pageSize(pageSize_), done(false)
+{
+	DirScan::compile(pattern, this->compiled);
+	memset(this->after, 0, sizeof(this->after));
+}
+
+
+/**
+ @brief		Reads the next page of the listing.
+ @param		page		Cleared and filled with up to the page size of files, following the previous page
+ @return	True if the page holds any file, false once the listing is over.
+ */
+bool MyFs::dir_cursor::next(dir_list& page)
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_LIST_DIR);
+
+	page.clear();
+	if (this->done)
+	{
+		return false;
+	}
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->fs->_deviceLock);
+	this->done = !this->fs->readDirPage(this->directory, this->compiled, this->after, this->pageSize, page);
+
+	return !page.empty();
+}
+
+
+/**
+ @brief		Appends the files of a directory that come after a name and match a pattern, up to a limit. The entries are
+			filtered in bulk (see DirScan) a leaf at a time, under the directory lock. The files are looked at after
+			it's released, inode locks are never nested. The caller holds the device lock.
+ @param		directory		The inode of the directory
+ @param		compiled		The pattern
+ @param		after			The name to start after (MAX_FILE_NAME zero padded bytes, all zeros to start at the first
+							file), set to the name of the last file appended
+ @param		limit			The most files to append
+ @param		directoryList	The files are appended to it
+ @return	True if there are more matching files after the last one appended, false otherwise.
+ */
+bool MyFs::readDirPage(uint32_t directory, const DirScan::pattern& compiled, char *after, size_t limit,
+	dir_list& directoryList)
+{
+	dir_entries found;
+	bool more = false;
+
+	// Takes the matching entries of a sorted run, returns false once past the limit
+	auto take = [&](const dir_entry *run, uint32_t count)
+	{
+		DirScan::match_list matches;
+		Metrics::count(Metrics::COUNTER_ENTRIES_SCANNED, count);
+		DirScan::scan((const char *)run, count, sizeof(dir_entry), compiled, matches);
+
+		for (uint32_t index : matches)
+		{
+			if (found.size() == limit)
+			{
+				more = true;
+				return false;
+			}
+			found.push_back(run[index]);
+		}
+		return true;
+	};
+
+	{
+		std::shared_lock<std::shared_mutex> directoryLock(this->inodeLock(directory));
+		MyFs::EntryInfo directoryInfo = this->readTableEntry(directory);
+
+		if (!(directoryInfo.second.flags & ENTRY_FLAG_DIRECTORY))
+		{
+			throw std::runtime_error(RED "Not a directory" RESET);
+		}
+
+		directory_store store(*this, directoryInfo);
+		if (DirIndex::isIndex(store))
+		{
+			DirIndex index(store);
+			DirIndex::node leaf;
+			uint32_t position;
+
+			if (index.seek(after, leaf, position))
+			{
+				while (take(leaf.entries + position, leaf.count - position) && index.next(leaf))
+				{
+					position = 0;
+				}
+			}
+		}
+		else
+		{
+			dir_entries entries;
+			this->readDirectory(store, entries);
+
+			const dir_entry *first = std::upper_bound(entries.data(), entries.data() + entries.size(), after,
+				[](const char *key, const dir_entry& entry)
+				{
+					return memcmp(key, entry.name, MAX_FILE_NAME) < 0;
+				});
+			take(first, entries.data() + entries.size() - first);
+		}
+	}
+
+	if (!found.empty())
+	{
+		memcpy(after, found.back().name, MAX_FILE_NAME);
+	}
+
+	directoryList.reserve(directoryList.size() + found.size());
+	for (const dir_entry& entry : found)
+	{
+		struct table_entry fileEntry;
+		uint32_t physical;
+		{
+			std::shared_lock<std::shared_mutex> fileLock(this->inodeLock(entry.inode));
+			fileEntry = this->readTableEntry(entry.inode).second;
+			physical = this->physicalSize(fileEntry);
+		}
+
+		dir_list_entry dle;
+		size_t nameLength = strnlen(entry.name, MAX_FILE_NAME);
+		memcpy(dle.name, entry.name, nameLength);
+		dle.name[nameLength] = '\0';
+		dle.is_dir = fileEntry.flags & ENTRY_FLAG_DIRECTORY;
+		dle.file_size = fileEntry.size;
+		dle.physical_size = physical;
+
+		directoryList.push_back(dle);
+	}
+
+	return more;
+}
+
+
+/**
+ @brief		Returns the number of bytes the data of a file takes on the device - whole blocks, or the inline record.
+			The extent map blocks aren't counted. The caller holds the file lock.
+ @param		entry		The table entry of the file
+ @return	The physical size in bytes
+ */
+uint32_t MyFs::physicalSize(const struct table_entry& entry)
+{
+	if (entry.flags & ENTRY_FLAG_INLINE)
+	{
+		return entry.size;
+	}
+
+	if (entry.flags & ENTRY_FLAG_COMPRESSED)
+	{
+		BlockAllocator::extent_list extents;
+		this->loadExtents(entry, extents);
+
+		uint32_t blocks = 0;
+		for (const BlockAllocator::extent& ext : extents)
+		{
+			blocks += ext.length;
+		}
+		return blocks * BLOCK_SIZE;
+	}
+
+	return blocksFor(entry.size) * BLOCK_SIZE;
+}
+
+
+/**
+ @brief		Collects space usage and fragmentation statistics of the device and the files on it.
+ @return	The collected statistics
+ */
+MyFs::fs_stats MyFs::get_stats()
+{
+	Arena::Scope scope;
+	Metrics::Timer timer(Metrics::OP_GET_STATS);
+
+	std::shared_lock<std::shared_mutex> deviceLock(this->_deviceLock);
+
+	fs_stats stats;
+	stats.blockSize = BLOCK_SIZE;
+	stats.space = this->_allocator.stats();
+	stats.journal = this->_journal.stats();
+	stats.filesWithData = 0;
+	stats.fileExtents = 0;
+	stats.inlineFiles = 0;
+	stats.compressedFiles = 0;
+	stats.compressedBytes = 0;
+	stats.compressedBlocks = 0;
+	stats.dedupFiles = 0;
+	stats.dedupReferences = 0;
+	stats.dedupBlocks = 0;
+	stats.snapshots = 0;
+
+	int fileCount;
+	{
+		std::lock_guard<std::mutex> tableLock(this->_tableMutex);
+		fileCount = this->_fileCount;
+	}
+
+	BlockAllocator::extent_list extents;
+	for (int inode = 0; inode < fileCount; inode++)
+	{
+		std::shared_lock<std::shared_mutex> fileLock(this->inodeLock(inode));
+		struct table_entry entry = this->readTableEntry(inode).second;
+
+		// Slots of creations that failed to link stay unused
+		if (!(entry.flags & ENTRY_FLAG_USED))
+		{
+			continue;
+		}
+
+		if (entry.flags & ENTRY_FLAG_INLINE)
+		{
+			stats.inlineFiles++;
+		}
+
+		this->loadExtents(entry, extents);
+
+		if (!extents.empty())
+		{
+			stats.filesWithData++;
+			stats.fileExtents += extents.size();
+		}
+
+		if (entry.flags & ENTRY_FLAG_COMPRESSED)
+		{
+			stats.compressedFiles++;
+			stats.compressedBytes += entry.size;
+			for (const BlockAllocator::extent& ext : extents)
+			{
+				stats.compressedBlocks += ext.length;
+			}
+		}
+
+		if (entry.flags & ENTRY_FLAG_DEDUP)
+		{
+			stats.dedupFiles++;
+		}
+	}
+
+	struct snapshot_list list;
+	this->readSnapshotList(list);
+	stats.snapshots = list.count;
+
+	{
+		std::lock_guard<std::mutex> dedupLock(this->_dedupMutex);
+		stats.dedupBlocks = this->_blockRefs.size();
+		for (const std::pair<const uint32_t, uint32_t>& refs : this->_blockRefs)
+		{
+			stats.dedupReferences += refs.second;
+		}
+	}
+
+	stats.log.segments = this->_allocator.segmentCount();
+	stats.log.freeSegments = this->_allocator.freeSegments();
+	stats.log.userBytes = this->_userBytes;
+	stats.log.dataBytes = this->_dataBytes;
+	stats.log.journalBytes = stats.journal.loggedBytes + stats.journal.appliedBytes;
+	stats.log.fallbackBlocks = this->_logFallbackBlocks;
+	stats.log.cleanerPasses = this->_cleanerPasses;
+	stats.log.cleanerBlocksMoved = this->_cleanerBlocksMoved;
+	stats.log.segmentsCleaned = this->_segmentsCleaned;
+	stats.log.cleanerNs = this->_cleanerNs;
+	stats.log.defragBlocks = this->_defragBlocks;
+	stats.checksums = this->_checksumDevice.enabled();
+	stats.checksumErrors = this->_checksumDevice.errors();
+
+	return stats;
 }
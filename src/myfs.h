@@ -4,40 +4,187 @@
 #include <memory>
 #include <vector>
 #include <utility>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <string_view>
 #include <stdint.h>
 #include "blkdev.h"
+#include "metereddev.h"
+#include "checksumdev.h"
+#include "allocator.h"
+#include "journal.h"
+#include "dirindex.h"
+#include "dirscan.h"
+#include "arena.h"
 #include "Helper.h"
 
 
 class MyFs
 {
 public:
-	MyFs(BlockDeviceSimulator *blkdevsim_);
+	MyFs(BlockDevice *blkdevsim_);
+	MyFs(BlockDevice *blkdevsim_, const std::string& snapshot);		// Read-only, mounts the snapshot
 	~MyFs();
 
 	struct dir_list_entry
 	{
-		std::string name;
+		char name[MAX_FILE_NAME + 1];		// Null terminated
 		bool is_dir;
 		int file_size;
+		int physical_size;		// The bytes the file takes on the device, less than file_size when compressed
 	};
 	typedef std::vector<struct dir_list_entry> dir_list;
 
+	struct table_entry
+	{
+		char name[MAX_FILE_NAME];		// Not null terminated when the name is exactly MAX_FILE_NAME long
+		uint8_t flags;
+		uint8_t parentHigh;		// The high bits of the parent inode
+		uint16_t parent;		// The inode of the containing directory (its low 16 bits)
+		uint32_t address;		// First data block, or the first extent map block when ENTRY_FLAG_EXTENT_MAP is set (0 when empty)
+		uint32_t size;
+	};
+
+	typedef DirIndex::dir_entry dir_entry;
+
+	struct fs_stats
+	{
+		uint32_t blockSize;
+		BlockAllocator::space_stats space;
+		uint32_t filesWithData;
+		uint32_t fileExtents;
+		uint32_t inlineFiles;
+		uint32_t compressedFiles;
+		uint64_t compressedBytes;		// The logical size of the compressed files
+		uint64_t compressedBlocks;		// The blocks they take
+		uint32_t dedupFiles;
+		uint64_t dedupReferences;		// Block references of the deduplicated files (and of the snapshots)
+		uint64_t dedupBlocks;			// Distinct blocks they reference
+		uint32_t snapshots;
+		Journal::journal_stats journal;
+		bool checksums;					// Every block is checked against its CRC32C
+		uint64_t checksumErrors;		// Blocks reads found bad
+
+		// Write amplification and what the segment cleaner costs, (dataBytes + journalBytes) / userBytes
+		struct log_stats
+		{
+			uint32_t segments;
+			uint32_t freeSegments;			// With no block in use
+			uint64_t userBytes;				// Given to set_content, write and append
+			uint64_t dataBytes;				// File data written to the device, the cleaner's copies included
+			uint64_t journalBytes;			// Metadata written to the journal and then to its home locations
+			uint64_t fallbackBlocks;		// Allocated outside the log in log-structured mode
+			uint64_t cleanerPasses;
+			uint64_t cleanerBlocksMoved;
+			uint64_t segmentsCleaned;		// Left with no block in use by a pass
+			uint64_t cleanerNs;				// Spent in cleaning steps
+			uint64_t defragBlocks;			// Moved along with a write to merge the extents of a file with a full map chain
+		} log;
+	};
+
+	// A read-only view of a file's content pointing straight into the device mapping, one segment per extent.
+	// The device stays pinned for the lifetime of the view. On a device without a mapping the view holds a copy.
+	class file_view
+	{
+	public:
+		file_view(BlockDevice *blkdevsim_);
+		file_view(file_view&& other);
+		file_view(const file_view&) = delete;
+		file_view& operator=(const file_view&) = delete;
+		~file_view();
+
+		const std::vector<std::string_view>& segments() const { return this->_segments; }
+		size_t size() const { return this->_size; }
+
+	private:
+		friend class MyFs;
+
+		BlockDevice *blkdevsim;
+		std::vector<std::string_view> _segments;
+		std::vector<char> _buffer;		// The copied content when the device isn't viewable
+		size_t _size;
+	};
+
+	static const size_t DIR_PAGE_SIZE = 256;		// Entries in a page of a directory cursor
+
+	// Streams the files of a directory in name order, a page at a time. Every page is read under the directory lock
+	// and picks up after the last file the previous one returned, so the cursor stays usable while the directory
+	// changes. The file system has to outlive it.
+	class dir_cursor
+	{
+	public:
+		bool next(dir_list& page);
+
+	private:
+		friend class MyFs;
+		dir_cursor(MyFs *fs_, uint32_t directory_, const std::string& pattern, size_t pageSize_);
+
+		MyFs *fs;
+		uint32_t directory;
+		DirScan::pattern compiled;
+		size_t pageSize;
+		char after[MAX_FILE_NAME];		// The name of the last file returned, zero padded
+		bool done;
+	};
+
 	void format();
 	
-	typedef std::pair<std::string, std::vector<std::string>> EntryInfo;
-	MyFs::EntryInfo getEntryInfo(const std::string& fileName);
+	typedef std::pair<int, struct table_entry> EntryInfo;		// <inode, entry>
+	MyFs::EntryInfo getEntryInfo(const std::string& path_str);
 
-	void addTableEntry(const std::string& fileName, const int& fileAddress, const int& fileSize);
-	void editTableEntry(const std::string& entryToEdit, const std::string& fileName, const int& fileAddress, const int& fileSize);
+	int addTableEntry(std::string_view fileName, const uint32_t& parent, const uint8_t& flags);
 	
-	bool isFileExists(const std::string& fileName);
+	bool isFileExists(const std::string& path_str);
 	void create_file(const std::string& path_str, const bool& directory);
+	void remove_file(const std::string& path_str);
+	void rename_file(const std::string& old_path, const std::string& new_path);
 
 	std::string get_content(const std::string& path_str);
 	void set_content(const std::string& path_str, std::string& content);
+
+	MyFs::file_view view_content(const std::string& path_str);
+
+	uint32_t read(const std::string& path_str, uint32_t offset, uint32_t length, char *buf);
+	void write(const std::string& path_str, uint32_t offset, uint32_t length, const char *buf);
+	void append(const std::string& path_str, uint32_t length, const char *buf);
 	
 	dir_list list_dir(const std::string& path_str);
+	dir_list list_dir(const std::string& path_str, const std::string& pattern);
+	void list_dir(const std::string& path_str, const std::string& pattern, dir_list& directoryList);
+	MyFs::dir_cursor open_dir(const std::string& path_str, const std::string& pattern = "", size_t pageSize = DIR_PAGE_SIZE);
+
+	fs_stats get_stats();
+
+	void compress_file(const std::string& path_str);
+	void setCompression(bool enabled);
+	bool compression() const { return this->_compression; }
+	void setDedup(bool enabled);
+	bool dedup() const { return this->_dedup; }
+
+	void create_snapshot(const std::string& name);
+	void delete_snapshot(const std::string& name);
+	std::vector<std::string> list_snapshots();
+	bool readOnly() const { return this->_readOnly; }
+
+	void grow(uint64_t newSize);
+	void sync();
+	bool compact_step(uint32_t maxBlocks, uint32_t& movedBlocks);
+
+	void setLogStructured(bool enabled);
+	bool logStructured() const { return this->_log; }
+	bool clean_step(uint32_t maxBlocks, uint32_t& movedBlocks);
+
+	void setChecksums(bool enabled);
+	bool checksums() const { return this->_checksumDevice.enabled(); }
+	ChecksumDevice::scrub_stats scrub(unsigned threads = 0);
+
+	static const uint32_t COMPACT_STEP_BLOCKS = 64;		// The blocks a compaction step moves by default
 
 
 private:
@@ -45,14 +192,342 @@ private:
 	{
 		char magic[4];
 		uint8_t version;
+		uint8_t state;		// STATE_MOUNTED while an instance uses the device, still set after a crash
+		uint8_t options;		// HEADER_OPTION_* flags
+		uint8_t stripeWidth;		// The images of the device set the file system was made on, 1 for a single image
+		uint32_t fileCount;
+		uint32_t blockCount;
+		uint64_t bitmapAddress;
+		uint64_t journalAddress;
+		uint32_t journalBlocks;
+		uint32_t stripeChunk;		// The device set's chunk size, 0 on a single image
+		uint64_t inlineAddress;		// The inline records, INLINE_DATA_SIZE bytes per table slot
+		uint32_t snapshotList;		// The snapshot list block, 0 before the first snapshot
+		uint32_t inodeMap;		// The inode map region
+		uint64_t stripeSetId;		// The device set's id, 0 on a single image
 	};
+	static_assert(sizeof(myfs_header) <= TABLE_START_ADDRESS, "myfs_header must fit before the files table");
 
-	BlockDeviceSimulator *blkdevsim;
+	// A file of more than one extent keeps its extent list in a chain of map blocks, MAX_EXTENTS extents in each
+	static const int MAX_EXTENTS = (BLOCK_SIZE - 8) / sizeof(BlockAllocator::extent);
+	static const int MAX_MAP_BLOCKS = 32;
+	static const int MAX_FILE_EXTENTS = MAX_EXTENTS * MAX_MAP_BLOCKS;
+	struct extent_map
+	{
+		uint32_t count;		// The extents in this block
+		uint32_t next;		// The next map block of the file, 0 in the last one
+		BlockAllocator::extent extents[MAX_EXTENTS];
+	};
+	static_assert(sizeof(extent_map) <= BLOCK_SIZE, "extent_map must fit in a single block");
+
+	// A snapshot is a frozen copy of the table followed by one of the inline records, in SNAPSHOT_BLOCKS blocks, and
+	// of the inode chunks in use with an inode map of its own. Its files and directories use the live ones' blocks. An
+	// entry only gets ENTRY_FLAG_FROZEN, and the snapshot's references on its blocks, when the live inode first changes.
+	struct snapshot_entry
+	{
+		char name[MAX_FILE_NAME];		// Not null terminated when the name is exactly MAX_FILE_NAME long
+		uint32_t fileCount;
+		uint32_t tableBlock;		// The first block of the frozen copy
+		uint32_t inodeMap;		// The frozen inode map, 0 when every inode of the snapshot is in the table
+	};
 
-	static const uint8_t CURR_VERSION = 0x03;
+	static const int MAX_SNAPSHOTS = (BLOCK_SIZE - 8) / sizeof(snapshot_entry);
+	struct snapshot_list
+	{
+		uint32_t count;
+		uint32_t reserved;
+		snapshot_entry snapshots[MAX_SNAPSHOTS];
+	};
+	static_assert(sizeof(snapshot_list) <= BLOCK_SIZE, "snapshot_list must fit in a single block");
+
+	// A slot of the dedup index, a block of a deduplicated file and the hash of its content. Block 0 (the header)
+	// marks a free slot.
+	struct dedup_slot
+	{
+		uint64_t hash;
+		uint32_t block;
+		uint32_t reserved;
+	};
+
+	// A block in the dedup index, and the slot it has there
+	struct indexed_block
+	{
+		uint64_t hash;
+		uint32_t slot;
+	};
+
+	// A snapshot of the list with its frozen inode map, read once for the changes that take its references
+	struct frozen_snapshot
+	{
+		struct snapshot_entry snapshot;
+		std::vector<uint32_t> chunks;		// See readSnapshotChunks
+	};
+
+	struct dentry_key
+	{
+		uint32_t parent;
+		char name[MAX_FILE_NAME];
+
+		bool operator==(const dentry_key& other) const;
+	};
+	struct dentry_key_hash
+	{
+		size_t operator()(const dentry_key& key) const;
+	};
+
+	// Temporaries of a single operation, on its arena
+	typedef std::vector<dir_entry, ArenaAllocator<dir_entry>> dir_entries;
+	typedef std::vector<BlockDevice::io_request, ArenaAllocator<BlockDevice::io_request>> io_batch;
+
+	void writeHeader(bool clean = false);
+	void checkDeviceSet(const struct myfs_header& header);
+	static BlockAllocator::extent checksumTable(uint32_t blockCount);
+	void migrateLegacyInstance(const struct myfs_header& header);
+	void migrateTableLocation(const struct myfs_header& header);
+	void migrateJournal(const struct myfs_header& header);
+	void createJournal(uint32_t goal);
+	void createInlineArea(uint32_t goal);
+	void createInodeMap(uint32_t goal);
+	void loadInodeMap(bool dedupChunks);
+	void addInodeChunk(uint32_t chunk);
+	uint32_t allocateRegion(uint32_t count, uint32_t goal, const char *error);
+	void clearTable(uint32_t firstInode);
+	void recover();
+	void writeTableEntry(const MyFs::EntryInfo& entryInfo);
+	MyFs::EntryInfo readTableEntry(uint32_t inode);
+
+	uint64_t chunkAddress(uint32_t inode) const;
+	uint64_t inodeAddress(uint32_t inode) const;
+	uint64_t inlineAddress(uint32_t inode) const;
+	static uint32_t chunksFor(uint32_t fileCount);
+	static dentry_key makeDentryKey(uint32_t parent, const char *name, size_t length);
+
+	uint32_t lookup(uint32_t parent, const char *name, size_t length);
+	uint32_t resolvePath(std::string_view path_str);
+	uint32_t resolveParent(std::string_view path_str, std::string_view& fileName);
+
+	class directory_store;
+	void loadDirectory(uint32_t directory);
+	void readDirectory(directory_store& store, dir_entries& entries);
+	void prepareDirectory(directory_store& store);
+	uint32_t findDirEntry(uint32_t directory, const char *name, size_t length);
+	void insertDirEntry(uint32_t directory, std::string_view name, uint32_t inode);
+	void removeDirEntry(uint32_t directory, std::string_view name);
+	bool readDirPage(uint32_t directory, const DirScan::pattern& compiled, char *after, size_t limit,
+		dir_list& directoryList);
+
+	void readExtents(const BlockAllocator::extent_list& extents, uint32_t offset, uint32_t length, char *data,
+		bool metadata);
+	void writeExtents(const BlockAllocator::extent_list& extents, uint32_t offset, uint32_t length, const char *data,
+		bool metadata);
+	void allocateBlocks(uint32_t count, uint32_t goal, BlockAllocator::extent_list& extents);
+	void resizeExtents(struct table_entry& entry, BlockAllocator::extent_list& extents, uint32_t size);
+
+	void readData(const struct table_entry& entry, char *data);
+	void readFileRange(const MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, char *data);
+	void writeData(MyFs::EntryInfo& entryInfo, const char *data, uint32_t size, uint8_t storage);
+	uint8_t storageFlags(const struct table_entry& entry) const;
+	void writeRange(MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, const char *data);
+	void writeInline(MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, const char *data);
+	void promoteInline(MyFs::EntryInfo& entryInfo, BlockAllocator::extent_list& extents);
+	void rewriteFile(MyFs::EntryInfo& entryInfo, uint32_t offset, uint32_t length, const char *data);
+	static std::vector<char> compressData(const char *data, uint32_t size);
+	void readCompressed(const BlockAllocator::extent_list& extents, uint32_t fileSize, uint32_t offset,
+		uint32_t length, char *data);
+	uint32_t physicalSize(const struct table_entry& entry);
+
+	bool writeDeduplicated(struct table_entry& entry, const char *data, uint32_t size);
+	void releaseBlocks(const BlockAllocator::extent& ext);
+	bool sharesBlocks(const BlockAllocator::extent_list& extents);
+	void referenceBlocks(const BlockAllocator::extent_list& extents);
+	bool claimBlocks(const BlockAllocator::extent_list& extents);
+	void indexBlocks(const BlockAllocator::extent_list& extents);
+	void indexBlock(uint32_t block, uint64_t hash);
+	void unindexBlock(uint32_t block);
+	bool addDedupChunk();
+	uint64_t dedupSlotAddress(uint32_t slot) const;
+	void loadBlockRefs(bool hashBlocks);
+	static uint64_t hashBlock(const char *block);
+
+	void readSnapshotList(struct snapshot_list& list);
+	static int findSnapshot(const struct snapshot_list& list, const std::string& name);
+	void readSnapshotChunks(const struct snapshot_entry& snapshot, std::vector<uint32_t>& chunks);
+	struct table_entry readSnapshotEntry(const struct snapshot_entry& snapshot, const std::vector<uint32_t>& chunks,
+		uint32_t inode);
+	uint64_t snapshotEntryAddress(const struct snapshot_entry& snapshot, const std::vector<uint32_t>& chunks,
+		uint32_t inode);
+	void loadSnapshots();
+	void freezeSnapshots();
+	void shareWithSnapshots(MyFs::EntryInfo& entryInfo);
+	bool sharedWithSnapshots(uint32_t inode);
+	void unshareFile(MyFs::EntryInfo& entryInfo);
+	void checkWritable() const;
+	uint32_t createEntry(const std::string& path_str, bool directory, bool& created);
+	void loadFreeInodes();
+	void releaseInode(uint32_t inode);
+	class relocation;
+	class compaction;
+	class segment_cleaning;
+	uint32_t relocateFile(uint32_t inode, relocation& how, uint32_t maxBlocks);
+	bool pickVictims();
+	void startCleaner();
+	void stopCleaner();
+	void runCleaner();
+	void wakeCleaner();
+	void redirectBlocks(MyFs::EntryInfo& entryInfo, BlockAllocator::extent_list& extents, uint32_t offset,
+		uint32_t length);
+	static void sliceExtents(const BlockAllocator::extent_list& extents, uint32_t first, uint32_t count,
+		BlockAllocator::extent_list& slice);
+	uint32_t openForWrite(const std::string& path_str);
+	uint32_t resolveFile(const std::string& path_str);
+	MyFs::EntryInfo readFileEntry(uint32_t inode);
+
+	void loadExtents(const struct table_entry& entry, BlockAllocator::extent_list& extents);
+	void loadMapBlocks(const struct table_entry& entry, BlockAllocator::extent_list& blocks);
+	void storeExtents(struct table_entry& entry, const BlockAllocator::extent_list& extents);
+	void storeExtents(struct table_entry& entry, const BlockAllocator::extent_list& extents,
+		BlockAllocator::extent_list& mapBlocks);
+	void truncateExtents(BlockAllocator::extent_list& extents, uint32_t blockCount);
+
+	static uint32_t blocksFor(uint64_t size);
+	static uint64_t blockAddress(uint32_t block);
+
+	std::shared_mutex& inodeLock(uint32_t inode);
+
+	ChecksumDevice _checksumDevice;		// Below the metering, so every access is checked
+	MeteredDevice _meteredDevice;		// Every device access goes through it
+	BlockDevice *blkdevsim;
+
+	static const uint8_t CURR_VERSION = 0x13;
+	static const uint8_t TEXT_TABLE_VERSION = 0x03;		// "name|address|size" entries with fixed 1 KiB data slots
+	static const uint8_t SLOT_TABLE_VERSION = 0x04;		// Binary entries with fixed 1 KiB data slots
+	static const uint8_t FLAT_TABLE_VERSION = 0x05;		// Binary entries with extents, single flat namespace
+	static const uint8_t FIXED_BITMAP_VERSION = 0x06;	// 16 bytes header, fixed 1 MiB device with the bitmap at BITMAP_START_ADDRESS
+	static const uint8_t UNJOURNALED_VERSION = 0x07;	// 64 bytes header, metadata written in place without a journal
+	static const uint8_t BLOCK_DATA_VERSION = 0x08;		// Every file's data in blocks, no inline records
+	static const uint8_t INLINE_DATA_VERSION = 0x09;	// No compressed files, the same layout otherwise
+	static const uint8_t COMPRESSED_DATA_VERSION = 0x0A;	// No shared blocks, the same layout otherwise
+	static const uint8_t SHARED_BLOCKS_VERSION = 0x0B;	// No snapshots, the same layout otherwise
+	static const uint8_t FLAT_DIRECTORY_VERSION = 0x0C;	// Sorted entry array directories and no inode map, the same layout otherwise
+	static const uint8_t SINGLE_DEVICE_VERSION = 0x0D;	// Always on a single image, the same layout otherwise
+	static const uint8_t STRIPED_VERSION = 0x0E;		// No block checksums, the same layout otherwise
+	static const uint8_t SINGLE_MAP_VERSION = 0x0F;		// A single extent map block per file, the same layout otherwise
+	static const uint8_t UNMARKED_SUMS_VERSION = 0x10;	// The checksum table only written at a clean unmount, the same layout otherwise
+	static const uint8_t EAGER_SNAPSHOT_VERSION = 0x11;	// The snapshot references all taken with the snapshot, the same layout otherwise
+	static const uint8_t HASHED_DEDUP_VERSION = 0x12;	// No dedup index on the device, the blocks hashed at mount, the same layout otherwise
 	static const char *MYFS_MAGIC;
 
-	int _fileCount;
+	static const uint32_t ROOT_INODE = 0;
+	static const uint32_t INODE_NOT_FOUND = 0xFFFFFFFF;
+	static const uint32_t TABLE_SLOTS = (TABLE_END_ADDRESS - TABLE_START_ADDRESS) / TABLE_ENTRY_SIZE;
+	static const uint32_t INLINE_AREA_SIZE = TABLE_SLOTS * INLINE_DATA_SIZE;
+	static const uint32_t TABLE_SIZE = TABLE_SLOTS * TABLE_ENTRY_SIZE;
+	static const uint32_t SNAPSHOT_BLOCKS = (TABLE_SIZE + INLINE_AREA_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// The inodes past the table live in inode chunks taken from the free space, INODE_CHUNK_INODES table entries
+	// followed by their inline records. The inode map lists the first block of every chunk, in inode order, and
+	// from its end on the chunks of the dedup index, DEDUP_CHUNK_SLOTS slots each, in slot order. At least one free
+	// entry is left between the two.
+	static const uint32_t INODE_CHUNK_INODES = 256;
+	static const uint32_t INODE_CHUNK_TABLE_SIZE = INODE_CHUNK_INODES * TABLE_ENTRY_SIZE;
+	static const uint32_t INODE_CHUNK_BLOCKS = INODE_CHUNK_INODES * (TABLE_ENTRY_SIZE + INLINE_DATA_SIZE) / BLOCK_SIZE;
+	static const uint32_t INODE_MAP_BLOCKS = 64;
+	static const uint32_t MAX_INODE_CHUNKS = INODE_MAP_BLOCKS * BLOCK_SIZE / sizeof(uint32_t);
+	static const uint32_t DEDUP_CHUNK_BLOCKS = 32;
+	static const uint32_t DEDUP_CHUNK_SLOTS = DEDUP_CHUNK_BLOCKS * BLOCK_SIZE / sizeof(dedup_slot);
+	static const uint32_t DENTRY_LOAD_LIMIT = 1024;		// Larger directories aren't read into the dentry cache whole
+	static const uint32_t COMPACT_MAX_STEP_BLOCKS = 128;	// Keeps a step's transaction well within the journal
+	static const uint8_t STATE_CLEAN = 0x00;
+	static const uint8_t STATE_MOUNTED = 0x01;
+	static const int INODE_LOCK_STRIPES = 64;
+	static const uint8_t HEADER_OPTION_COMPRESS = 0x01;		// New file content is compressed
+	static const uint8_t HEADER_OPTION_DEDUP = 0x02;		// New file content shares identical blocks
+	static const uint8_t HEADER_OPTION_LOG = 0x04;		// Blocks are allocated at the head of the log
+	static const uint8_t HEADER_OPTION_CHECKSUMS = 0x08;		// The last blocks of the device hold a CRC32C of every block before them
+
+	// The cleaner is woken when less than 1/CLEANER_LOW_WATER of the segments are free, and cleans until
+	// 1/CLEANER_HIGH_WATER are. A pass cleans the CLEAN_PASS_SEGMENTS least used segments that are at most
+	// CLEAN_MAX_USED percent used.
+	static const uint32_t CLEANER_LOW_WATER = 8;
+	static const uint32_t CLEANER_HIGH_WATER = 4;
+	static const uint32_t CLEAN_PASS_SEGMENTS = 16;
+	static const uint32_t CLEAN_MAX_USED = 75;
+
+	// A compressed file is a sequence of chunks, each holding COMPRESSED_CHUNK_SIZE bytes of the file (the last one
+	// less) behind a 32-bit header - the payload size, with CHUNK_STORED_FLAG set when the chunk didn't compress
+	static const uint32_t COMPRESSED_CHUNK_SIZE = 16384;
+	static const uint32_t CHUNK_STORED_FLAG = 0x80000000;
+
+	// Lock order: _cleanerControl, _compactMutex, _deviceLock, one inode lock, _dentryLock. The allocator and cleaner
+	// mutexes are leaves, the table mutex only takes the allocator's and the journal's (for a new inode chunk), and the
+	// dedup mutex only takes the table mutex and those (for a new dedup index chunk).
+	std::mutex _cleanerControl;		// Held to start or stop the cleaner thread
+	std::mutex _compactMutex;		// Held for a whole compaction or cleaning step, guards where they are at
+	std::shared_mutex _deviceLock;		// Exclusive only while the mapping may move, or for a change to two inodes at once
+	std::shared_mutex _inodeLocks[INODE_LOCK_STRIPES];		// Per-inode reader/writer locks, striped by inode
+	std::shared_mutex _dentryLock;		// Guards the dentry cache and the loaded and large directories sets
+	std::mutex _tableMutex;		// Guards _fileCount, the free inodes and the inode map, so inodes are taken atomically
+	std::mutex _dedupMutex;		// Guards the block references and the block hash index
+
+	int _fileCount;		// The inodes ever used, the removed ones below it are reused first
+	std::vector<uint32_t> _freeInodes;		// Removed inodes, highest first
+	uint32_t _compactInode;		// The next inode compaction looks at
+	bool _compactMoved;		// Whether the current compaction pass moved anything
+	uint32_t _compactLimit;		// The blocks at or past it are moved below it by the current pass, 0 before the pass
+	uint32_t _cleanInode;		// The next inode the cleaning pass looks at
+	bool _cleanMoved;		// Whether the current cleaning pass moved anything
+	std::vector<uint32_t> _cleanVictims;		// The segments the current pass empties, sorted, empty before the pass
+	std::unordered_map<uint32_t, uint32_t> _cleanStuck;		// Segments a pass couldn't empty -> their use then
+	bool _readOnly;		// A mounted snapshot
+	uint64_t _tableAddress;		// TABLE_START_ADDRESS, or the frozen table of a mounted snapshot
+	uint64_t _inlineAddress;
+	uint32_t _snapshotList;
+	std::vector<frozen_snapshot> _snapshots;		// In list order, oldest first. Changed under the exclusive device lock
+	uint32_t _inodeMap;
+	std::vector<uint32_t> _inodeChunks;		// The inode map, MAX_INODE_CHUNKS long so it never moves (0 past the last chunk)
+	std::vector<uint32_t> _dedupChunks;		// The dedup index chunks, changed under both the dedup and the table mutexes
+	std::atomic<bool> _compression;		// Whether set_content compresses, kept in the header options
+	std::atomic<bool> _dedup;		// Whether set_content shares identical blocks, kept in the header options
+	std::atomic<bool> _log;		// Whether blocks are allocated at the head of the log, kept in the header options
+	BlockAllocator _allocator;
+	Journal _journal;
+
+	std::pmr::unsynchronized_pool_resource _dentryPool;		// The dentry cache nodes, reused once the cache is cleared
+	std::pmr::unordered_map<dentry_key, uint32_t, dentry_key_hash> _dentryCache { &this->_dentryPool };		// (parent, name) -> inode
+	std::unordered_set<uint32_t> _loadedDirectories;		// Directories whose entries are all in the dentry cache
+	std::unordered_set<uint32_t> _largeDirectories;		// Directories looked up through their index, one name at a time
+
+	// Every block of a deduplicated file, of a file marked ENTRY_FLAG_SNAPSHOT and of a snapshot entry marked
+	// ENTRY_FLAG_FROZEN has a reference count, rebuilt from the extent lists at mount. A block referenced more than
+	// once is never written in place - the file writing it gets a copy of its own on new blocks instead. The hash
+	// index is kept in the dedup index chunks too, and loaded from them at mount.
+	std::unordered_map<uint32_t, uint32_t> _blockRefs;		// Block -> the number of files and snapshots referencing it
+	std::unordered_map<uint64_t, uint32_t> _dedupIndex;		// Block content hash -> a block holding that content
+	std::unordered_map<uint32_t, indexed_block> _indexedBlocks;		// The indexed blocks -> their hash and slot, to unindex them
+	std::vector<uint32_t> _freeDedupSlots;		// The slots of the dedup index chunks holding no block
+
+	// The segment cleaner of the log-structured mode runs on a thread of its own, woken by the allocations
+	std::thread _cleaner;
+	std::mutex _cleanerMutex;		// Taken to change the two flags below, so a wake-up is never missed
+	std::condition_variable _cleanerWake;
+	std::atomic<bool> _cleanerRunning;		// Cleared to stop the thread
+	std::atomic<bool> _cleanerWanted;		// Set to wake it
+	std::atomic<uint64_t> _cleanerRetryAt;		// The log blocks after which a cleaner that got nowhere is woken again
+
+	std::atomic<uint64_t> _userBytes;
+	std::atomic<uint64_t> _dataBytes;
+	std::atomic<uint64_t> _logBlocks;		// Allocated at the head of the log
+	std::atomic<uint64_t> _logFallbackBlocks;
+	std::atomic<uint64_t> _logDryAt;		// The blocks allocated by the last time the log ran out of segments
+	std::atomic<uint64_t> _cleanerPasses;
+	std::atomic<uint64_t> _cleanerBlocksMoved;
+	std::atomic<uint64_t> _segmentsCleaned;
+	std::atomic<uint64_t> _cleanerNs;
+	std::atomic<uint64_t> _defragBlocks;
 };
 
+static_assert(sizeof(MyFs::table_entry) == TABLE_ENTRY_SIZE, "table_entry must fill exactly one table slot");
+static_assert(sizeof(MyFs::dir_entry) == DIR_ENTRY_SIZE, "dir_entry must match the on-disk directory entry size");
+static_assert(sizeof(MyFs::dir_entry) >= 16, "DirScan compares 16 bytes at the start of every directory entry");
+
 #endif // __MYFS_H__
@@ -0,0 +1,733 @@
+#include "blkdev.h"
+#include "blockcache.h"
+#include "myfs.h"
+#include "asyncfs.h"
+#include "dirscan.h"
+#include "metrics.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+// Table sizes (files in the root directory) every benchmark is run at. The table holds 30 entries including the root,
+// the larger sizes take inode chunks.
+static const int TABLE_SIZES[] = { 1, 4, 8, 16, 28 };
+static const int DIRECTORY_SIZES[] = { 1000, 10000, 100000 };		// Files in the large directory benchmarks
+static const int SCAN_SIZES[] = { 1000, 10000, 50000 };		// Directory entries the scan kernels run over, in memory
+static const int QUEUE_DEPTHS[] = { 1, 4, 16, 64 };		// Operations the async benchmarks keep in flight
+static const int ASYNC_FILES = 256;		// Files the async benchmarks spread their operations over
+static const uint32_t FILE_SIZE = 4096;		// Size of the files read and overwritten
+static const uint64_t DEVICE_SIZE = 4 * 1024 * 1024;
+static const uint64_t LARGE_DEVICE_SIZE = 64 * 1024 * 1024;		// Grown to for the large directories
+static const size_t MIN_ITERATIONS = 100;
+static const double MAX_WALL_TIME_FACTOR = 10;		// Bounds the untimed setup time to this many times the minimum time
+
+
+// The heap allocations the thread has made - operator new is replaced below, every benchmark reports how many
+// allocations an operation makes on top of its latency
+static thread_local uint64_t allocations = 0;
+
+
+void *operator new(size_t size)
+{
+	allocations++;
+
+	void *p = malloc(size > 0 ? size : 1);
+	if (p == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return p;
+}
+
+
+// GCC can't tell that operator new above is the malloc these frees pair with
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+
+void operator delete(void *p, size_t size) noexcept
+{
+	free(p);
+}
+
+#pragma GCC diagnostic pop
+
+
+struct bench_result
+{
+	std::string name;
+	int files;
+	size_t iterations;
+	double opsPerSec;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+	double allocsPerOp;
+};
+
+
+/**
+ * @brief       Returns the path of the n-th benchmark file.
+ * @param       n           The file number
+ * @return      The file path
+ */
+static std::string file_path(int n)
+{
+	return "/file" + std::to_string(n);
+}
+
+
+/**
+ * @brief       Formats the file system and fills the root directory with the given number of files.
+ * @param       myfs        The file system
+ * @param       files       The number of files to create
+ * @return      void
+ */
+static void prepare(MyFs& myfs, int files)
+{
+	std::string content(FILE_SIZE, 'x');
+
+	myfs.format();
+	for (int i = 0; i < files; i++)
+	{
+		myfs.set_content(file_path(i), content);
+	}
+}
+
+
+/**
+ * @brief       Runs an operation until the minimum time has passed, timing every call on its own. Benchmarks with a
+ *              slow setup stop early once the wall time reaches MAX_WALL_TIME_FACTOR times the minimum time.
+ * @param       name        The benchmark name
+ * @param       files       The table size the benchmark runs at
+ * @param       minTime     The minimum time spent in the operation, in seconds
+ * @param       setup       Called before every call of the operation, not timed (may be empty)
+ * @param       op          The operation, called with the iteration number
+ * @return      The ops/sec and the latency percentiles
+ */
+static bench_result run(const std::string& name, int files, double minTime, const std::function<void()>& setup,
+	const std::function<void(size_t)>& op)
+{
+	std::vector<uint64_t> latencies;
+	uint64_t opAllocations = 0;
+	std::chrono::steady_clock::duration total(0);
+	std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+	while (latencies.size() < MIN_ITERATIONS || (std::chrono::duration<double>(total).count() < minTime &&
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count() < minTime * MAX_WALL_TIME_FACTOR))
+	{
+		if (setup)
+		{
+			setup();
+		}
+
+		uint64_t allocationsBefore = allocations;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		op(latencies.size());
+		std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+		opAllocations += allocations - allocationsBefore;
+
+		total += elapsed;
+		latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	bench_result result;
+	result.name = name;
+	result.files = files;
+	result.iterations = latencies.size();
+	result.opsPerSec = latencies.size() / std::chrono::duration<double>(total).count();
+	result.p50 = latencies[latencies.size() * 50 / 100];
+	result.p90 = latencies[latencies.size() * 90 / 100];
+	result.p99 = latencies[latencies.size() * 99 / 100];
+	result.max = latencies.back();
+	result.allocsPerOp = (double)opAllocations / latencies.size();
+
+	return result;
+}
+
+
+/**
+ * @brief       Keeps the given number of operations in flight until the minimum time has passed, submitting a new one
+ *              as soon as the oldest completes. Every operation is timed from its submission to its completion, the
+ *              throughput is the operations completed over the wall time.
+ * @param       name        The benchmark name
+ * @param       files       The number of files the operations are spread over
+ * @param       minTime     The minimum time, in seconds
+ * @param       depth       The number of operations in flight
+ * @param       submit      Submits an operation, called with the iteration number
+ * @return      The ops/sec and the latency percentiles
+ */
+static bench_result run_async(const std::string& name, int files, double minTime, int depth,
+	const std::function<std::future<void>(size_t)>& submit)
+{
+	typedef std::pair<std::chrono::steady_clock::time_point, std::future<void>> in_flight;
+
+	std::vector<uint64_t> latencies;
+	std::deque<in_flight> window;
+	size_t submitted = 0;
+	uint64_t allocationsBefore = allocations;
+	std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		bool done = latencies.size() >= MIN_ITERATIONS &&
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count() >= minTime;
+
+		while (!done && (int)window.size() < depth)
+		{
+			window.emplace_back(std::chrono::steady_clock::now(), submit(submitted++));
+		}
+		if (window.empty())
+		{
+			break;
+		}
+
+		window.front().second.get();
+		latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - window.front().first).count());
+		window.pop_front();
+	}
+
+	double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+	std::sort(latencies.begin(), latencies.end());
+
+	bench_result result;
+	result.name = name;
+	result.files = files;
+	result.iterations = latencies.size();
+	result.opsPerSec = latencies.size() / wallTime;
+	result.p50 = latencies[latencies.size() * 50 / 100];
+	result.p90 = latencies[latencies.size() * 90 / 100];
+	result.p99 = latencies[latencies.size() * 99 / 100];
+	result.max = latencies.back();
+	result.allocsPerOp = (double)(allocations - allocationsBefore) / latencies.size();		// Of the submitting thread
+
+	return result;
+}
+
+
+/**
+ * @brief       Runs the directory scan kernels over synthetic directories far bigger than the table can hold - a prefix
+ *              pattern ("file1*") per instruction set, a suffix pattern ("*.log") and, as the baseline, matching
+ *              every name after copying it into a string, the way listing used to.
+ * @param       results     The results are appended to it
+ * @param       minTime     The minimum time of every benchmark, in seconds
+ * @return      void
+ */
+static void run_scans(std::vector<bench_result>& results, double minTime)
+{
+	static const std::pair<const char *, DirScan::simd_level> LEVELS[] =
+	{
+		{ "scan_scalar", DirScan::SIMD_NONE },
+		{ "scan_sse2", DirScan::SIMD_SSE2 },
+		{ "scan_avx2", DirScan::SIMD_AVX2 }
+	};
+	volatile uint64_t sink = 0;
+
+	for (int entries : SCAN_SIZES)
+	{
+		std::vector<MyFs::dir_entry> directory(entries);
+		for (int i = 0; i < entries; i++)
+		{
+			memset(&directory[i], 0, sizeof(MyFs::dir_entry));
+			snprintf(directory[i].name, MAX_FILE_NAME, "file%d.%s", i, (i % 4 == 0) ? "log" : "txt");
+			directory[i].inode = i;
+		}
+
+		const char *data = (const char *)directory.data();
+		DirScan::match_list matches;
+		DirScan::pattern prefix;
+		DirScan::pattern suffix;
+		DirScan::compile("file1*", prefix);
+		DirScan::compile("*.log", suffix);
+
+		results.push_back(run("scan_strings", entries, minTime, nullptr, [&](size_t i)
+		{
+			matches.clear();
+			for (int j = 0; j < entries; j++)
+			{
+				std::string name(directory[j].name, strnlen(directory[j].name, MAX_FILE_NAME));
+				if (DirScan::match(prefix.glob.data(), prefix.glob.length(), name.data(), name.length()))
+				{
+					matches.push_back(j);
+				}
+			}
+			sink += matches.size();
+		}));
+
+		for (const auto& level : LEVELS)
+		{
+			if (level.second > DirScan::best())
+			{
+				continue;
+			}
+
+			results.push_back(run(level.first, entries, minTime, nullptr, [&](size_t i)
+			{
+				DirScan::scan(data, entries, sizeof(MyFs::dir_entry), prefix, matches, level.second);
+				sink += matches.size();
+			}));
+		}
+
+		results.push_back(run("scan_suffix", entries, minTime, nullptr, [&](size_t i)
+		{
+			DirScan::scan(data, entries, sizeof(MyFs::dir_entry), suffix, matches);
+			sink += matches.size();
+		}));
+	}
+}
+
+
+/**
+ * @brief       Runs the directory benchmarks on a single directory holding many files, past what the dentry cache
+ *              loads whole - creating a file, looking a file (or a missing name) up through the directory index, and
+ *              reading the first page of a cursor. The device is grown to LARGE_DEVICE_SIZE first.
+ * @param       myfs        The file system to run on, its content is wiped
+ * @param       results     The results are appended to it
+ * @param       minTime     The minimum time of every benchmark, in seconds
+ * @return      void
+ */
+static void run_large_dirs(MyFs& myfs, std::vector<bench_result>& results, double minTime)
+{
+	MyFs::dir_list page;
+	volatile uint64_t sink = 0;
+
+	// Formatting keeps the device size
+	myfs.grow(LARGE_DEVICE_SIZE);
+
+	for (int files : DIRECTORY_SIZES)
+	{
+		myfs.format();
+		myfs.create_file("/dir", true);
+		for (int i = 0; i < files; i++)
+		{
+			myfs.create_file("/dir" + file_path(i), false);
+		}
+
+		// Every call adds a file, the directory grows by at most the iteration count
+		results.push_back(run("dir_create", files, minTime, nullptr, [&](size_t i)
+		{
+			myfs.create_file("/dir/new" + std::to_string(i), false);
+		}));
+
+		results.push_back(run("dir_lookup_hit", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.getEntryInfo("/dir" + file_path((i * 7919) % files)).first;
+		}));
+
+		results.push_back(run("dir_lookup_miss", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.getEntryInfo("/dir/missing").first;
+		}));
+
+		results.push_back(run("dir_page", files, minTime, nullptr, [&](size_t i)
+		{
+			MyFs::dir_cursor cursor = myfs.open_dir("/dir");
+			cursor.next(page);
+			sink += page.size();
+		}));
+	}
+}
+
+
+/**
+ * @brief       Runs 4K reads and overwrites spread over ASYNC_FILES files, one at a time through the blocking calls,
+ *              then through the async front end at every queue depth.
+ * @param       myfs        The file system to run on, its content is wiped
+ * @param       results     The results are appended to it
+ * @param       minTime     The minimum time of every benchmark, in seconds
+ * @param       threads     The async front end's workers, 0 for one per hardware thread
+ * @return      void
+ */
+static void run_queue_depths(MyFs& myfs, std::vector<bench_result>& results, double minTime, unsigned threads)
+{
+	std::string content(FILE_SIZE, 'z');
+	volatile uint64_t sink = 0;
+
+	prepare(myfs, ASYNC_FILES);
+
+	// The buffers of the reads in flight, one per file, so concurrent reads never share one
+	std::vector<std::vector<char>> buffers(ASYNC_FILES, std::vector<char>(FILE_SIZE));
+	std::vector<std::string> paths;
+	for (int i = 0; i < ASYNC_FILES; i++)
+	{
+		paths.push_back(file_path(i));
+	}
+
+	// Spreading the operations over the files, consecutive ones on different files
+	auto fileOf = [](size_t i) { return (i * 97) % ASYNC_FILES; };
+
+	results.push_back(run("sync_read", ASYNC_FILES, minTime, nullptr, [&](size_t i)
+	{
+		sink += myfs.read(paths[fileOf(i)], 0, FILE_SIZE, buffers[fileOf(i)].data());
+	}));
+
+	results.push_back(run("sync_write", ASYNC_FILES, minTime, nullptr, [&](size_t i)
+	{
+		myfs.write(paths[fileOf(i)], 0, FILE_SIZE, content.data());
+	}));
+
+	AsyncFs afs(myfs, threads);
+
+	for (int depth : QUEUE_DEPTHS)
+	{
+		results.push_back(run_async("async_read_qd" + std::to_string(depth), ASYNC_FILES, minTime, depth, [&](size_t i)
+		{
+			return afs.submit(paths[fileOf(i)], AsyncFs::ACCESS_READ, [&, i](MyFs& fs)
+			{
+				sink += fs.read(paths[fileOf(i)], 0, FILE_SIZE, buffers[fileOf(i)].data());
+			});
+		}));
+
+		results.push_back(run_async("async_write_qd" + std::to_string(depth), ASYNC_FILES, minTime, depth, [&](size_t i)
+		{
+			return afs.submit(paths[fileOf(i)], AsyncFs::ACCESS_WRITE, [&, i](MyFs& fs)
+			{
+				fs.write(paths[fileOf(i)], 0, FILE_SIZE, content.data());
+			});
+		}));
+	}
+}
+
+
+/**
+ * @brief       Runs every benchmark at every table size.
+ * @param       myfs        The file system to run on, its content is wiped
+ * @param       minTime     The minimum time of every benchmark, in seconds
+ * @param       threads     The async front end's workers, 0 for one per hardware thread
+ * @return      The results
+ */
+static std::vector<bench_result> run_all(MyFs& myfs, double minTime, unsigned threads)
+{
+	std::vector<bench_result> results;
+	std::string content(FILE_SIZE, 'y');
+	std::vector<char> buffer(FILE_SIZE);
+	MyFs::dir_list listing;		// Reused by list_into, like a caller that lists over and over
+	volatile uint64_t sink = 0;		// Keeps the reads from being optimised away
+
+	for (int files : TABLE_SIZES)
+	{
+		// Files can't be removed, so the table is rebuilt before every create
+		results.push_back(run("create", files, minTime, [&]()
+		{
+			prepare(myfs, files);
+		},
+		[&](size_t i)
+		{
+			myfs.create_file(file_path(files), false);
+		}));
+
+		prepare(myfs, files);
+
+		results.push_back(run("lookup_hit", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.getEntryInfo(file_path(i % files)).second.size;
+		}));
+
+		results.push_back(run("lookup_miss", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.getEntryInfo("/missing").first;
+		}));
+
+		// The copy path (get_content) against the zero-copy path (view_content) of cat
+		results.push_back(run("read_copy", files, minTime, nullptr, [&](size_t i)
+		{
+			std::string fileContent = myfs.get_content(file_path(i % files));
+			sink += fileContent.size() + (unsigned char)fileContent.back();
+		}));
+
+		results.push_back(run("read_view", files, minTime, nullptr, [&](size_t i)
+		{
+			MyFs::file_view view = myfs.view_content(file_path(i % files));
+			for (const std::string_view& segment : view.segments())
+			{
+				sink += segment.size() + (unsigned char)segment.back();
+			}
+		}));
+
+		// Into a caller-provided buffer, the read path that allocates nothing
+		results.push_back(run("read_buffer", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.read(file_path(i % files), 0, FILE_SIZE, buffer.data()) + (unsigned char)buffer.back();
+		}));
+
+		results.push_back(run("overwrite", files, minTime, nullptr, [&](size_t i)
+		{
+			myfs.set_content(file_path(i % files), content);
+		}));
+
+		results.push_back(run("list", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.list_dir("/").size();
+		}));
+
+		results.push_back(run("list_into", files, minTime, nullptr, [&](size_t i)
+		{
+			myfs.list_dir("/", "", listing);
+			sink += listing.size();
+		}));
+
+		results.push_back(run("list_glob", files, minTime, nullptr, [&](size_t i)
+		{
+			sink += myfs.list_dir("/", "file1*").size();
+		}));
+	}
+
+	run_scans(results, minTime);
+	run_queue_depths(myfs, results, minTime, threads);
+	run_large_dirs(myfs, results, minTime);
+
+	return results;
+}
+
+
+/**
+ * @brief       Prints the results as tab separated lines under a header line.
+ * @param       out         The stream to print to
+ * @param       results     The results
+ * @return      void
+ */
+static void print_table(std::ostream& out, const std::vector<bench_result>& results)
+{
+	out << "benchmark\tfiles\titerations\tops_per_sec\tp50_ns\tp90_ns\tp99_ns\tmax_ns\tallocs_per_op" << std::endl;
+
+	for (const bench_result& result : results)
+	{
+		out << result.name << '\t' << result.files << '\t' << result.iterations << '\t'
+			<< std::fixed << std::setprecision(0) << result.opsPerSec << '\t'
+			<< result.p50 << '\t' << result.p90 << '\t' << result.p99 << '\t' << result.max << '\t'
+			<< std::setprecision(2) << result.allocsPerOp << std::endl;
+	}
+}
+
+
+/**
+ * @brief       Prints the results as JSON, laid out like Google Benchmark's JSON reporter.
+ * @param       out         The stream to print to
+ * @param       results     The results
+ * @return      void
+ */
+static void print_json(std::ostream& out, const std::vector<bench_result>& results)
+{
+	out << "{" << std::endl;
+	out << "  \"context\": { \"file_size\": " << FILE_SIZE << ", \"device_size\": " << DEVICE_SIZE
+		<< ", \"block_size\": " << BLOCK_SIZE << " }," << std::endl;
+	out << "  \"benchmarks\": [" << std::endl;
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const bench_result& result = results[i];
+
+		out << "    { \"name\": \"" << result.name << "/files:" << result.files << "\", \"iterations\": " << result.iterations
+			<< ", \"ops_per_sec\": " << std::fixed << std::setprecision(1) << result.opsPerSec
+			<< ", \"p50_ns\": " << result.p50 << ", \"p90_ns\": " << result.p90 << ", \"p99_ns\": " << result.p99
+			<< ", \"max_ns\": " << result.max << ", \"allocs_per_op\": " << std::setprecision(2) << result.allocsPerOp
+			<< " }" << (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+
+	out << "  ]" << std::endl;
+	out << "}" << std::endl;
+}
+
+
+/**
+ * @brief       Removes the device image, or every image of a comma separated list.
+ * @param       imageName   The image, or the images
+ * @return      void
+ */
+static void remove_images(const std::string& imageName)
+{
+	std::stringstream images(imageName);
+	std::string image;
+
+	while (std::getline(images, image, ','))
+	{
+		remove(image.c_str());
+	}
+}
+
+
+static void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [--json] [--min-time <seconds>] [--backend <name>] [--cache <blocks>] [--image <file>[,<file>...]] [--chunk <bytes>] [--threads <n>] [--no-timing]" << std::endl;
+	std::cerr << "  --json                Print the results as JSON instead of tab separated lines" << std::endl;
+	std::cerr << "  --min-time <seconds>  Minimum time spent in every benchmark, defaults to 0.2" << std::endl;
+	std::cerr << "  --backend <name>      The device backend: mmap (default), pread or uring" << std::endl;
+	std::cerr << "  --cache <blocks>      Run through a block cache of the given number of 4K blocks" << std::endl;
+	std::cerr << "  --image <file>        The device image to run on, recreated, defaults to myfs_bench.img. A comma separated" << std::endl;
+	std::cerr << "                        list stripes the file system over the images" << std::endl;
+	std::cerr << "  --chunk <bytes>       The bytes that go to an image before the next one, defaults to 65536" << std::endl;
+	std::cerr << "  --threads <n>         The async benchmarks' workers, defaults to one per hardware thread" << std::endl;
+	std::cerr << "  --no-timing           Turn off the per-operation latency histograms, to measure what they cost" << std::endl;
+}
+
+
+int main(int argc, char **argv)
+{
+	bool json = false;
+	double minTime = 0.2;
+	uint32_t cacheBlocks = 0;
+	unsigned threads = 0;
+	BlockDevice::options options;
+	options.size = DEVICE_SIZE;
+	std::string imageName = "myfs_bench.img";
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--json")
+		{
+			json = true;
+		}
+		else if (arg == "--min-time" && i + 1 < argc)
+		{
+			try
+			{
+				minTime = std::stod(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--backend" && i + 1 < argc)
+		{
+			std::string backend = argv[++i];
+
+			if (backend == "mmap")
+			{
+				options.backend = BlockDevice::BACKEND_MMAP;
+			}
+			else if (backend == "pread")
+			{
+				options.backend = BlockDevice::BACKEND_PREAD;
+			}
+			else if (backend == "uring")
+			{
+				options.backend = BlockDevice::BACKEND_URING;
+			}
+			else
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--cache" && i + 1 < argc)
+		{
+			try
+			{
+				cacheBlocks = std::stoul(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+		{
+			try
+			{
+				threads = std::stoul(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--image" && i + 1 < argc)
+		{
+			imageName = argv[++i];
+		}
+		else if (arg == "--chunk" && i + 1 < argc)
+		{
+			try
+			{
+				options.stripeChunk = std::stoul(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--no-timing")
+		{
+			Metrics::setTiming(false);
+		}
+		else
+		{
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	// The file system reports to std::cout, the results get the real stdout to themselves
+	std::ostream out(std::cout.rdbuf());
+	std::cout.rdbuf(nullptr);
+
+	std::vector<bench_result> results;
+	remove_images(imageName);
+
+	try
+	{
+		std::unique_ptr<BlockDevice> blkdev(BlockDevice::open(imageName, options));
+		std::unique_ptr<BlockCache> cache;
+		BlockDevice *device = blkdev.get();
+
+		if (cacheBlocks > 0)
+		{
+			cache.reset(new BlockCache(blkdev.get(), cacheBlocks));
+			device = cache.get();
+		}
+
+		MyFs myfs(device);
+
+		results = run_all(myfs, minTime, threads);
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << e.what() << std::endl;
+		remove_images(imageName);
+		return -1;
+	}
+
+	remove_images(imageName);
+
+	if (json)
+	{
+		print_json(out, results);
+	}
+	else
+	{
+		print_table(out, results);
+	}
+
+	return 0;
+}
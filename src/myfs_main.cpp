@@ -1,11 +1,19 @@
 #include "blkdev.h"
+#include "blockcache.h"
 #include "myfs.h"
+#include "dirscan.h"
+#include "metrics.h"
+#include "crc32c.h"
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <iomanip>
+#include <fstream>
+#include <iterator>
+#include <chrono>
+#include <algorithm>
 
 
 std::vector<std::string> split_cmd(const std::string& cmd)
@@ -23,6 +31,150 @@ std::vector<std::string> split_cmd(const std::string& cmd)
 }
 
 
+/**
+ * @brief       Reads content lines until an empty line (or the end of the input) is reached.
+ * @param       input       The stream to read the lines from
+ * @param       prompt      Whether to prompt for every line
+ * @return      The entered content, every line terminated with a new line
+ */
+static std::string read_content(std::istream& input, bool prompt)
+{
+	std::string content;
+	std::string curr_line;
+
+	if (prompt)
+	{
+		std::cout << CYAN "> " RESET;
+	}
+	while (std::getline(input, curr_line) && curr_line != "")
+	{
+		if (prompt)
+		{
+			std::cout << CYAN "> " RESET;
+		}
+		content += curr_line + "\n";
+	}
+
+	return content;
+}
+
+
+/**
+ * @brief       Reads a whole host file into memory.
+ * @param       path        The path of the host file
+ * @return      The content of the file
+ */
+static std::string read_host_file(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+	{
+		throw std::runtime_error(RED "Could not open host file " + path + RESET);
+	}
+
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+
+// Drops ANSI colour sequences from everything written to the given stream while it is alive, so batch output stays
+// plain text
+class ansi_filter_buf : public std::streambuf
+{
+public:
+	ansi_filter_buf(std::ostream& stream_) : stream(stream_), target(stream_.rdbuf()), inEscape(false)
+	{
+		this->stream.rdbuf(this);
+	}
+
+	~ansi_filter_buf()
+	{
+		this->stream.rdbuf(this->target);
+	}
+
+protected:
+	int overflow(int ch) override
+	{
+		if (ch == EOF)
+		{
+			return 0;
+		}
+
+		if (ch == '\033')
+		{
+			this->inEscape = true;
+		}
+		else if (this->inEscape)
+		{
+			this->inEscape = (ch != 'm');
+		}
+		else
+		{
+			return this->target->sputc(ch);
+		}
+
+		return ch;
+	}
+
+	int sync() override
+	{
+		return this->target->pubsync();
+	}
+
+private:
+	std::ostream& stream;
+	std::streambuf *target;
+	bool inEscape;
+};
+
+
+static void print_metrics()
+{
+	Metrics::metrics_snapshot snapshot = Metrics::collect();
+
+	std::cout << CYAN << std::setw(16) << std::left << "Operation" << std::setw(12) << std::right << "Count" << std::setw(12) << "Mean us"
+		<< std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "Max us" << std::setw(14) << "Total ms" << RESET << std::endl;
+	std::cout << std::fixed << std::setprecision(1);
+
+	for (int op = 0; op < Metrics::OPERATION_COUNT; op++)
+	{
+		const Metrics::operation_stats& stats = snapshot.operations[op];
+		if (stats.count == 0)
+		{
+			continue;
+		}
+
+		uint64_t timed = std::max<uint64_t>(stats.timed(), 1);
+
+		std::cout << MAGENTA << std::setw(16) << std::left << Metrics::operationName((Metrics::operation)op) << BOLDYELLOW << std::right
+			<< std::setw(12) << stats.count << std::setw(12) << stats.totalNs / 1000.0 / timed
+			<< std::setw(12) << stats.percentile(0.5) / 1000.0 << std::setw(12) << stats.percentile(0.99) / 1000.0
+			<< std::setw(12) << stats.maxNs / 1000.0 << std::setw(14) << stats.totalNs / 1000000.0 << RESET << std::endl;
+	}
+
+	for (int c = 0; c < Metrics::COUNTER_COUNT; c++)
+	{
+		std::cout << CYAN << std::setw(25) << std::left << Metrics::counterName((Metrics::counter)c) << BOLDYELLOW
+			<< snapshot.counters[c] << RESET << std::endl;
+	}
+
+	uint64_t loads = snapshot.counters[Metrics::COUNTER_DIRECTORY_LOADS];
+	std::cout << CYAN << std::setw(25) << std::left << "entries_per_load" << BOLDYELLOW
+		<< (loads == 0 ? 0 : (double)snapshot.counters[Metrics::COUNTER_ENTRIES_SCANNED] / loads) << RESET << std::endl;
+	std::cout << std::defaultfloat;
+}
+
+
+static bool write_trace(const std::string& traceName)
+{
+	std::ofstream traceFile(traceName);
+
+	Metrics::stopTrace();
+	Metrics::writeTrace(traceFile);
+
+	return (bool)traceFile;
+}
+
+
 static void recursive_print(MyFs& myfs, const std::string& path, const std::string& prefix="")
 {
 	MyFs::dir_list dlist = myfs.list_dir(path);
@@ -62,61 +214,289 @@ static void recursive_print(MyFs& myfs, const std::string& path, const std::stri
 }
 
 
+static void print_usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [--size <size>] [--populate] [--hugepages] [--sequential | --random] [--backend <name>] [--cache <size>] [--chunk <size>] [--snapshot <name>] [--trace <file>] <file>[,<file>...] [-c <script>]" << std::endl;
+	std::cerr << "  --size <size>     Device size when the file is created (e.g. 64M, 2G), defaults to 1M" << std::endl;
+	std::cerr << "  --populate        Pre-fault the whole device mapping (MAP_POPULATE)" << std::endl;
+	std::cerr << "  --hugepages       Back the device mapping with transparent huge pages" << std::endl;
+	std::cerr << "  --sequential      Hint sequential access to the device (aggressive read-ahead)" << std::endl;
+	std::cerr << "  --random          Hint random access to the device (no read-ahead)" << std::endl;
+	std::cerr << "  --backend <name>  How the device file is accessed: mmap (default), pread or uring" << std::endl;
+	std::cerr << "  --cache <size>    Put a write-back block cache of the given size (e.g. 256K, 4M) in front of the device" << std::endl;
+	std::cerr << "  --chunk <size>    The bytes that go to an image before the next one when a device set is created, defaults to 64K" << std::endl;
+	std::cerr << "  --snapshot <name> Mount the named snapshot of the file system, read-only" << std::endl;
+	std::cerr << "  --trace <file>    Record a Chrome trace (chrome://tracing, Perfetto) of the operations into the file" << std::endl;
+	std::cerr << "  <file>,<file>...  Stripe the file system over several images, the size is that of the whole set" << std::endl;
+	std::cerr << "  -c <script>       Run the commands of the script (- for stdin) without prompts or colour," << std::endl;
+	std::cerr << "                    timing every command on stderr" << std::endl;
+}
+
+
 int main(int argc, char **argv)
 {
-	if (argc != 2)
+	BlockDevice::options options;
+	uint64_t cacheSize = 0;
+	std::string fileName;
+	std::string scriptName;
+	std::string snapshotName;
+	std::string traceName;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--size" && i + 1 < argc)
+		{
+			try
+			{
+				options.size = parseSize(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--populate")
+		{
+			options.populate = true;
+		}
+		else if (arg == "--hugepages")
+		{
+			options.hugePages = true;
+		}
+		else if (arg == "--sequential")
+		{
+			options.pattern = BlockDevice::ACCESS_SEQUENTIAL;
+		}
+		else if (arg == "--random")
+		{
+			options.pattern = BlockDevice::ACCESS_RANDOM;
+		}
+		else if (arg == "--backend" && i + 1 < argc)
+		{
+			std::string backend = argv[++i];
+
+			if (backend == "mmap")
+			{
+				options.backend = BlockDevice::BACKEND_MMAP;
+			}
+			else if (backend == "pread")
+			{
+				options.backend = BlockDevice::BACKEND_PREAD;
+			}
+			else if (backend == "uring")
+			{
+				options.backend = BlockDevice::BACKEND_URING;
+			}
+			else
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--cache" && i + 1 < argc)
+		{
+			try
+			{
+				cacheSize = parseSize(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--chunk" && i + 1 < argc)
+		{
+			try
+			{
+				options.stripeChunk = parseSize(argv[++i]);
+			}
+			catch (std::logic_error &e)
+			{
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+		else if (arg == "--snapshot" && i + 1 < argc)
+		{
+			snapshotName = argv[++i];
+		}
+		else if (arg == "--trace" && i + 1 < argc)
+		{
+			traceName = argv[++i];
+		}
+		else if (arg == "-c" && i + 1 < argc)
+		{
+			scriptName = argv[++i];
+		}
+		else if (fileName.empty() && arg[0] != '-')
+		{
+			fileName = arg;
+		}
+		else
+		{
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (fileName.empty())
 	{
 		std::cerr << RED "Please provide the file to operate on" RESET << std::endl;
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	// Batch mode reads the commands from a script (or stdin) and runs them back-to-back
+	bool batch = !scriptName.empty();
+	std::ifstream scriptFile;
+	std::istream *input = &std::cin;
+
+	if (batch && scriptName != "-")
+	{
+		scriptFile.open(scriptName);
+		if (!scriptFile)
+		{
+			std::cerr << RED "Could not open script " << scriptName << RESET << std::endl;
+			return -1;
+		}
+		input = &scriptFile;
+	}
+
+	std::unique_ptr<ansi_filter_buf> colorFilter;
+	if (batch)
+	{
+		colorFilter.reset(new ansi_filter_buf(std::cout));
+	}
+
+	std::unique_ptr<BlockDevice> device;
+	try
+	{
+		device.reset(BlockDevice::open(fileName, options));
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << RED << e.what() << RESET << std::endl;
 		return -1;
 	}
 
-	BlockDeviceSimulator *blkdevptr = new BlockDeviceSimulator(argv[1]);
-	MyFs myfs(blkdevptr);
+	std::unique_ptr<BlockCache> cache;
+	BlockDevice *blkdevptr = device.get();
+
+	if (cacheSize > 0)
+	{
+		uint32_t cacheBlocks = std::max<uint64_t>(cacheSize / BlockCache::DEFAULT_BLOCK_SIZE, 1);
+		cache.reset(new BlockCache(device.get(), cacheBlocks));
+		blkdevptr = cache.get();
+	}
+
+	// Started before the mount, so the trace covers the journal replay
+	if (!traceName.empty())
+	{
+		Metrics::startTrace();
+	}
+
+	std::unique_ptr<MyFs> fs;
+	try
+	{
+		fs.reset(snapshotName.empty() ? new MyFs(blkdevptr) : new MyFs(blkdevptr, snapshotName));
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	MyFs& myfs = *fs;
 	bool exit = false;
 
-	std::cout << GREEN << MENU_ASCII_ART << RESET << std::endl;
-	std::cout << "To get help, please type 'help' on the prompt below." << std::endl;
-	std::cout << std::endl;
+	// Batch totals
+	size_t lineNumber = 0;
+	size_t commandCount = 0;
+	size_t errorCount = 0;
+	size_t importedFiles = 0;
+	uint64_t importedBytes = 0;
+	std::chrono::steady_clock::duration totalTime(0);
+
+	if (!batch)
+	{
+		std::cout << GREEN << MENU_ASCII_ART << RESET << std::endl;
+		std::cout << "To get help, please type 'help' on the prompt below." << std::endl;
+		std::cout << std::endl;
+	}
 
 	while (!exit)
 	{
-		try
+		std::string cmdline;
+		if (!batch)
 		{
-			std::string cmdline;
 			std::cout << YELLOW << FS_NAME << "$ " << RESET;
-
 			std::cout << GREEN;
-			std::getline(std::cin, cmdline, '\n');
+		}
+
+		bool gotLine = (bool)std::getline(*input, cmdline, '\n');
+		if (!batch)
+		{
 			std::cout << RESET;
-			if (cmdline == std::string(""))
-			{
-				continue;
-			}
+		}
+		if (!gotLine)		// End of the input
+		{
+			break;
+		}
+
+		lineNumber++;
+		if (cmdline == std::string(""))
+		{
+			continue;
+		}
 
-			std::vector<std::string> cmd = split_cmd(cmdline);
+		std::vector<std::string> cmd = split_cmd(cmdline);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool failed = false;
 
+		try
+		{
 			if (cmd[0] == LIST_CMD)
 			{
-				MyFs::dir_list dlist;
-				if (cmd.size() == 1)
+				std::string directory = "/";
+				std::string pattern;
+				if (cmd.size() == 2 && DirScan::isPattern(cmd[1]))
 				{
-					dlist = myfs.list_dir("/");
+					// The pattern is the last component of the path, the rest is the directory
+					size_t slash = cmd[1].find_last_of('/');
+					directory = (slash == std::string::npos) ? "/" : cmd[1].substr(0, slash + 1);
+					pattern = (slash == std::string::npos) ? cmd[1] : cmd[1].substr(slash + 1);
 				}
 				else if (cmd.size() == 2)
 				{
-					dlist = myfs.list_dir(cmd[1]);
+					directory = cmd[1];
 				}
-				else
+
+				if (cmd.size() > 2)
 				{
 					std::cout << RED << LIST_CMD << ": one or zero arguments requested" RESET << std::endl;
 				}
-
-				for (size_t i=0; i < dlist.size(); i++)
+				else
 				{
-					std::cout << CYAN << std::setw(25) << std::left
-						<< dlist[i].name + (dlist[i].is_dir ? "/":"")
-						<< std::setw(10) << std::right
-						<< BOLDYELLOW << dlist[i].file_size << RESET << std::endl;
+					// Printed a page at a time, a large directory is never held in memory whole
+					MyFs::dir_cursor cursor = myfs.open_dir(directory, pattern);
+					MyFs::dir_list dlist;
+					while (cursor.next(dlist))
+					{
+						// The logical size, then the bytes the file takes on the device
+						for (size_t i=0; i < dlist.size(); i++)
+						{
+							std::cout << CYAN << std::setw(25) << std::left
+								<< std::string(dlist[i].name) + (dlist[i].is_dir ? "/":"")
+								<< std::setw(10) << std::right
+								<< BOLDYELLOW << dlist[i].file_size
+								<< std::setw(10) << std::right
+								<< CYAN << dlist[i].physical_size << RESET << std::endl;
+						}
+					}
 				}
 			}
 
@@ -146,7 +526,13 @@ int main(int argc, char **argv)
 			{
 				if (cmd.size() == 2)
 				{
-					std::cout << myfs.get_content(cmd[1]) << std::endl;
+					// Streaming the content straight out of the device mapping
+					MyFs::file_view view = myfs.view_content(cmd[1]);
+					for (const std::string_view& segment : view.segments())
+					{
+						std::cout.write(segment.data(), segment.size());
+					}
+					std::cout << std::endl;
 				}
 				else
 				{
@@ -163,46 +549,432 @@ int main(int argc, char **argv)
 			{
 				if (cmd.size() == 2)
 				{
-					std::cout << CYAN "> " RESET;
-					std::string content;
-					std::string curr_line;
-					std::getline(std::cin, curr_line);
-					while (curr_line != "")
+					std::string content = read_content(*input, !batch);
+					myfs.set_content(cmd[1], content);
+				}
+				else
+				{
+					std::cout << RED << EDIT_CMD << ": file path requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == APPEND_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					std::string content = read_content(*input, !batch);
+					myfs.append(cmd[1], content.length(), content.data());
+				}
+				else
+				{
+					std::cout << RED << APPEND_CMD << ": file path requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == DISK_FREE_CMD)
+			{
+				MyFs::fs_stats stats = myfs.get_stats();
+				uint32_t usedBlocks = stats.space.totalBlocks - stats.space.freeBlocks;
+
+				BlockDevice::stripe_layout layout = blkdevptr->layout();
+
+				std::cout << CYAN << std::setw(25) << std::left << "Block size" << BOLDYELLOW << stats.blockSize << RESET << std::endl;
+				if (layout.width > 1)
+				{
+					std::cout << CYAN << std::setw(25) << std::left << "Device set" << BOLDYELLOW << layout.width << " images in "
+						<< layout.chunkSize / 1024 << "K chunks" << RESET << std::endl;
+				}
+				std::cout << CYAN << std::setw(25) << std::left << "Used blocks" << BOLDYELLOW << usedBlocks << " / " << stats.space.totalBlocks << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Free bytes" << BOLDYELLOW << (uint64_t)stats.space.freeBlocks * stats.blockSize << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Free extents" << BOLDYELLOW << stats.space.freeExtents << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Largest free extent" << BOLDYELLOW << stats.space.largestFreeExtent << " blocks" << RESET << std::endl;
+
+				// Free space fragmentation - the part of the free space that isn't in the largest free extent
+				double freeFragmentation = stats.space.freeBlocks == 0 ? 0 :
+					100.0 * (stats.space.freeBlocks - stats.space.largestFreeExtent) / stats.space.freeBlocks;
+				double extentsPerFile = stats.filesWithData == 0 ? 0 : (double)stats.fileExtents / stats.filesWithData;
+
+				std::cout << CYAN << std::setw(25) << std::left << "Free space fragmentation" << BOLDYELLOW << std::fixed << std::setprecision(1) << freeFragmentation << "%" << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Extents per file" << BOLDYELLOW << std::setprecision(2) << extentsPerFile << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Inline files" << BOLDYELLOW << stats.inlineFiles << RESET << std::endl;
+
+				uint64_t compressedPhysical = stats.compressedBlocks * stats.blockSize;
+				double compressionRatio = compressedPhysical == 0 ? 0 : (double)stats.compressedBytes / compressedPhysical;
+				std::cout << CYAN << std::setw(25) << std::left << "Compression" << BOLDYELLOW << (myfs.compression() ? "on" : "off") << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Compressed files" << BOLDYELLOW << stats.compressedFiles << ", " << stats.compressedBytes
+					<< " bytes in " << compressedPhysical << " (" << std::setprecision(2) << compressionRatio << "x)" << RESET << std::endl;
+
+				// The blocks the deduplicated files would take on their own, against the distinct blocks they take
+				double dedupRatio = stats.dedupBlocks == 0 ? 0 : (double)stats.dedupReferences / stats.dedupBlocks;
+				std::cout << CYAN << std::setw(25) << std::left << "Deduplication" << BOLDYELLOW << (myfs.dedup() ? "on" : "off") << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Deduplicated files" << BOLDYELLOW << stats.dedupFiles << ", " << stats.dedupReferences
+					<< " blocks in " << stats.dedupBlocks << " (" << dedupRatio << "x, " << (stats.dedupReferences - stats.dedupBlocks) * stats.blockSize
+					<< " bytes saved)" << RESET << std::endl;
+				std::cout << std::defaultfloat;
+
+				std::cout << CYAN << std::setw(25) << std::left << "Snapshots" << BOLDYELLOW << stats.snapshots << (myfs.readOnly() ? " (mounted read-only)" : "") << RESET << std::endl;
+
+				std::cout << CYAN << std::setw(25) << std::left << "Journal" << BOLDYELLOW << stats.journal.usedBytes << " / " << stats.journal.capacity << " bytes, "
+					<< stats.journal.pendingTransactions << " uncommitted" << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Journal activity" << BOLDYELLOW << stats.journal.transactions << " transactions, "
+					<< stats.journal.commits << " commits, " << stats.journal.checkpoints << " checkpoints, "
+					<< stats.journal.discardedBlocks << " blocks discarded" << RESET << std::endl;
+
+				// What the device took for every byte the files were given, the journal and the cleaner's copies included
+				double writeAmplification = stats.log.userBytes == 0 ? 0 :
+					(double)(stats.log.dataBytes + stats.log.journalBytes) / stats.log.userBytes;
+				double movedPerSegment = stats.log.segmentsCleaned == 0 ? 0 : (double)stats.log.cleanerBlocksMoved / stats.log.segmentsCleaned;
+				std::cout << CYAN << std::setw(25) << std::left << "Log-structured" << BOLDYELLOW << (myfs.logStructured() ? "on" : "off") << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Free segments" << BOLDYELLOW << stats.log.freeSegments << " / " << stats.log.segments
+					<< ", " << stats.log.fallbackBlocks << " blocks allocated outside the log, " << stats.log.defragBlocks
+					<< " moved to merge extents" << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Write amplification" << BOLDYELLOW << std::fixed << std::setprecision(2) << writeAmplification
+					<< " (" << stats.log.userBytes << " bytes written, " << stats.log.dataBytes << " data, " << stats.log.journalBytes << " journal)" << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Cleaner" << BOLDYELLOW << stats.log.cleanerPasses << " passes, " << stats.log.cleanerBlocksMoved
+					<< " blocks moved, " << stats.log.segmentsCleaned << " segments reclaimed (" << std::setprecision(1) << movedPerSegment << " blocks each), "
+					<< std::setprecision(2) << stats.log.cleanerNs / 1e6 << " ms" << RESET << std::endl;
+				std::cout << std::defaultfloat;
+
+				std::cout << CYAN << std::setw(25) << std::left << "Checksums" << BOLDYELLOW;
+				if (stats.checksums)
+				{
+					std::cout << "CRC32C (" << Crc32c::name(Crc32c::best()) << "), " << stats.checksumErrors << " bad blocks read";
+				}
+				else
+				{
+					std::cout << "off";
+				}
+				std::cout << RESET << std::endl;
+
+				if (cache)
+				{
+					BlockCache::cache_stats cacheStats = cache->stats();
+					uint64_t lookups = cacheStats.hits + cacheStats.misses;
+					double hitRate = lookups == 0 ? 0 : 100.0 * cacheStats.hits / lookups;
+
+					std::cout << CYAN << std::setw(25) << std::left << "Block cache" << BOLDYELLOW << cacheStats.cachedBlocks << " / " << cacheStats.capacity
+						<< " blocks of " << cacheStats.blockSize << " bytes, " << cacheStats.dirtyBlocks << " dirty" << RESET << std::endl;
+					std::cout << CYAN << std::setw(25) << std::left << "Cache hit rate" << BOLDYELLOW << std::fixed << std::setprecision(1) << hitRate << "% ("
+						<< cacheStats.hits << " hits, " << cacheStats.misses << " misses)" << RESET << std::endl;
+					std::cout << std::defaultfloat;
+					std::cout << CYAN << std::setw(25) << std::left << "Cache write-back" << BOLDYELLOW << cacheStats.blocksWritten << " blocks in "
+						<< cacheStats.writeBacks << " writes, " << cacheStats.evictions << " evictions" << RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == STATS_CMD)
+			{
+				if (cmd.size() == 1)
+				{
+					print_metrics();
+				}
+				else if (cmd.size() == 2 && cmd[1] == "reset")
+				{
+					Metrics::reset();
+				}
+				else
+				{
+					std::cout << RED << STATS_CMD << ": no argument or reset requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == TRACE_CMD)
+			{
+				if (cmd.size() == 2 && cmd[1] == "start")
+				{
+					Metrics::startTrace();
+				}
+				else if (cmd.size() == 2)
+				{
+					if (!write_trace(cmd[1]))
 					{
-						std::cout << CYAN "> " RESET;
-						content += curr_line + "\n";
-						std::getline(std::cin, curr_line);
+						throw std::runtime_error(RED "Could not write the trace" RESET);
 					}
+				}
+				else
+				{
+					std::cout << RED << TRACE_CMD << ": start or a trace file requested" RESET << std::endl;
+				}
+			}
 
-					myfs.set_content(cmd[1], content);
+			else if (cmd[0] == SYNC_CMD)
+			{
+				myfs.sync();
+			}
+
+			else if (cmd[0] == COMPACT_CMD)
+			{
+				MyFs::fs_stats before = myfs.get_stats();
+				uint64_t movedTotal = 0;
+				uint32_t moved;
+
+				// Step by step, the other threads of a real user would go on between the steps
+				while (myfs.compact_step(MyFs::COMPACT_STEP_BLOCKS, moved))
+				{
+					movedTotal += moved;
+				}
+				movedTotal += moved;
+
+				MyFs::fs_stats after = myfs.get_stats();
+				std::cout << CYAN << std::setw(25) << std::left << "Blocks moved" << BOLDYELLOW << movedTotal << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Free extents" << BOLDYELLOW << before.space.freeExtents << " -> " << after.space.freeExtents << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Largest free extent" << BOLDYELLOW << before.space.largestFreeExtent << " -> " << after.space.largestFreeExtent << " blocks" << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Blocks discarded" << BOLDYELLOW << after.journal.discardedBlocks - before.journal.discardedBlocks << RESET << std::endl;
+			}
+
+			else if (cmd[0] == CLEAN_CMD)
+			{
+				MyFs::fs_stats before = myfs.get_stats();
+				uint64_t movedTotal = 0;
+				uint32_t moved;
+
+				while (myfs.clean_step(MyFs::COMPACT_STEP_BLOCKS, moved))
+				{
+					movedTotal += moved;
+				}
+				movedTotal += moved;
+
+				MyFs::fs_stats after = myfs.get_stats();
+				std::cout << CYAN << std::setw(25) << std::left << "Blocks moved" << BOLDYELLOW << movedTotal << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Free segments" << BOLDYELLOW << before.log.freeSegments << " -> " << after.log.freeSegments << RESET << std::endl;
+				std::cout << CYAN << std::setw(25) << std::left << "Segments reclaimed" << BOLDYELLOW << after.log.segmentsCleaned - before.log.segmentsCleaned << RESET << std::endl;
+			}
+
+			else if (cmd[0] == LOG_CMD)
+			{
+				if (cmd.size() == 2 && (cmd[1] == "on" || cmd[1] == "off"))
+				{
+					myfs.setLogStructured(cmd[1] == "on");
 				}
 				else
 				{
-					std::cout << RED << EDIT_CMD << ": file path requested" RESET << std::endl;
+					std::cout << RED << LOG_CMD << ": on or off requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == SCRUB_CMD || cmd[0] == FSCK_CMD)
+			{
+				if (cmd.size() <= 2)
+				{
+					ChecksumDevice::scrub_stats scrub = myfs.scrub(cmd.size() == 2 ? std::stoul(cmd[1]) : 0);
+					double seconds = scrub.nanoseconds / 1e9;
+					double throughput = seconds == 0 ? 0 : scrub.bytes / seconds / 1e9;
+
+					std::cout << CYAN << std::setw(25) << std::left << "Blocks checked" << BOLDYELLOW << scrub.blocks << " (" << scrub.bytes << " bytes)" << RESET << std::endl;
+					std::cout << CYAN << std::setw(25) << std::left << "Throughput" << BOLDYELLOW << std::fixed << std::setprecision(2) << throughput << " GB/s ("
+						<< scrub.threads << " threads, " << scrub.nanoseconds / 1e6 << " ms, CRC32C " << Crc32c::name(Crc32c::best()) << ")" << RESET << std::endl;
+					std::cout << std::defaultfloat;
+					std::cout << CYAN << std::setw(25) << std::left << "Bad blocks" << (scrub.badBlocks == 0 ? GREEN : RED) << scrub.badBlocks;
+					for (size_t i = 0; i < scrub.firstBad.size(); i++)
+					{
+						std::cout << (i == 0 ? ": " : ", ") << scrub.firstBad[i];
+					}
+					std::cout << (scrub.badBlocks > scrub.firstBad.size() ? ", ..." : "") << RESET << std::endl;
+
+					failed = scrub.badBlocks > 0;
+				}
+				else
+				{
+					std::cout << RED << cmd[0] << ": no argument or a thread count requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == CHECKSUMS_CMD)
+			{
+				if (cmd.size() == 2 && (cmd[1] == "on" || cmd[1] == "off"))
+				{
+					myfs.setChecksums(cmd[1] == "on");
+				}
+				else
+				{
+					std::cout << RED << CHECKSUMS_CMD << ": on or off requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == IMPORT_CMD)
+			{
+				if (cmd.size() == 3)
+				{
+					// The whole host file goes in with a single write
+					std::string content = read_host_file(cmd[1]);
+					myfs.set_content(cmd[2], content);
+
+					importedFiles++;
+					importedBytes += content.length();
+				}
+				else
+				{
+					std::cout << RED << IMPORT_CMD << ": host file and file path requested" RESET << std::endl;
 				}
 			}
 
-			// else if (cmd[0] == CREATE_DIR_CMD)
-			// {
-			// 	if (cmd.size() == 2)
-			// 	{
-			// 		myfs.create_file(cmd[1], true);
-			// 	}
-			// 	else
-			// 	{
-			// 		std::cout << CREATE_DIR_CMD << ": one argument requested" << std::endl;
-			// 	}
-			// }
+			else if (cmd[0] == COMPRESS_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					myfs.compress_file(cmd[1]);
+				}
+				else
+				{
+					std::cout << RED << COMPRESS_CMD << ": file path requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == COMPRESSION_CMD)
+			{
+				if (cmd.size() == 2 && (cmd[1] == "on" || cmd[1] == "off"))
+				{
+					myfs.setCompression(cmd[1] == "on");
+				}
+				else
+				{
+					std::cout << RED << COMPRESSION_CMD << ": on or off requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == DEDUP_CMD)
+			{
+				if (cmd.size() == 2 && (cmd[1] == "on" || cmd[1] == "off"))
+				{
+					myfs.setDedup(cmd[1] == "on");
+				}
+				else
+				{
+					std::cout << RED << DEDUP_CMD << ": on or off requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == SNAPSHOT_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					myfs.create_snapshot(cmd[1]);
+				}
+				else
+				{
+					std::cout << RED << SNAPSHOT_CMD << ": snapshot name requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == LIST_SNAPSHOTS_CMD)
+			{
+				for (const std::string& name : myfs.list_snapshots())
+				{
+					std::cout << CYAN << name << RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == DELETE_SNAPSHOT_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					myfs.delete_snapshot(cmd[1]);
+				}
+				else
+				{
+					std::cout << RED << DELETE_SNAPSHOT_CMD << ": snapshot name requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == GROW_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					myfs.grow(parseSize(cmd[1]));
+				}
+				else
+				{
+					std::cout << RED << GROW_CMD << ": new device size requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == CREATE_DIR_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					myfs.create_file(cmd[1], true);
+				}
+				else
+				{
+					std::cout << RED << CREATE_DIR_CMD << ": one argument requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == REMOVE_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					myfs.remove_file(cmd[1]);
+				}
+				else
+				{
+					std::cout << RED << REMOVE_CMD << ": one argument requested" RESET << std::endl;
+				}
+			}
+
+			else if (cmd[0] == MOVE_CMD)
+			{
+				if (cmd.size() == 3)
+				{
+					myfs.rename_file(cmd[1], cmd[2]);
+				}
+				else
+				{
+					std::cout << RED << MOVE_CMD << ": old and new paths requested" RESET << std::endl;
+				}
+			}
 
 			else
 			{
 				std::cout << RED "Unknown command: " << cmd[0] << RESET << std::endl;
+				failed = true;
 			}
 		}
 		
 		catch (std::runtime_error &e)
 		{
 			std::cout << e.what() << std::endl;
+			failed = true;
+		}
+
+		catch (std::logic_error &e)		// Malformed numeric arguments
+		{
+			std::cout << RED "Invalid argument: " << e.what() << RESET << std::endl;
+			failed = true;
 		}
+
+		if (batch)
+		{
+			// Per-command timing as tab separated "line, command, microseconds, status" records
+			std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+			totalTime += elapsed;
+			commandCount++;
+			errorCount += failed;
+
+			std::cerr << lineNumber << '\t' << cmd[0] << '\t'
+				<< std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << '\t'
+				<< (failed ? "error" : "ok") << std::endl;
+		}
+	}
+
+	if (!traceName.empty() && !write_trace(traceName))
+	{
+		std::cerr << RED "Could not write the trace " << traceName << RESET << std::endl;
+		errorCount++;
+	}
+
+	if (batch)
+	{
+		double seconds = std::chrono::duration<double>(totalTime).count();
+
+		std::cerr << "total\tcommands\t" << commandCount << std::endl;
+		std::cerr << "total\terrors\t" << errorCount << std::endl;
+		std::cerr << "total\tmicroseconds\t" << std::chrono::duration_cast<std::chrono::microseconds>(totalTime).count() << std::endl;
+		std::cerr << "total\tcommands_per_sec\t" << std::fixed << std::setprecision(1) << (seconds > 0 ? commandCount / seconds : 0) << std::endl;
+		std::cerr << "total\timported_files\t" << importedFiles << std::endl;
+		std::cerr << "total\timported_bytes\t" << importedBytes << std::endl;
+		std::cerr << "total\timport_mb_per_sec\t" << (seconds > 0 ? importedBytes / seconds / (1024 * 1024) : 0) << std::endl;
 	}
+
+	return errorCount == 0 ? 0 : 1;
 }
@@ -0,0 +1,491 @@
+#include "stripedev.h"
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+
+const char *StripedDevice::STRIPE_MAGIC = "MYST";
+
+
+/**
+ @brief		Constructor - Opens the images of a device set. Images that hold nothing yet (all zeros where the label
+			goes, like the images this creates) become a new set in the order given, with the chunk size of the
+			options. An existing set is put in the order of its labels and keeps its own chunk size.
+ @param		fnames		The image files of the set
+ @param		opts		The options every image is opened with, the size is that of the whole set
+ */
+StripedDevice::StripedDevice(const std::vector<std::string>& fnames, const options& opts) : _chunkSize(opts.stripeChunk),
+	_chunkShift(0), _setId(0)
+{
+	if (fnames.empty() || fnames.size() > MAX_WIDTH)
+	{
+		throw std::runtime_error("A device set has 1 to " + std::to_string(MAX_WIDTH) + " images");
+	}
+
+	this->readLabels(fnames, opts);
+	this->_chunkShift = __builtin_ctz(this->_chunkSize);
+
+	if (this->_members.size() > 1)
+	{
+		this->_pool.reset(new WorkPool(this->_members.size() - 1));
+	}
+}
+
+
+// A power of two lets the addresses be mapped with shifts and masks, a page at least keeps hole punching whole
+static bool validChunkSize(uint32_t chunkSize)
+{
+	return chunkSize >= 4096 && (chunkSize & (chunkSize - 1)) == 0;
+}
+
+
+/**
+ @brief		Opens the images and checks their labels, or labels them when none of them has a label yet.
+ @param		fnames		The image files of the set
+ @param		opts		The options the images are opened with
+ @return	void
+ */
+void StripedDevice::readLabels(const std::vector<std::string>& fnames, const options& opts)
+{
+	uint32_t width = fnames.size();
+	std::vector<std::unique_ptr<BlockDevice>> images;
+	std::vector<stripe_label> labels(width);
+	uint32_t labelled = 0;
+
+	if (!validChunkSize(this->_chunkSize))
+	{
+		throw std::runtime_error("The stripe chunk size has to be a power of two of at least 4K");
+	}
+
+	// Images that don't exist yet are created big enough for their share of the size asked for
+	options imageOpts = opts;
+	uint64_t stripeSize = (uint64_t)width * this->_chunkSize;
+	imageOpts.size = LABEL_SIZE + (opts.size + stripeSize - 1) / stripeSize * this->_chunkSize;
+
+	for (uint32_t i = 0; i < width; i++)
+	{
+		images.emplace_back(openImage(fnames[i], imageOpts));
+		if (images[i]->size() < LABEL_SIZE)
+		{
+			throw std::runtime_error("The image " + fnames[i] + " is too small to be a part of a device set");
+		}
+
+		images[i]->read(0, sizeof(stripe_label), (char *)&labels[i]);
+		if (memcmp(labels[i].magic, STRIPE_MAGIC, sizeof(labels[i].magic)) == 0)
+		{
+			labelled++;
+			continue;
+		}
+
+		// Anything but zeros is somebody's data, a file system made on a single image for one
+		char empty[sizeof(stripe_label)] = {};
+		if (memcmp(&labels[i], empty, sizeof(empty)) != 0)
+		{
+			throw std::runtime_error("The image " + fnames[i] + " holds something else than a part of a device set");
+		}
+	}
+
+	if (labelled == 0)
+	{
+		std::random_device random;
+		uint64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+		this->_setId = (((uint64_t)random() << 32) | random()) ^ now;
+		this->_setId += (this->_setId == 0);
+		this->_members = std::move(images);
+		this->writeLabels();
+		return;
+	}
+
+	if (labelled != width)
+	{
+		throw std::runtime_error("Incomplete device set: some of the images given aren't a part of it");
+	}
+
+	const stripe_label& first = labels[0];
+	if (first.version != STRIPE_VERSION || !validChunkSize(first.chunkSize))
+	{
+		throw std::runtime_error("The image " + fnames[0] + " has an unknown device set label");
+	}
+
+	this->_members.resize(width);
+	for (uint32_t i = 0; i < width; i++)
+	{
+		const stripe_label& label = labels[i];
+
+		if (label.setId != first.setId || label.version != first.version || label.width != first.width ||
+			label.chunkSize != first.chunkSize)
+		{
+			throw std::runtime_error("The images " + fnames[0] + " and " + fnames[i] + " belong to different device sets");
+		}
+		if (label.width != width)
+		{
+			throw std::runtime_error("Incomplete device set: it has " + std::to_string(label.width) + " images, " +
+				std::to_string(width) + " were given");
+		}
+		if (label.index >= width || this->_members[label.index])
+		{
+			throw std::runtime_error("The image " + fnames[i] + " is given twice, or its label is damaged");
+		}
+
+		this->_members[label.index] = std::move(images[i]);
+	}
+
+	this->_chunkSize = first.chunkSize;
+	this->_setId = first.setId;
+}
+
+
+// Writes every image's label and flushes it, the set exists from then on
+void StripedDevice::writeLabels()
+{
+	for (uint32_t i = 0; i < this->_members.size(); i++)
+	{
+		stripe_label label;
+		memset(&label, 0, sizeof(label));
+		memcpy(label.magic, STRIPE_MAGIC, sizeof(label.magic));
+		label.version = STRIPE_VERSION;
+		label.width = this->_members.size();
+		label.index = i;
+		label.chunkSize = this->_chunkSize;
+		label.setId = this->_setId;
+
+		this->_members[i]->write(0, sizeof(label), (const char *)&label);
+		this->_members[i]->flush(0, sizeof(label));
+	}
+}
+
+
+// Whether the device is an image of a device set, which makes no sense on its own
+bool StripedDevice::isMember(BlockDevice *device)
+{
+	char magic[4];
+
+	if (device->size() < sizeof(magic))
+	{
+		return false;
+	}
+
+	device->read(0, sizeof(magic), magic);
+	return memcmp(magic, STRIPE_MAGIC, sizeof(magic)) == 0;
+}
+
+
+// The chunk bytes every image needs for a set of the given size
+uint64_t StripedDevice::memberSize(uint64_t deviceSize) const
+{
+	uint64_t stripeSize = (uint64_t)this->_members.size() * this->_chunkSize;
+	return (deviceSize + stripeSize - 1) / stripeSize * this->_chunkSize;
+}
+
+
+/**
+ @brief		Cuts a request into a request per chunk it touches, added to the batch of the chunk's image. Pieces that
+			follow each other both on the image and in memory are merged.
+ @param		request		The request, in device addresses
+ @param		batches		The batch of every image
+ @param		bytes		Increased by the request's size
+ @return	void
+ */
+void StripedDevice::split(const io_request& request, batch_list& batches, size_t& bytes) const
+{
+	uint64_t width = this->_members.size();
+	uint64_t mask = this->_chunkSize - 1;
+	size_t done = 0;
+
+	while (done < request.size)
+	{
+		uint64_t addr = request.addr + done;
+		uint64_t chunk = addr >> this->_chunkShift;
+		size_t piece = std::min<uint64_t>(request.size - done, this->_chunkSize - (addr & mask));
+
+		io_request part = request;
+		part.addr = LABEL_SIZE + ((chunk / width) << this->_chunkShift) + (addr & mask);
+		part.size = piece;
+		if (request.write)
+		{
+			part.data = request.data + done;
+		}
+		else
+		{
+			part.buffer = request.buffer + done;
+		}
+
+		request_list& batch = batches[chunk % width];
+		io_request *last = batch.empty() ? nullptr : &batch.back();
+		if (last != nullptr && last->write == part.write && last->addr + last->size == part.addr &&
+			(part.write ? last->data + last->size == part.data : last->buffer + last->size == part.buffer))
+		{
+			last->size += piece;
+		}
+		else
+		{
+			batch.push_back(part);
+		}
+
+		done += piece;
+	}
+
+	bytes += request.size;
+}
+
+
+/**
+ @brief		Finds the bytes of an image a device range covers. The chunks of a contiguous range that go to a single
+			image are contiguous on it, so they're a single range of the image.
+ @param		member		The image
+ @param		addr		The device address of the range
+ @param		size		The size of the range
+ @param		start		Set to the first image address covered
+ @param		end			Set past the last image address covered
+ @return	False if the range doesn't touch the image
+ */
+bool StripedDevice::memberRange(uint32_t member, uint64_t addr, size_t size, uint64_t& start, uint64_t& end) const
+{
+	if (size == 0)
+	{
+		return false;
+	}
+
+	uint64_t width = this->_members.size();
+	uint64_t mask = this->_chunkSize - 1;
+	uint64_t firstChunk = addr >> this->_chunkShift;
+	uint64_t lastChunk = (addr + size - 1) >> this->_chunkShift;
+
+	// The image's first and last chunks in the range
+	uint64_t first = firstChunk + (member + width - firstChunk % width) % width;
+	if (first > lastChunk)
+	{
+		return false;
+	}
+	uint64_t last = lastChunk - (lastChunk % width + width - member) % width;
+
+	start = LABEL_SIZE + ((first / width) << this->_chunkShift) + (first == firstChunk ? addr & mask : 0);
+	end = LABEL_SIZE + ((last / width) << this->_chunkShift) +
+		(last == lastChunk ? ((addr + size - 1) & mask) + 1 : this->_chunkSize);
+	return true;
+}
+
+
+/**
+ @brief		Runs a job for every given image, on the workers and the calling thread at once, and waits for all of
+			them. A single image's job runs on the calling thread alone.
+ @param		members		The images
+ @param		job			The job, called with an image
+ @return	void
+ */
+void StripedDevice::fanOut(const member_list& members, const std::function<void(uint32_t)>& job)
+{
+	if (members.size() < 2 || !this->_pool)
+	{
+		for (uint32_t member : members)
+		{
+			job(member);
+		}
+		return;
+	}
+
+	struct latch
+	{
+		std::mutex mutex;
+		std::condition_variable done;
+		size_t remaining;
+		std::exception_ptr error;
+	} jobs;
+	jobs.remaining = members.size() - 1;
+
+	std::vector<WorkPool::task> tasks;
+	for (size_t i = 1; i < members.size(); i++)
+	{
+		uint32_t member = members[i];
+		tasks.push_back([&jobs, &job, member]()
+		{
+			std::exception_ptr error;
+			try
+			{
+				job(member);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			// Notified under the lock, the latch is gone as soon as the caller sees the count reach zero
+			std::lock_guard<std::mutex> lock(jobs.mutex);
+			if (error && !jobs.error)
+			{
+				jobs.error = error;
+			}
+			if (--jobs.remaining == 0)
+			{
+				jobs.done.notify_one();
+			}
+		});
+	}
+	this->_pool->push(tasks);
+
+	std::exception_ptr error;
+	try
+	{
+		job(members[0]);
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+
+	std::unique_lock<std::mutex> lock(jobs.mutex);
+	jobs.done.wait(lock, [&jobs]() { return jobs.remaining == 0; });
+
+	if (!error)
+	{
+		error = jobs.error;
+	}
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+
+void StripedDevice::read(uint64_t addr, size_t size, char *ans)
+{
+	io_request request{ false, addr, size, ans, nullptr };
+	this->submit(&request, 1);
+}
+
+
+void StripedDevice::write(uint64_t addr, size_t size, const char *data)
+{
+	io_request request{ true, addr, size, nullptr, data };
+	this->submit(&request, 1);
+}
+
+
+/**
+ @brief		Splits the requests by image and submits a batch to every image. Small batches run on the calling thread
+			one image after the other, larger ones on every image at once.
+ @param		requests		The requests
+ @param		count			The number of requests
+ @return	void
+ */
+void StripedDevice::submit(const io_request *requests, size_t count)
+{
+	uint64_t deviceSize = this->size();
+	batch_list batches(this->_members.size());
+	size_t bytes = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		checkBounds(requests[i].addr, requests[i].size, deviceSize);
+		this->split(requests[i], batches, bytes);
+	}
+
+	member_list busy;
+	for (uint32_t member = 0; member < batches.size(); member++)
+	{
+		if (!batches[member].empty())
+		{
+			busy.push_back(member);
+		}
+	}
+
+	auto run = [this, &batches](uint32_t member)
+	{
+		this->_members[member]->submit(batches[member].data(), batches[member].size());
+	};
+
+	if (bytes < PARALLEL_MIN_SIZE)
+	{
+		for (uint32_t member : busy)
+		{
+			run(member);
+		}
+		return;
+	}
+
+	this->fanOut(busy, run);
+}
+
+
+// Every image flushes its part of the range, at once
+void StripedDevice::flush(uint64_t addr, size_t size)
+{
+	uint64_t end = std::min<uint64_t>(addr + size, this->size());
+	std::vector<uint64_t, ArenaAllocator<uint64_t>> starts(this->_members.size());
+	std::vector<uint64_t, ArenaAllocator<uint64_t>> ends(this->_members.size());
+	member_list busy;
+
+	for (uint32_t member = 0; addr < end && member < this->_members.size(); member++)
+	{
+		if (this->memberRange(member, addr, end - addr, starts[member], ends[member]))
+		{
+			busy.push_back(member);
+		}
+	}
+
+	this->fanOut(busy, [this, &starts, &ends](uint32_t member)
+	{
+		this->_members[member]->flush(starts[member], ends[member] - starts[member]);
+	});
+}
+
+
+void StripedDevice::discard(uint64_t addr, size_t size)
+{
+	checkBounds(addr, size, this->size());
+
+	for (uint32_t member = 0; member < this->_members.size(); member++)
+	{
+		uint64_t start, end;
+		if (this->memberRange(member, addr, size, start, end))
+		{
+			this->_members[member]->discard(start, end - start);
+		}
+	}
+}
+
+
+// The whole stripes every image has room for
+uint64_t StripedDevice::size() const
+{
+	uint64_t smallest = UINT64_MAX;
+
+	for (const std::unique_ptr<BlockDevice>& member : this->_members)
+	{
+		smallest = std::min(smallest, member->size());
+	}
+
+	if (smallest <= LABEL_SIZE)
+	{
+		return 0;
+	}
+
+	return this->_members.size() * (((smallest - LABEL_SIZE) >> this->_chunkShift) << this->_chunkShift);
+}
+
+
+// Grows every image by its share, the device ends up a whole number of stripes, maybe larger than asked for
+void StripedDevice::grow(uint64_t newSize)
+{
+	if (newSize <= this->size())
+	{
+		return;
+	}
+
+	uint64_t imageSize = LABEL_SIZE + this->memberSize(newSize);
+	for (const std::unique_ptr<BlockDevice>& member : this->_members)
+	{
+		member->grow(imageSize);
+	}
+}
+
+
+BlockDevice::stripe_layout StripedDevice::layout() const
+{
+	return stripe_layout{ (uint32_t)this->_members.size(), this->_chunkSize, this->_setId };
+}
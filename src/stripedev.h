@@ -0,0 +1,72 @@
+#ifndef __STRIPEDEV_H__
+#define __STRIPEDEV_H__
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include "blkdev.h"
+#include "arena.h"
+#include "workpool.h"
+
+
+// Several image files presented as one device. The device is cut into chunks of stripeChunk bytes that go to the
+// images in turn (RAID 0), so a large access covers every image and the images are accessed in parallel, on a worker
+// per image besides the caller. Every image starts with a label naming its set and its place in it, the set can be
+// given in any order and a set that misses images or mixes images of other sets is refused.
+class StripedDevice : public BlockDevice
+{
+public:
+	StripedDevice(const std::vector<std::string>& fnames, const options& opts);
+
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void submit(const io_request *requests, size_t count) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
+
+	stripe_layout layout() const override;
+
+	static bool isMember(BlockDevice *device);
+
+	static const uint32_t LABEL_SIZE = 4096;					// Before the chunks of every image
+	static const uint32_t MAX_WIDTH = 255;
+	static const size_t PARALLEL_MIN_SIZE = 64 * 1024;			// Smaller accesses stay on the calling thread
+
+
+private:
+	struct stripe_label
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t width;
+		uint32_t index;			// The image's place in the set
+		uint32_t chunkSize;
+		uint32_t reserved;
+		uint64_t setId;
+	};
+
+	typedef std::vector<io_request, ArenaAllocator<io_request>> request_list;
+	typedef std::vector<request_list, ArenaAllocator<request_list>> batch_list;		// A request list per image
+	typedef std::vector<uint32_t, ArenaAllocator<uint32_t>> member_list;
+
+	void readLabels(const std::vector<std::string>& fnames, const options& opts);
+	void writeLabels();
+	uint64_t memberSize(uint64_t deviceSize) const;
+	void split(const io_request& request, batch_list& batches, size_t& bytes) const;
+	bool memberRange(uint32_t member, uint64_t addr, size_t size, uint64_t& start, uint64_t& end) const;
+	void fanOut(const member_list& members, const std::function<void(uint32_t)>& job);
+
+	std::vector<std::unique_ptr<BlockDevice>> _members;		// In their order in the set
+	uint32_t _chunkSize;
+	uint32_t _chunkShift;
+	uint64_t _setId;
+	std::unique_ptr<WorkPool> _pool;		// A worker per image but one, the caller takes one image itself
+
+	static const char *STRIPE_MAGIC;
+	static const uint32_t STRIPE_VERSION = 1;
+};
+
+#endif // __STRIPEDEV_H__
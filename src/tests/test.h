@@ -0,0 +1,70 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include "blkdev.h"
+#include "myfs.h"
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// What every test program shares. A test exits with 0 when every check passed and with 1 otherwise, after printing
+// the checks that failed - make test runs them one after the other and stops at the first one that fails.
+
+inline std::atomic<int> failures(0);		// Checks can fail on several threads at once
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+
+/**
+ * @brief       Records a check, and prints it when it failed.
+ * @param       passed      Whether the check passed
+ * @param       what        The checked condition
+ * @param       file        The source file of the check
+ * @param       line        The line of the check
+ * @return      Whether the check passed
+ */
+inline bool check(bool passed, const char *what, const char *file, int line)
+{
+	if (!passed)
+	{
+		std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+		failures++;
+	}
+
+	return passed;
+}
+
+
+/**
+ * @brief       Prints the outcome of a test program.
+ * @param       name        The test name
+ * @return      The exit code of the program
+ */
+inline int finish(const char *name)
+{
+	std::cerr << name << ": " << (failures == 0 ? "passed" : "FAILED") << std::endl;
+	return failures == 0 ? 0 : 1;
+}
+
+
+/**
+ * @brief       Opens a new device image, removing the one a previous run left behind. The file system reports to
+ *              std::cout, which is silenced so only the test's own output is printed.
+ * @param       imageName       The image file
+ * @param       size            The device size
+ * @return      The device
+ */
+inline BlockDevice *open_image(const std::string& imageName, uint64_t size)
+{
+	std::cout.rdbuf(nullptr);
+	remove(imageName.c_str());
+
+	BlockDevice::options options;
+	options.size = size;
+	return BlockDevice::open(imageName, options);
+}
+
+#endif // __TEST_H__
@@ -0,0 +1,161 @@
+#include "test.h"
+#include <memory>
+#include <vector>
+#include <functional>
+#include <new>
+
+
+// The hot paths - creating a file, overwriting or writing one and reading one into a caller's buffer - make no heap
+// allocation: their temporaries live on the operation's arena. operator new is replaced with one that counts, and
+// every path has to count none once it is warmed up - run until the journal has checkpointed twice, which grows the
+// arena, the caches and the lists the journal keeps between checkpoints to the size they stay at. With the checksums
+// on, in place and log-structured.
+
+static const uint64_t DEVICE_SIZE = 4 * 1024 * 1024;
+static const uint32_t FILE_SIZE = 4096;
+static const int FILES = 16;
+static const int ITERATIONS = 200;
+static const int MAX_WARM_UP = 4000;		// Operations, in case the journal never fills
+
+static thread_local uint64_t allocations = 0;
+
+
+void *operator new(size_t size)
+{
+	allocations++;
+
+	void *p = malloc(size > 0 ? size : 1);
+	if (p == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return p;
+}
+
+
+// GCC can't tell that operator new above is the malloc these frees pair with
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+
+void operator delete(void *p, size_t size) noexcept
+{
+	free(p);
+}
+
+#pragma GCC diagnostic pop
+
+
+/**
+ * @brief       Returns the path of the n-th file.
+ * @param       n           The file number
+ * @return      The file path
+ */
+static std::string file_path(int n)
+{
+	return "/file" + std::to_string(n);
+}
+
+
+/**
+ * @brief       Runs an operation until the journal has checkpointed twice, then ITERATIONS times more and checks those
+ *              made no allocation. The paths are built before, a std::string of a path is the caller's allocation.
+ * @param       myfs        The file system
+ * @param       name        The operation name, printed when it allocates
+ * @param       op          The operation, called with the iteration number
+ * @return      void
+ */
+static void expect_no_allocations(MyFs& myfs, const std::string& name, const std::function<void(int)>& op)
+{
+	uint64_t checkpoints = myfs.get_stats().journal.checkpoints;
+	int i = 0;
+	for (; i < MAX_WARM_UP && myfs.get_stats().journal.checkpoints < checkpoints + 2; i++)
+	{
+		op(i);
+	}
+
+	uint64_t before = allocations;
+	for (int end = i + ITERATIONS; i < end; i++)
+	{
+		op(i);
+	}
+
+	uint64_t made = allocations - before;
+	if (!CHECK(made == 0))
+	{
+		std::cerr << name << ": " << (double)made / ITERATIONS << " allocations per operation" << std::endl;
+	}
+}
+
+
+/**
+ * @brief       Checks the hot paths on a new file system in the given write mode.
+ * @param       device          The device
+ * @param       logStructured   Whether to write log-structured
+ * @return      void
+ */
+static void run_mode(BlockDevice *device, bool logStructured)
+{
+	MyFs myfs(device);
+	myfs.format();
+	myfs.setLogStructured(logStructured);
+	CHECK(myfs.checksums());
+
+	std::string content(FILE_SIZE, 'x');
+	std::string newContent(FILE_SIZE, 'y');
+	std::vector<char> buffer(FILE_SIZE);
+	std::vector<std::string> paths;
+	std::vector<std::string> createPaths;
+	for (int i = 0; i < FILES; i++)
+	{
+		paths.push_back(file_path(i));
+		myfs.set_content(paths.back(), content);
+	}
+	for (int i = 0; i < MAX_WARM_UP + ITERATIONS; i++)
+	{
+		createPaths.push_back(file_path(FILES + i));
+	}
+
+	std::string prefix = logStructured ? "log-structured " : "in-place ";
+
+	expect_no_allocations(myfs, prefix + "overwrite", [&](int i)
+	{
+		myfs.set_content(paths[i % FILES], i % 2 ? content : newContent);
+	});
+
+	expect_no_allocations(myfs, prefix + "write", [&](int i)
+	{
+		myfs.write(paths[i % FILES], (i * 97) % FILE_SIZE, 64, content.data());
+	});
+
+	expect_no_allocations(myfs, prefix + "read", [&](int i)
+	{
+		CHECK(myfs.read(paths[i % FILES], 0, FILE_SIZE, buffer.data()) == FILE_SIZE);
+	});
+
+	// Last, the table and the directory grow with every file created
+	expect_no_allocations(myfs, prefix + "create", [&](int i)
+	{
+		myfs.create_file(createPaths[i], false);
+	});
+}
+
+
+int main()
+{
+	std::unique_ptr<BlockDevice> device(open_image("test_allocations.img", DEVICE_SIZE));
+
+	run_mode(device.get(), false);
+	run_mode(device.get(), true);
+
+	device.reset();
+	remove("test_allocations.img");
+
+	return finish("test_allocations");
+}
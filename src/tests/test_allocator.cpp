@@ -0,0 +1,127 @@
+#include "test.h"
+#include <memory>
+#include <vector>
+
+
+// Fills the device, removes every file and fills it again - every block a file took has to come back to the
+// allocator, and the space has to be as usable the second time as the first. The files fit in the table, so no inode
+// chunk is taken, and the directory gets its index before the free space is counted - both stay once they are taken.
+// The free space is compared after a remount, removed files' blocks are only freed with the checkpoint of the unmount.
+
+static const uint64_t DEVICE_SIZE = 2 * 1024 * 1024;
+static const uint32_t MAX_FILE_BLOCKS = 640;
+static const int MAX_FILES = 24;
+static const int ROUNDS = 3;
+
+
+/**
+ * @brief       Returns the size of the n-th file of a round, spread between 1 byte and MAX_FILE_BLOCKS blocks so the
+ *              files take runs of every length and some stay inline.
+ * @param       round       The round
+ * @param       n           The file number
+ * @return      The file size
+ */
+static uint32_t file_size(int round, int n)
+{
+	uint32_t mix = (uint32_t)(n * 2654435761u + round * 40503u);
+	return 1 + (mix >> 8) % (MAX_FILE_BLOCKS * BLOCK_SIZE);
+}
+
+
+/**
+ * @brief       Returns the path of the n-th file, every fourth one in a directory of its own.
+ * @param       n           The file number
+ * @return      The file path
+ */
+static std::string file_path(int n)
+{
+	return (n % 4 == 3 ? "/dir/file" : "/file") + std::to_string(n);
+}
+
+
+/**
+ * @brief       Writes files until the device is full, or MAX_FILES are written.
+ * @param       myfs        The file system
+ * @param       round       The round, picks the file sizes
+ * @param       written     Set to the file data written
+ * @return      The number of files written
+ */
+static int fill(MyFs& myfs, int round, uint64_t& written)
+{
+	written = 0;
+	int files = 0;
+
+	while (files < MAX_FILES)
+	{
+		std::string content(file_size(round, files), 'a' + (files + round) % 26);
+		try
+		{
+			myfs.set_content(file_path(files), content);
+		}
+		catch (std::runtime_error &e)
+		{
+			if (myfs.isFileExists(file_path(files)))
+			{
+				myfs.remove_file(file_path(files));
+			}
+			return files;
+		}
+
+		written += content.length();
+		files++;
+	}
+
+	return files;
+}
+
+
+int main()
+{
+	std::unique_ptr<BlockDevice> device(open_image("test_allocator.img", DEVICE_SIZE));
+	{
+		MyFs myfs(device.get());
+		myfs.create_file("/dir", true);
+		myfs.create_file("/dir/index", false);
+		myfs.remove_file("/dir/index");
+	}
+
+	uint32_t startFree = MyFs(device.get()).get_stats().space.freeBlocks;
+	uint64_t firstWritten = 0;
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		{
+			MyFs myfs(device.get());
+			uint64_t written = 0;
+			int files = fill(myfs, round, written);
+			CHECK(files > 0 && files < MAX_FILES);
+
+			// Whatever the sizes, a full device has less free space than the largest file
+			CHECK(myfs.get_stats().space.freeBlocks < MAX_FILE_BLOCKS);
+			if (round == 0)
+			{
+				firstWritten = written;
+			}
+			else
+			{
+				CHECK(written + MAX_FILE_BLOCKS * BLOCK_SIZE >= firstWritten);
+			}
+
+			for (int n = 0; n < files; n++)
+			{
+				std::string content = myfs.get_content(file_path(n));
+				CHECK(content == std::string(file_size(round, n), 'a' + (n + round) % 26));
+				myfs.remove_file(file_path(n));
+			}
+		}
+
+		MyFs remounted(device.get());
+		CHECK(remounted.get_stats().space.freeBlocks == startFree);
+		CHECK(remounted.list_dir("/dir").empty());
+	}
+
+	device.reset();
+	remove("test_allocator.img");
+
+	return finish("test_allocator");
+}
@@ -0,0 +1,279 @@
+#include "test.h"
+#include "metrics.h"
+#include <memory>
+#include <vector>
+
+
+// Small writes to a large file cost about the blocks they touch. One byte writes scattered over a large file, in place
+// and log-structured, may write at most MAX_DATA_PER_BYTE bytes of file data per byte written - a log-structured
+// write moves the block it lands in, so the file ends up in far more extents than one map block holds, and past what
+// its map chain holds it has the extents around a write merged into the moved run. The file has to read back as
+// written after a remount, and its blocks have to come back to the allocator once it is removed. After a snapshot, a
+// write copies only the block it lands in - at most a block of data per byte - and writes in place once it has. The
+// same goes for a deduplicated file sharing its blocks with another, and the blocks written have to be shared again
+// by a file of the same content. Taking the snapshot references no block, only the files changed after it take the
+// snapshot's references, and the snapshot keeps the files removed and the directories changed after it. The hash
+// index of the deduplicated files is loaded at a remount without reading their blocks, and still shares them.
+
+static const uint64_t DEVICE_SIZE = 16 * 1024 * 1024;
+static const uint32_t FILE_SIZE = 4 * 1024 * 1024;
+static const int WRITES = 1500;		// Enough for the log-structured file to fill its map chain
+static const uint64_t MAX_DATA_PER_BYTE = 16 * BLOCK_SIZE;
+static const int SHARED_WRITES = 300;		// Few enough for the copied blocks to fit the map chain
+
+
+/**
+ * @brief       Returns the offset of the n-th write, spread over the whole file.
+ * @param       n           The write number
+ * @return      The file offset
+ */
+static uint32_t write_offset(int n)
+{
+	return (uint32_t)(n * 2654435761u) % FILE_SIZE;
+}
+
+
+/**
+ * @brief       Returns the content a large file is written with.
+ * @return      The content
+ */
+static std::string initial_content()
+{
+	std::string content(FILE_SIZE, '\0');
+	for (uint32_t i = 0; i < FILE_SIZE; i++)
+	{
+		content[i] = 'a' + (i / 7) % 26;
+	}
+
+	return content;
+}
+
+
+/**
+ * @brief       Writes a large file, then scatters one byte writes over it and checks what they cost.
+ * @param       device          The device
+ * @param       logStructured   Whether to write log-structured
+ * @return      void
+ */
+static void run_mode(BlockDevice *device, bool logStructured)
+{
+	std::string name = logStructured ? "log-structured" : "in-place";
+	std::string content = initial_content();
+
+	uint32_t startFree;
+	{
+		MyFs myfs(device);
+		myfs.format();
+		myfs.setLogStructured(logStructured);
+		myfs.create_file("/big", false);		// The root directory's index is taken with its first file
+		startFree = myfs.get_stats().space.freeBlocks;
+
+		myfs.set_content("/big", content);
+
+		MyFs::fs_stats before = myfs.get_stats();
+		for (int i = 0; i < WRITES; i++)
+		{
+			char byte = 'A' + i % 26;
+			myfs.write("/big", write_offset(i), 1, &byte);
+			content[write_offset(i)] = byte;
+		}
+		MyFs::fs_stats after = myfs.get_stats();
+
+		uint64_t userBytes = after.log.userBytes - before.log.userBytes;
+		uint64_t dataBytes = after.log.dataBytes - before.log.dataBytes;
+		if (!CHECK(dataBytes <= userBytes * MAX_DATA_PER_BYTE))
+		{
+			std::cerr << name << ": " << (double)dataBytes / userBytes << " bytes of data written per byte" << std::endl;
+		}
+		if (logStructured)
+		{
+			CHECK(after.log.defragBlocks > 0);
+		}
+
+		CHECK(myfs.get_content("/big") == content);
+	}
+
+	{
+		MyFs myfs(device);
+		CHECK(myfs.get_content("/big") == content);
+		CHECK(myfs.scrub(1).badBlocks == 0);
+		myfs.remove_file("/big");
+	}
+
+	CHECK(MyFs(device).get_stats().space.freeBlocks == startFree);
+}
+
+
+/**
+ * @brief       Scatters one byte writes over a large file whose blocks are shared, twice over the same offsets - the
+ *              first pass copies the blocks written, the second writes them in place.
+ * @param       myfs        The file system
+ * @param       path        The file
+ * @param       content     The content of the file, updated with the writes
+ * @param       name        The scenario, printed when the writes cost too much
+ * @return      void
+ */
+static void write_shared(MyFs& myfs, const std::string& path, std::string& content, const std::string& name)
+{
+	for (int pass = 0; pass < 2; pass++)
+	{
+		MyFs::fs_stats before = myfs.get_stats();
+		for (int i = 0; i < SHARED_WRITES; i++)
+		{
+			char byte = 'A' + (i + pass) % 26;
+			myfs.write(path, write_offset(i), 1, &byte);
+			content[write_offset(i)] = byte;
+		}
+		MyFs::fs_stats after = myfs.get_stats();
+
+		uint64_t userBytes = after.log.userBytes - before.log.userBytes;
+		uint64_t dataBytes = after.log.dataBytes - before.log.dataBytes;
+		if (!CHECK(dataBytes <= userBytes * (pass == 0 ? BLOCK_SIZE : 1)))
+		{
+			std::cerr << name << " pass " << pass << ": " << (double)dataBytes / userBytes
+				<< " bytes of data written per byte" << std::endl;
+		}
+	}
+
+	CHECK(myfs.get_content(path) == content);
+}
+
+
+/**
+ * @brief       Writes a large file a snapshot was taken of, removes another and adds a file to a directory. The
+ *              snapshot has to keep everything as it was taken, and only reference the blocks of what changed.
+ * @param       device      The device
+ * @return      void
+ */
+static void run_snapshot(BlockDevice *device)
+{
+	std::string original = initial_content();
+	std::string content = original;
+	std::string small(FILE_SIZE / 64, 'k');
+
+	{
+		MyFs myfs(device);
+		myfs.format();
+		myfs.setLogStructured(false);		// Kept in the header, a format leaves it as it was
+		myfs.create_file("/big", false);
+		myfs.create_file("/dir", true);
+		myfs.create_file("/dir/kept", false);		// A directory keeps the index its first file makes
+		myfs.create_snapshot("first");		// The snapshot list is taken with the first snapshot
+		myfs.delete_snapshot("first");
+	}
+	uint32_t startFree = MyFs(device).get_stats().space.freeBlocks;		// The snapshot's blocks come back at the unmount
+
+	{
+		MyFs myfs(device);
+		myfs.set_content("/big", content);
+		myfs.set_content("/dir/kept", small);
+		myfs.set_content("/gone", small);
+		myfs.create_snapshot("before");
+		CHECK(myfs.get_stats().dedupReferences == 0);
+
+		write_shared(myfs, "/big", content, "snapshot");
+		uint64_t references = myfs.get_stats().dedupReferences;
+		myfs.remove_file("/gone");
+		myfs.create_file("/dir/new", false);
+		CHECK(myfs.get_stats().dedupReferences > references);
+	}
+
+	{
+		MyFs snapshot(device, "before");
+		CHECK(snapshot.get_content("/big") == original);
+		CHECK(snapshot.get_content("/gone") == small);
+		CHECK(snapshot.get_content("/dir/kept") == small);
+		CHECK(snapshot.list_dir("/dir").size() == 1);
+	}
+
+	{
+		MyFs myfs(device);
+		CHECK(myfs.get_content("/big") == content);
+		CHECK(!myfs.isFileExists("/gone"));
+		CHECK(myfs.list_dir("/dir").size() == 2);
+		CHECK(myfs.scrub(1).badBlocks == 0);
+		myfs.delete_snapshot("before");
+		myfs.remove_file("/big");
+		myfs.remove_file("/dir/kept");
+		myfs.remove_file("/dir/new");
+	}
+
+	CHECK(MyFs(device).get_stats().space.freeBlocks == startFree);
+}
+
+
+/**
+ * @brief       Writes a deduplicated file that shares every block with another. The other file has to keep its content,
+ *              and a third file written with the new content has to share every block, the written ones too.
+ * @param       device      The device
+ * @return      void
+ */
+static void run_dedup(BlockDevice *device)
+{
+	std::string original = initial_content();
+	std::string content = original;
+
+	{
+		MyFs myfs(device);
+		myfs.format();
+		myfs.setLogStructured(false);
+		myfs.setDedup(true);
+		myfs.create_file("/a", false);
+		myfs.set_content("/a", original);		// The dedup index keeps the chunk its first blocks take
+		std::string empty;
+		myfs.set_content("/a", empty);
+	}
+	uint32_t startFree = MyFs(device).get_stats().space.freeBlocks;
+
+	{
+		MyFs myfs(device);
+		myfs.set_content("/a", content);
+		myfs.set_content("/b", content);
+
+		write_shared(myfs, "/a", content, "dedup");
+		CHECK(myfs.get_content("/b") == original);
+
+		// The copy takes no block of data of its own
+		uint64_t distinct = myfs.get_stats().dedupBlocks;
+		myfs.set_content("/c", content);
+		CHECK(myfs.get_stats().dedupBlocks == distinct);
+	}
+
+	{
+		uint64_t startRead = Metrics::collect().counters[Metrics::COUNTER_DEVICE_BYTES_READ];
+		MyFs myfs(device);
+		CHECK(Metrics::collect().counters[Metrics::COUNTER_DEVICE_BYTES_READ] - startRead < FILE_SIZE);
+
+		CHECK(myfs.get_content("/a") == content);
+		CHECK(myfs.get_content("/b") == original);
+		CHECK(myfs.get_content("/c") == content);
+		CHECK(myfs.scrub(1).badBlocks == 0);
+
+		uint64_t distinct = myfs.get_stats().dedupBlocks;
+		myfs.set_content("/d", original);
+		CHECK(myfs.get_stats().dedupBlocks == distinct);
+
+		myfs.remove_file("/a");
+		myfs.remove_file("/b");
+		myfs.remove_file("/c");
+		myfs.remove_file("/d");
+	}
+
+	CHECK(MyFs(device).get_stats().space.freeBlocks == startFree);
+}
+
+
+int main()
+{
+	std::unique_ptr<BlockDevice> device(open_image("test_amplification.img", DEVICE_SIZE));
+
+	run_mode(device.get(), false);
+	run_mode(device.get(), true);
+	run_snapshot(device.get());
+	run_dedup(device.get());
+
+	device.reset();
+	remove("test_amplification.img");
+
+	return finish("test_amplification");
+}
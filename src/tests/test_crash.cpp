@@ -0,0 +1,360 @@
+#include "test.h"
+#include <memory>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+
+// Kills a writer at random points and checks that the image mounts again consistently. Every round forks a child
+// that mounts the image and writes until it is killed with SIGKILL - mid-operation, mid-commit or mid-mount - and the
+// parent then mounts it, which replays the journal, and checks it:
+//  - every file listed can be read and is as long as listed
+//  - a file written once is either still empty or holds all of its content
+//  - the log file, only ever appended to, holds exactly the first records appended, none torn
+//  - the checksums find no bad block
+// The rounds go on from the state the last one left, in place and log-structured in turn, and at the end every file
+// is removed and the free space has to be what it was after the format. Last, a block corrupted behind the file
+// system's back has to be found bad after a crash - the sums of the blocks nobody wrote to are kept, not taken from
+// the blocks as they are. Takes the seed of the kill points, a new one every run by default.
+
+static const uint64_t DEVICE_SIZE = 4 * 1024 * 1024;
+static const int ROUNDS = 40;
+static const int MAX_KILL_DELAY_US = 30000;
+static const int MAX_WRITTEN_FILES = 20;		// Written once files kept, older ones are removed - all fit in the table
+static const int REWRITTEN_FILES = 4;
+static const uint32_t MAX_LOG_SIZE = 48 * 1024;
+
+
+/**
+ * @brief       Returns the content of a file written once, told apart by its id.
+ * @param       id          The file id
+ * @return      The content
+ */
+static std::string written_content(uint32_t id)
+{
+	std::string content = "file" + std::to_string(id) + ":";
+	content.resize(1 + (id * 2654435761u >> 8) % (12 * BLOCK_SIZE), 'a' + id % 26);
+	return content;
+}
+
+
+/**
+ * @brief       Returns the n-th record appended to the log.
+ * @param       n           The record number
+ * @return      The record
+ */
+static std::string log_record(uint32_t n)
+{
+	std::string record = "<" + std::to_string(n) + ">";
+	record.resize(8 + (n * 40503u) % 700, 'A' + n % 26);
+	return record;
+}
+
+
+/**
+ * @brief       Returns the path of a file written once.
+ * @param       id          The file id
+ * @return      The file path
+ */
+static std::string written_path(uint32_t id)
+{
+	return "/dir/w" + std::to_string(id);
+}
+
+
+/**
+ * @brief       The child - mounts the image and writes until it is killed. Never returns.
+ * @param       imageName       The image
+ * @param       logStructured   Whether to write log-structured
+ * @param       seed            Seeds the operations
+ * @param       nextId          The id of the next file written once
+ * @param       firstId         The lowest id that may still exist
+ * @param       logRecords      The records the log holds
+ * @return      void
+ */
+static void writer(const std::string& imageName, bool logStructured, uint32_t seed, uint32_t nextId, uint32_t firstId,
+	uint32_t logRecords)
+{
+	std::mt19937 random(seed);
+	BlockDevice::options options;
+	std::unique_ptr<BlockDevice> device(BlockDevice::open(imageName, options));
+	MyFs myfs(device.get());
+	myfs.setLogStructured(logStructured);
+
+	while (true)
+	{
+		uint32_t choice = random() % 100;
+
+		try
+		{
+			if (choice < 35)
+			{
+				std::string content = written_content(nextId);
+				myfs.set_content(written_path(nextId++), content);
+
+				while (nextId - firstId > MAX_WRITTEN_FILES)
+				{
+					if (myfs.isFileExists(written_path(firstId)))
+					{
+						myfs.remove_file(written_path(firstId));
+					}
+					firstId++;
+				}
+			}
+			else if (choice < 60)
+			{
+				if (log_record(logRecords).length() + myfs.getEntryInfo("/log").second.size <= MAX_LOG_SIZE)
+				{
+					std::string record = log_record(logRecords);
+					myfs.append("/log", record.length(), record.data());
+					logRecords++;
+				}
+			}
+			else if (choice < 80)
+			{
+				std::string content(random() % (16 * BLOCK_SIZE), 'a' + random() % 26);
+				myfs.set_content("/r" + std::to_string(random() % REWRITTEN_FILES), content);
+			}
+			else if (choice < 95)
+			{
+				std::string data(1 + random() % (2 * BLOCK_SIZE), 'a' + random() % 26);
+				myfs.write("/r" + std::to_string(random() % REWRITTEN_FILES), random() % (8 * BLOCK_SIZE), data.length(),
+					data.data());
+			}
+			else
+			{
+				myfs.sync();
+			}
+		}
+		catch (std::runtime_error &e)
+		{
+			// A full device, the removals free it again
+		}
+	}
+}
+
+
+/**
+ * @brief       Mounts the image after a crash and checks it.
+ * @param       device          The device
+ * @param       nextId          Set past the id of every file written once that exists
+ * @param       firstId         Set to the lowest id of the files written once that exist, nextId when none does
+ * @param       logRecords      Set to the records the log holds
+ * @return      void
+ */
+static void check_image(BlockDevice *device, uint32_t& nextId, uint32_t& firstId, uint32_t& logRecords)
+{
+	MyFs myfs(device);
+	uint32_t lowestId = UINT32_MAX;
+
+	for (const std::string& directory : { std::string("/"), std::string("/dir") })
+	{
+		for (const MyFs::dir_list_entry& entry : myfs.list_dir(directory))
+		{
+			if (entry.is_dir)
+			{
+				continue;
+			}
+
+			std::string path = (directory == "/" ? "/" : directory + "/") + entry.name;
+			std::string content = myfs.get_content(path);
+			CHECK(content.length() == (size_t)entry.file_size);
+
+			if (directory == "/dir")
+			{
+				uint32_t id = std::stoul(std::string(entry.name).substr(1));
+				CHECK(id >= firstId);
+				CHECK(content.empty() || content == written_content(id));
+				nextId = std::max(nextId, id + 1);
+				lowestId = std::min(lowestId, id);
+			}
+		}
+	}
+
+	// Whole records from the first one on, and nothing after them
+	std::string log = myfs.get_content("/log");
+	size_t position = 0;
+	logRecords = 0;
+	while (position < log.length())
+	{
+		std::string record = log_record(logRecords);
+		if (!CHECK(log.compare(position, record.length(), record) == 0))
+		{
+			break;
+		}
+		position += record.length();
+		logRecords++;
+	}
+
+	CHECK(myfs.scrub(1).badBlocks == 0);
+	firstId = std::min(lowestId, nextId);
+}
+
+
+/**
+ * @brief       Writes a file and unmounts, corrupts a byte of the file's data in the image, then kills an instance
+ *              that only mounted it. The next mount has to find the block bad.
+ * @param       imageName       The image
+ * @return      void
+ */
+static void check_corruption_found(const std::string& imageName)
+{
+	std::string content;
+	for (int i = 0; content.length() < 8 * BLOCK_SIZE; i++)
+	{
+		content += "victim" + std::to_string(i) + ";";
+	}
+
+	BlockDevice::options options;
+	{
+		std::unique_ptr<BlockDevice> device(BlockDevice::open(imageName, options));
+		MyFs myfs(device.get());
+		myfs.set_content("/victim", content);
+	}
+
+	// Written behind the file system's back, in the middle of the file
+	std::string image(DEVICE_SIZE, 0);
+	FILE *file = fopen(imageName.c_str(), "r+b");
+	CHECK(file != nullptr && fread(&image[0], 1, image.size(), file) == image.size());
+	size_t position = image.find(content.substr(content.length() / 2, 64));
+	CHECK(position != std::string::npos && image.find(content.substr(content.length() / 2, 64), position + 1) == std::string::npos);
+	fseek(file, position, SEEK_SET);
+	fputc(image[position] ^ 1, file);
+	fclose(file);
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+		std::unique_ptr<BlockDevice> device(BlockDevice::open(imageName, options));
+		MyFs myfs(device.get());
+		kill(getpid(), SIGKILL);
+	}
+	int status = 0;
+	waitpid(child, &status, 0);
+	CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+	std::unique_ptr<BlockDevice> device(BlockDevice::open(imageName, options));
+	MyFs myfs(device.get());
+	CHECK(myfs.scrub(1).badBlocks == 1);
+
+	bool thrown = false;
+	try
+	{
+		myfs.get_content("/victim");
+	}
+	catch (std::runtime_error &e)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+}
+
+
+int main(int argc, char **argv)
+{
+	const std::string imageName = "test_crash.img";
+	std::unique_ptr<BlockDevice> device(open_image(imageName, DEVICE_SIZE));
+	uint32_t startFree = 0;
+	{
+		MyFs myfs(device.get());
+		myfs.create_file("/dir", true);
+		myfs.create_file("/dir/index", false);		// The directory keeps its index from now on
+		myfs.remove_file("/dir/index");
+		myfs.create_file("/log", false);
+		for (int i = 0; i < REWRITTEN_FILES; i++)
+		{
+			myfs.create_file("/r" + std::to_string(i), false);
+		}
+	}
+	startFree = MyFs(device.get()).get_stats().space.freeBlocks;
+	device.reset();
+
+	// A new seed every run, printed on a failure - the kill points are timed, so a seed only gets close to a run
+	uint32_t testSeed = argc > 1 ? std::stoul(argv[1]) : std::random_device()();
+	std::mt19937 random(testSeed);
+	uint32_t nextId = 0;
+	uint32_t firstId = 0;
+	uint32_t logRecords = 0;
+
+	for (int round = 0; round < ROUNDS && failures == 0; round++)
+	{
+		uint32_t seed = random();
+		int delay = random() % MAX_KILL_DELAY_US;
+
+		pid_t child = fork();
+		if (child == 0)
+		{
+			writer(imageName, round % 2 == 1, seed, nextId, firstId, logRecords);
+			_exit(0);
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds(delay));
+		kill(child, SIGKILL);
+		int status = 0;
+		waitpid(child, &status, 0);
+		CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+		try
+		{
+			BlockDevice::options options;
+			device.reset(BlockDevice::open(imageName, options));
+			check_image(device.get(), nextId, firstId, logRecords);
+			device.reset();
+		}
+		catch (std::runtime_error &e)
+		{
+			std::cerr << "round " << round << ": " << e.what() << std::endl;
+			CHECK(false);
+		}
+
+		if (failures > 0)
+		{
+			std::cerr << "test_crash: failed after the writer was killed " << delay << "us in, in round " << round
+				<< " of seed " << testSeed << std::endl;
+		}
+	}
+
+	// Nothing leaked - with every file gone the free space is what it was to begin with
+	if (failures == 0)
+	{
+		BlockDevice::options options;
+		device.reset(BlockDevice::open(imageName, options));
+		{
+			MyFs myfs(device.get());
+			myfs.setLogStructured(false);
+			for (const std::string& directory : { std::string("/dir"), std::string("/") })
+			{
+				for (const MyFs::dir_list_entry& entry : myfs.list_dir(directory))
+				{
+					if (!entry.is_dir)
+					{
+						myfs.remove_file((directory == "/" ? "/" : directory + "/") + entry.name);
+					}
+				}
+			}
+			myfs.create_file("/log", false);
+			for (int i = 0; i < REWRITTEN_FILES; i++)
+			{
+				myfs.create_file("/r" + std::to_string(i), false);
+			}
+		}
+		CHECK(MyFs(device.get()).get_stats().space.freeBlocks == startFree);
+		std::cerr << "test_crash: " << ROUNDS << " crashes, " << logRecords << " log records and " << nextId
+			<< " files written" << std::endl;
+	}
+	device.reset();
+
+	if (failures == 0)
+	{
+		check_corruption_found(imageName);
+	}
+
+	remove(imageName.c_str());
+
+	return finish("test_crash");
+}
@@ -0,0 +1,379 @@
+#include "test.h"
+#include <memory>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <future>
+#include "asyncfs.h"
+
+
+// Several threads create, write, read and remove files at once, each in a directory of its own, and check every read
+// against what they wrote. All of them also rewrite and read a few shared files, whose content is one repeated byte,
+// so a read that sees half of a write finds two. A last thread syncs, lists, scrubs and takes the stats meanwhile.
+// Then the same file system is driven through an AsyncFs, whose reads have to see exactly the appends submitted
+// before them. Run once per write mode, the log-structured one with its cleaner running, and built with
+// -fsanitize=thread by make test as well. Last, a few threads grow the device at once.
+
+static const uint64_t DEVICE_SIZE = 8 * 1024 * 1024;
+static const int THREADS = 4;
+static const int OPERATIONS = 600;		// Per thread and mode
+static const int FILES_PER_THREAD = 12;
+static const int SHARED_FILES = 4;
+static const uint32_t MAX_FILE_SIZE = 24 * 1024;
+static const int ASYNC_FILES = 8;
+static const int ASYNC_APPENDS = 40;		// Per file
+static const int GROW_THREADS = 4;
+
+enum write_mode
+{
+	MODE_IN_PLACE,
+	MODE_LOG,
+	MODE_DEDUP,
+	MODE_COMPRESSED,
+	MODE_COUNT
+};
+
+static const char *MODE_NAMES[] = { "in-place", "log-structured", "dedup", "compressed" };
+
+
+/**
+ * @brief       Returns data of the given size. The bytes depend on the seed and the position, so a write that lands
+ *              at the wrong offset or a block of another file reads back different.
+ * @param       size        The data size
+ * @param       seed        Picks the data
+ * @return      The data
+ */
+static std::string make_data(uint32_t size, uint32_t seed)
+{
+	std::string data(size, '\0');
+	for (uint32_t i = 0; i < size; i++)
+	{
+		data[i] = 'a' + (seed + i / 7) % 26;
+	}
+
+	return data;
+}
+
+
+/**
+ * @brief       Returns whether the content of a shared file is whole - a single repeated byte.
+ * @param       content     The content read
+ * @return      Whether it is whole
+ */
+static bool is_whole(const std::string& content)
+{
+	return content.find_first_not_of(content.empty() ? 'x' : content[0]) == std::string::npos;
+}
+
+
+/**
+ * @brief       Runs random operations on the files of a thread's directory, checking every read against the model,
+ *              and on the shared files.
+ * @param       myfs        The file system
+ * @param       thread      The thread number
+ * @param       seed        Seeds the operations
+ * @return      void
+ */
+static void worker(MyFs& myfs, int thread, uint32_t seed)
+{
+	std::mt19937 random(seed);
+	std::string directory = "/t" + std::to_string(thread);
+	std::map<std::string, std::string> files;		// The content every file of the thread should have
+	std::vector<char> buffer(MAX_FILE_SIZE);
+
+	myfs.create_file(directory, true);
+
+	for (int op = 0; op < OPERATIONS; op++)
+	{
+		std::string path = directory + "/f" + std::to_string(random() % FILES_PER_THREAD);
+		std::map<std::string, std::string>::iterator it = files.find(path);
+		uint32_t choice = random() % 100;
+
+		if (it == files.end())
+		{
+			// A missing file is created, either empty or with content
+			if (choice < 30)
+			{
+				myfs.create_file(path, false);
+				files[path] = "";
+			}
+			else
+			{
+				std::string content = make_data(random() % MAX_FILE_SIZE, random());
+				myfs.set_content(path, content);
+				files[path] = content;
+			}
+		}
+		else if (choice < 20)
+		{
+			std::string content = make_data(random() % MAX_FILE_SIZE, random());
+			myfs.set_content(path, content);
+			it->second = content;
+		}
+		else if (choice < 40)
+		{
+			uint32_t offset = random() % (it->second.length() + 1);
+			std::string data = make_data(random() % std::min<uint32_t>(4096, MAX_FILE_SIZE - offset), random());
+			myfs.write(path, offset, data.length(), data.data());
+			it->second.replace(offset, std::min(data.length(), it->second.length() - offset), data);
+		}
+		else if (choice < 50 && it->second.length() < MAX_FILE_SIZE / 2)
+		{
+			std::string data = make_data(random() % 2048, random());
+			myfs.append(path, data.length(), data.data());
+			it->second += data;
+		}
+		else if (choice < 65)
+		{
+			CHECK(myfs.get_content(path) == it->second);
+		}
+		else if (choice < 80)
+		{
+			uint32_t offset = random() % (it->second.length() + 1);
+			uint32_t length = random() % (MAX_FILE_SIZE - offset + 1);
+			uint32_t read = myfs.read(path, offset, length, buffer.data());
+			CHECK(std::string(buffer.data(), read) == it->second.substr(offset, length));
+		}
+		else if (choice < 90)
+		{
+			myfs.remove_file(path);
+			files.erase(it);
+		}
+		else
+		{
+			// Everyone rewrites and reads the shared files
+			std::string shared = "/shared/s" + std::to_string(random() % SHARED_FILES);
+			if (choice < 95)
+			{
+				std::string content(random() % MAX_FILE_SIZE, 'a' + random() % 26);
+				myfs.set_content(shared, content);
+			}
+			else
+			{
+				CHECK(is_whole(myfs.get_content(shared)));
+			}
+		}
+	}
+
+	// The directory lists exactly the files left
+	MyFs::dir_list listing = myfs.list_dir(directory);
+	CHECK(listing.size() == files.size());
+	for (const MyFs::dir_list_entry& entry : listing)
+	{
+		std::map<std::string, std::string>::iterator it = files.find(directory + "/" + entry.name);
+		CHECK(it != files.end() && it->second.length() == (size_t)entry.file_size);
+	}
+
+	for (const std::pair<const std::string, std::string>& file : files)
+	{
+		CHECK(myfs.get_content(file.first) == file.second);
+		myfs.remove_file(file.first);
+	}
+	myfs.remove_file(directory);
+}
+
+
+/**
+ * @brief       Interleaves appends and reads of a few files through an asynchronous front end. Every read is ordered
+ *              after the appends submitted before it and before the ones after it, so it sees exactly those.
+ * @param       myfs        The file system
+ * @return      void
+ */
+static void run_async(MyFs& myfs)
+{
+	AsyncFs afs(myfs, THREADS);
+	std::vector<std::string> expected(ASYNC_FILES);
+	std::vector<std::future<void>> appends;
+	std::vector<std::pair<int, std::future<std::string>>> reads;		// <file, content>
+	std::vector<std::string> readExpected;
+
+	for (int file = 0; file < ASYNC_FILES; file++)
+	{
+		afs.create_file("/async" + std::to_string(file), false).get();
+	}
+
+	for (int i = 0; i < ASYNC_APPENDS; i++)
+	{
+		for (int file = 0; file < ASYNC_FILES; file++)
+		{
+			std::string path = "/async" + std::to_string(file);
+			std::string data = make_data(1 + (i * 37 + file) % 600, i + file);
+			appends.push_back(afs.append(path, data));
+			expected[file] += data;
+
+			if (i % 4 == file % 4)
+			{
+				// Named differently, the same file to the front end
+				reads.emplace_back(file, afs.get_content(i % 2 ? "//async" + std::to_string(file) : path));
+				readExpected.push_back(expected[file]);
+			}
+		}
+	}
+
+	for (std::future<void>& append : appends)
+	{
+		append.get();
+	}
+	for (size_t i = 0; i < reads.size(); i++)
+	{
+		CHECK(reads[i].second.get() == readExpected[i]);
+	}
+	for (int file = 0; file < ASYNC_FILES; file++)
+	{
+		std::string path = "/async" + std::to_string(file);
+		CHECK(afs.get_content(path).get() == expected[file]);
+		afs.remove_file(path).get();
+	}
+}
+
+
+/**
+ * @brief       Runs the workers and then the front end on a new file system in the given mode.
+ * @param       device      The device
+ * @param       mode        The write mode
+ * @return      void
+ */
+static void run_mode(BlockDevice *device, write_mode mode)
+{
+	int failuresBefore = failures;
+	MyFs myfs(device);
+	myfs.format();
+	myfs.setLogStructured(mode == MODE_LOG);
+	myfs.setDedup(mode == MODE_DEDUP);
+	myfs.setCompression(mode == MODE_COMPRESSED);
+
+	myfs.create_file("/shared", true);
+	for (int i = 0; i < SHARED_FILES; i++)
+	{
+		myfs.create_file("/shared/s" + std::to_string(i), false);
+	}
+
+	std::atomic<int> running(THREADS);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < THREADS; i++)
+	{
+		threads.emplace_back([&myfs, &running, i, mode]()
+		{
+			try
+			{
+				worker(myfs, i, i * 7919 + mode);
+			}
+			catch (std::runtime_error &e)
+			{
+				std::cerr << "thread " << i << ": " << e.what() << std::endl;
+				CHECK(false);
+			}
+			running--;
+		});
+	}
+
+	// The maintenance thread, alongside the workers until they're done
+	threads.emplace_back([&myfs, &running]()
+	{
+		try
+		{
+			for (int round = 0; running > 0; round++)
+			{
+				myfs.sync();
+				CHECK(myfs.list_dir("/shared").size() == SHARED_FILES);
+				CHECK(myfs.get_stats().checksumErrors == 0);
+#ifndef __SANITIZE_THREAD__
+				// The scrub reads the blocks without the stripe locks on purpose and checks a block that doesn't match
+				// again under its lock, a race ThreadSanitizer reports all the same
+				if (round % 16 == 0)
+				{
+					CHECK(myfs.scrub(2).badBlocks == 0);
+				}
+#endif
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		catch (std::runtime_error &e)
+		{
+			std::cerr << "maintenance: " << e.what() << std::endl;
+			CHECK(false);
+		}
+	});
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	for (int i = 0; i < SHARED_FILES; i++)
+	{
+		CHECK(is_whole(myfs.get_content("/shared/s" + std::to_string(i))));
+	}
+
+	try
+	{
+		run_async(myfs);
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << "async: " << e.what() << std::endl;
+		CHECK(false);
+	}
+
+	if (failures > failuresBefore)
+	{
+		std::cerr << "test_stress: failed in " << MODE_NAMES[mode] << " mode" << std::endl;
+	}
+}
+
+
+/**
+ * @brief       Grows the device from several threads at once, each to a size of its own. Whatever order they run
+ *              in, the device ends at the largest size, and the checksum table it moved still holds every sum.
+ * @param       device      The device
+ * @return      void
+ */
+static void run_grow(BlockDevice *device)
+{
+	MyFs myfs(device);
+	myfs.format();
+	uint32_t startBlocks = myfs.get_stats().space.totalBlocks;
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i <= GROW_THREADS; i++)
+	{
+		threads.emplace_back([&myfs, startBlocks, i]()
+		{
+			try
+			{
+				myfs.grow((uint64_t)(startBlocks + i * 64) * BLOCK_SIZE);
+			}
+			catch (std::runtime_error &e)
+			{
+				// A larger grow got there first
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	CHECK(myfs.get_stats().space.totalBlocks == startBlocks + GROW_THREADS * 64);
+	CHECK(myfs.scrub(1).badBlocks == 0);
+}
+
+
+int main()
+{
+	std::unique_ptr<BlockDevice> device(open_image("test_stress.img", DEVICE_SIZE));
+
+	for (int mode = 0; mode < MODE_COUNT; mode++)
+	{
+		run_mode(device.get(), (write_mode)mode);
+	}
+	run_grow(device.get());
+
+	device.reset();
+	remove("test_stress.img");
+
+	return finish("test_stress");
+}
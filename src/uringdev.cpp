@@ -0,0 +1,310 @@
+#include <unistd.h>
+#include <string.h>
+#include "uringdev.h"
+#include "arena.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <errno.h>
+#include <deque>
+#include <algorithm>
+
+
+UringBlockDevice::UringBlockDevice(std::string fname, const options& opts) : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED),
+	sqes((struct io_uring_sqe *)MAP_FAILED)
+{
+	fd = openFile(fname, opts.size, 0);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		throw std::runtime_error(std::string("stat failed: ") + strerror(errno));
+	}
+	fileSize = st.st_size;
+
+	try
+	{
+		setupRing(std::max<uint32_t>(opts.queueDepth, 1));
+	}
+	catch (std::runtime_error &e)
+	{
+		release();
+		throw;
+	}
+}
+
+
+UringBlockDevice::~UringBlockDevice()
+{
+	release();
+}
+
+
+// Unmaps and closes whatever the constructor got to set up
+void UringBlockDevice::release()
+{
+	if (sqes != MAP_FAILED)
+	{
+		munmap(sqes, ringEntries * sizeof(struct io_uring_sqe));
+	}
+	if (cqRing != MAP_FAILED && cqRing != sqRing)
+	{
+		munmap(cqRing, cqRingSize);
+	}
+	if (sqRing != MAP_FAILED)
+	{
+		munmap(sqRing, sqRingSize);
+	}
+	if (ringFd != -1)
+	{
+		close(ringFd);
+	}
+	close(fd);
+}
+
+
+// Creates the ring and maps its submission queue, completion queue and submission entries
+void UringBlockDevice::setupRing(uint32_t entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ringFd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ringFd == -1)
+	{
+		throw std::runtime_error(std::string("io_uring is not available: ") + strerror(errno));
+	}
+	ringEntries = params.sq_entries;
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels map both rings with a single mmap
+	bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMap)
+	{
+		sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+	}
+
+	sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		throw std::runtime_error(std::string("Could not map the submission ring: ") + strerror(errno));
+	}
+
+	cqRing = singleMap ? sqRing : mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+	if (cqRing == MAP_FAILED)
+	{
+		throw std::runtime_error(std::string("Could not map the completion ring: ") + strerror(errno));
+	}
+
+	sqes = (struct io_uring_sqe *)mmap(NULL, ringEntries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ringFd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		throw std::runtime_error(std::string("Could not map the submission entries: ") + strerror(errno));
+	}
+
+	char *sq = (char *)sqRing;
+	sqTail = (uint32_t *)(sq + params.sq_off.tail);
+	sqMask = (uint32_t *)(sq + params.sq_off.ring_mask);
+	sqArray = (uint32_t *)(sq + params.sq_off.array);
+
+	char *cq = (char *)cqRing;
+	cqHead = (uint32_t *)(cq + params.cq_off.head);
+	cqTail = (uint32_t *)(cq + params.cq_off.tail);
+	cqMask = (uint32_t *)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+
+void UringBlockDevice::read(uint64_t addr, size_t size, char *ans)
+{
+	io_request request = { false, addr, size, ans, nullptr };
+	submit(&request, 1);
+}
+
+
+void UringBlockDevice::write(uint64_t addr, size_t size, const char *data)
+{
+	io_request request = { true, addr, size, nullptr, data };
+	submit(&request, 1);
+}
+
+
+// Queues the whole batch (a ring at a time) and waits for it. Short transfers are queued again for the rest.
+void UringBlockDevice::submit(const io_request *requests, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		checkBounds(requests[i].addr, requests[i].size, fileSize);
+	}
+
+	std::lock_guard<std::mutex> lock(ringMutex);
+
+	std::vector<io_request, ArenaAllocator<io_request>> work(requests, requests + count);		// Advanced in place as parts of the requests complete
+	std::deque<size_t, ArenaAllocator<size_t>> ready;
+	uint32_t inFlight = 0;
+	int error = 0;
+
+	for (size_t i = 0; i < work.size(); i++)
+	{
+		if (work[i].size > 0)
+		{
+			ready.push_back(i);
+		}
+	}
+
+	while ((!ready.empty() && error == 0) || inFlight > 0)
+	{
+		uint32_t toSubmit = 0;
+		while (!ready.empty() && error == 0 && inFlight + toSubmit < ringEntries)
+		{
+			queue(work[ready.front()], ready.front());
+			ready.pop_front();
+			toSubmit++;
+		}
+
+		uint32_t submitted = 0;
+		int enterError = enter(toSubmit, inFlight + toSubmit, submitted);
+		inFlight += submitted;
+		if (enterError != 0)
+		{
+			// The entries the kernel didn't take are taken back out of the ring. The ones it took are still reaped
+			// before the error is thrown, the kernel uses their buffers until they complete.
+			__atomic_store_n(sqTail, *sqTail - (toSubmit - submitted), __ATOMIC_RELEASE);
+			error = enterError;
+		}
+
+		// Reaping the completions
+		uint32_t head = *cqHead;
+		uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			const struct io_uring_cqe& cqe = cqes[head & *cqMask];
+			io_request& request = work[cqe.user_data];
+			inFlight--;
+
+			if (cqe.res <= 0)
+			{
+				error = cqe.res == 0 ? EIO : -cqe.res;
+				continue;
+			}
+
+			request.addr += cqe.res;
+			request.size -= cqe.res;
+			if (request.write)
+			{
+				request.data += cqe.res;
+			}
+			else
+			{
+				request.buffer += cqe.res;
+			}
+
+			if (request.size > 0)
+			{
+				ready.push_back(cqe.user_data);
+			}
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	// Nothing is left in flight - even after a failed io_uring_enter - so the kernel no longer uses the buffers
+	if (error != 0)
+	{
+		throw std::runtime_error(std::string("io_uring request failed: ") + strerror(error));
+	}
+}
+
+
+// Fills the next submission entry with a read or write of (up to MAX_IO_SIZE bytes of) the request
+void UringBlockDevice::queue(const io_request& request, uint64_t userData)
+{
+	uint32_t tail = *sqTail;
+	uint32_t index = tail & *sqMask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = request.addr;
+	sqe->addr = (uint64_t)(request.write ? request.data : request.buffer);
+	sqe->len = std::min<size_t>(request.size, MAX_IO_SIZE);
+	sqe->user_data = userData;
+
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+// Hands the queued entries to the kernel and waits until minComplete requests have completed. Doesn't throw, the
+// caller has requests in flight to reap first - returns the error, with submitted set to the entries the kernel took.
+// Only waiting (nothing to submit) never fails for good, it is retried until the completions come.
+int UringBlockDevice::enter(uint32_t toSubmit, uint32_t minComplete, uint32_t& submitted)
+{
+	submitted = 0;
+
+	while (true)
+	{
+		int result = syscall(__NR_io_uring_enter, ringFd, toSubmit - submitted, minComplete, IORING_ENTER_GETEVENTS,
+			NULL, 0);
+		if (result == -1)
+		{
+			if (errno == EINTR || (toSubmit == 0 && (errno == EAGAIN || errno == EBUSY)))
+			{
+				continue;
+			}
+			return errno;
+		}
+
+		submitted += result;
+		if (submitted == toSubmit)
+		{
+			return 0;
+		}
+	}
+}
+
+
+// The ring has no ranged flush either, the whole file is flushed
+void UringBlockDevice::flush(uint64_t addr, size_t size)
+{
+	if (fdatasync(fd) == -1)
+	{
+		throw std::runtime_error(std::string("fdatasync failed: ") + strerror(errno));
+	}
+}
+
+
+// Not queued in the ring, a discard only comes with a checkpoint and nothing in flight touches the range
+void UringBlockDevice::discard(uint64_t addr, size_t size)
+{
+	checkBounds(addr, size, fileSize);
+	punchHole(fd, addr, size);
+}
+
+
+uint64_t UringBlockDevice::size() const
+{
+	return fileSize;
+}
+
+
+void UringBlockDevice::grow(uint64_t newSize)
+{
+	if (newSize <= fileSize)
+	{
+		return;
+	}
+
+	if (ftruncate(fd, newSize) == -1)
+	{
+		throw std::runtime_error(std::string("Could not grow the device: ") + strerror(errno));
+	}
+	fileSize = newSize;
+}
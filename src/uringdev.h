@@ -0,0 +1,61 @@
+#ifndef __URINGDEV_H__
+#define __URINGDEV_H__
+
+#include <mutex>
+#include <linux/io_uring.h>
+#include "blkdev.h"
+
+
+// A device reached through an io_uring on the image file. A batch of requests is queued in the submission ring and
+// handed to the kernel with a single io_uring_enter, which also waits for all of them to complete.
+// The ring is set up with raw system calls, there is no liburing dependency.
+// There is a single ring, and a batch holds it until all of its requests complete, so the queue depth is only used
+// within a batch - concurrent callers take turns. The file system batches the blocks of an operation, which is where
+// the depth pays off.
+class UringBlockDevice : public BlockDevice
+{
+public:
+	UringBlockDevice(std::string fname, const options& opts);
+	~UringBlockDevice() override;
+
+	void read(uint64_t addr, size_t size, char *ans) override;
+	void write(uint64_t addr, size_t size, const char *data) override;
+	void submit(const io_request *requests, size_t count) override;
+	void flush(uint64_t addr, size_t size) override;
+	void discard(uint64_t addr, size_t size) override;
+
+	uint64_t size() const override;
+	void grow(uint64_t newSize) override;
+
+	static const uint32_t MAX_IO_SIZE = 1 << 30;		// Larger requests are split, the kernel caps a single read/write anyway
+
+
+private:
+	void setupRing(uint32_t entries);
+	void release();
+	void queue(const io_request& request, uint64_t userData);
+	int enter(uint32_t toSubmit, uint32_t minComplete, uint32_t& submitted);
+
+	int fd;
+	std::atomic<uint64_t> fileSize;
+
+	std::mutex ringMutex;		// One batch uses the ring at a time, which serializes the I/O of concurrent callers
+	int ringFd;
+	uint32_t ringEntries;
+
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+
+	uint32_t *sqTail;
+	uint32_t *sqMask;
+	uint32_t *sqArray;
+	uint32_t *cqHead;
+	uint32_t *cqTail;
+	uint32_t *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+#endif // __URINGDEV_H__
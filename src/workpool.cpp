@@ -0,0 +1,216 @@
+#include "workpool.h"
+#include <algorithm>
+#include <iterator>
+
+
+// The pool the calling thread works for, and its queue there
+static thread_local WorkPool *currentPool = nullptr;
+static thread_local unsigned currentQueue = 0;
+
+
+/**
+ @brief		Constructor - Starts the workers.
+ @param		threads		The number of workers, 0 for one per hardware thread
+ */
+WorkPool::WorkPool(unsigned threads) : _queued(0), _sleepers(0), _stopping(false), _next(0), _tasks(0), _steals(0)
+{
+	if (threads == 0)
+	{
+		threads = std::max(1U, std::thread::hardware_concurrency());
+	}
+
+	for (unsigned i = 0; i < threads; i++)
+	{
+		this->_queues.emplace_back(new worker_queue());
+	}
+	for (unsigned i = 0; i < threads; i++)
+	{
+		this->_threads.emplace_back(&WorkPool::run, this, i);
+	}
+}
+
+
+/**
+ @brief		Destructor - Lets the workers finish every queued task, then stops them.
+ */
+WorkPool::~WorkPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->_sleepMutex);
+		this->_stopping = true;
+	}
+	this->_wake.notify_all();
+
+	for (std::thread& thread : this->_threads)
+	{
+		thread.join();
+	}
+}
+
+
+// The queue a task pushed by the calling thread goes to
+unsigned WorkPool::target()
+{
+	if (currentPool == this)
+	{
+		return currentQueue;
+	}
+
+	return this->_next.fetch_add(1, std::memory_order_relaxed) % this->_queues.size();
+}
+
+
+/**
+ @brief		Queues a task. Tasks must not throw.
+ @param		t		The task
+ @return	void
+ */
+void WorkPool::push(task t)
+{
+	// Counted before it's published, a worker that takes it right away never takes the count below zero. A worker
+	// that sees the count first finds nothing to take and looks again.
+	this->_queued++;
+
+	worker_queue& queue = *this->_queues[this->target()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(t));
+	}
+
+	// A worker going to sleep counts itself before it checks for tasks, so either it sees the task or it is seen here
+	if (this->_sleepers > 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->_sleepMutex);
+		}
+		this->_wake.notify_one();
+	}
+}
+
+
+/**
+ @brief		Queues a batch of tasks with a single wake-up. Tasks must not throw.
+ @param		tasks		The tasks, moved from
+ @return	void
+ */
+void WorkPool::push(std::vector<task>& tasks)
+{
+	if (tasks.empty())
+	{
+		return;
+	}
+
+	size_t count = tasks.size();
+	this->_queued += count;		// Before the tasks are published, as in push(task)
+
+	// From a worker, the whole batch goes to its own queue and the idle workers steal from it
+	if (currentPool == this)
+	{
+		worker_queue& queue = *this->_queues[currentQueue];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		std::move(tasks.begin(), tasks.end(), std::back_inserter(queue.tasks));
+	}
+	else
+	{
+		for (task& t : tasks)
+		{
+			worker_queue& queue = *this->_queues[this->target()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(std::move(t));
+		}
+	}
+	if (this->_sleepers > 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->_sleepMutex);
+		}
+		if (count == 1)
+		{
+			this->_wake.notify_one();
+		}
+		else
+		{
+			this->_wake.notify_all();
+		}
+	}
+
+	tasks.clear();
+}
+
+
+/**
+ @brief		Takes the next task for a worker - the newest of its own queue, or else the oldest of another one.
+ @param		index		The worker's queue
+ @param		t			Set to the task
+ @return	True if a task was taken
+ */
+bool WorkPool::take(unsigned index, task& t)
+{
+	for (size_t i = 0; i < this->_queues.size(); i++)
+	{
+		worker_queue& queue = *this->_queues[(index + i) % this->_queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (queue.tasks.empty())
+		{
+			continue;
+		}
+
+		if (i == 0)
+		{
+			t = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			t = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			this->_steals.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		this->_queued--;
+		return true;
+	}
+
+	return false;
+}
+
+
+/**
+ @brief		The loop of a worker - runs tasks while there are any, and sleeps otherwise.
+ @param		index		The worker's queue
+ @return	void
+ */
+void WorkPool::run(unsigned index)
+{
+	currentPool = this;
+	currentQueue = index;
+
+	task t;
+	while (true)
+	{
+		if (this->take(index, t))
+		{
+			t();
+			t = nullptr;
+			this->_tasks.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(this->_sleepMutex);
+		this->_sleepers++;
+		this->_wake.wait(lock, [this]() { return this->_stopping || this->_queued > 0; });
+		this->_sleepers--;
+
+		if (this->_stopping && this->_queued == 0)
+		{
+			return;
+		}
+	}
+}
+
+
+WorkPool::pool_stats WorkPool::stats() const
+{
+	return pool_stats{ this->_tasks.load(std::memory_order_relaxed), this->_steals.load(std::memory_order_relaxed) };
+}
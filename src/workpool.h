@@ -0,0 +1,68 @@
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A fixed set of worker threads running tasks, every worker with a queue of its own. A task pushed by a worker goes
+// to the back of its own queue and the worker takes its own tasks from the back, the newest first, while it still
+// has them in cache. An idle worker steals the oldest task of another queue. Tasks pushed from outside are spread
+// over the queues in turn. Idle workers sleep until tasks are pushed.
+class WorkPool
+{
+public:
+	typedef std::function<void()> task;
+
+	WorkPool(unsigned threads = 0);		// 0 for one per hardware thread
+	WorkPool(const WorkPool&) = delete;
+	WorkPool& operator=(const WorkPool&) = delete;
+	~WorkPool();
+
+	void push(task t);
+	void push(std::vector<task>& tasks);
+
+	unsigned size() const { return this->_threads.size(); }
+
+	struct pool_stats
+	{
+		uint64_t tasks;			// Run so far
+		uint64_t steals;		// Of them, taken from the queue of another worker
+	};
+	pool_stats stats() const;
+
+
+private:
+	struct worker_queue
+	{
+		std::mutex mutex;
+		std::deque<task> tasks;
+	};
+
+	void run(unsigned index);
+	bool take(unsigned index, task& t);
+	unsigned target();
+
+	std::vector<std::unique_ptr<worker_queue>> _queues;
+	std::vector<std::thread> _threads;
+
+	std::mutex _sleepMutex;		// Taken only to sleep and to wake the sleepers
+	std::condition_variable _wake;
+	std::atomic<size_t> _queued;		// Tasks in all the queues, counted before they are queued so it never drops below zero
+	std::atomic<unsigned> _sleepers;		// Workers asleep or about to be, only they need a wake-up
+	bool _stopping;
+	std::atomic<unsigned> _next;		// The queue the next task pushed from outside goes to
+
+	std::atomic<uint64_t> _tasks;
+	std::atomic<uint64_t> _steals;
+};
+
+#endif // __WORKPOOL_H__